@@ -0,0 +1,68 @@
+#ifndef AABB_H
+#define AABB_H
+
+#include "project_utils.h"
+#include <utility>
+
+/** Axis-aligned bounding box, stored as one range per axis */
+class aabb {
+    public:
+        range x, y, z;
+
+        aabb() {} // The default AABB is empty, since ranges are empty by default.
+        aabb(const range& x, const range& y, const range& z) : x(x), y(y), z(z) {}
+
+        /** Treat the two points a and b as extrema for the bounding box, so we don't require a particular order */
+        aabb(const point3& a, const point3& b) {
+            x = (a[0] <= b[0]) ? range(a[0], b[0]) : range(b[0], a[0]);
+            y = (a[1] <= b[1]) ? range(a[1], b[1]) : range(b[1], a[1]);
+            z = (a[2] <= b[2]) ? range(a[2], b[2]) : range(b[2], a[2]);
+        }
+
+        /** the box enclosing both boxes */
+        aabb(const aabb& box0, const aabb& box1) : x(box0.x, box1.x), y(box0.y, box1.y), z(box0.z, box1.z) {}
+
+        const range& axis_range(int n) const {
+            if (n == 1) return y;
+            if (n == 2) return z;
+            return x;
+        }
+
+        bool is_empty() const { return x.min > x.max || y.min > y.max || z.min > z.max; }
+
+        point3 centroid() const {
+            return point3((x.min + x.max) / 2, (y.min + y.max) / 2, (z.min + z.max) / 2);
+        }
+
+        /** Used by the SAH: the cost of a node is proportional to the chance a ray hits it, which is proportional to its surface */
+        double surface_area() const {
+            if (is_empty()) return 0;
+            auto dx = x.size();
+            auto dy = y.size();
+            auto dz = z.size();
+            return 2 * (dx*dy + dy*dz + dz*dx);
+        }
+
+        /**
+         * Slab test: intersect the ray with the three pairs of planes.
+         * The ray hits the box if the t-ranges of all three slabs overlap
+         */
+        bool hit(const ray& r, range ray_t) const {
+            const point3& ray_orig = r.origin();
+            const vec3& ray_dir = r.direction();
+            for (int axis = 0; axis < 3; axis++) {
+                const range& ax = axis_range(axis);
+                const real adinv = 1 / ray_dir[axis];
+
+                auto t0 = (ax.min - ray_orig[axis]) * adinv;
+                auto t1 = (ax.max - ray_orig[axis]) * adinv;
+                if (t0 > t1) std::swap(t0, t1);
+                if (t0 > ray_t.min) ray_t.min = t0;
+                if (t1 < ray_t.max) ray_t.max = t1;
+                if (ray_t.max <= ray_t.min) return false;
+            }
+            return true;
+        }
+};
+
+#endif
@@ -0,0 +1,322 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include "project_utils.h"
+#include "camera.h"
+#include "denoise.h"
+#include "framebuffer.h"
+#include "hittable_list.h"
+#include "scene_file.h"
+#include "sphere_set.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Animation: a camera fly-through, and spheres that move, rendered as a sequence of frames by one process.
+ *
+ * The scene is loaded and its BVHs built once. Between frames only the camera and the moving spheres change:
+ * the spheres are moved in place and the sphere BVH is refitted (refit_bvh), which keeps the tree and only
+ * updates its boxes. Once the refitted tree costs rebuild_factor times as much as a fresh one would have
+ * (bvh_cost), it is built again. Meshes and instances never move, their BVHs stay as they are.
+ *
+ * Frames are written by a thread of their own, so frame k is encoded and saved while frame k+1 renders.
+ * Every frame gets its own seed, derived from the camera's, so the noise doesn't stand still while the picture moves.
+ *
+ * The animation file (.rta), one statement per line, # starts a comment:
+ *     frames 48                            the number of frames, 0 to frames-1
+ *     key 0 position 13 2 3                the camera at frame 0. position, viewport_position, up, vertical_fov,
+ *     key 0 viewport_position 0 0 0        focus_dist and defocus_angle can be keyed, fields a key doesn't set keep
+ *     key 47 position 10 2 -5              their value from the key before (or from the scene's camera)
+ *     move 3 0 4 1 0                       move <sphere> <frame> <x y z>: where the sphere with this index
+ *     move 3 47 4 3 0                      (in the scene file or the order of add()) is at that frame.
+ *                                          .rtb files store that order; in files older than version 2 it is the BVH order
+ * Between keys, values follow a Catmull-Rom spline through the keys, so the camera doesn't change direction abruptly at a key.
+ * Before the first and after the last key they stay put.
+ */
+namespace animation {
+    /** the camera at one frame */
+    struct camera_key {
+        double frame;
+        point3 position, viewport_position;
+        vec3 up;
+        double vertical_fov, focus_dist, defocus_angle;
+    };
+
+    /** a moving sphere's center at one frame */
+    struct sphere_key {
+        double frame;
+        point3 center;
+    };
+
+    struct sequence {
+        int frame_count = 1;
+        std::vector<camera_key> camera_keys; // by frame
+        std::map<uint32_t, std::vector<sphere_key>> sphere_keys; // by the added index of the sphere, each by frame
+    };
+
+    struct options {
+        std::string output = "frame_%04d.png"; // one file per frame, %d (or %04d, ...) is replaced by the frame number
+        bool denoise = false; // filter every frame, see denoise.h
+        double rebuild_factor = 1.5; // build the sphere BVH again once refits made it this much more expensive
+    };
+
+    /**
+     * The value at frame along keys (sorted by frame), value(key) picks the value of a key.
+     * MATH: a cubic Hermite spline, with the tangent at a key taken from its neighbours: (p[i+1] - p[i-1]) / (t[i+1] - t[i-1]).
+     * That is Catmull-Rom, for keys that are not evenly spaced.
+     */
+    template <typename T, typename key_type, typename value_of>
+    inline T interpolate(const std::vector<key_type>& keys, double frame, value_of value) {
+        if (frame <= keys.front().frame) return value(keys.front());
+        if (frame >= keys.back().frame) return value(keys.back());
+        size_t i = 0;
+        while (keys[i + 1].frame < frame) i++;
+        auto tangent = [&](size_t k) -> T {
+            size_t before = k > 0 ? k - 1 : k, after = k + 1 < keys.size() ? k + 1 : k;
+            return (value(keys[after]) - value(keys[before])) * (1 / (keys[after].frame - keys[before].frame));
+        };
+        double length = keys[i + 1].frame - keys[i].frame;
+        double s = (frame - keys[i].frame) / length;
+        double s2 = s * s, s3 = s2 * s;
+        return value(keys[i]) * (2 * s3 - 3 * s2 + 1) + tangent(i) * ((s3 - 2 * s2 + s) * length)
+               + value(keys[i + 1]) * (-2 * s3 + 3 * s2) + tangent(i + 1) * ((s3 - s2) * length);
+    }
+
+    /** set the keyed fields of cam to their values at frame */
+    inline void apply_camera(const sequence& seq, double frame, camera& cam) {
+        if (seq.camera_keys.empty()) return;
+        const std::vector<camera_key>& keys = seq.camera_keys;
+        cam.position = interpolate<vec3>(keys, frame, [](const camera_key& k) { return k.position; });
+        cam.viewport_position = interpolate<vec3>(keys, frame, [](const camera_key& k) { return k.viewport_position; });
+        cam.up = interpolate<vec3>(keys, frame, [](const camera_key& k) { return k.up; });
+        cam.vertical_fov = interpolate<double>(keys, frame, [](const camera_key& k) { return k.vertical_fov; });
+        cam.focus_dist = interpolate<double>(keys, frame, [](const camera_key& k) { return k.focus_dist; });
+        cam.defocus_angle = std::max(0.0, interpolate<double>(keys, frame, [](const camera_key& k) { return k.defocus_angle; }));
+    }
+
+    /** the camera fields a key statement may set */
+    inline bool is_keyed_field(const std::string& field) {
+        return field == "position" || field == "viewport_position" || field == "up" || field == "vertical_fov"
+               || field == "focus_dist" || field == "defocus_angle";
+    }
+
+    /** read an animation file. cam is the scene's camera, the keys start from its values */
+    inline bool load(const std::string& path, const camera& cam, sequence& seq, std::string& error) {
+        FILE* in = fopen(path.c_str(), "r");
+        if (!in) {
+            error = "cannot read " + path;
+            return false;
+        }
+        seq = sequence();
+        std::map<double, std::vector<std::vector<std::string>>> key_statements; // field and values, by frame
+        char line[1024];
+        char* words[32];
+        int line_number = 0;
+        while (fgets(line, sizeof(line), in)) {
+            line_number++;
+            int count = scene_file::split_words(line, words, 32);
+            if (count == 0) continue;
+            std::string keyword = words[0];
+            double v[4];
+            bool ok = false;
+            if (keyword == "frames" && count == 2 && scene_file::parse_number(words[1], v[0]) && v[0] >= 1) {
+                seq.frame_count = int(v[0]);
+                ok = true;
+            } else if (keyword == "key" && count >= 4 && scene_file::parse_number(words[1], v[0]) && is_keyed_field(words[2])) {
+                camera check = cam;
+                std::string field_error; // the keyed fields have no counts to get wrong
+                ok = scene_file::set_camera_field(check, words[2], words + 3, count - 3, field_error);
+                if (ok) key_statements[v[0]].push_back(std::vector<std::string>(words + 2, words + count));
+            } else if (keyword == "move" && count == 6 && scene_file::parse_numbers(words + 1, 5, v) && v[0] >= 0) {
+                sphere_key k = { v[1], point3(v[2], v[3], v[4]) };
+                seq.sphere_keys[uint32_t(v[0])].push_back(k);
+                ok = true;
+            }
+            if (!ok) {
+                error = "line " + std::to_string(line_number) + ": cannot parse '" + keyword + "' statement";
+                fclose(in);
+                return false;
+            }
+        }
+        fclose(in);
+
+        // every key starts from the one before, so it only needs to name what changes
+        camera keyed = cam;
+        for (auto& frame : key_statements) {
+            for (auto& statement : frame.second) {
+                std::vector<char*> values;
+                for (size_t i = 1; i < statement.size(); i++) values.push_back(&statement[i][0]);
+                std::string field_error;
+                scene_file::set_camera_field(keyed, statement[0], values.data(), int(values.size()), field_error);
+            }
+            camera_key k = { frame.first, keyed.position, keyed.viewport_position, keyed.up,
+                             keyed.vertical_fov, keyed.focus_dist, keyed.defocus_angle };
+            seq.camera_keys.push_back(k);
+        }
+        for (auto& sphere : seq.sphere_keys) {
+            std::stable_sort(sphere.second.begin(), sphere.second.end(),
+                             [](const sphere_key& a, const sphere_key& b) { return a.frame < b.frame; });
+        }
+        return true;
+    }
+
+    /** the file name of a frame: pattern with its %d or %0Nd replaced, or _0000 put before the extension if there is none */
+    inline std::string frame_path(const std::string& pattern, int frame) {
+        size_t percent = pattern.find('%');
+        size_t d = percent == std::string::npos ? percent : pattern.find_first_not_of("0123456789", percent + 1);
+        if (d == std::string::npos || pattern[d] != 'd') {
+            size_t dot = pattern.find_last_of('.');
+            size_t slash = pattern.find_last_of('/');
+            if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) dot = pattern.size();
+            return frame_path(pattern.substr(0, dot) + "_%04d" + pattern.substr(dot), frame);
+        }
+        int width = atoi(pattern.substr(percent + 1, d - percent - 1).c_str());
+        std::string number = std::to_string(frame);
+        if (int(number.size()) < width) number.insert(0, width - number.size(), '0');
+        return pattern.substr(0, percent) + number + pattern.substr(d + 1);
+    }
+
+    /**
+     * Writes frames on a thread of its own. One frame can wait while another is written, submit() blocks
+     * beyond that, so a slow disk holds up rendering instead of piling up frames in memory.
+     */
+    class frame_writer {
+        public:
+            frame_writer() : thread([this] { run(); }) {}
+
+            ~frame_writer() { finish(); }
+
+            /** queue image to be written to path. Takes the pixels, image is empty afterwards */
+            void submit(framebuffer& image, const std::string& path) {
+                std::unique_lock<std::mutex> lock(mutex);
+                auto start = std::chrono::steady_clock::now();
+                slot_free.wait(lock, [this] { return !has_pending; });
+                wait_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                std::swap(pending, image);
+                pending_path = path;
+                has_pending = true;
+                wake.notify_one();
+            }
+
+            /** write what is still queued and stop the thread. False if any frame could not be written */
+            bool finish() {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    stopping = true;
+                    wake.notify_one();
+                }
+                if (thread.joinable()) thread.join();
+                return !failed;
+            }
+
+            /** how long submit() waited for the writer, in total */
+            double waited() const { return wait_seconds; }
+
+        private:
+            std::mutex mutex;
+            std::condition_variable wake, slot_free;
+            framebuffer pending, writing;
+            std::string pending_path, writing_path;
+            bool has_pending = false, stopping = false, failed = false;
+            double wait_seconds = 0;
+            std::thread thread; // last, so it starts after everything it uses
+
+            void run() {
+                while (true) {
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        wake.wait(lock, [this] { return has_pending || stopping; });
+                        if (!has_pending) return;
+                        std::swap(pending, writing);
+                        writing_path = pending_path;
+                        has_pending = false;
+                        slot_free.notify_one();
+                    }
+                    if (!image_io::write_image(writing, writing_path)) {
+                        std::clog << "\nCould not write " << writing_path << "\n";
+                        failed = true;
+                    }
+                }
+            }
+    };
+
+    /**
+     * Render all frames of seq with cam and world. spheres is the sphere set of world the moving spheres belong to.
+     * Returns false if a sphere index is out of range or a frame can't be written.
+     */
+    inline bool render(camera& cam, const hittable& world, sphere_set& spheres, const sequence& seq, const options& opts) {
+        typedef std::chrono::steady_clock clock;
+        for (const auto& sphere : seq.sphere_keys) {
+            if (sphere.first >= spheres.size()) {
+                std::cerr << "Cannot move sphere " << sphere.first << ", the scene has " << spheres.size() << "\n";
+                return false;
+            }
+        }
+        // where every moving sphere is stored. build() moves them around
+        std::vector<uint32_t> stored_at;
+        auto find_spheres = [&] {
+            const std::vector<uint32_t>& added = spheres.added_indices();
+            stored_at.assign(added.size(), 0);
+            for (size_t i = 0; i < added.size(); i++) stored_at[added[i]] = uint32_t(i);
+        };
+        find_spheres();
+        if (!seq.sphere_keys.empty() && spheres.bvh_nodes().empty()) spheres.build();
+        double built_cost = bvh_cost(spheres.bvh_nodes());
+
+        uint64_t base_seed = cam.seed;
+        frame_writer writer;
+        int refits = 0, rebuilds = 0;
+        double update_seconds = 0;
+        render_stats stats;
+        auto start = clock::now();
+        for (int frame = 0; frame < seq.frame_count; frame++) {
+            apply_camera(seq, frame, cam);
+            cam.seed = hash_key(base_seed, uint64_t(frame));
+            if (!seq.sphere_keys.empty()) {
+                auto update_start = clock::now();
+                for (const auto& sphere : seq.sphere_keys) {
+                    point3 center = interpolate<vec3>(sphere.second, frame, [](const sphere_key& k) { return k.center; });
+                    spheres.move_sphere(stored_at[sphere.first], center);
+                }
+                spheres.refit();
+                refits++;
+                if (bvh_cost(spheres.bvh_nodes()) > opts.rebuild_factor * built_cost) {
+                    spheres.build();
+                    find_spheres();
+                    built_cost = bvh_cost(spheres.bvh_nodes());
+                    rebuilds++;
+                }
+                update_seconds += std::chrono::duration<double>(clock::now() - update_start).count();
+            }
+
+            framebuffer image;
+            cam.render(world, image);
+            stats += cam.stats();
+            if (opts.denoise) {
+                framebuffer normal, albedo, depth;
+                cam.render_aovs(world, normal, albedo, depth);
+                denoise::filter(image, normal, albedo, depth, cam.pixel_variances());
+            }
+            std::clog << "Frame " << frame + 1 << " of " << seq.frame_count << " done\n";
+            writer.submit(image, frame_path(opts.output, frame));
+        }
+        bool written = writer.finish();
+        cam.seed = base_seed;
+
+        double seconds = std::chrono::duration<double>(clock::now() - start).count();
+        std::clog << "Rendered " << seq.frame_count << " frames in " << seconds << " s (" << seconds / seq.frame_count << " s per frame), "
+                  << stats.rays / seconds << " rays/s. ";
+        if (refits > 0) std::clog << "Moving spheres: " << refits << " refits, " << rebuilds << " rebuilds, " << 1000 * update_seconds << " ms. ";
+        std::clog << "Waited " << 1000 * writer.waited() << " ms for the frame writer\n";
+        return written;
+    }
+}
+
+#endif
@@ -0,0 +1,921 @@
+/**
+ * Benchmarks for the renderer. Not part of the image pipeline, run it with
+ * `build/RaytracingBenchmark`, or `build/RaytracingBenchmark arena denoise` for just those two (main() lists the names)
+ */
+#include "material.h"
+#include "project_utils.h"
+#include "hittable_list.h"
+#include "sphere.h"
+#include "bvh.h"
+#include "sphere_set.h"
+#include "scene_file.h"
+#include "triangle_mesh.h"
+#include "mesh_file.h"
+#include "scenes.h"
+#include "instance.h"
+#include "scene_arena.h"
+#include "camera.h"
+#include "denoise.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using bench_clock = std::chrono::steady_clock;
+
+static double seconds_since(bench_clock::time_point start) {
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+static int failed_checks = 0;
+
+/** a check some benchmarks make of their results. A failed one is printed and makes the run exit with 1 */
+static bool check(bool ok, const std::string& what) {
+    if (!ok) {
+        printf("FAILED: %s\n", what.c_str());
+        failed_checks++;
+    }
+    return ok;
+}
+
+/** N spheres at random positions in a cube whose size grows with N, so the density stays the same */
+static hittable_list random_sphere_cloud(int sphere_count, rng& gen) {
+    hittable_list world;
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    double side = 4 * cbrt(double(sphere_count));
+    for (int i = 0; i < sphere_count; i++) {
+        auto center = vec3::random(gen, -side / 2, side / 2);
+        world.add(make_shared<sphere>(center, 0.5, mat));
+    }
+    return world;
+}
+
+/** rays from random points on a big sphere around the scene towards random points inside of it */
+static std::vector<ray> random_rays(const aabb& bounds, int ray_count, rng& gen) {
+    std::vector<ray> rays;
+    rays.reserve(ray_count);
+    auto center = bounds.centroid();
+    auto reach = bounds.x.size() + bounds.y.size() + bounds.z.size();
+    for (int i = 0; i < ray_count; i++) {
+        auto origin = center + reach * random_unit_vector(gen);
+        auto target = center + vec3(bounds.x.size() * random_double(gen, -0.5, 0.5),
+                                    bounds.y.size() * random_double(gen, -0.5, 0.5),
+                                    bounds.z.size() * random_double(gen, -0.5, 0.5));
+        rays.push_back(ray(origin, target - origin));
+    }
+    return rays;
+}
+
+/** returns rays per second. hit_count makes sure the compiler can't skip the work */
+static double trace_rays(const hittable& world, const std::vector<ray>& rays, int& hit_count) {
+    auto start = bench_clock::now();
+    hit_details hit;
+    for (const ray& r : rays) {
+        if (world.hits(r, range(0.001, infinity), hit)) hit_count++;
+    }
+    return rays.size() / seconds_since(start);
+}
+
+/** rays/sec of the linear hittable_list against the BVH as the number of spheres grows */
+static void bvh_scaling_benchmark() {
+    printf("%10s %12s %16s %16s %10s\n", "spheres", "build [ms]", "list [rays/s]", "bvh [rays/s]", "speedup");
+    for (int sphere_count = 100; sphere_count <= 1000000; sphere_count *= 10) {
+        rng gen = rng(uint64_t(sphere_count));
+        hittable_list world = random_sphere_cloud(sphere_count, gen);
+
+        auto build_start = bench_clock::now();
+        bvh tree(world);
+        double build_ms = 1000 * seconds_since(build_start);
+
+        int hit_count = 0;
+        auto rays = random_rays(world.bounding_box(), 200000, gen);
+        double bvh_rate = trace_rays(tree, rays, hit_count);
+
+        // the linear list gets very slow, so it gets fewer rays for bigger scenes
+        int list_rays = int(rays.size() * 100 / sphere_count);
+        list_rays = list_rays < 200 ? 200 : (list_rays > int(rays.size()) ? int(rays.size()) : list_rays);
+        std::vector<ray> list_subset(rays.begin(), rays.begin() + list_rays);
+        double list_rate = trace_rays(world, list_subset, hit_count);
+
+        printf("%10d %12.1f %16.0f %16.0f %9.1fx\n", sphere_count, build_ms, list_rate, bvh_rate, bvh_rate / list_rate);
+        if (hit_count < 0) printf("unreachable\n");
+    }
+}
+
+/** sphere objects in a bvh against the structure-of-arrays sphere_set with every SIMD kernel */
+static void sphere_kernel_benchmark() {
+    printf("\nbest SIMD level on this CPU: %s\n", simd_level_name(best_simd_level()));
+    printf("%10s %16s %16s %16s %16s %16s\n", "spheres", "bvh [rays/s]", "scalar", "sse2", "avx2", "avx512");
+    const simd_level levels[] = { simd_level::scalar, simd_level::sse2, simd_level::avx2, simd_level::avx512 };
+    for (int sphere_count = 1000; sphere_count <= 100000; sphere_count *= 10) {
+        rng gen = rng(uint64_t(sphere_count));
+        hittable_list world = random_sphere_cloud(sphere_count, gen);
+        bvh tree(world);
+        sphere_set spheres;
+        uint32_t mat = spheres.add_material(make_shared<lambertian>(color(0.5, 0.5, 0.5)));
+        for (const auto& object : world.objects) {
+            auto box = object->bounding_box();
+            spheres.add(box.centroid(), box.x.size() / 2, mat);
+        }
+        spheres.build();
+
+        auto rays = random_rays(world.bounding_box(), 200000, gen);
+        int reference_hits = 0;
+        printf("%10d %16.0f", sphere_count, trace_rays(tree, rays, reference_hits));
+        for (simd_level level : levels) {
+            if (int(level) > int(best_simd_level())) {
+                printf(" %16s", "n/a");
+                continue;
+            }
+            spheres.use_simd_level(level);
+            int hit_count = 0;
+            double rate = trace_rays(spheres, rays, hit_count);
+            printf(" %16.0f", rate);
+            if (hit_count != reference_hits) printf(" (MISMATCH: %d hits instead of %d)", hit_count, reference_hits);
+        }
+        printf("\n");
+    }
+}
+
+/** how long a million sphere scene takes to load from the text and the binary scene format */
+static void scene_load_benchmark() {
+    const int sphere_count = 1000000;
+    rng gen = rng(7);
+    sphere_set spheres;
+    double side = 4 * cbrt(double(sphere_count));
+    for (int i = 0; i < sphere_count; i++) {
+        // 64 distinct materials, every one of them used by many spheres
+        auto mat = make_shared<lambertian>(color(i % 4 / 4.0, i / 4 % 4 / 4.0, i / 16 % 4 / 4.0));
+        spheres.add(vec3::random(gen, -side / 2, side / 2), 0.5, mat);
+    }
+    spheres.build();
+    camera cam;
+    const std::string text_path = "benchmark_scene.rts", binary_path = "benchmark_scene.rtb";
+    scene_file::save_scene(text_path, spheres, cam);
+    scene_file::save_scene(binary_path, spheres, cam);
+
+    printf("\n%10s %8s %12s %12s\n", "format", "spheres", "materials", "load [ms]");
+    const std::string paths[] = { text_path, binary_path };
+    for (const std::string& path : paths) {
+        hittable_list world;
+        camera loaded_cam;
+        std::string error;
+        auto start = bench_clock::now();
+        bool ok = scene_file::load_scene(path, world, loaded_cam, error);
+        double load_ms = 1000 * seconds_since(start);
+        if (!ok) {
+            printf("%s: %s\n", path.c_str(), error.c_str());
+            continue;
+        }
+        const sphere_set& loaded = static_cast<const sphere_set&>(*world.objects[0]);
+        std::vector<material_record> materials;
+        std::vector<uint32_t> slots;
+        scene_file::used_materials(loaded, materials, slots);
+        size_t material_count = materials.size();
+        printf("%10s %8zu %12zu %12.1f\n", path.substr(path.size() - 3).c_str(), loaded.size(), material_count, load_ms);
+        remove(path.c_str());
+    }
+}
+
+/**
+ * The hit path of a bounce: closest hit, then scatter off the material that was hit.
+ * Run on every core at once, since shared materials cost the most when many threads touch them.
+ */
+static void material_benchmark() {
+    const int sphere_count = 10000, ray_count = 200000;
+    rng gen = rng(11);
+    sphere_set spheres;
+    double side = 4 * cbrt(double(sphere_count));
+    // the three material classes, so scatter has to dispatch
+    shared_ptr<material> materials[] = { make_shared<lambertian>(color(0.5, 0.5, 0.5)),
+                                         make_shared<metal>(color(0.7, 0.6, 0.5), 0.2),
+                                         make_shared<dielectric>(1.5) };
+    for (int i = 0; i < sphere_count; i++) spheres.add(vec3::random(gen, -side / 2, side / 2), 0.5, materials[i % 3]);
+    spheres.build();
+    auto rays = random_rays(spheres.bounding_box(), ray_count, gen);
+
+    printf("\n%10s %16s\n", "threads", "hit+scatter [rays/s]");
+    int hardware_threads = int(std::thread::hardware_concurrency());
+    for (int thread_count = 1; ; thread_count = thread_count * 2 < hardware_threads ? thread_count * 2 : hardware_threads) {
+        std::vector<std::thread> threads;
+        std::vector<int> scatter_counts(thread_count, 0);
+        auto start = bench_clock::now();
+        for (int t = 0; t < thread_count; t++) {
+            threads.emplace_back([&, t]() {
+                hit_details hit;
+                rng ray_gen = rng(uint64_t(t));
+                for (const ray& r : rays) {
+                    if (!spheres.hits(r, range(0.001, infinity), hit)) continue;
+                    color attenuation;
+                    ray scattered;
+                    if (scene_materials()[hit.mat].scatter(r, hit, attenuation, scattered, ray_gen)) scatter_counts[t]++;
+                }
+            });
+        }
+        for (auto& thread : threads) thread.join();
+        double rate = double(rays.size()) * thread_count / seconds_since(start);
+        printf("%10d %16.0f\n", thread_count, rate);
+        if (scatter_counts[0] < 0) printf("unreachable\n");
+        if (thread_count >= hardware_threads) break;
+    }
+}
+
+/**
+ * Triangle meshes: how fast OBJ and PLY files load, how much memory a loaded mesh takes,
+ * and how many rays per second its BVH and the watertight triangle test manage
+ */
+static void mesh_benchmark() {
+    const int ray_count = 200000;
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    printf("\n%10s %10s %12s %12s %14s %12s %12s\n", "format", "triangles", "load [ms]", "build [ms]", "memory [MB]", "bytes/tri", "rays/s");
+    for (int triangle_count : { 100000, 1000000, 4000000 }) {
+        auto source = bumpy_sphere_mesh(point3(0, 0, 0), 10, triangle_count, mat);
+        const std::string paths[] = { "benchmark_mesh.obj", "benchmark_mesh.ply" };
+        mesh_file::save_obj(paths[0], *source);
+        mesh_file::save_ply(paths[1], *source);
+        source.reset();
+        for (const std::string& path : paths) {
+            triangle_mesh mesh(mat);
+            std::string error;
+            double load_ms, build_ms;
+            {
+                auto start = bench_clock::now();
+                mapped_file file(path);
+                bool ok = path.substr(path.size() - 3) == "ply" ? mesh_file::load_ply(file, mesh, error) : mesh_file::load_obj(file, mesh, error);
+                load_ms = 1000 * seconds_since(start);
+                if (!ok) {
+                    printf("%s: %s\n", path.c_str(), error.c_str());
+                    continue;
+                }
+            }
+            auto start = bench_clock::now();
+            mesh.build();
+            build_ms = 1000 * seconds_since(start);
+            remove(path.c_str());
+
+            rng gen = rng(5);
+            auto rays = random_rays(mesh.bounding_box(), ray_count, gen);
+            int hit_count = 0;
+            double rate = trace_rays(mesh, rays, hit_count);
+            printf("%10s %10zu %12.1f %12.1f %14.1f %12.1f %12.0f\n", path.substr(path.size() - 3).c_str(), mesh.triangle_count(), load_ms,
+                   build_ms, mesh.memory_bytes() / 1e6, double(mesh.memory_bytes()) / mesh.triangle_count(), rate);
+        }
+    }
+}
+
+/**
+ * Copies of a 100k triangle mesh as instances: memory has to stay at one mesh plus a little per copy,
+ * compared to what real copies would take, and the transformed rays should not cost much speed
+ */
+static void instance_benchmark() {
+    const int ray_count = 100000;
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    auto mesh = bumpy_sphere_mesh(point3(0, 0, 0), 1, 100000, mat);
+    printf("\n%10s %14s %16s %12s\n", "instances", "memory [MB]", "as copies [MB]", "rays/s");
+    for (int count : { 1, 100, 10000 }) {
+        rng gen = rng(9);
+        std::vector<shared_ptr<hittable>> copies;
+        double side = 4 * cbrt(double(count));
+        for (int i = 0; i < count; i++) {
+            affine_transform placement = affine_transform::translate(vec3::random(gen, -side / 2, side / 2))
+                                         * affine_transform::rotate(i % 3, random_double(gen, 0, 360));
+            copies.push_back(make_shared<instance>(mesh, placement));
+        }
+        bvh world(copies);
+        size_t instanced_bytes = mesh->memory_bytes() + count * sizeof(instance) + world.node_count() * sizeof(bvh_node);
+        auto rays = random_rays(world.bounding_box(), ray_count, gen);
+        int hit_count = 0;
+        double rate = trace_rays(world, rays, hit_count);
+        printf("%10d %14.1f %16.1f %12.0f\n", count, instanced_bytes / 1e6, double(count) * mesh->memory_bytes() / 1e6, rate);
+    }
+}
+
+/** a Linux perf event counter, for this thread only */
+class perf_counter {
+    public:
+        perf_counter(uint32_t type, uint64_t config) {
+#ifdef __linux__
+            perf_event_attr attributes;
+            memset(&attributes, 0, sizeof(attributes));
+            attributes.type = type;
+            attributes.size = sizeof(attributes);
+            attributes.config = config;
+            attributes.disabled = 1;
+            attributes.exclude_kernel = 1;
+            attributes.exclude_hv = 1;
+            fd = int(syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0));
+#else
+            (void)type;
+            (void)config;
+#endif
+        }
+        ~perf_counter() {
+#ifdef __linux__
+            if (fd >= 0) close(fd);
+#endif
+        }
+
+        bool available() const { return fd >= 0; }
+
+        void start() {
+#ifdef __linux__
+            if (fd < 0) return;
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+        }
+
+        uint64_t stop() {
+            uint64_t count = 0;
+#ifdef __linux__
+            if (fd < 0) return 0;
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fd, &count, sizeof(count)) != ssize_t(sizeof(count))) count = 0;
+#endif
+            return count;
+        }
+
+    private:
+        int fd = -1;
+};
+
+/** the median distance in bytes between objects made one after the other: how densely they are packed */
+static double median_stride(const std::vector<shared_ptr<hittable>>& objects) {
+    std::vector<double> strides;
+    for (size_t i = 1; i < objects.size(); i++) {
+        strides.push_back(fabs(double(reinterpret_cast<uintptr_t>(objects[i].get())) - double(reinterpret_cast<uintptr_t>(objects[i - 1].get()))));
+    }
+    std::nth_element(strides.begin(), strides.begin() + strides.size() / 2, strides.end());
+    return strides[strides.size() / 2];
+}
+
+/**
+ * A million spheres built the way main.cc-style code does, one material and one sphere after the other,
+ * once with make_shared and once in a scene_arena: build time, packing, rays/s of the traversal and its cache misses per ray,
+ * teardown time and frees. The misses need the CPU's counters, n/a without them (e.g. in most virtual machines).
+ */
+static void arena_benchmark() {
+    const int sphere_count = 1000000;
+    const int ray_count = 500000;
+#ifdef __linux__
+    perf_counter page_faults(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS);
+    perf_counter cache_misses(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+#else
+    perf_counter page_faults(0, 0);
+    perf_counter cache_misses(0, 0);
+#endif
+    printf("\n%12s %12s %14s %12s %12s %12s %12s %14s %8s\n", "1M spheres", "build [ms]", "bvh build [ms]", "stride [B]",
+           "page faults", "rays/s", "misses/ray", "teardown [ms]", "frees");
+    for (int use_arena = 0; use_arena < 2; use_arena++) {
+        rng gen = rng(11);
+        double side = 4 * cbrt(double(sphere_count));
+        auto start = bench_clock::now();
+        page_faults.start();
+        hittable_list world;
+        size_t frees = sphere_count; // make_shared: one per sphere
+        {
+            auto arena = make_shared<scene_arena>();
+            for (int i = 0; i < sphere_count; i++) {
+                auto center = vec3::random(gen, -side / 2, side / 2);
+                color albedo = color::random(gen);
+                if (use_arena) world.add(arena->make<sphere>(center, 0.5, arena->make<lambertian>(albedo)));
+                else world.add(make_shared<sphere>(center, 0.5, make_shared<lambertian>(albedo)));
+            }
+            if (use_arena) frees = arena->release_count();
+        }
+        double build_ms = 1000 * seconds_since(start);
+        start = bench_clock::now();
+        auto tree = make_shared<bvh>(world);
+        double bvh_ms = 1000 * seconds_since(start);
+        uint64_t faults = page_faults.stop();
+
+        auto rays = random_rays(world.bounding_box(), ray_count, gen);
+        int hit_count = 0;
+        cache_misses.start();
+        double rate = trace_rays(*tree, rays, hit_count);
+        uint64_t misses = cache_misses.stop();
+        char misses_per_ray[32] = "n/a";
+        if (cache_misses.available()) snprintf(misses_per_ray, sizeof(misses_per_ray), "%.2f", double(misses) / ray_count);
+        double stride = median_stride(world.objects);
+
+        start = bench_clock::now();
+        tree.reset();
+        world.clear();
+        double teardown_ms = 1000 * seconds_since(start);
+        printf("%12s %12.1f %14.1f %12.0f %12llu %12.0f %12s %14.1f %8zu\n", use_arena ? "arena" : "make_shared", build_ms, bvh_ms, stride,
+               (unsigned long long)faults, rate, misses_per_ray, teardown_ms, frees);
+    }
+}
+
+/**
+ * Quality against samples per pixel, with and without the denoiser: the error of a cover scene render against
+ * a 256 spp reference, in display units (image_io::compare_images). rmse is per pixel, mean shows a bias
+ */
+static void denoise_benchmark() {
+    const int reference_spp = 256;
+    sphere_set spheres;
+    camera cam;
+    cover_scene(spheres, cam);
+    spheres.build();
+    cam.image_width = 240;
+    cam.samples_per_pixel = reference_spp;
+    std::clog.setstate(std::ios::failbit); // the renders' progress lines
+    framebuffer reference;
+    cam.render(spheres, reference);
+    printf("\n%6s %12s %14s %14s %14s %14s\n", "spp", "render [ms]", "noisy rmse", "denoised rmse", "denoised mean", "denoise [ms]");
+    for (int spp = 1; spp <= 64; spp *= 2) {
+        cam.samples_per_pixel = spp;
+        framebuffer image, normal, albedo, depth;
+        auto start = bench_clock::now();
+        cam.render(spheres, image);
+        double render_ms = 1000 * seconds_since(start);
+        image_io::image_difference noisy = image_io::compare_images(reference, image);
+        start = bench_clock::now();
+        cam.render_aovs(spheres, normal, albedo, depth);
+        denoise::filter(image, normal, albedo, depth, cam.pixel_variances());
+        double denoise_ms = 1000 * seconds_since(start);
+        image_io::image_difference denoised = image_io::compare_images(reference, image);
+        printf("%6d %12.1f %14.4f %14.4f %14.4f %14.1f\n", spp, render_ms, noisy.rmse, denoised.rmse, denoised.mean_error, denoise_ms);
+        // low sample counts are what the denoiser is for, but it must not make cleaner images worse either
+        if (spp >= 16) check(denoised.rmse <= noisy.rmse, "denoising " + std::to_string(spp) + " spp raises the rmse");
+    }
+    std::clog.clear();
+}
+
+/**
+ * Moving spheres between the frames of an animation: building the BVH again every frame against refitting it.
+ * A share of 100k spheres drifts in random directions for 24 frames, about two sphere diameters in total.
+ * Refits are much cheaper than builds, but the tree gets worse as things move away from where it was built for,
+ * cost is bvh_cost after the last frame relative to a fresh build
+ */
+static void animation_benchmark() {
+    const int sphere_count = 100000, frame_count = 24, ray_count = 200000;
+    printf("\n%8s %10s %16s %14s %16s\n", "moving", "update", "per frame [ms]", "cost", "rays/s");
+    for (int percent : { 1, 10, 100 }) {
+        for (bool refit : { false, true }) {
+            rng gen = rng(uint64_t(sphere_count));
+            hittable_list cloud = random_sphere_cloud(sphere_count, gen);
+            sphere_set spheres;
+            uint32_t mat = spheres.add_material(make_shared<lambertian>(color(0.5, 0.5, 0.5)));
+            std::vector<point3> centers;
+            std::vector<vec3> velocities;
+            for (const auto& object : cloud.objects) {
+                auto box = object->bounding_box();
+                spheres.add(box.centroid(), box.x.size() / 2, mat);
+                centers.push_back(box.centroid());
+                velocities.push_back(random_double(gen) * 100 < percent ? (2.0 / frame_count) * random_unit_vector(gen) : vec3(0,0,0));
+            }
+            spheres.build();
+
+            double update_seconds = 0;
+            for (int frame = 1; frame <= frame_count; frame++) {
+                auto start = bench_clock::now();
+                const std::vector<uint32_t>& added = spheres.added_indices();
+                for (size_t i = 0; i < spheres.size(); i++) {
+                    if (velocities[added[i]].length_squared() > 0) spheres.move_sphere(i, centers[added[i]] + frame * velocities[added[i]]);
+                }
+                if (refit) spheres.refit();
+                else spheres.build();
+                update_seconds += seconds_since(start);
+            }
+            double cost = bvh_cost(spheres.bvh_nodes());
+            auto rays = random_rays(spheres.bounding_box(), ray_count, gen);
+            int hit_count = 0;
+            double rate = trace_rays(spheres, rays, hit_count);
+            sphere_set fresh;
+            for (size_t i = 0; i < spheres.size(); i++) {
+                fresh.add(point3(spheres.centers_x()[i], spheres.centers_y()[i], spheres.centers_z()[i]), spheres.radius_values()[i], mat);
+            }
+            fresh.build();
+            printf("%7d%% %10s %16.2f %14.2f %16.0f\n", percent, refit ? "refit" : "build", 1000 * update_seconds / frame_count,
+                   cost / bvh_cost(fresh.bvh_nodes()), rate);
+        }
+    }
+}
+
+/** the rejection samplers the warps replaced, counting the random numbers they draw */
+static vec3 rejection_unit_disk(rng& gen, int& draws) {
+    while (true) {
+        draws += 2;
+        auto p = vec3(random_double(gen, -1, 1), random_double(gen, -1, 1), 0);
+        if (p.length_squared() < 1) return p;
+    }
+}
+
+static vec3 rejection_unit_vector(rng& gen, int& draws) {
+    while (true) {
+        draws += 3;
+        auto p = vec3::random(gen, -1, 1);
+        if (p.length_squared() < 1) return unit_vector(p);
+    }
+}
+
+/** the old lambertian direction: the normal plus a uniform direction on its hemisphere */
+static vec3 normal_plus_hemisphere(const vec3& normal, rng& gen, int& draws) {
+    vec3 v = rejection_unit_vector(gen, draws);
+    if (dot(v, normal) < 0) v *= -1;
+    return unit_vector(normal + v);
+}
+
+/** mean and standard error of a stream of values */
+struct running_mean {
+    double sum = 0, squared_sum = 0;
+    long count = 0;
+
+    void add(double value) {
+        sum += value;
+        squared_sum += value * value;
+        count++;
+    }
+    double mean() const { return sum / count; }
+    double variance() const { return squared_sum / count - mean() * mean(); }
+    double standard_error() const { return sqrt(variance() / count); }
+};
+
+/**
+ * Pearson's chi-square of points binned by (x, angle) in a grid of equally likely cells, for a warp that should make x and
+ * the angle independent and uniform in [0, 1) and [-pi, pi). With many cells it is about normal, mean and variance
+ * 1 and 2 per degree of freedom; more than 5 standard deviations above the mean fails
+ */
+struct uniform_histogram {
+    static const int bins = 16;
+    long counts[bins * bins] = {};
+    long count = 0;
+
+    void add(double x, double angle) {
+        int i = std::min(bins - 1, std::max(0, int(x * bins)));
+        int j = std::min(bins - 1, std::max(0, int((angle + pi) / (2 * pi) * bins)));
+        counts[i * bins + j]++;
+        count++;
+    }
+    double chi_square() const {
+        double expected = double(count) / (bins * bins), sum = 0;
+        for (long c : counts) sum += (c - expected) * (c - expected) / expected;
+        return sum;
+    }
+    static double critical_value() {
+        double degrees = bins * bins - 1;
+        return degrees + 5 * sqrt(2 * degrees);
+    }
+};
+
+/**
+ * The sampling warps (concentric_disk, uniform_sphere, cosine_hemisphere in an onb) against the rejection loops they replaced.
+ * Speed: ns and random numbers per sample. Correctness: the mean of test functions whose exact expected value is known,
+ * with how many standard errors the estimate is off (|z| < 4 passes, anything else fails the run). The lambertian rows
+ * estimate the light a lambertian surface reflects from a sky that brightens with height (exactly a + 2/3 b n.y, see the
+ * MATH note below) with each way of picking directions. Every unbiased one gets the same answer, the old one must not;
+ * the variance per sample says how many samples each needs for the same noise. Last, a chi-square test of each warp's
+ * whole distribution
+ */
+static void sampling_benchmark() {
+    const int sample_count = 2000000;
+    printf("\n%-34s %8s %8s %12s %12s %12s %8s %6s\n", "sampler / test", "ns", "draws", "estimate", "exact", "variance", "z", "");
+    // biased rows are there for comparison: they have to miss
+    auto report = [&](const char* name, double seconds, long draws, const running_mean& m, double exact, bool biased = false) {
+        double z = (m.mean() - exact) / m.standard_error();
+        bool unbiased = fabs(z) < 4;
+        printf("%-34s %8.1f %8.2f %12.6f %12.6f %12.6f %8.2f %6s\n", name, 1e9 * seconds / sample_count, double(draws) / sample_count,
+               m.mean(), exact, m.variance(), z, unbiased ? "ok" : "biased");
+        check(unbiased != biased, std::string(name) + (biased ? " should be biased" : " is biased"));
+    };
+    // one fixed, tilted normal, so the onb is exercised off the axes
+    const vec3 normal = unit_vector(vec3(0.3, 0.8, -0.52));
+    // MATH: the cosine weighted average of the sky a + b * d.y over the hemisphere is a + b * 2/3 * n.y
+    const double sky_a = 0.7, sky_b = 0.3;
+    auto sky = [&](const vec3& d) { return sky_a + sky_b * d.y(); };
+    const double irradiance = sky_a + sky_b * 2.0 / 3.0 * normal.y();
+
+    {
+        rng gen(1);
+        running_mean m;
+        int draws = 0;
+        auto start = bench_clock::now();
+        for (int i = 0; i < sample_count; i++) m.add(rejection_unit_disk(gen, draws).length_squared());
+        report("disk: rejection, E[r^2]", seconds_since(start), draws, m, 0.5);
+    }
+    {
+        rng gen(1);
+        running_mean m;
+        auto start = bench_clock::now();
+        for (int i = 0; i < sample_count; i++) m.add(random_in_unit_disk(gen).length_squared());
+        report("disk: concentric, E[r^2]", seconds_since(start), 2L * sample_count, m, 0.5);
+    }
+    {
+        rng gen(1);
+        running_mean m;
+        int draws = 0;
+        auto start = bench_clock::now();
+        for (int i = 0; i < sample_count; i++) m.add(pow(rejection_unit_vector(gen, draws).z(), 2));
+        report("sphere: rejection, E[z^2]", seconds_since(start), draws, m, 1.0 / 3);
+    }
+    {
+        rng gen(1);
+        running_mean m;
+        auto start = bench_clock::now();
+        for (int i = 0; i < sample_count; i++) m.add(pow(random_unit_vector(gen).z(), 2));
+        report("sphere: closed form, E[z^2]", seconds_since(start), 2L * sample_count, m, 1.0 / 3);
+    }
+    {
+        rng gen(1);
+        running_mean m;
+        auto start = bench_clock::now();
+        for (int i = 0; i < sample_count; i++) {
+            double u1 = random_double(gen);
+            m.add(pow(dot(onb(normal).local(cosine_hemisphere(u1, random_double(gen))), normal), 2));
+        }
+        report("cosine: onb, E[cos^2]", seconds_since(start), 2L * sample_count, m, 0.5);
+    }
+    {
+        rng gen(1);
+        running_mean m;
+        int draws = 0;
+        auto start = bench_clock::now();
+        for (int i = 0; i < sample_count; i++) m.add(sky(normal_plus_hemisphere(normal, gen, draws)));
+        report("lambertian: old n + hemisphere", seconds_since(start), draws, m, irradiance, true);
+    }
+    {
+        rng gen(1);
+        running_mean m;
+        auto start = bench_clock::now();
+        for (int i = 0; i < sample_count; i++) {
+            double u1 = random_double(gen);
+            m.add(sky(onb(normal).local(cosine_hemisphere(u1, random_double(gen)))));
+        }
+        report("lambertian: cosine, weight 1", seconds_since(start), 2L * sample_count, m, irradiance);
+    }
+    {
+        // the same integral through lambertian_reflectance / pdf, with directions that ignore the cosine
+        lambertian surface(color(1, 1, 1));
+        hit_details hit;
+        hit.normal = normal;
+        rng gen(1);
+        running_mean m;
+        auto start = bench_clock::now();
+        for (int i = 0; i < sample_count; i++) {
+            vec3 d = random_unit_vector(gen);
+            m.add(sky(d) * surface.lambertian_reflectance(hit, d).x() / uniform_sphere_pdf());
+        }
+        report("lambertian: uniform, f cos / pdf", seconds_since(start), 2L * sample_count, m, irradiance);
+    }
+
+    // the whole distributions: each warp is uniform in (r^2 or the height, angle), so every cell is equally likely
+    printf("\n%-34s %12s %12s\n", "warp histogram", "chi-square", "critical");
+    auto report_histogram = [&](const char* name, const uniform_histogram& h) {
+        double chi_square = h.chi_square();
+        printf("%-34s %12.1f %12.1f\n", name, chi_square, uniform_histogram::critical_value());
+        check(chi_square < uniform_histogram::critical_value(), std::string(name) + " is not uniform");
+    };
+    {
+        rng gen(2);
+        uniform_histogram h;
+        for (int i = 0; i < sample_count; i++) {
+            vec3 p = random_in_unit_disk(gen);
+            h.add(p.length_squared(), atan2(p.y(), p.x()));
+        }
+        report_histogram("disk: concentric, (r^2, angle)", h);
+    }
+    {
+        rng gen(3);
+        uniform_histogram h;
+        for (int i = 0; i < sample_count; i++) {
+            vec3 d = random_unit_vector(gen);
+            h.add((d.z() + 1) / 2, atan2(d.y(), d.x()));
+        }
+        report_histogram("sphere: closed form, (z, angle)", h);
+    }
+    {
+        // MATH: for the cosine density sin^2(theta) is uniform, the disk's r^2 before the lift
+        rng gen(4);
+        onb basis(normal);
+        uniform_histogram h;
+        for (int i = 0; i < sample_count; i++) {
+            double u1 = random_double(gen);
+            vec3 d = basis.local(cosine_hemisphere(u1, random_double(gen)));
+            double cos_theta = dot(d, basis.w);
+            h.add(1 - cos_theta * cos_theta, atan2(dot(d, basis.v), dot(d, basis.u)));
+        }
+        report_histogram("cosine: onb, (sin^2, angle)", h);
+    }
+}
+
+/**
+ * The error of the cover scene against a reference for every sampler_type, by samples per pixel.
+ * Independent samples halve the error with 4x the samples, the others should do better, most for small counts;
+ * from 4 spp one that doesn't fails the run.
+ * The reference uses another seed, so its own noise isn't correlated with any of the renders
+ */
+static void sampler_benchmark() {
+    const int reference_spp = 1024;
+    sphere_set spheres;
+    camera cam;
+    cover_scene(spheres, cam);
+    spheres.build();
+    cam.image_width = 160;
+    std::clog.setstate(std::ios::failbit); // the renders' progress lines
+    framebuffer reference;
+    cam.sampler = sampler_type::sobol;
+    cam.samples_per_pixel = reference_spp;
+    cam.seed = hash_key(cam.seed, 1);
+    cam.render(spheres, reference);
+    cam.seed = camera().seed;
+    const sampler_type types[] = { sampler_type::independent, sampler_type::stratified, sampler_type::sobol, sampler_type::blue_noise };
+    printf("\n%6s %12s %12s %12s %12s  (rmse)\n", "spp", "independent", "stratified", "sobol", "blue noise");
+    for (int spp = 1; spp <= 64; spp *= 2) {
+        printf("%6d", spp);
+        double rmse[4];
+        for (int i = 0; i < 4; i++) {
+            cam.sampler = types[i];
+            cam.samples_per_pixel = spp;
+            framebuffer image;
+            cam.render(spheres, image);
+            rmse[i] = image_io::compare_images(reference, image).rmse;
+            printf(" %12.4f", rmse[i]);
+        }
+        printf("\n");
+        if (spp >= 4) {
+            for (int i = 1; i < 4; i++) check(rmse[i] <= rmse[0], std::to_string(spp) + " spp: a sampler is worse than independent samples");
+        }
+    }
+    std::clog.clear();
+}
+
+/**
+ * The room lit by a single small lamp (room_scene), with light sampling against bounces alone.
+ * Error against a 1024 spp reference with light sampling, made with another seed. Light sampling has to come out ahead.
+ */
+static void light_sampling_benchmark() {
+    sphere_set spheres;
+    camera cam;
+    room_scene(spheres, cam);
+    cam.image_width = 80;
+    std::clog.setstate(std::ios::failbit); // the renders' progress lines
+    framebuffer reference;
+    cam.samples_per_pixel = 1024;
+    cam.seed = hash_key(cam.seed, 1);
+    cam.render(spheres, reference);
+    cam.seed = camera().seed;
+    printf("\n%6s %14s %12s %14s %12s %14s\n", "spp", "lights [rmse]", "[ms]", "bounces [rmse]", "[ms]", "shadow rays");
+    for (int spp = 1; spp <= 256; spp *= 4) {
+        cam.samples_per_pixel = spp;
+        printf("%6d", spp);
+        uint64_t shadow_rays = 0;
+        double rmse[2];
+        for (bool light_sampling : { true, false }) {
+            cam.light_sampling = light_sampling;
+            framebuffer image;
+            auto start = bench_clock::now();
+            cam.render(spheres, image);
+            double ms = 1000 * seconds_since(start);
+            if (light_sampling) shadow_rays = cam.stats().shadow_rays;
+            rmse[light_sampling ? 0 : 1] = image_io::compare_images(reference, image).rmse;
+            printf(" %14.4f %12.1f", rmse[light_sampling ? 0 : 1], ms);
+        }
+        printf(" %14llu\n", (unsigned long long)shadow_rays);
+        check(rmse[0] < rmse[1], std::to_string(spp) + " spp: light sampling is no better than bounces");
+    }
+    cam.light_sampling = true;
+    std::clog.clear();
+}
+
+/** returns rays per second of any-hit queries. blocked_count counts the rays that hit something */
+static double trace_shadow_rays(const hittable& world, const std::vector<ray>& rays, int& blocked_count) {
+    auto start = bench_clock::now();
+    for (const ray& r : rays) {
+        if (world.occluded(r, range(0.001, infinity))) blocked_count++;
+    }
+    return rays.size() / seconds_since(start);
+}
+
+/**
+ * Closest-hit against any-hit queries on the same rays: sphere objects in a bvh, a mesh and nested instances.
+ * Both must agree on which rays hit something at all
+ */
+static void occlusion_benchmark() {
+    const int ray_count = 200000;
+    rng gen = rng(12);
+    std::vector<std::pair<const char*, shared_ptr<hittable>>> scenes;
+    scenes.push_back(std::make_pair("spheres", make_shared<bvh>(random_sphere_cloud(100000, gen))));
+    scenes.push_back(std::make_pair("mesh", bumpy_sphere_mesh(point3(0, 0, 0), 1, 100000, make_shared<lambertian>(color(0.5, 0.5, 0.5)))));
+    hittable_list instance_world;
+    camera cam;
+    instance_scene(instance_world, cam, 1000);
+    scenes.push_back(std::make_pair("instances", instance_world.objects.back())); // the copies, without the ground
+
+    printf("\n%10s %16s %16s %10s\n", "scene", "closest [rays/s]", "any [rays/s]", "speedup");
+    for (const auto& scene : scenes) {
+        auto rays = random_rays(scene.second->bounding_box(), ray_count, gen);
+        int hit_count = 0, blocked_count = 0;
+        double closest_rate = trace_rays(*scene.second, rays, hit_count);
+        double any_rate = trace_shadow_rays(*scene.second, rays, blocked_count);
+        printf("%10s %16.0f %16.0f %9.1fx", scene.first, closest_rate, any_rate, any_rate / closest_rate);
+        if (hit_count != blocked_count) printf(" (MISMATCH: %d blocked, %d hit)", blocked_count, hit_count);
+        printf("\n");
+    }
+}
+
+/**
+ * The cover scene's glass makes some tiles far more expensive than others. The largest tile limits how fast a
+ * render of whole tiles can get, however many threads there are; split_samples shares its samples out.
+ * Prints the measured tile costs, then the wall time of a render with and without splitting on every hardware thread;
+ * the two images have to be the same
+ */
+static void sample_split_benchmark() {
+    sphere_set spheres;
+    camera cam;
+    cover_scene(spheres, cam);
+    cam.image_width = 240;
+    cam.samples_per_pixel = 32;
+    int height = cam.get_image_height();
+    std::clog.setstate(std::ios::failbit); // the renders' progress lines
+
+    std::vector<double> tile_seconds;
+    std::vector<color> sums;
+    std::vector<int> counts;
+    cam.thread_count = 1;
+    for (int y = 0; y < height; y += cam.tile_size) {
+        for (int x = 0; x < cam.image_width; x += cam.tile_size) {
+            auto start = bench_clock::now();
+            cam.render_samples(spheres, x, y, std::min(x + cam.tile_size, cam.image_width), std::min(y + cam.tile_size, height),
+                               0, cam.samples_per_pixel, sums, counts);
+            tile_seconds.push_back(seconds_since(start));
+        }
+    }
+    double total = 0, largest = 0;
+    for (double seconds : tile_seconds) {
+        total += seconds;
+        largest = std::max(largest, seconds);
+    }
+    printf("\n%6s %14s %16s %14s\n", "tiles", "largest [%]", "mean tile [ms]", "largest [ms]");
+    printf("%6zu %14.2f %16.2f %14.2f\n", tile_seconds.size(), 100 * largest / total, 1000 * total / tile_seconds.size(), 1000 * largest);
+    printf("whole tiles cannot render faster than the largest tile: at most %.0fx the speed of one thread\n", total / largest);
+
+    cam.thread_count = 0;
+    framebuffer whole, split;
+    printf("%8s %16s %14s %12s\n", "threads", "whole tiles [s]", "split [s]", "same image");
+    auto start = bench_clock::now();
+    cam.render(spheres, whole);
+    double whole_seconds = seconds_since(start);
+    cam.split_samples = true;
+    start = bench_clock::now();
+    cam.render(spheres, split);
+    double split_seconds = seconds_since(start);
+    bool same = memcmp(whole.data(), split.data(), sizeof(float) * 3 * size_t(whole.width()) * whole.height()) == 0;
+    printf("%8u %16.3f %14.3f %12s\n", std::thread::hardware_concurrency(), whole_seconds, split_seconds, same ? "yes" : "NO");
+    check(same, "the split render differs from the render of whole tiles");
+    std::clog.clear();
+}
+
+/** every benchmark by name, in the order a full run goes through them */
+struct named_benchmark {
+    const char* name;
+    void (*run)();
+};
+
+static const named_benchmark benchmarks[] = {
+    { "bvh_scaling", bvh_scaling_benchmark },
+    { "sphere_kernel", sphere_kernel_benchmark },
+    { "scene_load", scene_load_benchmark },
+    { "material", material_benchmark },
+    { "mesh", mesh_benchmark },
+    { "instance", instance_benchmark },
+    { "arena", arena_benchmark },
+    { "denoise", denoise_benchmark },
+    { "animation", animation_benchmark },
+    { "sampling", sampling_benchmark },
+    { "sampler", sampler_benchmark },
+    { "light_sampling", light_sampling_benchmark },
+    { "occlusion", occlusion_benchmark },
+    { "sample_split", sample_split_benchmark },
+};
+
+/** without arguments every benchmark runs, otherwise only the ones named. Exits with 1 if a check failed */
+int main(int argc, char** argv) {
+    int run_count = 0;
+    for (const named_benchmark& benchmark : benchmarks) {
+        bool selected = argc < 2;
+        for (int i = 1; i < argc; i++) selected = selected || strcmp(benchmark.name, argv[i]) == 0;
+        if (!selected) continue;
+        benchmark.run();
+        run_count++;
+    }
+    if (run_count == 0) {
+        fprintf(stderr, "No benchmark matches. The benchmarks are:\n");
+        for (const named_benchmark& benchmark : benchmarks) fprintf(stderr, "    %s\n", benchmark.name);
+        return 1;
+    }
+    if (failed_checks > 0) {
+        printf("\n%d checks failed\n", failed_checks);
+        return 1;
+    }
+    return 0;
+}
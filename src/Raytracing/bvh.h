@@ -0,0 +1,391 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "project_utils.h"
+#include "vec4.h"
+#include <algorithm>
+#include <vector>
+
+/**
+ * One node of a flattened BVH. 56 bytes (32 with float geometry), so a node fits in a cache line.
+ * The first child of an interior node is always stored directly after it, so only the second child needs an index.
+ */
+struct bvh_node {
+    aabb box;
+    uint32_t offset = 0; // leaf: index of the first primitive. interior: index of the second child
+    uint16_t count = 0; // number of primitives in a leaf. 0 for interior nodes
+    uint16_t axis = 0; // split axis of an interior node. Lets traversal visit the nearer child first
+};
+
+/**
+ * Builds a flat BVH over a list of primitive bounding boxes with the surface area heuristic (SAH).
+ * It only sees boxes, so anything with an AABB can be put into it (hittables, triangles, ...).
+ * The result is the node array plus the order in which the primitives have to be stored, so that
+ * every leaf refers to a contiguous run of primitives.
+ */
+class bvh_builder {
+    public:
+        static const int max_depth = 96; // past this depth we always split in the middle, so the traversal stack can never overflow
+        static const int traversal_stack_size = 128;
+
+        int max_leaf_size = 4; // leaves are only allowed to get bigger when the SAH really wants them to
+        int max_forced_leaf_size = 16;
+
+        void build(const std::vector<aabb>& boxes, std::vector<bvh_node>& nodes, std::vector<uint32_t>& order) {
+            nodes.clear();
+            order.resize(boxes.size());
+            centroids.resize(boxes.size());
+            for (size_t i = 0; i < boxes.size(); i++) {
+                order[i] = uint32_t(i);
+                centroids[i] = boxes[i].centroid();
+            }
+            if (boxes.empty()) {
+                nodes.push_back(bvh_node());
+                return;
+            }
+            nodes.reserve(2 * boxes.size() / max_leaf_size + 1);
+            build_node(boxes, nodes, order, 0, uint32_t(boxes.size()), 0);
+            centroids.clear();
+            centroids.shrink_to_fit();
+        }
+
+    private:
+        static const int bin_count = 16;
+        std::vector<point3> centroids;
+
+        struct bin {
+            aabb box;
+            uint32_t count = 0;
+        };
+
+        void build_node(const std::vector<aabb>& boxes, std::vector<bvh_node>& nodes, std::vector<uint32_t>& order,
+                        uint32_t begin, uint32_t end, int depth) {
+            uint32_t node_index = uint32_t(nodes.size());
+            nodes.push_back(bvh_node());
+
+            aabb bounds, centroid_bounds;
+            for (uint32_t i = begin; i < end; i++) {
+                bounds = aabb(bounds, boxes[order[i]]);
+                centroid_bounds = aabb(centroid_bounds, aabb(centroids[order[i]], centroids[order[i]]));
+            }
+            nodes[node_index].box = bounds;
+            uint32_t count = end - begin;
+            if (count <= uint32_t(max_leaf_size)) {
+                make_leaf(nodes[node_index], begin, count);
+                return;
+            }
+
+            /** Binned SAH: drop every centroid into one of bin_count buckets along each axis and try every bucket border as a split */
+            int best_axis = -1;
+            int best_split = 0;
+            double best_cost = infinity;
+            for (int axis = 0; axis < 3 && depth < max_depth; axis++) {
+                const range& extent = centroid_bounds.axis_range(axis);
+                if (extent.size() <= 0) continue;
+                bin bins[bin_count];
+                double scale = bin_count / extent.size();
+                for (uint32_t i = begin; i < end; i++) {
+                    int b = bin_index(centroids[order[i]][axis], extent.min, scale);
+                    bins[b].count++;
+                    bins[b].box = aabb(bins[b].box, boxes[order[i]]);
+                }
+                // sweep from the right to get the cost of every possible right side, then from the left
+                double right_area[bin_count];
+                uint32_t right_count[bin_count];
+                aabb right_box;
+                uint32_t right_sum = 0;
+                for (int b = bin_count - 1; b > 0; b--) {
+                    right_box = aabb(right_box, bins[b].box);
+                    right_sum += bins[b].count;
+                    right_area[b] = right_box.surface_area();
+                    right_count[b] = right_sum;
+                }
+                aabb left_box;
+                uint32_t left_sum = 0;
+                for (int b = 0; b < bin_count - 1; b++) {
+                    left_box = aabb(left_box, bins[b].box);
+                    left_sum += bins[b].count;
+                    if (left_sum == 0 || right_count[b+1] == 0) continue;
+                    double cost = left_box.surface_area() * left_sum + right_area[b+1] * right_count[b+1];
+                    if (cost < best_cost) {
+                        best_cost = cost;
+                        best_axis = axis;
+                        best_split = b + 1;
+                    }
+                }
+            }
+
+            uint32_t mid;
+            if (best_axis < 0) {
+                // all centroids in one point (or the tree got too deep): no SAH split exists, so cut the list in half
+                if (count <= uint32_t(max_forced_leaf_size) && depth < max_depth) {
+                    make_leaf(nodes[node_index], begin, count);
+                    return;
+                }
+                best_axis = 0;
+                mid = begin + count / 2;
+            } else {
+                /** Compare against not splitting at all. One primitive test costs 1, one box test about 1/8 of that */
+                double area = bounds.surface_area();
+                double split_cost = 0.125 + (area > 0 ? best_cost / area : count);
+                if (split_cost >= count && count <= uint32_t(max_forced_leaf_size)) {
+                    make_leaf(nodes[node_index], begin, count);
+                    return;
+                }
+                const range& extent = centroid_bounds.axis_range(best_axis);
+                double scale = bin_count / extent.size();
+                const std::vector<point3>& c = centroids;
+                int axis = best_axis;
+                int split = best_split;
+                uint32_t* middle = std::partition(&order[begin], &order[0] + end, [&](uint32_t index) {
+                    return bin_index(c[index][axis], extent.min, scale) < split;
+                });
+                mid = uint32_t(middle - &order[0]);
+            }
+
+            nodes[node_index].axis = uint16_t(best_axis);
+            build_node(boxes, nodes, order, begin, mid, depth + 1);
+            nodes[node_index].offset = uint32_t(nodes.size());
+            build_node(boxes, nodes, order, mid, end, depth + 1);
+        }
+
+        static int bin_index(double value, double min, double scale) {
+            int b = int((value - min) * scale);
+            return b < 0 ? 0 : (b >= bin_count ? bin_count - 1 : b);
+        }
+
+        static void make_leaf(bvh_node& node, uint32_t begin, uint32_t count) {
+            node.offset = begin;
+            node.count = uint16_t(count);
+        }
+};
+
+/**
+ * Refit a flat BVH after its primitives moved: the same tree, with every box recomputed bottom up.
+ * leaf_box(first, count) returns the bounds of a leaf's primitives. Much cheaper than a build, but the tree
+ * stays the one built for the old positions, so it gets slower the further things move (see bvh_cost).
+ */
+template <typename leaf_bounds>
+inline void refit_bvh(std::vector<bvh_node>& nodes, leaf_bounds leaf_box) {
+    // children are always stored after their parent, so walking backwards visits them first
+    for (size_t i = nodes.size(); i-- > 0;) {
+        bvh_node& node = nodes[i];
+        if (node.count > 0) node.box = leaf_box(node.offset, uint32_t(node.count));
+        else if (i + 1 < nodes.size()) node.box = aabb(nodes[i + 1].box, nodes[node.offset].box); // (not the empty tree's only node)
+    }
+}
+
+/** The SAH cost of a whole BVH, relative to its root box, in the units of bvh_builder. Tells how much a refit degraded a tree */
+inline double bvh_cost(const std::vector<bvh_node>& nodes) {
+    if (nodes.empty()) return 0;
+    double root_area = nodes[0].box.surface_area();
+    if (root_area <= 0) return 0;
+    double cost = 0;
+    for (const bvh_node& node : nodes) cost += node.box.surface_area() * (node.count > 0 ? node.count : 0.125);
+    return cost / root_area;
+}
+
+/**
+ * Precomputed per-ray data for the box tests of a BVH traversal.
+ * Dividing once per ray instead of once per box test is most of the win of a fast slab test.
+ *
+ * NOTE: the slab distances are rounded, so a ray that grazes a box (e.g. through a triangle corner that lies on its face)
+ * can come out a hair outside of it and skip a primitive it hits. Scaling the far distance up by a few ulps
+ * makes the test conservative (Ize, "Robust BVH Ray Traversal", JCGT 2013)
+ */
+const real bvh_far_scale = 1 + 2 * (3 * std::numeric_limits<real>::epsilon() / 2) / (1 - 3 * std::numeric_limits<real>::epsilon() / 2);
+
+#if defined(RT_SINGLE_PRECISION) && defined(RT_VEC4_SSE)
+/** float geometry: all three slabs at once in one vec4f */
+struct bvh_ray {
+    vec4f origin;
+    vec4f inverse_direction;
+    vec4f negative_mask; // lanes with a negative direction, where the near and far planes swap
+    bool negative[3];
+
+    bvh_ray(const ray& r) {
+        float inverse[3];
+        for (int axis = 0; axis < 3; axis++) {
+            inverse[axis] = 1 / r.direction()[axis];
+            negative[axis] = inverse[axis] < 0;
+        }
+        origin = vec4f(r.origin());
+        inverse_direction = vec4f(inverse[0], inverse[1], inverse[2]);
+        negative_mask = less_than(inverse_direction, vec4f());
+    }
+
+    bool hits(const aabb& box, real t_min, real t_max) const {
+        vec4f t0 = (vec4f(box.x.min, box.y.min, box.z.min) - origin) * inverse_direction;
+        vec4f t1 = (vec4f(box.x.max, box.y.max, box.z.max) - origin) * inverse_direction;
+        // like the scalar test, a NaN slab (ray in the plane of a flat box) leaves the range alone
+        vec4f near = max(vec4f::select(t0, t1, negative_mask), vec4f(t_min, t_min, t_min, t_min));
+        vec4f far = min(vec4f::select(t1, t0, negative_mask) * vec4f(bvh_far_scale, bvh_far_scale, bvh_far_scale, bvh_far_scale),
+                        vec4f(t_max, t_max, t_max, t_max));
+        return !(min3(far) < max3(near));
+    }
+};
+#else
+struct bvh_ray {
+    real origin[3];
+    real inverse_direction[3];
+    bool negative[3];
+
+    bvh_ray(const ray& r) {
+        for (int axis = 0; axis < 3; axis++) {
+            origin[axis] = r.origin()[axis];
+            inverse_direction[axis] = 1 / r.direction()[axis];
+            negative[axis] = inverse_direction[axis] < 0;
+        }
+    }
+
+    bool hits(const aabb& box, real t_min, real t_max) const {
+        for (int axis = 0; axis < 3; axis++) {
+            const range& ax = box.axis_range(axis);
+            real t0 = (ax.min - origin[axis]) * inverse_direction[axis];
+            real t1 = (ax.max - origin[axis]) * inverse_direction[axis];
+            if (negative[axis]) std::swap(t0, t1);
+            t1 *= bvh_far_scale;
+            t_min = t0 > t_min ? t0 : t_min;
+            t_max = t1 < t_max ? t1 : t_max;
+            if (t_max < t_min) return false;
+        }
+        return true;
+    }
+};
+#endif
+
+/**
+ * Check a node array that didn't come from bvh_builder (e.g. read from a file) before traversing it:
+ * every child lies after its parent and inside the array, no node is reached twice, every leaf stays inside the
+ * primitive_count primitives and the tree is shallow enough for the traversal stack.
+ */
+inline bool valid_bvh(const bvh_node* nodes, size_t node_count, size_t primitive_count) {
+    if (node_count == 0 || node_count > UINT32_MAX) return false;
+    std::vector<bool> reached(node_count, false);
+    std::vector<std::pair<uint32_t, int>> pending; // node index and depth
+    pending.push_back(std::make_pair(0u, 0));
+    reached[0] = true;
+    while (!pending.empty()) {
+        uint32_t index = pending.back().first;
+        int depth = pending.back().second;
+        pending.pop_back();
+        const bvh_node& node = nodes[index];
+        if (node.count > 0) {
+            if (size_t(node.offset) + node.count > primitive_count) return false;
+            continue;
+        }
+        // traverse_bvh holds one pending sibling per level above plus both children
+        if (depth + 2 > bvh_builder::traversal_stack_size || node.axis > 2) return false;
+        uint32_t children[2] = {index + 1, node.offset};
+        for (uint32_t child : children) {
+            if (child <= index || child >= node_count || reached[child]) return false;
+            reached[child] = true;
+            pending.push_back(std::make_pair(child, depth + 1));
+        }
+    }
+    return true;
+}
+
+/**
+ * Walk a flat BVH with an explicit stack, nearer child first.
+ * visit_leaf(first, count, ray_range) tests the primitives of a leaf and shrinks ray_range.max whenever it finds a closer hit,
+ * which lets the traversal skip every box behind it. Any-hit queries end the traversal by emptying ray_range (max below min).
+ */
+template <typename leaf_visitor>
+inline void traverse_bvh(const std::vector<bvh_node>& nodes, const ray& r, range& ray_range, leaf_visitor visit_leaf) {
+    bvh_ray fast_ray(r);
+    uint32_t stack[bvh_builder::traversal_stack_size];
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+
+    while (stack_size > 0) {
+        uint32_t node_index = stack[--stack_size];
+        const bvh_node& node = nodes[node_index];
+        if (!fast_ray.hits(node.box, ray_range.min, ray_range.max)) continue;
+
+        if (node.count > 0) {
+            visit_leaf(node.offset, uint32_t(node.count), ray_range);
+            if (ray_range.max < ray_range.min) return;
+            continue;
+        }
+        uint32_t first_child = node_index + 1;
+        uint32_t second_child = node.offset;
+        // push the far child first, so the near one is popped (and shrinks ray_range.max) first
+        if (fast_ray.negative[node.axis]) {
+            stack[stack_size++] = first_child;
+            stack[stack_size++] = second_child;
+        } else {
+            stack[stack_size++] = second_child;
+            stack[stack_size++] = first_child;
+        }
+    }
+}
+
+/**
+ * Bounding volume hierarchy over the objects of a hittable_list.
+ * Rays only test the objects whose boxes they pass through, so the cost per ray grows with log(N) instead of N.
+ * Nodes live in one flat array and are visited with traverse_bvh.
+ */
+class bvh : public hittable {
+    public:
+        bvh(const hittable_list& list) : bvh(list.objects) {}
+
+        bvh(const std::vector<shared_ptr<hittable>>& source_objects) {
+            std::vector<aabb> boxes;
+            boxes.reserve(source_objects.size());
+            for (const auto& object : source_objects) boxes.push_back(object->bounding_box());
+
+            std::vector<uint32_t> order;
+            bvh_builder().build(boxes, nodes, order);
+
+            // store the objects in leaf order, so a leaf is a contiguous run of the array
+            objects.reserve(order.size());
+            primitives.reserve(order.size());
+            for (uint32_t index : order) {
+                objects.push_back(source_objects[index]);
+                primitives.push_back(source_objects[index].get());
+            }
+        }
+
+        bool closest_hit(const ray& r, range ray_range, hit_id& id) const override {
+            if (primitives.empty()) return false;
+            bool hit_anything = false;
+            traverse_bvh(nodes, r, ray_range, [&](uint32_t first, uint32_t count, range& current_range) {
+                for (uint32_t i = first; i < first + count; i++) {
+                    if (primitives[i]->closest_hit(r, current_range, id)) {
+                        hit_anything = true;
+                        current_range.max = id.t; // only closer hits are interesting from now on
+                    }
+                }
+            });
+            return hit_anything;
+        }
+
+        bool occluded(const ray& r, range ray_range) const override {
+            if (primitives.empty()) return false;
+            bool blocked = false;
+            traverse_bvh(nodes, r, ray_range, [&](uint32_t first, uint32_t count, range& current_range) {
+                for (uint32_t i = first; i < first + count; i++) {
+                    if (primitives[i]->occluded(r, current_range)) {
+                        blocked = true;
+                        current_range.max = -infinity; // ends the traversal
+                        return;
+                    }
+                }
+            });
+            return blocked;
+        }
+
+        aabb bounding_box() const override { return nodes[0].box; }
+
+        size_t node_count() const { return nodes.size(); }
+
+    private:
+        std::vector<bvh_node> nodes;
+        std::vector<const hittable*> primitives; // raw pointers in leaf order, for the traversal loop
+        std::vector<shared_ptr<hittable>> objects; // keeps the primitives alive
+};
+
+#endif
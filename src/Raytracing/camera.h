@@ -4,14 +4,39 @@
 #include "project_utils.h"
 #include "hittable.h"
 #include "material.h"
+#include "thread_pool.h"
+#include "wavefront.h"
+#include "framebuffer.h"
+#include "render_stats.h"
+#include "path_limits.h"
+#include "sampler.h"
+#include "lights.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
 
+/** how camera::render follows the light paths */
+enum class integrator_type {
+    recursive, // one path at a time, depth first (ray_color)
+    wavefront  // all paths of a tile at once, one bounce at a time (wavefront_integrator)
+};
+
+/** what a pixel has collected so far: enough to go on sampling it later and end up with the same sum */
+struct pixel_accumulator {
+    color sum = color(0,0,0);
+    int samples = 0;
+    double mean = 0, squared_deviations = 0; // of the sample luminance, for adaptive sampling
+    bool converged = false; // adaptive sampling stopped the pixel
+};
 
 class camera {
     public:
         double aspect_ratio = 1.0; // Ratio of image width over height
         int image_width = 100; // Rendered image width in pixel count
         int samples_per_pixel = 1;
-        double max_depth = 10;
+        int max_depth = 10; // bounces per path
         double vertical_fov = 90; /** Vertical field of view */
 
         /** Variables defining the Transform (location, rotation) */
@@ -22,20 +47,240 @@ class camera {
         double defocus_angle = 0; // Variation angle of rays through each pixel. Defines the size of the "lens" instead of giving it a radius
         double focus_dist = 10; // Distance from camera position to plane of perfect focus. Here: same as focal length
 
+        /**
+         * Per-kind bounce limits (see path_limits). 0 means only max_depth applies.
+         * Diffuse: lambertian, specular: metal, transmission: dielectric
+         */
+        int max_diffuse_depth = 0;
+        int max_specular_depth = 0;
+        int max_transmission_depth = 0;
+        bool russian_roulette = true; // end paths that carry little light early, without biasing the image
+        int roulette_depth = 3; // bounces before Russian roulette starts
+
+        int thread_count = 0; // Number of render threads. 0 means one per hardware thread
+        int tile_size = 16; // Width and height of the square image tiles handed out to the threads
+        uint64_t seed = 0; // Base seed of the frame. Every pixel, sample and bounce derives its own generator from it
+        integrator_type integrator = integrator_type::recursive;
+        sampler_type sampler = sampler_type::independent; // where the numbers of the pixel position, lens point and bounces come from
+        bool light_sampling = true; // next-event estimation: a shadow ray to an emissive sphere at every diffuse bounce, see lights.h
+
+        /**
+         * Adaptive sampling: every pixel takes at least adaptive_min_samples and at most samples_per_pixel samples.
+         * In between it stops as soon as its 95% confidence interval is small enough to not be visible any more:
+         * the half-width of the interval, converted to gamma corrected display units, has to drop below adaptive_tolerance.
+         * Flat sky pixels stop early, glass and caustics keep going. Adaptive pixels are always traced one path at a time.
+         */
+        bool adaptive_sampling = false;
+        int adaptive_min_samples = 16; // fewer makes the variance estimate too unreliable to stop on
+        double adaptive_tolerance = 0.01; // in display units, 1/256 is one step of an 8-bit image
+
+        /**
+         * Sample splitting: the samples of an expensive tile (glass, caustics) are traced by several threads at once,
+         * each taking a range of them, so a single tile no longer keeps one thread busy long after the others ran dry.
+         * Tiles are timed on their first samples and the rest is cut by that measured cost, see render_split_tiles.
+         * The image is bit for bit the one render() makes without it. Not with adaptive sampling, whose pixels decide
+         * one sample at a time when to stop.
+         */
+        bool split_samples = false;
+
         /* Public Camera Parameters Here */
+        /** render and write the image to stdout as a binary ppm */
         void render(const hittable& world) {
+            framebuffer image;
+            render(world, image);
+            // the whole image is done, so write it out in one go
+            image_io::write_image(image, "-");
+        }
+
+        /** render into a linear float framebuffer. Use image_io to save it */
+        void render(const hittable& world, framebuffer& image) {
+            initialize(world);
+            image.resize(image_width, image_height);
+            sample_counts.assign(size_t(image_width) * image_height, samples_per_pixel);
+            variances.assign(sample_counts.size(), -1.0f);
+            auto start = std::chrono::steady_clock::now();
+            if (split_samples && !adaptive_sampling) render_split_tiles(world, image);
+            else render_tiles(world, image);
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::clog << "Traced " << last_stats.rays << " rays (" << last_stats.primary_rays << " from the camera) in "
+                      << seconds << " s: " << last_stats.rays / seconds << " rays/s, average path length "
+                      << last_stats.average_path_depth() << "\n";
+            if (!lights.empty()) std::clog << last_stats.shadow_rays << " shadow rays to " << lights.size() << " lights\n";
+            if (adaptive_sampling) {
+                double total = 0;
+                for (int count : sample_counts) total += count;
+                double average = total / sample_counts.size();
+                std::clog << "Adaptive sampling: " << average << " samples per pixel on average ("
+                          << 100.0 * average / samples_per_pixel << "% of " << samples_per_pixel << ")\n";
+            }
+        }
+
+        /** what the last render did: rays traced, intersection tests and so on */
+        const render_stats& stats() const { return last_stats; }
+
+        /**
+         * The noise of every pixel of the last render, row by row: the variance of its mean luminance,
+         * estimated from its samples. -1 where a pixel took a single sample. The denoiser uses it to tell noise from detail
+         */
+        const std::vector<float>& pixel_variances() const { return variances; }
+
+        /** how many samples every pixel of the last render took, row by row */
+        const std::vector<int>& samples_taken() const { return sample_counts; }
+
+        /** the sample counts of the last render as a grey image. White is samples_per_pixel, black is none */
+        void sample_count_image(framebuffer& map) const {
+            map.resize(image_width, image_height);
+            for (int y = 0; y < image_height; y++) {
+                for (int x = 0; x < image_width; x++) {
+                    double share = double(sample_counts[size_t(y) * image_width + x]) / samples_per_pixel;
+                    map.set(x, y, color(share, share, share));
+                }
+            }
+        }
+
+        /** Render a single pixel. It comes out bit-for-bit the same as the same pixel of a full render */
+        color render_pixel(const hittable& world, int x, int y) {
+            initialize(world);
+            return get_pixel_color(x, y, world);
+        }
+
+        /** the height of the image render() makes, from image_width and aspect_ratio */
+        int get_image_height() const {
+            int height = int(image_width / aspect_ratio);
+            return height < 1 ? 1 : height;
+        }
+
+        /**
+         * Part of a frame, for distributed rendering: the sum (not the average) of the samples sample_begin..sample_end-1
+         * of every pixel in the rectangle x0..x1-1, y0..y1-1, row by row, and how many samples each pixel took
+         * (fewer than asked with adaptive sampling). Without adaptive sampling, adding up the parts of all sample ranges
+         * in range order and dividing by the count gives exactly the pixel render() makes from one range with all samples.
+         * Adaptive sampling starts its statistics and minimum sample count over in every range, so there only the full
+         * range 0..samples_per_pixel matches render(). stats() counts this part.
+         */
+        void render_samples(const hittable& world, int x0, int y0, int x1, int y1, int sample_begin, int sample_end,
+                            std::vector<color>& sums, std::vector<int>& counts) {
+            initialize(world);
+            int width = x1 - x0;
+            sums.assign(size_t(width) * (y1 - y0), color(0,0,0));
+            counts.assign(sums.size(), 0);
+            std::vector<render_stats> row_stats(size_t(y1 - y0));
+            thread_pool pool(thread_count);
+            for (int j = y0; j < y1; j++) {
+                pool.submit([&, j] {
+                    render_stats before = thread_stats();
+                    for (int i = x0; i < x1; i++) {
+                        size_t index = size_t(j - y0) * width + (i - x0);
+                        pixel_accumulator pixel;
+                        accumulate_samples(i, j, world, sample_begin, sample_end, min_samples(sample_end - sample_begin), pixel);
+                        sums[index] = pixel.sum;
+                        counts[index] = pixel.samples;
+                    }
+                    row_stats[j - y0] = thread_stats() - before;
+                });
+            }
+            pool.wait();
+            last_stats = render_stats();
+            for (const render_stats& s : row_stats) last_stats += s;
+        }
+
+        /**
+         * Auxiliary buffers (AOVs) for the denoiser, of what the camera rays hit first, averaged over the first
+         * aov_samples samples of every pixel. These are the camera rays render() traces (and more of the same kind),
+         * so edges are antialiased the same way. The denoiser wants clean guides, and camera rays without bounces
+         * are cheap, so 0 means samples_per_pixel but at least 16. Rays that miss get the sky color as albedo, a zero normal and depth 0.
+         *   - normal: the surface normal facing the camera, in world space
+         *   - albedo: material::surface_albedo
+         *   - depth: distance from the camera to the hit (hit.t along the camera ray), in all three channels
+         */
+        void render_aovs(const hittable& world, framebuffer& normal, framebuffer& albedo, framebuffer& depth, int aov_samples = 0) {
             initialize();
-            // Render
-            std::cout << "P3\n" << image_width << " " << image_height << "\n255\n";
+            int sample_count = aov_samples > 0 ? aov_samples : std::max(samples_per_pixel, 16);
+            normal.resize(image_width, image_height);
+            albedo.resize(image_width, image_height);
+            depth.resize(image_width, image_height);
+            thread_pool pool(thread_count);
             for (int j = 0; j < image_height; j++) {
-                std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' << std::flush;
-                for (int i = 0; i < image_width; i++) {
-                    //every pixel color is defined by a ray going from the camera center to its pixel
-                    color pixel_color = get_pixel_color(i,j, world);
-                    write_color(std::cout, pixel_color);
+                pool.submit([&, j] {
+                    for (int i = 0; i < image_width; i++) {
+                        vec3 normal_sum(0,0,0);
+                        color albedo_sum(0,0,0);
+                        double depth_sum = 0;
+                        for (int s = 0; s < sample_count; s++) {
+                            rng gen(get_sample_key(i, j, s));
+                            ray r = get_ray(i, j, get_sample_sequence(i, j, s, sample_count), gen);
+                            hit_details hit;
+                            if (world.hits(r, range(0.001, infinity), hit)) {
+                                normal_sum += hit.normal;
+                                albedo_sum += scene_materials()[hit.mat].surface_albedo();
+                                depth_sum += hit.t * r.direction().length();
+                            } else {
+                                albedo_sum += sky_color(r);
+                            }
+                        }
+                        normal.set(i, j, normal_sum / sample_count);
+                        albedo.set(i, j, albedo_sum / sample_count);
+                        double d = depth_sum / sample_count;
+                        depth.set(i, j, color(d, d, d));
+                    }
+                });
+            }
+            pool.wait();
+        }
+
+        /**
+         * Progressive rendering: take every pixel of the frame up to sample_end samples, continuing where pixels
+         * (image_width * image height accumulators, row by row) left off. A frame rendered in several passes has
+         * exactly the sums of one render(). stats() counts this pass.
+         */
+        void accumulate_pass(const hittable& world, std::vector<pixel_accumulator>& pixels, int sample_end) {
+            begin_frame(world);
+            std::vector<render_stats> tile_stats(tile_count());
+            thread_pool pool(thread_count);
+            for (int t = 0; t < tile_count(); t++) {
+                pool.submit([&, t] {
+                    render_stats before = thread_stats();
+                    accumulate_tile(world, t, pixels, sample_end);
+                    tile_stats[t] = thread_stats() - before;
+                });
+            }
+            pool.wait();
+            last_stats = render_stats();
+            for (const render_stats& s : tile_stats) last_stats += s;
+        }
+
+        /** set up a frame for accumulate_tile: the image size, the view and the lights of world */
+        void begin_frame(const hittable& world) { initialize(world); }
+
+        /** the tiles of the frame set up by begin_frame, tile_size squares numbered row by row */
+        int tile_count() const {
+            int tile = tile_size < 1 ? 1 : tile_size;
+            return ((image_width + tile - 1) / tile) * ((image_height + tile - 1) / tile);
+        }
+
+        /** the pixels x0..x1-1, y0..y1-1 of tile t */
+        void tile_bounds(int t, int& x0, int& y0, int& x1, int& y1) const {
+            int tile = tile_size < 1 ? 1 : tile_size;
+            int tiles_x = (image_width + tile - 1) / tile;
+            x0 = (t % tiles_x) * tile;
+            y0 = (t / tiles_x) * tile;
+            x1 = std::min(x0 + tile, image_width);
+            y1 = std::min(y0 + tile, image_height);
+        }
+
+        /**
+         * accumulate_pass for tile t alone, on the calling thread, so a caller with a pool of its own can let every
+         * tile go at its own pace. Different tiles can be accumulated at the same time. Counts into thread_stats()
+         */
+        void accumulate_tile(const hittable& world, int t, std::vector<pixel_accumulator>& pixels, int sample_end) const {
+            int x0, y0, x1, y1;
+            tile_bounds(t, x0, y0, x1, y1);
+            int min_pixel_samples = min_samples(samples_per_pixel);
+            for (int j = y0; j < y1; j++) {
+                for (int i = x0; i < x1; i++) {
+                    accumulate_samples(i, j, world, 0, sample_end, min_pixel_samples, pixels[size_t(j) * image_width + i]);
                 }
             }
-            std::clog << "\rDone. \n";
         }
     private:
         /* Private Camera Variables Here */
@@ -48,12 +293,22 @@ class camera {
         double lens_radius;
         vec3 defocus_disk_u; // Defocus disk horizontal radius
         vec3 defocus_disk_v; // Defocus disk vertical radius
+        std::vector<int> sample_counts; // samples taken per pixel in the last render
+        std::vector<float> variances; // of the mean luminance per pixel in the last render
+        render_stats last_stats; // counted by the last render
+        light_list lights; // of the world being rendered, empty without light_sampling
+
+        /** Set all the private camera variables and gather the lights of world */
+        void initialize(const hittable& world) {
+            if (light_sampling) lights.build(world);
+            else lights = light_list();
+            initialize();
+        }
 
         /** Set all the private camera variables */
         void initialize() {
             // Calculate the image height, and ensure that it's at least 1.
-            image_height = int(image_width / aspect_ratio);
-            image_height = (image_height < 1) ? 1 : image_height;
+            image_height = get_image_height();
 
             /** 
              * We use the focal length and vertical FOV to calculate the viewport height. 
@@ -84,45 +339,416 @@ class camera {
             defocus_disk_v = lens_radius * local_y_direction;
         }
 
-        color get_pixel_color(int x, int y, const hittable& world) {
-            color pixel_color = color(0,0,0);
-            /**Anti-aliasing: we slightly randomize the starting position within the pixel
-             *  and take the average of all the colors we get back */
-            for (int i = 0; i < samples_per_pixel; i++)
-            {
-                auto pixel_center = pixel00_loc + (x * pixel_width_vector) + (y * pixel_height_vector);
-                auto sample_point = pixel_center + random_double(-0.5, 0.5) * pixel_width_vector + random_double(-0.5, 0.5) * pixel_height_vector;
-                auto ray_origin = defocus_angle < 0 ? camera_center : sample_on_lens();
-                auto ray_direction = sample_point - ray_origin;
-                ray r(ray_origin, ray_direction) ;
-                pixel_color += ray_color(r, world, max_depth);
-            }
-            pixel_color /= samples_per_pixel;
+        /**
+         * Split the image into tiles and trace them on a thread pool.
+         * Pixels draw their random numbers from generators seeded by pixel, sample and bounce,
+         * so the image is the same no matter how many threads there are or in which order the tiles finish
+         */
+        void render_tiles(const hittable& world, framebuffer& image) {
+            int tile = tile_size < 1 ? 1 : tile_size;
+            int tiles_x = (image_width + tile - 1) / tile;
+            int tiles_y = (image_height + tile - 1) / tile;
+            int tile_count = tiles_x * tiles_y;
+
+            int tiles_done = 0; // guarded by progress_mutex
+            std::mutex progress_mutex;
+            std::clog << "\rTiles remaining: " << tile_count << ' ' << std::flush;
+
+            // every tile keeps what its thread counted while tracing it, summed up once all tiles are done
+            std::vector<render_stats> tile_stats(tile_count);
+            thread_pool pool(thread_count);
+            for (int t = 0; t < tile_count; t++) {
+                pool.submit([&, t] {
+                    render_stats before = thread_stats();
+                    int x0 = (t % tiles_x) * tile;
+                    int y0 = (t / tiles_x) * tile;
+                    int x1 = std::min(x0 + tile, image_width);
+                    int y1 = std::min(y0 + tile, image_height);
+                    if (integrator == integrator_type::wavefront && !adaptive_sampling) {
+                        render_tile_wavefront(world, x0, y0, x1, y1, image, variances);
+                    } else {
+                        for (int j = y0; j < y1; j++) {
+                            for (int i = x0; i < x1; i++) {
+                                //every pixel color is defined by a ray going from the camera center to its pixel
+                                size_t index = size_t(j) * image_width + i;
+                                image.set(i, j, get_pixel_color(i, j, world, &sample_counts[index], &variances[index]));
+                            }
+                        }
+                    }
+                    tile_stats[t] = thread_stats() - before;
+                    std::lock_guard<std::mutex> lock(progress_mutex);
+                    tiles_done++;
+                    std::clog << "\rTiles remaining: " << (tile_count - tiles_done) << "   " << std::flush;
+                });
+            }
+            pool.wait();
+            std::clog << "\rDone.                    \n";
+            last_stats = render_stats();
+            for (const render_stats& s : tile_stats) last_stats += s;
+        }
+
+        /** one task of render_split_tiles: a range of the samples of every pixel of one tile */
+        struct sample_range {
+            int tile;
+            int sample_begin, sample_end;
+            double predicted_seconds; // the order the threads take the ranges in, largest first
+        };
+
+        /**
+         * render_tiles with split_samples. A first pass traces 1/16 of the samples of every tile and times them.
+         * The rest of every tile is then cut into ranges that should each take about 1/4 of a thread's share of
+         * the frame, judging by that time, so a tile that took 3 shares in the first pass becomes 12 ranges for
+         * 12 threads. The threads take the ranges largest first, the cheap ones fill the gaps at the end.
+         * No range is longer than range_samples, so the buffers of the ranges in flight don't grow with the samples per pixel.
+         * Pixels keep going where the first pass left them (pixel_accumulator), so every pixel sums exactly
+         * what render_tiles sums, in the same order, however the ranges fell
+         */
+        void render_split_tiles(const hittable& world, framebuffer& image) {
+            int tile = tile_size < 1 ? 1 : tile_size;
+            int tiles_x = (image_width + tile - 1) / tile;
+            int tiles_y = (image_height + tile - 1) / tile;
+            int tile_count = tiles_x * tiles_y;
+            const int range_samples = 16;
+            int first_samples = std::min(range_samples, std::max(1, samples_per_pixel / 16));
+            int rest = samples_per_pixel - first_samples;
+            std::vector<pixel_accumulator> pixels(size_t(image_width) * image_height);
+            std::vector<double> tile_seconds(tile_count, 0.0);
+            thread_pool pool(thread_count);
+            last_stats = render_stats();
+
+            std::vector<sample_range> ranges;
+            for (int t = 0; t < tile_count; t++) ranges.push_back({ t, 0, first_samples, 0.0 });
+            trace_sample_ranges(world, pool, ranges, tiles_x, pixels, tile_seconds, rest == 0);
+
+            if (rest > 0) {
+                double total = 0;
+                for (double seconds : tile_seconds) total += seconds;
+                double range_seconds = total / (4.0 * pool.size()); // in first pass time, the rest scales the same for all tiles
+                ranges.clear();
+                for (int t = 0; t < tile_count; t++) {
+                    int parts = range_seconds > 0 ? int(ceil(tile_seconds[t] / range_seconds)) : 1;
+                    parts = std::max((rest + range_samples - 1) / range_samples, std::min(parts, rest));
+                    for (int part = 0; part < parts; part++) {
+                        int begin = first_samples + int(int64_t(rest) * part / parts);
+                        int end = first_samples + int(int64_t(rest) * (part + 1) / parts);
+                        ranges.push_back({ t, begin, end, tile_seconds[t] * (end - begin) / first_samples });
+                    }
+                }
+                std::stable_sort(ranges.begin(), ranges.end(), [](const sample_range& a, const sample_range& b) {
+                    return a.predicted_seconds > b.predicted_seconds;
+                });
+                trace_sample_ranges(world, pool, ranges, tiles_x, pixels, tile_seconds, true);
+                if (int(ranges.size()) > tile_count) {
+                    std::clog << "Split the samples of " << tile_count << " tiles into " << ranges.size() << " ranges\n";
+                }
+            }
+
+            for (int j = 0; j < image_height; j++) {
+                for (int i = 0; i < image_width; i++) {
+                    size_t index = size_t(j) * image_width + i;
+                    const pixel_accumulator& pixel = pixels[index];
+                    color pixel_color = pixel.sum;
+                    pixel_color /= pixel.samples;
+                    image.set(i, j, pixel_color);
+                    sample_counts[index] = pixel.samples;
+                    variances[index] = variance_of_mean(pixel.squared_deviations, pixel.samples);
+                }
+            }
+        }
+
+        /**
+         * Trace sample ranges on the pool, in the order given: every thread takes the next one from a shared atomic
+         * counter. A range traces into a buffer of its own, so no two threads ever write the same memory. Once all
+         * earlier ranges of its tile are in, a finished range is added to the tile's pixels, sample by sample, under
+         * the tile's lock, and its buffer is freed; the thread adding it also adds the later ranges that finished
+         * while it waited. tile_seconds gets the time of every tile's ranges added
+         */
+        void trace_sample_ranges(const hittable& world, thread_pool& pool, const std::vector<sample_range>& ranges, int tiles_x,
+                                 std::vector<pixel_accumulator>& pixels, std::vector<double>& tile_seconds, bool show_progress) {
+            int tile = tile_size < 1 ? 1 : tile_size;
+            int tile_count = int(tile_seconds.size());
+            std::vector<std::vector<size_t>> ranges_of_tile(tile_count); // in sample order
+            for (size_t r = 0; r < ranges.size(); r++) ranges_of_tile[ranges[r].tile].push_back(r);
+            for (auto& of_tile : ranges_of_tile) {
+                std::sort(of_tile.begin(), of_tile.end(), [&](size_t a, size_t b) { return ranges[a].sample_begin < ranges[b].sample_begin; });
+            }
+            std::vector<std::mutex> tile_locks(tile_count);
+            std::vector<size_t> ranges_added(tile_count, 0); // of ranges_of_tile, under the tile's lock
+            std::vector<char> range_done(ranges.size(), 0); // same
+            std::vector<std::vector<color>> radiance(ranges.size());
+            std::vector<double> range_seconds(ranges.size());
+            std::vector<render_stats> range_stats(ranges.size());
+            std::atomic<size_t> next_range(0);
+            std::atomic<int> tiles_done(0);
+            std::mutex progress_mutex; // only for the progress line
+            if (show_progress) std::clog << "\rTiles remaining: " << tile_count << ' ' << std::flush;
+
+            for (int worker = 0; worker < pool.size(); worker++) {
+                pool.submit([&] {
+                    for (size_t r = next_range++; r < ranges.size(); r = next_range++) {
+                        const sample_range& part = ranges[r];
+                        render_stats before = thread_stats();
+                        auto start = std::chrono::steady_clock::now();
+                        int x0 = (part.tile % tiles_x) * tile, y0 = (part.tile / tiles_x) * tile;
+                        int x1 = std::min(x0 + tile, image_width), y1 = std::min(y0 + tile, image_height);
+                        trace_tile_samples(world, x0, y0, x1, y1, part.sample_begin, part.sample_end, radiance[r]);
+                        range_seconds[r] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+                        bool tile_finished = false;
+                        {
+                            std::lock_guard<std::mutex> lock(tile_locks[part.tile]);
+                            range_done[r] = 1;
+                            const std::vector<size_t>& of_tile = ranges_of_tile[part.tile];
+                            size_t& added = ranges_added[part.tile];
+                            size_t added_before = added;
+                            int tile_width = x1 - x0;
+                            for (; added < of_tile.size() && range_done[of_tile[added]]; added++) {
+                                size_t piece = of_tile[added];
+                                int count = ranges[piece].sample_end - ranges[piece].sample_begin;
+                                for (int pixel = 0; pixel < tile_width * (y1 - y0); pixel++) {
+                                    pixel_accumulator& accumulated = pixels[size_t(y0 + pixel / tile_width) * image_width + x0 + pixel % tile_width];
+                                    for (int i = 0; i < count; i++) add_sample(accumulated, radiance[piece][size_t(pixel) * count + i]);
+                                }
+                                std::vector<color>().swap(radiance[piece]);
+                            }
+                            tile_finished = added_before < of_tile.size() && added == of_tile.size();
+                        }
+                        if (tile_finished) {
+                            int done = ++tiles_done;
+                            if (show_progress) {
+                                std::lock_guard<std::mutex> lock(progress_mutex);
+                                std::clog << "\rTiles remaining: " << (tile_count - done) << "   " << std::flush;
+                            }
+                        }
+                        range_stats[r] = thread_stats() - before;
+                    }
+                });
+            }
+            pool.wait();
+            if (show_progress) std::clog << "\rDone.                    \n";
+            for (size_t r = 0; r < ranges.size(); r++) {
+                tile_seconds[ranges[r].tile] += range_seconds[r];
+                last_stats += range_stats[r];
+            }
+        }
+
+        /** the generator of one sample of a pixel. Seeds its camera ray and, with the bounce number, every bounce after it */
+        uint64_t get_sample_key(int x, int y, int sample) const {
+            uint64_t pixel_key = hash_key(seed, uint64_t(y) * image_width + x);
+            return hash_key(pixel_key, sample);
+        }
+
+        /** the numbers of sample index of sample_count samples of a pixel, see sampler.h */
+        sample_sequence get_sample_sequence(int x, int y, int index, int sample_count) const {
+            return sample_sequence(sampler, hash_key(seed, uint64_t(y) * image_width + x), seed, x, y, index, sample_count);
+        }
+
+        /**Anti-aliasing: we slightly randomize the starting position within the pixel */
+        ray get_ray(int x, int y, const sample_sequence& samples, rng& gen) const {
+            auto pixel_center = pixel00_loc + (x * pixel_width_vector) + (y * pixel_height_vector);
+            sample_2d offset = samples.get_2d(sample_sequence::pixel_dimension, gen);
+            auto sample_point = pixel_center + (offset.u1 - 0.5) * pixel_width_vector + (offset.u2 - 0.5) * pixel_height_vector;
+            auto ray_origin = defocus_angle < 0 ? camera_center : sample_on_lens(samples.get_2d(sample_sequence::lens_dimension, gen));
+            auto ray_direction = sample_point - ray_origin;
+            return ray(ray_origin, ray_direction);
+        }
+
+        color get_pixel_color(int x, int y, const hittable& world, int* samples_taken = nullptr, float* variance = nullptr) const {
+            pixel_accumulator pixel;
+            accumulate_samples(x, y, world, 0, samples_per_pixel, min_samples(samples_per_pixel), pixel);
+            /** take the average of all the colors we get back */
+            color pixel_color = pixel.sum;
+            pixel_color /= pixel.samples;
+            if (samples_taken) *samples_taken = pixel.samples;
+            if (variance) *variance = variance_of_mean(pixel.squared_deviations, pixel.samples);
             return pixel_color;
         }
-        
-        /** iterate over world objects and display normal as color. if no hit, display blue-white gradient background */
-        color ray_color(const ray& r, const hittable& world, double depth) const {
-            if (depth <= 0) return color(0,0,0);
-
-            hit_details hit;
-            /**
-             * NOTE: Shadow Acne 
-             * if min is zero, we might hit the same geometry again by accident due to rounding errors 
-             * This makes the geometry darker and have weird bright spots
-             * */
-            range ray_range = range(0.001, infinity); 
-            bool hit_something = world.hits(r, ray_range, hit);
-            if (hit_something) {
+
+        /** MATH: the variance of the mean of n samples is the sample variance over n. Unknown (-1) from one sample */
+        static float variance_of_mean(double squared_deviations, int n) {
+            return n > 1 ? float(squared_deviations / (n - 1) / n) : -1.0f;
+        }
+
+        /** the samples a pixel takes at least before adaptive sampling may stop it, out of sample_count */
+        int min_samples(int sample_count) const {
+            return adaptive_sampling ? std::min(adaptive_min_samples, sample_count) : sample_count;
+        }
+
+        /**
+         * Continue a pixel: add its samples first_sample + pixel.samples .. sample_end-1 to pixel.sum, in order,
+         * unless adaptive sampling has stopped it. Stopping and going on later gives the same sum as one call
+         */
+        void accumulate_samples(int x, int y, const hittable& world, int first_sample, int sample_end, int min_samples,
+                                pixel_accumulator& pixel) const {
+            while (!pixel.converged && first_sample + pixel.samples < sample_end)
+            {
+                add_sample(pixel, trace_sample(x, y, world, first_sample + pixel.samples));
+                int n = pixel.samples;
+                if (adaptive_sampling) pixel.converged = n >= min_samples && n >= 2 && is_converged(pixel.mean, pixel.squared_deviations, n);
+            }
+        }
+
+        /** the color of sample index of a pixel: its camera ray and the path that follows it */
+        color trace_sample(int x, int y, const hittable& world, int index) const {
+            uint64_t sample_key = get_sample_key(x, y, index);
+            sample_sequence samples = get_sample_sequence(x, y, index, samples_per_pixel);
+            rng gen(sample_key);
+            ray r = get_ray(x, y, samples, gen);
+            thread_stats().primary_rays++;
+            return ray_color(r, world, sample_key, samples);
+        }
+
+        /** add the next sample to a pixel */
+        static void add_sample(pixel_accumulator& pixel, const color& sample) {
+            pixel.sum += sample;
+            int n = ++pixel.samples;
+
+            // Welford's running mean and sum of squared deviations of the sample luminance
+            double value = luminance(sample);
+            double delta = value - pixel.mean;
+            pixel.mean += delta / n;
+            pixel.squared_deviations += delta * (value - pixel.mean);
+        }
+
+        static double luminance(const color& c) {
+            return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+        }
+
+        /**
+         * MATH: the 95% confidence interval of the mean is mean +- 1.96 * sqrt(variance / n).
+         * The image is displayed as sqrt(linear) (see linear_to_gamma), whose slope is 1 / (2 sqrt(mean)),
+         * so that is how much an error in the linear mean gets stretched on screen.
+         */
+        bool is_converged(double mean, double squared_deviations, int n) const {
+            double variance = squared_deviations / (n - 1);
+            double half_width = 1.96 * sqrt(variance / n);
+            double display_slope = 1.0 / (2.0 * sqrt(fmax(mean, 1e-4)));
+            return half_width * display_slope <= adaptive_tolerance;
+        }
+
+        /** trace a whole tile breadth-first. Per pixel, the samples are summed in the same order as get_pixel_color */
+        void render_tile_wavefront(const hittable& world, int x0, int y0, int x1, int y1, framebuffer& image,
+                                   std::vector<float>& pixel_variances) const {
+            static thread_local std::vector<color> sample_radiance;
+            int tile_width = x1 - x0;
+            int pixel_count = tile_width * (y1 - y0);
+            trace_tile_samples(world, x0, y0, x1, y1, 0, samples_per_pixel, sample_radiance);
+
+            for (int pixel = 0; pixel < pixel_count; pixel++) {
+                pixel_accumulator accumulated;
+                for (int i = 0; i < samples_per_pixel; i++) add_sample(accumulated, sample_radiance[size_t(pixel) * samples_per_pixel + i]);
+                color pixel_color = accumulated.sum;
+                pixel_color /= samples_per_pixel;
+                int x = x0 + pixel % tile_width, y = y0 + pixel / tile_width;
+                image.set(x, y, pixel_color);
+                pixel_variances[size_t(y) * image_width + x] = variance_of_mean(accumulated.squared_deviations, samples_per_pixel);
+            }
+        }
+
+        /**
+         * The colors of samples sample_begin..sample_end-1 of every pixel of a tile, laid out [pixel][sample] with
+         * the pixels row by row. Traced breadth-first with the wavefront integrator, depth first otherwise
+         */
+        void trace_tile_samples(const hittable& world, int x0, int y0, int x1, int y1, int sample_begin, int sample_end,
+                                std::vector<color>& radiance) const {
+            int tile_width = x1 - x0;
+            int pixel_count = tile_width * (y1 - y0);
+            int sample_count = sample_end - sample_begin;
+            if (integrator == integrator_type::wavefront) {
+                static thread_local wavefront_integrator wavefront; // keeps its buffers from tile to tile
+                wavefront.render(world, lights, pixel_count, sample_count, get_path_limits(),
+                    [&](int pixel, int sample, path_state& path) {
+                        int x = x0 + pixel % tile_width;
+                        int y = y0 + pixel / tile_width;
+                        path.sample_key = get_sample_key(x, y, sample_begin + sample);
+                        path.samples = get_sample_sequence(x, y, sample_begin + sample, samples_per_pixel);
+                        rng gen(path.sample_key);
+                        path.r = get_ray(x, y, path.samples, gen);
+                    },
+                    [](const ray& r) { return sky_color(r); },
+                    radiance);
+                return;
+            }
+            radiance.resize(size_t(pixel_count) * sample_count);
+            for (int pixel = 0; pixel < pixel_count; pixel++) {
+                for (int sample = 0; sample < sample_count; sample++) {
+                    radiance[size_t(pixel) * sample_count + sample] = trace_sample(x0 + pixel % tile_width, y0 + pixel / tile_width, world, sample_begin + sample);
+                }
+            }
+        }
+
+        path_limits get_path_limits() const {
+            path_limits limits;
+            limits.max_depth = max_depth;
+            limits.max_diffuse_depth = max_diffuse_depth;
+            limits.max_specular_depth = max_specular_depth;
+            limits.max_transmission_depth = max_transmission_depth;
+            limits.russian_roulette = russian_roulette;
+            limits.roulette_depth = roulette_depth;
+            return limits;
+        }
+
+        /**
+         * Follow one path from the camera until it escapes to the sky, gets absorbed or runs out of bounces.
+         * A loop instead of recursion: the throughput (product of all attenuations so far) is carried forward,
+         * which is also what Russian roulette needs to decide whether a path is still worth following.
+         * Light arrives from the sky, from lights the path hits and from the light samples of its diffuse bounces.
+         */
+        color ray_color(const ray& camera_ray, const hittable& world, uint64_t sample_key, const sample_sequence& samples) const {
+            path_limits limits = get_path_limits();
+            uint16_t bounce_counts[int(bounce_kind::count)] = {0, 0, 0};
+            ray r = camera_ray;
+            color throughput = color(1,1,1);
+            color radiance = color(0,0,0);
+            double scatter_pdf = 0; // of the direction of the last bounce if it sampled the lights, see emission_weight
+            const material_table& materials = scene_materials();
+            for (int bounce = 0; bounce < limits.max_depth; bounce++) {
+                hit_details hit;
+                /**
+                 * NOTE: Shadow Acne 
+                 * if min is zero, we might hit the same geometry again by accident due to rounding errors 
+                 * This makes the geometry darker and have weird bright spots
+                 * */
+                range ray_range = range(0.001, infinity); 
+                thread_stats().rays++;
+                if (!world.hits(r, ray_range, hit)) {
+                    radiance += throughput * sky_color(r);
+                    break;
+                }
+
+                const material& mat = materials[hit.mat];
+                if (mat.type() == material_type::emissive) {
+                    radiance += throughput * (mat.emitted(hit) * real(emission_weight(lights, r, hit, scatter_pdf)));
+                    break;
+                }
+                if (!limits.allows_bounce(bounce_kind_of(mat.type()), bounce_counts)) break;
                 ray outgoing_ray;
                 color attenuation;
-                if (hit.mat->scatter(r, hit, attenuation, outgoing_ray)) {
-                    return attenuation * ray_color(outgoing_ray, world, depth-1);
+                // every bounce gets its own generator, keyed by how many bounces came before it
+                rng gen(hash_key(sample_key, uint64_t(bounce) + 1));
+                sample_2d u = samples.get_2d(sample_sequence::bounce_dimension(bounce), gen);
+                bool sample_lights = mat.type() == material_type::lambertian && !lights.empty() && bounce + 1 < limits.max_depth;
+                if (sample_lights) {
+                    sample_2d light_u = samples.get_2d(sample_sequence::light_dimension(bounce), gen);
+                    ray shadow;
+                    range shadow_range;
+                    color light;
+                    if (sample_direct_light(lights, mat, hit, light_u, shadow, shadow_range, light)) {
+                        thread_stats().shadow_rays++;
+                        if (!world.occluded(shadow, shadow_range)) radiance += throughput * light;
+                    }
                 }
-                return color(0,0,0);
+                if (!mat.scatter(r, hit, attenuation, outgoing_ray, u, gen)) break;
+                scatter_pdf = sample_lights ? mat.lambertian_pdf(hit, outgoing_ray.direction()) : 0;
+                throughput = throughput * attenuation;
+                if (!limits.survives_roulette(bounce, throughput, gen)) break;
+                r = outgoing_ray;
             }
+            return radiance;
+        }
 
-            //add sky gradient
+        //add sky gradient
+        static color sky_color(const ray& r) {
             auto white = color(1,1,1);
             auto blue = color(0.5, 0.7, 1.0);
             auto dir = unit_vector(r.direction());
@@ -130,8 +756,8 @@ class camera {
             return (1-y) * white + y * blue;
         }
 
-        point3 sample_on_lens() const {
-            vec3 r = random_in_unit_disk();
+        point3 sample_on_lens(const sample_2d& u) const {
+            vec3 r = concentric_disk(u.u1, u.u2);
             vec3 offset =  r.x() * defocus_disk_u + r.y() * defocus_disk_v;
             return camera_center + offset;
         }
@@ -0,0 +1,360 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "project_utils.h"
+#include "camera.h"
+#include "distributed.h"
+#include "framebuffer.h"
+#include "render_stats.h"
+#include "thread_pool.h"
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+
+/**
+ * Checkpoint and resume of long renders.
+ *
+ * Every tile is rendered in passes of a few samples per pixel (camera::accumulate_tile) at its own pace, on one pool for
+ * the whole frame, so no pass waits for the slowest tile. Every interval seconds the state of every pixel is saved:
+ * the sum of its samples, how many it took and its adaptive sampling statistics.
+ * That is all the random number state there is, since every sample seeds its own generator from the frame seed, the pixel
+ * and the sample number (see camera::get_sample_key). A run that finds a checkpoint of the same frame goes on where it
+ * ended and makes the same image, bit for bit, as a run that was never stopped, which is also the image camera::render makes.
+ * The frame is recognized by distributed::frame_settings: the render settings, the camera, the scene bounds and the materials.
+ * Geometry that changed inside the same bounds goes unnoticed.
+ *
+ * Saving must not hold up rendering, so it is double buffered: after every pass a tile copies its pixels into a published
+ * frame under the tile's lock, a save copies that frame and a writer thread writes it out while rendering goes on. If the writer is still busy, the newer state replaces the
+ * one waiting. The file is written under a temporary name and renamed over the old one, so a checkpoint is either
+ * the old one or the new one, never half written, even if the job is killed while saving.
+ */
+namespace checkpoint {
+    struct options {
+        std::string path; // the checkpoint file, read on start if it exists
+        double interval = 60; // seconds between two saves
+        int samples_per_pass = 4; // per tile: how often it can stop and show up in a save
+    };
+
+    const char file_magic[4] = { 'R', 'T', 'C', 'P' };
+    const uint32_t file_version = 4; // 2: the settings include the sampler, 3: and light sampling, 4: and the materials key
+
+    struct file_header {
+        char magic[4];
+        uint32_t version;
+        uint32_t width, height;
+        uint32_t samples_done; // every pixel took at least this many samples, or stopped early with adaptive sampling
+        uint32_t pixel_size; // bytes of a pixel_record, to catch files of another build
+        distributed::frame_settings settings; // the frame the checkpoint belongs to
+    };
+
+    /** a pixel_accumulator as it is stored, with doubles in both builds */
+    struct pixel_record {
+        double sum[3];
+        double mean, squared_deviations;
+        int32_t samples, converged;
+    };
+
+    inline pixel_record to_record(const pixel_accumulator& pixel) {
+        pixel_record record;
+        for (int c = 0; c < 3; c++) record.sum[c] = pixel.sum[c];
+        record.mean = pixel.mean;
+        record.squared_deviations = pixel.squared_deviations;
+        record.samples = pixel.samples;
+        record.converged = pixel.converged;
+        return record;
+    }
+
+    inline pixel_accumulator from_record(const pixel_record& record) {
+        pixel_accumulator pixel;
+        pixel.sum = color(real(record.sum[0]), real(record.sum[1]), real(record.sum[2]));
+        pixel.mean = record.mean;
+        pixel.squared_deviations = record.squared_deviations;
+        pixel.samples = record.samples;
+        pixel.converged = record.converged != 0;
+        return pixel;
+    }
+
+    /**
+     * Read a checkpoint of the frame described by settings. Returns false with error empty if there is no checkpoint,
+     * and with an error if there is one but it can't be read or belongs to another frame.
+     */
+    inline bool load(const std::string& path, const distributed::frame_settings& settings, int width, int height,
+                     std::vector<pixel_accumulator>& pixels, int& samples_done, std::string& error) {
+        error.clear();
+        FILE* file = fopen(path.c_str(), "rb");
+        if (!file) return false;
+        file_header header;
+        std::vector<pixel_record> records(size_t(width) * height);
+        bool ok = fread(&header, sizeof(header), 1, file) == 1;
+        if (!ok || memcmp(header.magic, file_magic, 4) != 0 || header.version != file_version || header.pixel_size != sizeof(pixel_record)) {
+            error = "not a checkpoint of this renderer";
+        } else if (header.width != uint32_t(width) || header.height != uint32_t(height)
+                   || memcmp(&header.settings, &settings, sizeof(settings)) != 0) {
+            error = "the checkpoint is of another scene or other render settings";
+        } else if (fread(records.data(), sizeof(pixel_record), records.size(), file) != records.size()) {
+            error = "the checkpoint is cut short";
+        }
+        fclose(file);
+        if (!error.empty()) return false;
+        pixels.resize(records.size());
+        for (size_t i = 0; i < records.size(); i++) pixels[i] = from_record(records[i]);
+        samples_done = int(header.samples_done);
+        return true;
+    }
+
+    /** saves checkpoints on a thread of its own, see the top of the file */
+    class writer {
+        public:
+            writer(const std::string& path) : path(path), thread([this] { run(); }) {}
+
+            ~writer() { finish(); }
+
+            /** queue a copy of pixels to be saved. Returns at once, the saving happens on the writer thread */
+            void submit(const std::vector<pixel_accumulator>& pixels, const file_header& header) {
+                std::lock_guard<std::mutex> lock(mutex);
+                pending_header = header;
+                pending.resize(pixels.size());
+                for (size_t i = 0; i < pixels.size(); i++) pending[i] = to_record(pixels[i]);
+                has_pending = true;
+                wake.notify_one();
+            }
+
+            /** save what is still queued and stop the writer thread. False if any save failed */
+            bool finish() {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    stopping = true;
+                    wake.notify_one();
+                }
+                if (thread.joinable()) thread.join();
+                return !failed;
+            }
+
+        private:
+            std::string path;
+            std::mutex mutex;
+            std::condition_variable wake;
+            std::vector<pixel_record> pending, writing; // filled by submit, saved by the thread
+            file_header pending_header, writing_header;
+            bool has_pending = false, stopping = false, failed = false;
+            std::thread thread; // last, so it starts after everything it uses
+
+            void run() {
+                while (true) {
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        wake.wait(lock, [this] { return has_pending || stopping; });
+                        if (!has_pending) return;
+                        pending.swap(writing);
+                        writing_header = pending_header;
+                        has_pending = false;
+                    }
+                    if (!save()) {
+                        std::clog << "\nCould not write the checkpoint " << path << "\n";
+                        failed = true;
+                    }
+                }
+            }
+
+            bool save() const {
+                std::string temporary = path + ".tmp";
+                FILE* file = fopen(temporary.c_str(), "wb");
+                if (!file) return false;
+                bool ok = fwrite(&writing_header, sizeof(writing_header), 1, file) == 1
+                          && fwrite(writing.data(), sizeof(pixel_record), writing.size(), file) == writing.size()
+                          && fflush(file) == 0;
+#if defined(__unix__) || defined(__APPLE__)
+                ok = ok && fsync(fileno(file)) == 0; // on disk before it replaces the old checkpoint
+#endif
+                ok = fclose(file) == 0 && ok;
+                return ok && rename(temporary.c_str(), path.c_str()) == 0;
+            }
+    };
+
+    /** set by SIGTERM and SIGINT: the batch system wants the job gone. The render saves and stops after the current pass */
+    inline volatile std::sig_atomic_t& stop_requested() {
+        static volatile std::sig_atomic_t requested = 0;
+        return requested;
+    }
+
+    inline void request_stop(int signal_number) {
+        stop_requested() = 1;
+        std::signal(signal_number, SIG_DFL); // a second signal ends the process right away
+    }
+
+    /** how a checkpointed render ended */
+    enum class outcome {
+        finished, // image holds the frame
+        stopped, // by a signal, the checkpoint is saved. Running again resumes
+        failed // the checkpoint can't be used or saved
+    };
+
+    /**
+     * Render the frame of cam in passes, saving a checkpoint every opts.interval seconds and at the end.
+     * Resumes from opts.path if it holds a checkpoint of this frame.
+     */
+    inline outcome render(camera& cam, const hittable& world, framebuffer& image, const options& opts) {
+        int width = cam.image_width, height = cam.get_image_height();
+        distributed::frame_settings settings = distributed::get_frame_settings(cam, world);
+        std::vector<pixel_accumulator> pixels(size_t(width) * height);
+        int samples_done = 0;
+        std::string error;
+        if (load(opts.path, settings, width, height, pixels, samples_done, error)) {
+            std::clog << "Resuming " << opts.path << " at " << samples_done << " of " << cam.samples_per_pixel << " samples per pixel\n";
+        } else if (!error.empty()) {
+            std::cerr << "Cannot resume from " << opts.path << ": " << error << "\n";
+            return outcome::failed;
+        }
+
+        file_header header;
+        memcpy(header.magic, file_magic, 4);
+        header.version = file_version;
+        header.width = uint32_t(width);
+        header.height = uint32_t(height);
+        header.pixel_size = sizeof(pixel_record);
+        header.settings = settings;
+
+        stop_requested() = 0;
+        std::signal(SIGTERM, request_stop);
+        std::signal(SIGINT, request_stop);
+        writer saver(opts.path);
+        int pass = std::max(1, opts.samples_per_pass);
+        auto start = std::chrono::steady_clock::now();
+        auto last_save = start;
+
+        cam.begin_frame(world);
+        int tile_count = cam.tile_count();
+        std::vector<pixel_accumulator> published = pixels; // what a save sees, a tile at a time under its lock
+        std::vector<std::mutex> tile_locks(tile_count);
+        std::vector<int> tile_samples(tile_count, samples_done); // published with the tile
+        std::vector<render_stats> tile_stats(tile_count);
+        // the tiles waiting for their next pass, first come first served, so all of them move on together
+        std::deque<int> waiting;
+        for (int t = 0; t < tile_count; t++) {
+            if (samples_done < cam.samples_per_pixel) waiting.push_back(t);
+        }
+        int tiles_left = int(waiting.size()), passes_running = 0;
+        std::mutex queue_mutex;
+        std::condition_variable queue_changed, tile_done;
+
+        // every thread takes the next tile and puts it back after its pass, until no tile is left or a stop is requested
+        thread_pool pool(cam.thread_count);
+        for (int worker = 0; worker < pool.size(); worker++) {
+            pool.submit([&] {
+                std::unique_lock<std::mutex> queue_lock(queue_mutex);
+                while (true) {
+                    // an empty queue with passes running isn't the end: they put their tiles back
+                    queue_changed.wait(queue_lock, [&] { return !waiting.empty() || passes_running == 0; });
+                    if (waiting.empty() || stop_requested()) break;
+                    int t = waiting.front();
+                    waiting.pop_front();
+                    passes_running++;
+                    queue_lock.unlock();
+
+                    int sample_end = std::min(tile_samples[t] + pass, cam.samples_per_pixel); // only this tile's passes write it
+                    render_stats before = thread_stats();
+                    cam.accumulate_tile(world, t, pixels, sample_end);
+                    tile_stats[t] += thread_stats() - before;
+                    int x0, y0, x1, y1;
+                    cam.tile_bounds(t, x0, y0, x1, y1);
+                    {
+                        std::lock_guard<std::mutex> lock(tile_locks[t]);
+                        for (int y = y0; y < y1; y++) {
+                            std::copy(&pixels[size_t(y) * width + x0], &pixels[size_t(y) * width + x1], &published[size_t(y) * width + x0]);
+                        }
+                        tile_samples[t] = sample_end;
+                    }
+
+                    queue_lock.lock();
+                    passes_running--;
+                    if (sample_end < cam.samples_per_pixel) waiting.push_back(t);
+                    else if (--tiles_left == 0) tile_done.notify_one();
+                    queue_changed.notify_all();
+                }
+                queue_changed.notify_all();
+            });
+        }
+
+        // the samples every published pixel has at least, and with copy, a copy of the published frame
+        std::vector<pixel_accumulator> snapshot(published.size());
+        auto published_samples = [&](bool copy) {
+            int least = cam.samples_per_pixel;
+            for (int t = 0; t < tile_count; t++) {
+                int x0, y0, x1, y1;
+                cam.tile_bounds(t, x0, y0, x1, y1);
+                std::lock_guard<std::mutex> lock(tile_locks[t]);
+                for (int y = y0; copy && y < y1; y++) {
+                    std::copy(&published[size_t(y) * width + x0], &published[size_t(y) * width + x1], &snapshot[size_t(y) * width + x0]);
+                }
+                least = std::min(least, tile_samples[t]);
+            }
+            return least;
+        };
+
+        bool stopped = false, finished = false;
+        int shown = -1;
+        while (!finished && !stopped) {
+            {
+                // a signal can't notify, so look at the stop flag every 100 ms
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                tile_done.wait_for(lock, std::chrono::milliseconds(100), [&] { return tiles_left == 0; });
+                finished = tiles_left == 0;
+            }
+            stopped = !finished && stop_requested() != 0;
+            if (stopped) pool.wait(); // the passes under way end, no new ones start
+            auto now = std::chrono::steady_clock::now();
+            bool save = finished || stopped || std::chrono::duration<double>(now - last_save).count() >= opts.interval;
+            int least = published_samples(save);
+            if (least != shown) {
+                std::clog << "\rSamples: " << least << " of " << cam.samples_per_pixel << "   " << std::flush;
+                shown = least;
+            }
+            if (save) {
+                samples_done = least;
+                header.samples_done = uint32_t(samples_done);
+                saver.submit(snapshot, header);
+                last_save = now;
+            }
+        }
+        pool.wait();
+        render_stats stats;
+        for (const render_stats& s : tile_stats) stats += s;
+        bool saved = saver.finish();
+        std::signal(SIGTERM, SIG_DFL);
+        std::signal(SIGINT, SIG_DFL);
+        if (stopped) {
+            std::clog << "\nStopped at " << samples_done << " samples per pixel" << (saved ? ", checkpoint saved to " : ", could not save ")
+                      << opts.path << "\n";
+            return saved ? outcome::stopped : outcome::failed;
+        }
+        std::clog << "\rDone.                    \n";
+
+        image.resize(width, height);
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                const pixel_accumulator& pixel = pixels[size_t(y) * width + x];
+                color c = pixel.sum;
+                c /= pixel.samples > 0 ? pixel.samples : 1;
+                image.set(x, y, c);
+            }
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::clog << "Traced " << stats.rays << " rays (" << stats.primary_rays << " from the camera) in "
+                  << seconds << " s: " << stats.rays / seconds << " rays/s, average path length "
+                  << stats.average_path_depth() << "\n";
+        return outcome::finished;
+    }
+}
+
+#endif
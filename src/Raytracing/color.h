@@ -18,18 +18,16 @@ color linear_to_gamma(color linear_component) {
     return color(r,g,b);
 }
 
-void write_color(std::ostream& out, const color& pixel_color) {
-    color gamma_color = linear_to_gamma(pixel_color);
-
-    auto r = gamma_color.x();
-    auto g = gamma_color.y();
-    auto b = gamma_color.z();
-
-    // Translate the [0,1] component values to the byte range [0,255].
+// Translate a linear [0,1] component to a gamma corrected byte in the range [0,255].
+inline uint8_t color_component_to_byte(double linear_component) {
     static const range intensity(0.000, 0.999);
-    int rbyte = int(256 * intensity.clamp(r));
-    int gbyte = int(256 * intensity.clamp(g));
-    int bbyte = int(256 * intensity.clamp(b));
+    return uint8_t(256 * intensity.clamp(linear_to_gamma(linear_component)));
+}
+
+void write_color(std::ostream& out, const color& pixel_color) {
+    int rbyte = color_component_to_byte(pixel_color.x());
+    int gbyte = color_component_to_byte(pixel_color.y());
+    int bbyte = color_component_to_byte(pixel_color.z());
 
     // Write out the pixel color components.
     out << rbyte << ' ' << gbyte << ' ' << bbyte << '\n';
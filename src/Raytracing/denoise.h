@@ -0,0 +1,240 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include "project_utils.h"
+#include "framebuffer.h"
+#include "thread_pool.h"
+#include <cmath>
+#include <functional>
+#include <vector>
+
+/**
+ * Edge-avoiding à-trous wavelet denoiser (Dammertz, Sewtz, Hanika, Lensch: "Edge-Avoiding À-Trous Wavelet Transform
+ * for fast Global Illumination Filtering", HPG 2010), guided by the camera's AOVs (camera::render_aovs),
+ * with the variance-scaled color weight of SVGF (Schied et al.: "Spatiotemporal Variance-Guided Filtering", HPG 2017).
+ *
+ * Every iteration blurs the image with a 5x5 B-spline kernel whose taps lie 1, 2, 4, 8, ... pixels apart, so five
+ * iterations cover a 125x125 pixel area with 25 taps each. A tap only counts as much as it looks like the center pixel:
+ *   - normal: the same orientation
+ *   - depth: the distance the center's depth gradient predicts for the tap, so slanted floors still blur
+ *   - albedo: the same material color
+ *   - brightness: within a few standard deviations of the noise. The noise comes from the spread of each pixel's samples
+ *     (camera::pixel_variances), or where that is unknown from the image itself. It shrinks with every iteration
+ * Noise gets averaged away within a surface, but not across the edges between surfaces, materials or objects.
+ * At the end, pixels the filter changed by more than their noise explains are blended back towards the input,
+ * so a clean image keeps its detail and mostly comes out as it went in.
+ *
+ * The color is divided by the albedo before filtering and multiplied by it afterwards, so the filter only smooths
+ * the lighting and the colors of the materials stay sharp.
+ */
+namespace denoise {
+    struct settings {
+        int iterations = 5;
+        float sigma_luminance = 3; // how many standard deviations of noise a tap's brightness may differ
+        int normal_power = 128; // the normal weight is max(0, dot(n_p, n_q)) to this power
+        float sigma_depth = 1; // tolerance of the depth the gradient predicts
+        float sigma_albedo = 0.1f;
+        float blend_noise = 0.75f; // how much change the noise may explain before the result is blended back, 0: no filtering
+        int thread_count = 0; // 0: one per hardware thread
+    };
+
+    /** MATH: the B3 spline, separable: the 5x5 kernel weight of tap (i, j) is kernel[i] * kernel[j] */
+    const float kernel[5] = { 1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16 };
+
+    /** the guides of a pixel, prepared once */
+    struct guide {
+        float normal[3]; // unit length, or zero where the camera ray missed
+        float albedo[3];
+        float depth;
+        float depth_gradient; // how much the depth changes per pixel, the larger of x and y
+    };
+
+    inline float luminance(const float* c) { return 0.2126f * c[0] + 0.7152f * c[1] + 0.0722f * c[2]; }
+
+    /** how much pixel q looks like the same surface as pixel p, pixel_distance pixels away */
+    inline float guide_weight(const guide& p, const guide& q, float pixel_distance, const settings& s) {
+        bool p_sky = p.depth == 0, q_sky = q.depth == 0;
+        if (p_sky != q_sky) return 0; // sky pixels only mix with each other
+        float weight = 1;
+        if (!p_sky) {
+            float n_dot = fmaxf(0.0f, p.normal[0] * q.normal[0] + p.normal[1] * q.normal[1] + p.normal[2] * q.normal[2]);
+            for (int power = 1; power < s.normal_power; power *= 2) n_dot *= n_dot; // (normal_power a power of 2)
+            weight = n_dot;
+        }
+        float depth_distance = fabsf(p.depth - q.depth) / (s.sigma_depth * p.depth_gradient * pixel_distance + 1e-3f * p.depth + 1e-6f);
+        float albedo_distance = 0;
+        for (int c = 0; c < 3; c++) albedo_distance += (p.albedo[c] - q.albedo[c]) * (p.albedo[c] - q.albedo[c]);
+        return weight * expf(-depth_distance - albedo_distance / (s.sigma_albedo * s.sigma_albedo));
+    }
+
+    /**
+     * Filter image in place with the guides normal, albedo and depth of the same size (see camera::render_aovs).
+     * pixel_variances is the variance of every pixel's mean luminance (camera::pixel_variances), negative where unknown,
+     * or empty to estimate them all from the image. Rows are split among threads. The result does not depend on the thread count.
+     */
+    inline void filter(framebuffer& image, const framebuffer& normal, const framebuffer& albedo, const framebuffer& depth,
+                       const std::vector<float>& pixel_variances, const settings& s = settings()) {
+        int width = image.width(), height = image.height();
+        size_t pixel_count = size_t(width) * height;
+        std::vector<guide> guides(pixel_count);
+        std::vector<float> current(3 * pixel_count), next(3 * pixel_count); // the lighting: color over albedo
+        std::vector<float> variance(pixel_count), next_variance(pixel_count), deviation(pixel_count); // of sqrt(luminance)
+        std::vector<float> brightness(pixel_count); // sqrt(luminance), about how bright a pixel looks
+        thread_pool pool(s.thread_count);
+        auto for_rows = [&](const std::function<void(int)>& row) {
+            for (int y = 0; y < height; y++) pool.submit([&row, y] { row(y); });
+            pool.wait();
+        };
+
+        for (size_t p = 0; p < pixel_count; p++) {
+            guide& g = guides[p];
+            const float* n = &normal.data()[3*p];
+            float length = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+            for (int c = 0; c < 3; c++) {
+                g.normal[c] = length > 0 ? n[c] / length : 0;
+                g.albedo[c] = albedo.data()[3*p + c];
+                float a = g.albedo[c] > 1e-3f ? g.albedo[c] : 1.0f;
+                current[3*p + c] = fmaxf(image.data()[3*p + c] / a, 0.0f);
+            }
+            g.depth = depth.data()[3*p];
+        }
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                // central differences, one-sided at the border and next to the sky
+                float here = guides[size_t(y) * width + x].depth, gradient = 0;
+                const int dx[4] = { -1, 1, 0, 0 }, dy[4] = { 0, 0, -1, 1 };
+                for (int k = 0; k < 4; k++) {
+                    int qx = x + dx[k], qy = y + dy[k];
+                    if (qx < 0 || qx >= width || qy < 0 || qy >= height) continue;
+                    float there = guides[size_t(qy) * width + qx].depth;
+                    if (there != 0) gradient = fmaxf(gradient, fabsf(there - here));
+                }
+                guides[size_t(y) * width + x].depth_gradient = gradient;
+            }
+        }
+        for (size_t p = 0; p < pixel_count; p++) brightness[p] = sqrtf(luminance(&current[3*p]));
+
+        // the noise of every pixel to start with: the variance of the brightness of its surface in a 5x5 window
+        for_rows([&](int y) {
+            for (int x = 0; x < width; x++) {
+                size_t p = size_t(y) * width + x;
+                float weight_sum = 0, sum = 0, squared_sum = 0;
+                for (int j = -2; j <= 2; j++) {
+                    for (int i = -2; i <= 2; i++) {
+                        int qx = x + i, qy = y + j;
+                        if (qx < 0 || qx >= width || qy < 0 || qy >= height) continue;
+                        size_t q = size_t(qy) * width + qx;
+                        float w = guide_weight(guides[p], guides[q], sqrtf(float(i * i + j * j)), s);
+                        weight_sum += w;
+                        sum += w * brightness[q];
+                        squared_sum += w * brightness[q] * brightness[q];
+                    }
+                }
+                float mean = sum / weight_sum;
+                variance[p] = fmaxf(0.0f, squared_sum / weight_sum - mean * mean);
+            }
+        });
+        // better: the variance of the samples. MATH: var(sqrt(L)) ~ var(L) / 4L, and L was divided by the albedo
+        if (pixel_variances.size() == pixel_count) {
+            for (size_t p = 0; p < pixel_count; p++) {
+                if (pixel_variances[p] < 0) continue;
+                float a = luminance(guides[p].albedo);
+                a = a > 1e-3f ? a : 1.0f;
+                variance[p] = pixel_variances[p] / (a * a) / (4 * brightness[p] * brightness[p] + 1e-3f);
+            }
+        }
+
+        std::vector<float> noisy = current, noise = variance; // for the blend at the end
+        for (int iteration = 0; iteration < s.iterations; iteration++) {
+            int step = 1 << iteration;
+            // the color weight uses the 3x3 blurred variance, a single pixel's estimate is too noisy itself
+            for_rows([&](int y) {
+                for (int x = 0; x < width; x++) {
+                    float sum = 0, weight_sum = 0;
+                    for (int j = -1; j <= 1; j++) {
+                        for (int i = -1; i <= 1; i++) {
+                            int qx = x + i, qy = y + j;
+                            if (qx < 0 || qx >= width || qy < 0 || qy >= height) continue;
+                            float w = kernel[2 * i + 2] * kernel[2 * j + 2];
+                            sum += w * variance[size_t(qy) * width + qx];
+                            weight_sum += w;
+                        }
+                    }
+                    deviation[size_t(y) * width + x] = sqrtf(sum / weight_sum);
+                }
+            });
+            for_rows([&](int y) {
+                for (int x = 0; x < width; x++) {
+                    size_t p = size_t(y) * width + x;
+                    float brightness_scale = 1.0f / (s.sigma_luminance * deviation[p] + 1e-4f);
+                    float sum[3] = { 0, 0, 0 };
+                    float weight_sum = 0, variance_sum = 0;
+                    for (int j = -2; j <= 2; j++) {
+                        int qy = y + j * step;
+                        if (qy < 0 || qy >= height) continue;
+                        for (int i = -2; i <= 2; i++) {
+                            int qx = x + i * step;
+                            if (qx < 0 || qx >= width) continue;
+                            size_t q = size_t(qy) * width + qx;
+                            float w = kernel[i + 2] * kernel[j + 2] * guide_weight(guides[p], guides[q], step * sqrtf(float(i * i + j * j)), s)
+                                      * expf(-fabsf(brightness[p] - brightness[q]) * brightness_scale);
+                            for (int c = 0; c < 3; c++) sum[c] += w * current[3*q + c];
+                            weight_sum += w;
+                            variance_sum += w * w * variance[q];
+                        }
+                    }
+                    // the center tap has weight 9/64, so weight_sum > 0
+                    for (int c = 0; c < 3; c++) next[3*p + c] = sum[c] / weight_sum;
+                    next_variance[p] = variance_sum / (weight_sum * weight_sum); // MATH: the variance of a weighted average
+                }
+            });
+            current.swap(next);
+            variance.swap(next_variance);
+            for (size_t p = 0; p < pixel_count; p++) brightness[p] = sqrtf(luminance(&current[3*p]));
+        }
+
+        /**
+         * Blend the filtered pixels back towards the noisy ones where the filter changed them by more than their noise
+         * explains: there it blurred away detail, and in a clean image that costs more than the noise it removes.
+         * MATH: if the filtered pixel were the true value, the change would be about as large as the noise, E[d^2] ~ noise.
+         * A larger d^2 is mostly bias, and mixing in noise / d^2 of the filter result (times blend_noise) keeps the
+         * error below either of the two. d^2 and the noise are averaged over the pixel's surface in a 5x5 window.
+         */
+        std::vector<float>& change = next_variance; // the iterations are done, their buffers are free
+        std::vector<float>& local_change = deviation;
+        std::vector<float>& local_noise = variance;
+        for (size_t p = 0; p < pixel_count; p++) {
+            float d = brightness[p] - sqrtf(luminance(&noisy[3*p]));
+            change[p] = d * d;
+        }
+        for_rows([&](int y) {
+            for (int x = 0; x < width; x++) {
+                size_t p = size_t(y) * width + x;
+                float change_sum = 0, noise_sum = 0, weight_sum = 0;
+                for (int j = -2; j <= 2; j++) {
+                    for (int i = -2; i <= 2; i++) {
+                        int qx = x + i, qy = y + j;
+                        if (qx < 0 || qx >= width || qy < 0 || qy >= height) continue;
+                        size_t q = size_t(qy) * width + qx;
+                        float w = guide_weight(guides[p], guides[q], sqrtf(float(i * i + j * j)), s);
+                        change_sum += w * change[q];
+                        noise_sum += w * noise[q];
+                        weight_sum += w;
+                    }
+                }
+                local_change[p] = change_sum / weight_sum;
+                local_noise[p] = noise_sum / weight_sum;
+            }
+        });
+        for (size_t p = 0; p < pixel_count; p++) {
+            float strength = local_change[p] > 0 ? fminf(1.0f, s.blend_noise * local_noise[p] / local_change[p]) : 1.0f;
+            for (int c = 0; c < 3; c++) {
+                float a = guides[p].albedo[c] > 1e-3f ? guides[p].albedo[c] : 1.0f;
+                float lighting = noisy[3*p + c] + strength * (current[3*p + c] - noisy[3*p + c]);
+                image.data()[3*p + c] = lighting * a;
+            }
+        }
+    }
+}
+
+#endif
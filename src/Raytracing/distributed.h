@@ -0,0 +1,569 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include "project_utils.h"
+#include "camera.h"
+#include "framebuffer.h"
+#include "hittable.h"
+#include "render_stats.h"
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define RT_HAS_DISTRIBUTED 1
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+/**
+ * Distributed rendering: one frame split over several processes, on this machine or others.
+ *
+ * The coordinator cuts the frame into work units (an image tile and a range of samples) and hands them out to workers,
+ * one at a time, over a stream socket. A worker renders the unit with camera::render_samples and sends back
+ * the per-pixel sums of its samples (as doubles, so nothing gets rounded on the way) plus how many samples each pixel took.
+ * The coordinator adds up the sums of every pixel in unit order, not in the order they arrive,
+ * so the image is exactly the same however many workers there are and whichever did what.
+ * With one sample range (sample_chunk 0) it is bit for bit the image camera::render makes. Adaptive sampling decides when
+ * a pixel is done from all the samples it took so far, which a unit of later samples doesn't have, so adaptive frames are
+ * only ever split into tiles and keep this guarantee.
+ *
+ * Local workers are forked from the coordinator and talk to it over a socketpair; they share the scene it already loaded.
+ * Remote workers load the same scene themselves and connect over TCP (`--listen` on the coordinator, `--connect` on the worker).
+ * The frame settings and camera view are sent to every worker, together with the scene bounds and a key of the materials
+ * to catch workers with a different scene.
+ * A worker that disconnects, crashes or takes longer than worker_timeout for one unit is dropped and its unit goes back
+ * into the queue. If no worker is left, the coordinator renders the rest itself.
+ * Workers are expected to have the same byte order and build (float or double) as the coordinator.
+ */
+namespace distributed {
+    /** a tile of the image and a range of samples of its pixels */
+    struct work_unit {
+        uint32_t id;
+        int32_t x0, y0, x1, y1;
+        int32_t sample_begin, sample_end;
+    };
+
+    /**
+     * Cut a frame into units. sample_chunk > 0 splits the samples of every tile into ranges of that many samples,
+     * so even a frame with few tiles keeps many workers busy. Units of the same tile have increasing ids.
+     */
+    inline std::vector<work_unit> split_frame(int width, int height, int samples_per_pixel, int tile_size, int sample_chunk) {
+        int tile = tile_size < 1 ? 1 : tile_size;
+        int chunk = sample_chunk < 1 ? samples_per_pixel : sample_chunk;
+        std::vector<work_unit> units;
+        for (int y0 = 0; y0 < height; y0 += tile) {
+            for (int x0 = 0; x0 < width; x0 += tile) {
+                for (int s = 0; s < samples_per_pixel; s += chunk) {
+                    work_unit unit;
+                    unit.id = uint32_t(units.size());
+                    unit.x0 = x0;
+                    unit.y0 = y0;
+                    unit.x1 = std::min(x0 + tile, width);
+                    unit.y1 = std::min(y0 + tile, height);
+                    unit.sample_begin = s;
+                    unit.sample_end = std::min(s + chunk, samples_per_pixel);
+                    units.push_back(unit);
+                }
+            }
+        }
+        return units;
+    }
+
+    /** what a worker sends back for a unit */
+    struct unit_result {
+        std::vector<double> sums; // r, g, b per pixel, row by row
+        std::vector<uint32_t> counts; // samples per pixel
+        render_stats stats;
+        bool done = false;
+    };
+
+    struct options {
+        int local_workers = 0; // forked on this machine
+        int listen_port = 0; // accept remote workers on this TCP port. 0: none
+        int sample_chunk = 0; // samples per unit, 0: all samples of a tile in one unit. Ignored with adaptive sampling
+        int threads_per_worker = 0; // render threads of a local worker. 0: the cores shared among the local workers
+        double worker_timeout = 120; // seconds a worker may take for one unit before it counts as failed
+        int fail_worker_after = 0; // testing: the first local worker crashes after this many units. 0: never
+    };
+
+    /** the units of cam's frame. Adaptive frames get one sample range per tile, see above */
+    inline std::vector<work_unit> split_frame(const camera& cam, const options& opts) {
+        int sample_chunk = cam.adaptive_sampling ? 0 : opts.sample_chunk;
+        return split_frame(cam.image_width, cam.get_image_height(), cam.samples_per_pixel, cam.tile_size, sample_chunk);
+    }
+
+    /** the settings of a frame that a worker has to render with, sent before the first unit */
+    struct frame_settings {
+        int32_t image_width, samples_per_pixel, max_depth;
+        int32_t max_diffuse_depth, max_specular_depth, max_transmission_depth;
+        int32_t russian_roulette, roulette_depth, adaptive_sampling, adaptive_min_samples;
+        int32_t sampler, light_sampling;
+        uint64_t seed;
+        double adaptive_tolerance;
+        double aspect_ratio, vertical_fov, defocus_angle, focus_dist;
+        double position[3], viewport_position[3], up[3];
+        double scene_bounds[6]; // the world's bounding box, a cheap check that the worker has the same scene
+        uint64_t materials_key; // scene_materials().key(), the same check for the materials
+    };
+
+    inline frame_settings get_frame_settings(const camera& cam, const hittable& world) {
+        frame_settings f;
+        memset(&f, 0, sizeof(f));
+        f.image_width = cam.image_width;
+        f.samples_per_pixel = cam.samples_per_pixel;
+        f.max_depth = cam.max_depth;
+        f.max_diffuse_depth = cam.max_diffuse_depth;
+        f.max_specular_depth = cam.max_specular_depth;
+        f.max_transmission_depth = cam.max_transmission_depth;
+        f.russian_roulette = cam.russian_roulette;
+        f.roulette_depth = cam.roulette_depth;
+        f.adaptive_sampling = cam.adaptive_sampling;
+        f.adaptive_min_samples = cam.adaptive_min_samples;
+        f.sampler = int32_t(cam.sampler);
+        f.light_sampling = cam.light_sampling;
+        f.seed = cam.seed;
+        f.adaptive_tolerance = cam.adaptive_tolerance;
+        f.aspect_ratio = cam.aspect_ratio;
+        f.vertical_fov = cam.vertical_fov;
+        f.defocus_angle = cam.defocus_angle;
+        f.focus_dist = cam.focus_dist;
+        for (int axis = 0; axis < 3; axis++) {
+            f.position[axis] = cam.position[axis];
+            f.viewport_position[axis] = cam.viewport_position[axis];
+            f.up[axis] = cam.up[axis];
+        }
+        aabb bounds = world.bounding_box();
+        for (int axis = 0; axis < 3; axis++) {
+            f.scene_bounds[2*axis] = bounds.axis_range(axis).min;
+            f.scene_bounds[2*axis + 1] = bounds.axis_range(axis).max;
+        }
+        f.materials_key = scene_materials().key();
+        return f;
+    }
+
+    /** apply the coordinator's settings. False if the worker's scene is not the coordinator's */
+    inline bool apply_frame_settings(const frame_settings& f, camera& cam, const hittable& world) {
+        frame_settings mine = get_frame_settings(cam, world);
+        if (memcmp(mine.scene_bounds, f.scene_bounds, sizeof(f.scene_bounds)) != 0 || mine.materials_key != f.materials_key) return false;
+        cam.image_width = f.image_width;
+        cam.samples_per_pixel = f.samples_per_pixel;
+        cam.max_depth = f.max_depth;
+        cam.max_diffuse_depth = f.max_diffuse_depth;
+        cam.max_specular_depth = f.max_specular_depth;
+        cam.max_transmission_depth = f.max_transmission_depth;
+        cam.russian_roulette = f.russian_roulette != 0;
+        cam.roulette_depth = f.roulette_depth;
+        cam.adaptive_sampling = f.adaptive_sampling != 0;
+        cam.adaptive_min_samples = f.adaptive_min_samples;
+        cam.sampler = sampler_type(f.sampler);
+        cam.light_sampling = f.light_sampling != 0;
+        cam.seed = f.seed;
+        cam.adaptive_tolerance = f.adaptive_tolerance;
+        cam.aspect_ratio = f.aspect_ratio;
+        cam.vertical_fov = f.vertical_fov;
+        cam.defocus_angle = f.defocus_angle;
+        cam.focus_dist = f.focus_dist;
+        cam.position = point3(f.position[0], f.position[1], f.position[2]);
+        cam.viewport_position = point3(f.viewport_position[0], f.viewport_position[1], f.viewport_position[2]);
+        cam.up = vec3(f.up[0], f.up[1], f.up[2]);
+        return true;
+    }
+
+    /** add up the unit results of every pixel in unit order and divide by the samples taken */
+    inline void merge_results(const std::vector<work_unit>& units, const std::vector<unit_result>& results, int width, int height,
+                              framebuffer& image, render_stats& stats) {
+        std::vector<color> sums(size_t(width) * height, color(0,0,0));
+        std::vector<int> counts(sums.size(), 0);
+        stats = render_stats();
+        for (size_t u = 0; u < units.size(); u++) {
+            const work_unit& unit = units[u];
+            const unit_result& result = results[u];
+            int unit_width = unit.x1 - unit.x0;
+            for (int y = unit.y0; y < unit.y1; y++) {
+                for (int x = unit.x0; x < unit.x1; x++) {
+                    size_t i = size_t(y - unit.y0) * unit_width + (x - unit.x0);
+                    size_t pixel = size_t(y) * width + x;
+                    sums[pixel] += color(real(result.sums[3*i]), real(result.sums[3*i + 1]), real(result.sums[3*i + 2]));
+                    counts[pixel] += int(result.counts[i]);
+                }
+            }
+            stats += result.stats;
+        }
+        image.resize(width, height);
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                size_t pixel = size_t(y) * width + x;
+                color c = sums[pixel];
+                c /= counts[pixel] > 0 ? counts[pixel] : 1;
+                image.set(x, y, c);
+            }
+        }
+    }
+
+    /** render a unit in this process, e.g. when no worker is left */
+    inline void render_unit(camera& cam, const hittable& world, const work_unit& unit, unit_result& result) {
+        std::vector<color> sums;
+        std::vector<int> counts;
+        cam.render_samples(world, unit.x0, unit.y0, unit.x1, unit.y1, unit.sample_begin, unit.sample_end, sums, counts);
+        result.sums.resize(3 * sums.size());
+        result.counts.resize(sums.size());
+        for (size_t i = 0; i < sums.size(); i++) {
+            for (int c = 0; c < 3; c++) result.sums[3*i + c] = sums[i][c];
+            result.counts[i] = uint32_t(counts[i]);
+        }
+        result.stats = cam.stats();
+        result.done = true;
+    }
+
+#ifdef RT_HAS_DISTRIBUTED
+    enum class message_type : uint32_t { frame = 1, unit, result, quit };
+
+    struct message_header {
+        uint32_t magic;
+        uint32_t type;
+        uint64_t size; // bytes of payload after the header
+    };
+    const uint32_t message_magic = 0x46445452; // "RTDF"
+    const uint64_t max_message_size = uint64_t(1) << 32;
+
+    /** what a result message starts with. The sums and counts follow */
+    struct result_header {
+        uint32_t unit_id;
+        uint32_t pixel_count;
+        uint64_t primary_rays, rays, intersection_tests;
+    };
+
+    inline bool write_all(int fd, const void* data, size_t size) {
+        const char* p = static_cast<const char*>(data);
+        while (size > 0) {
+            ssize_t written = write(fd, p, size);
+            if (written < 0 && errno == EINTR) continue;
+            if (written <= 0) return false;
+            p += written;
+            size -= size_t(written);
+        }
+        return true;
+    }
+
+    inline bool read_all(int fd, void* data, size_t size) {
+        char* p = static_cast<char*>(data);
+        while (size > 0) {
+            ssize_t got = read(fd, p, size);
+            if (got < 0 && errno == EINTR) continue;
+            if (got <= 0) return false;
+            p += got;
+            size -= size_t(got);
+        }
+        return true;
+    }
+
+    inline bool send_message(int fd, message_type type, const void* payload, size_t size) {
+        message_header header = { message_magic, uint32_t(type), uint64_t(size) };
+        return write_all(fd, &header, sizeof(header)) && (size == 0 || write_all(fd, payload, size));
+    }
+
+    inline bool receive_message(int fd, message_type& type, std::vector<uint8_t>& payload) {
+        message_header header;
+        if (!read_all(fd, &header, sizeof(header)) || header.magic != message_magic || header.size > max_message_size) return false;
+        type = message_type(header.type);
+        payload.resize(size_t(header.size));
+        return header.size == 0 || read_all(fd, payload.data(), payload.size());
+    }
+
+    inline bool send_result(int fd, const work_unit& unit, const unit_result& result) {
+        result_header header = { unit.id, uint32_t(result.counts.size()), result.stats.primary_rays, result.stats.rays,
+                                 result.stats.intersection_tests };
+        std::vector<uint8_t> payload(sizeof(header) + result.sums.size() * sizeof(double) + result.counts.size() * sizeof(uint32_t));
+        uint8_t* p = payload.data();
+        memcpy(p, &header, sizeof(header));
+        memcpy(p + sizeof(header), result.sums.data(), result.sums.size() * sizeof(double));
+        memcpy(p + sizeof(header) + result.sums.size() * sizeof(double), result.counts.data(), result.counts.size() * sizeof(uint32_t));
+        return send_message(fd, message_type::result, payload.data(), payload.size());
+    }
+
+    /** read a result message for unit. False if it is malformed or for another unit */
+    inline bool parse_result(const std::vector<uint8_t>& payload, const work_unit& unit, unit_result& result) {
+        result_header header;
+        if (payload.size() < sizeof(header)) return false;
+        memcpy(&header, payload.data(), sizeof(header));
+        size_t pixel_count = size_t(unit.x1 - unit.x0) * (unit.y1 - unit.y0);
+        if (header.unit_id != unit.id || header.pixel_count != pixel_count
+            || payload.size() != sizeof(header) + pixel_count * (3 * sizeof(double) + sizeof(uint32_t))) return false;
+        result.sums.resize(3 * pixel_count);
+        result.counts.resize(pixel_count);
+        memcpy(result.sums.data(), payload.data() + sizeof(header), result.sums.size() * sizeof(double));
+        memcpy(result.counts.data(), payload.data() + sizeof(header) + result.sums.size() * sizeof(double), pixel_count * sizeof(uint32_t));
+        result.stats.primary_rays = header.primary_rays;
+        result.stats.rays = header.rays;
+        result.stats.intersection_tests = header.intersection_tests;
+        result.done = true;
+        return true;
+    }
+
+    /**
+     * The worker side: render the units the coordinator sends over fd until it says quit or disconnects.
+     * fail_after > 0 makes the worker stop without answering after that many units, to test the coordinator's recovery.
+     * Returns false if the connection broke or the scene doesn't match.
+     */
+    inline bool serve(int fd, camera& cam, const hittable& world, int fail_after = 0) {
+        message_type type;
+        std::vector<uint8_t> payload;
+        int units_done = 0;
+        while (receive_message(fd, type, payload)) {
+            if (type == message_type::quit) return true;
+            if (type == message_type::frame) {
+                frame_settings f;
+                if (payload.size() != sizeof(f)) return false;
+                memcpy(&f, payload.data(), sizeof(f));
+                if (!apply_frame_settings(f, cam, world)) {
+                    std::cerr << "Worker: the coordinator renders a different scene\n";
+                    return false;
+                }
+            } else if (type == message_type::unit) {
+                work_unit unit;
+                if (payload.size() != sizeof(unit)) return false;
+                memcpy(&unit, payload.data(), sizeof(unit));
+                if (fail_after > 0 && units_done == fail_after) return false;
+                unit_result result;
+                render_unit(cam, world, unit, result);
+                if (!send_result(fd, unit, result)) return false;
+                units_done++;
+            }
+        }
+        return false;
+    }
+
+    /** connect to a coordinator started with --listen. Returns the socket, or -1 */
+    inline int connect_to(const std::string& host, int port) {
+        addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* addresses = nullptr;
+        if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses) != 0) return -1;
+        int fd = -1;
+        for (addrinfo* a = addresses; a && fd < 0; a = a->ai_next) {
+            fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+            if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(addresses);
+        if (fd >= 0) {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        return fd;
+    }
+
+    inline int listen_on(int port) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) return -1;
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        address.sin_port = htons(uint16_t(port));
+        if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(fd, 64) != 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    /** the coordinator's view of one worker */
+    struct worker_connection {
+        int fd = -1;
+        pid_t pid = -1; // local workers only
+        std::string name;
+        int unit = -1; // the unit it is working on, -1 when idle
+        std::chrono::steady_clock::time_point started;
+    };
+
+    /**
+     * The coordinator: render the frame of cam on the workers and merge their results into image.
+     * Returns false only if it could not start; failed workers are handled, not reported as an error.
+     */
+    inline bool render(camera& cam, const hittable& world, framebuffer& image, const options& opts, render_stats& stats) {
+        auto start = std::chrono::steady_clock::now();
+        signal(SIGPIPE, SIG_IGN); // a worker that dies makes writes to it fail instead of killing the coordinator
+        int width = cam.image_width, height = cam.get_image_height();
+        std::vector<work_unit> units = split_frame(cam, opts);
+        std::vector<unit_result> results(units.size());
+        std::deque<uint32_t> pending;
+        for (const work_unit& unit : units) pending.push_back(unit.id);
+        frame_settings frame = get_frame_settings(cam, world);
+
+        int listener = -1;
+        if (opts.listen_port > 0) {
+            listener = listen_on(opts.listen_port);
+            if (listener < 0) {
+                std::cerr << "Cannot listen on port " << opts.listen_port << "\n";
+                return false;
+            }
+            std::clog << "Waiting for workers on port " << opts.listen_port << "\n";
+        }
+
+        std::vector<worker_connection> workers;
+        int hardware_threads = std::max(1, int(std::thread::hardware_concurrency()));
+        int local_threads = opts.threads_per_worker > 0 ? opts.threads_per_worker
+                            : std::max(1, hardware_threads / std::max(1, opts.local_workers));
+        for (int w = 0; w < opts.local_workers; w++) {
+            int pair[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) break;
+            std::cout.flush();
+            std::clog.flush();
+            pid_t pid = fork();
+            if (pid < 0) {
+                close(pair[0]);
+                close(pair[1]);
+                break;
+            }
+            if (pid == 0) {
+                // the worker: it has a copy of the scene already. _exit skips the coordinator's atexit handlers and buffers
+                close(pair[0]);
+                for (const worker_connection& other : workers) close(other.fd);
+                if (listener >= 0) close(listener);
+                std::clog.rdbuf(nullptr); // the coordinator reports progress
+                cam.thread_count = local_threads;
+                bool ok = serve(pair[1], cam, world, w == 0 ? opts.fail_worker_after : 0);
+                _exit(ok ? 0 : 1);
+            }
+            close(pair[1]);
+            worker_connection worker;
+            worker.fd = pair[0];
+            worker.pid = pid;
+            worker.name = "local worker " + std::to_string(w);
+            if (send_message(worker.fd, message_type::frame, &frame, sizeof(frame))) workers.push_back(worker);
+            else close(worker.fd);
+        }
+
+        auto drop_worker = [&](worker_connection& worker, const char* reason) {
+            std::clog << "\n" << worker.name << " " << reason;
+            if (worker.unit >= 0) {
+                std::clog << ", unit " << worker.unit << " goes back into the queue";
+                pending.push_front(uint32_t(worker.unit));
+            }
+            std::clog << "\n";
+            close(worker.fd);
+            if (worker.pid > 0) {
+                kill(worker.pid, SIGKILL);
+                waitpid(worker.pid, nullptr, 0);
+            }
+            worker.fd = -1;
+        };
+
+        size_t units_done = 0;
+        auto last_progress = std::chrono::steady_clock::now();
+        std::clog << "\rUnits remaining: " << units.size() << "   " << std::flush;
+        std::vector<pollfd> polled;
+        std::vector<uint8_t> payload;
+        while (units_done < units.size()) {
+            // hand out work to idle workers
+            for (worker_connection& worker : workers) {
+                if (worker.fd < 0 || worker.unit >= 0 || pending.empty()) continue;
+                uint32_t id = pending.front();
+                pending.pop_front();
+                worker.unit = int(id);
+                worker.started = std::chrono::steady_clock::now();
+                if (!send_message(worker.fd, message_type::unit, &units[id], sizeof(work_unit))) drop_worker(worker, "disconnected");
+            }
+            workers.erase(std::remove_if(workers.begin(), workers.end(), [](const worker_connection& w) { return w.fd < 0; }), workers.end());
+
+            // nobody left to do the work: do it here. With a listener, give remote workers worker_timeout to show up
+            double idle_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - last_progress).count();
+            if (workers.empty() && !pending.empty() && (listener < 0 || idle_seconds > opts.worker_timeout)) {
+                std::clog << "\nNo workers left, rendering " << pending.size() << " units here\n";
+                while (!pending.empty()) {
+                    render_unit(cam, world, units[pending.front()], results[pending.front()]);
+                    pending.pop_front();
+                    units_done++;
+                }
+                continue;
+            }
+
+            polled.clear();
+            for (const worker_connection& worker : workers) polled.push_back({ worker.fd, POLLIN, 0 });
+            if (listener >= 0) polled.push_back({ listener, POLLIN, 0 });
+            int ready = poll(polled.data(), nfds_t(polled.size()), 100);
+            if (ready < 0 && errno != EINTR) break;
+
+            for (size_t w = 0; w < workers.size(); w++) {
+                worker_connection& worker = workers[w];
+                if (ready > 0 && (polled[w].revents & (POLLIN | POLLHUP | POLLERR))) {
+                    message_type type;
+                    if (!receive_message(worker.fd, type, payload) || type != message_type::result || worker.unit < 0
+                        || !parse_result(payload, units[worker.unit], results[worker.unit])) {
+                        drop_worker(worker, "failed");
+                        continue;
+                    }
+                    worker.unit = -1;
+                    units_done++;
+                    last_progress = std::chrono::steady_clock::now();
+                    std::clog << "\rUnits remaining: " << (units.size() - units_done) << "   " << std::flush;
+                } else if (worker.unit >= 0) {
+                    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - worker.started).count();
+                    if (seconds > opts.worker_timeout) drop_worker(worker, "timed out");
+                }
+            }
+            if (listener >= 0 && ready > 0 && (polled.back().revents & POLLIN)) {
+                int fd = accept(listener, nullptr, nullptr);
+                if (fd >= 0) {
+                    int one = 1;
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                    worker_connection worker;
+                    worker.fd = fd;
+                    worker.name = "remote worker " + std::to_string(fd);
+                    if (send_message(fd, message_type::frame, &frame, sizeof(frame))) {
+                        workers.push_back(worker);
+                        last_progress = std::chrono::steady_clock::now();
+                    } else {
+                        close(fd);
+                    }
+                }
+            }
+            workers.erase(std::remove_if(workers.begin(), workers.end(), [](const worker_connection& w) { return w.fd < 0; }), workers.end());
+        }
+        std::clog << "\rDone.                    \n";
+
+        for (worker_connection& worker : workers) {
+            send_message(worker.fd, message_type::quit, nullptr, 0);
+            close(worker.fd);
+            if (worker.pid > 0) waitpid(worker.pid, nullptr, 0);
+        }
+        if (listener >= 0) close(listener);
+        merge_results(units, results, width, height, image, stats);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::clog << "Traced " << stats.rays << " rays (" << stats.primary_rays << " from the camera) in "
+                  << seconds << " s: " << stats.rays / seconds << " rays/s, average path length "
+                  << stats.average_path_depth() << "\n";
+        return true;
+    }
+#else
+    /** no sockets or fork here: render the units one after the other in this process */
+    inline bool render(camera& cam, const hittable& world, framebuffer& image, const options& opts, render_stats& stats) {
+        int height = cam.get_image_height();
+        std::vector<work_unit> units = split_frame(cam, opts);
+        std::vector<unit_result> results(units.size());
+        for (const work_unit& unit : units) render_unit(cam, world, unit, results[unit.id]);
+        merge_results(units, results, cam.image_width, height, image, stats);
+        return true;
+    }
+#endif
+}
+
+#endif
@@ -0,0 +1,416 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include "project_utils.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/**
+ * Linear (not gamma corrected) float image the renderer fills.
+ * Rows go from top to bottom, every pixel is three floats (r,g,b).
+ */
+class framebuffer {
+    public:
+        framebuffer() {}
+        framebuffer(int width, int height) { resize(width, height); }
+
+        void resize(int new_width, int new_height) {
+            image_width = new_width;
+            image_height = new_height;
+            pixels.assign(size_t(new_width) * new_height * 3, 0.0f);
+        }
+
+        int width() const { return image_width; }
+        int height() const { return image_height; }
+        const float* data() const { return pixels.data(); }
+        float* data() { return pixels.data(); }
+
+        void set(int x, int y, const color& c) {
+            float* p = &pixels[(size_t(y) * image_width + x) * 3];
+            p[0] = float(c.x());
+            p[1] = float(c.y());
+            p[2] = float(c.z());
+        }
+        color get(int x, int y) const {
+            const float* p = &pixels[(size_t(y) * image_width + x) * 3];
+            return color(p[0], p[1], p[2]);
+        }
+
+    private:
+        int image_width = 0;
+        int image_height = 0;
+        std::vector<float> pixels;
+};
+
+/**
+ * Image encoders. Each one builds the complete file in memory, so writing it out is a single write call
+ * instead of one stream operation per pixel.
+ */
+namespace image_io {
+
+    /** gamma corrected 8-bit rgb, the way write_color turns a color into bytes */
+    inline std::vector<uint8_t> to_bytes(const framebuffer& image) {
+        size_t count = size_t(image.width()) * image.height() * 3;
+        std::vector<uint8_t> bytes(count);
+        const float* linear = image.data();
+        for (size_t i = 0; i < count; i++) bytes[i] = color_component_to_byte(linear[i]);
+        return bytes;
+    }
+
+    /** binary PPM (P6): a short text header followed by the raw bytes */
+    inline std::vector<uint8_t> encode_ppm(const framebuffer& image) {
+        std::string header = "P6\n" + std::to_string(image.width()) + " " + std::to_string(image.height()) + "\n255\n";
+        std::vector<uint8_t> file(header.begin(), header.end());
+        std::vector<uint8_t> bytes = to_bytes(image);
+        file.insert(file.end(), bytes.begin(), bytes.end());
+        return file;
+    }
+
+    /**
+     * Portable float map: 32-bit float rgb without gamma or clamping, so the full dynamic range survives.
+     * PFM stores its rows bottom to top. A negative scale in the header means little-endian floats.
+     */
+    inline std::vector<uint8_t> encode_pfm(const framebuffer& image) {
+        uint16_t endian_probe = 1;
+        bool little_endian = *reinterpret_cast<uint8_t*>(&endian_probe) == 1;
+        std::string header = "PF\n" + std::to_string(image.width()) + " " + std::to_string(image.height()) + "\n"
+                           + (little_endian ? "-1.0\n" : "1.0\n");
+        std::vector<uint8_t> file(header.begin(), header.end());
+        size_t row_bytes = size_t(image.width()) * 3 * sizeof(float);
+        size_t offset = file.size();
+        file.resize(offset + row_bytes * image.height());
+        for (int y = 0; y < image.height(); y++) {
+            const float* row = image.data() + size_t(image.height() - 1 - y) * image.width() * 3;
+            memcpy(&file[offset + row_bytes * y], row, row_bytes);
+        }
+        return file;
+    }
+
+    /** CRC-32 as used by PNG chunks */
+    struct crc32_table {
+        uint32_t entries[256];
+        crc32_table() {
+            for (uint32_t n = 0; n < 256; n++) {
+                uint32_t c = n;
+                for (int k = 0; k < 8; k++) c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+                entries[n] = c;
+            }
+        }
+    };
+    inline uint32_t crc32(const uint8_t* data, size_t length, uint32_t crc = 0) {
+        static const crc32_table table;
+        crc = ~crc;
+        for (size_t i = 0; i < length; i++) crc = table.entries[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+        return ~crc;
+    }
+
+    /** writes bits least significant first, the way deflate wants them */
+    class bit_writer {
+        public:
+            std::vector<uint8_t>& out;
+            explicit bit_writer(std::vector<uint8_t>& out) : out(out) {}
+
+            void write(uint32_t value, int count) {
+                buffer |= uint64_t(value) << bit_count;
+                bit_count += count;
+                while (bit_count >= 8) {
+                    out.push_back(uint8_t(buffer));
+                    buffer >>= 8;
+                    bit_count -= 8;
+                }
+            }
+            /** Huffman codes are defined most significant bit first, so they go in reversed */
+            void write_code(uint32_t code, int length) {
+                uint32_t reversed = 0;
+                for (int i = 0; i < length; i++) reversed |= ((code >> i) & 1) << (length - 1 - i);
+                write(reversed, length);
+            }
+            void flush() {
+                if (bit_count > 0) out.push_back(uint8_t(buffer));
+                buffer = 0;
+                bit_count = 0;
+            }
+
+        private:
+            uint64_t buffer = 0;
+            int bit_count = 0;
+    };
+
+    /**
+     * Deflate (RFC 1951) with the fixed Huffman tables and a greedy LZ77 match finder.
+     * Not as tight as zlib at its best setting, but small, fast and dependency free.
+     */
+    inline void deflate_fixed(const std::vector<uint8_t>& input, std::vector<uint8_t>& out) {
+        static const int length_base[29] = {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+        static const int length_extra[29] = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+        static const int distance_base[30] = {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+        static const int distance_extra[30] = {0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+        const int window = 32768, hash_bits = 15, max_chain = 32;
+
+        bit_writer bits(out);
+        bits.write(1, 1); // last block
+        bits.write(1, 2); // fixed Huffman codes
+
+        auto write_literal = [&](int symbol) {
+            if (symbol < 144) bits.write_code(0x30 + symbol, 8);
+            else if (symbol < 256) bits.write_code(0x190 + symbol - 144, 9);
+            else if (symbol < 280) bits.write_code(symbol - 256, 7);
+            else bits.write_code(0xc0 + symbol - 280, 8);
+        };
+
+        // hash chains: head is the latest position of every hash, previous the one before a position with the same hash.
+        // Matches reach back at most window bytes, so previous only needs the last window positions, as a ring buffer
+        std::vector<int> head(size_t(1) << hash_bits, -1);
+        std::vector<int> previous(window, -1);
+        auto hash_at = [&](size_t i) {
+            uint32_t key = uint32_t(input[i]) | uint32_t(input[i+1]) << 8 | uint32_t(input[i+2]) << 16;
+            return (key * 2654435761u) >> (32 - hash_bits);
+        };
+        auto insert = [&](size_t i) {
+            if (i + 2 >= input.size()) return;
+            uint32_t h = hash_at(i);
+            previous[i & (window - 1)] = head[h];
+            head[h] = int(i);
+        };
+
+        size_t i = 0;
+        while (i < input.size()) {
+            int best_length = 0, best_distance = 0;
+            if (i + 2 < input.size()) {
+                int candidate = head[hash_at(i)];
+                int max_length = int(std::min<size_t>(258, input.size() - i));
+                for (int chain = 0; candidate >= 0 && chain < max_chain && int(i) - candidate <= window; chain++) {
+                    int length = 0;
+                    while (length < max_length && input[candidate + length] == input[i + length]) length++;
+                    if (length > best_length) {
+                        best_length = length;
+                        best_distance = int(i) - candidate;
+                        if (length == max_length) break;
+                    }
+                    int next = previous[candidate & (window - 1)];
+                    if (next >= candidate) break; // the slot already holds a newer position
+                    candidate = next;
+                }
+            }
+            if (best_length < 3) {
+                write_literal(input[i]);
+                insert(i);
+                i++;
+                continue;
+            }
+            int code = 28;
+            while (length_base[code] > best_length) code--;
+            write_literal(257 + code);
+            bits.write(uint32_t(best_length - length_base[code]), length_extra[code]);
+            int distance_code = 29;
+            while (distance_base[distance_code] > best_distance) distance_code--;
+            bits.write_code(uint32_t(distance_code), 5);
+            bits.write(uint32_t(best_distance - distance_base[distance_code]), distance_extra[distance_code]);
+            for (int k = 0; k < best_length; k++) insert(i + k);
+            i += best_length;
+        }
+        write_literal(256); // end of block
+        bits.flush();
+    }
+
+    inline void append_be32(std::vector<uint8_t>& out, uint32_t value) {
+        out.push_back(uint8_t(value >> 24));
+        out.push_back(uint8_t(value >> 16));
+        out.push_back(uint8_t(value >> 8));
+        out.push_back(uint8_t(value));
+    }
+
+    inline void append_png_chunk(std::vector<uint8_t>& file, const char* type, const std::vector<uint8_t>& data) {
+        append_be32(file, uint32_t(data.size()));
+        size_t type_start = file.size();
+        file.insert(file.end(), type, type + 4);
+        file.insert(file.end(), data.begin(), data.end());
+        append_be32(file, crc32(&file[type_start], file.size() - type_start));
+    }
+
+    /** the Paeth predictor of the PNG filter type 4 */
+    inline int paeth(int a, int b, int c) {
+        int p = a + b - c;
+        int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+        if (pa <= pb && pa <= pc) return a;
+        return pb <= pc ? b : c;
+    }
+
+    /**
+     * 8-bit rgb PNG. Every row gets the PNG filter that makes its bytes smallest (a cheap, common heuristic),
+     * then everything is deflated into a single IDAT chunk.
+     */
+    inline std::vector<uint8_t> encode_png(const framebuffer& image) {
+        const int width = image.width(), height = image.height();
+        const size_t stride = size_t(width) * 3;
+        std::vector<uint8_t> bytes = to_bytes(image);
+
+        std::vector<uint8_t> filtered;
+        filtered.reserve((stride + 1) * height);
+        std::vector<uint8_t> candidate(stride), best(stride);
+        std::vector<uint8_t> zero_row(stride, 0);
+        for (int y = 0; y < height; y++) {
+            const uint8_t* row = &bytes[stride * y];
+            const uint8_t* above = y > 0 ? &bytes[stride * (y - 1)] : zero_row.data();
+            long best_score = -1;
+            int best_filter = 0;
+            for (int filter = 0; filter < 5; filter++) {
+                long score = 0;
+                for (size_t x = 0; x < stride; x++) {
+                    int left = x >= 3 ? row[x - 3] : 0;
+                    int up = above[x];
+                    int up_left = x >= 3 ? above[x - 3] : 0;
+                    int prediction = 0;
+                    if (filter == 1) prediction = left;
+                    else if (filter == 2) prediction = up;
+                    else if (filter == 3) prediction = (left + up) / 2;
+                    else if (filter == 4) prediction = paeth(left, up, up_left);
+                    candidate[x] = uint8_t(row[x] - prediction);
+                    score += candidate[x] < 128 ? candidate[x] : 256 - candidate[x];
+                }
+                if (best_score < 0 || score < best_score) {
+                    best_score = score;
+                    best_filter = filter;
+                    best.swap(candidate);
+                }
+            }
+            filtered.push_back(uint8_t(best_filter));
+            filtered.insert(filtered.end(), best.begin(), best.end());
+        }
+
+        // zlib stream: header, deflate data, adler-32 of the uncompressed bytes
+        std::vector<uint8_t> zlib = { 0x78, 0x01 };
+        deflate_fixed(filtered, zlib);
+        uint32_t s1 = 1, s2 = 0;
+        for (uint8_t b : filtered) {
+            s1 = (s1 + b) % 65521;
+            s2 = (s2 + s1) % 65521;
+        }
+        append_be32(zlib, (s2 << 16) | s1);
+
+        std::vector<uint8_t> header;
+        append_be32(header, uint32_t(width));
+        append_be32(header, uint32_t(height));
+        header.push_back(8); // bit depth
+        header.push_back(2); // color type: rgb
+        header.push_back(0); // compression
+        header.push_back(0); // filter method
+        header.push_back(0); // no interlacing
+
+        std::vector<uint8_t> file = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+        append_png_chunk(file, "IHDR", header);
+        append_png_chunk(file, "IDAT", zlib);
+        append_png_chunk(file, "IEND", std::vector<uint8_t>());
+        return file;
+    }
+
+    inline bool ends_with(const std::string& text, const std::string& suffix) {
+        return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+
+    /** pick the encoder from the file extension: .png, .pfm, everything else becomes a binary ppm */
+    inline std::vector<uint8_t> encode_for_path(const framebuffer& image, const std::string& path) {
+        if (ends_with(path, ".png")) return encode_png(image);
+        if (ends_with(path, ".pfm")) return encode_pfm(image);
+        return encode_ppm(image);
+    }
+
+    /** one fwrite for the whole file */
+    inline bool write_file(FILE* out, const std::vector<uint8_t>& file) {
+        return fwrite(file.data(), 1, file.size(), out) == file.size() && fflush(out) == 0;
+    }
+
+    /** write the image to path, or to stdout as binary ppm if path is empty or "-" */
+    inline bool write_image(const framebuffer& image, const std::string& path) {
+        if (path.empty() || path == "-") return write_file(stdout, encode_ppm(image));
+        FILE* out = fopen(path.c_str(), "wb");
+        if (!out) return false;
+        bool ok = write_file(out, encode_for_path(image, path));
+        return fclose(out) == 0 && ok;
+    }
+
+    /** read a PFM written by encode_pfm (or any other 3-channel PFM) back into a framebuffer */
+    inline bool read_pfm(const std::string& path, framebuffer& image) {
+        FILE* in = fopen(path.c_str(), "rb");
+        if (!in) return false;
+        char kind[3] = {0};
+        int width = 0, height = 0;
+        double scale = 0;
+        bool ok = fscanf(in, "%2s %d %d %lf", kind, &width, &height, &scale) == 4 && strcmp(kind, "PF") == 0
+                  && width > 0 && height > 0 && fgetc(in) != EOF; // the single whitespace after the scale
+        if (ok) {
+            uint16_t endian_probe = 1;
+            bool little_endian = *reinterpret_cast<uint8_t*>(&endian_probe) == 1;
+            bool swap_bytes = (scale < 0) != little_endian;
+            image.resize(width, height);
+            size_t row_floats = size_t(width) * 3;
+            for (int y = 0; y < height && ok; y++) {
+                float* row = image.data() + size_t(height - 1 - y) * row_floats;
+                ok = fread(row, sizeof(float), row_floats, in) == row_floats;
+                if (!swap_bytes) continue;
+                for (size_t i = 0; i < row_floats; i++) {
+                    uint8_t* b = reinterpret_cast<uint8_t*>(&row[i]);
+                    std::swap(b[0], b[3]);
+                    std::swap(b[1], b[2]);
+                }
+            }
+        }
+        fclose(in);
+        return ok;
+    }
+
+    /**
+     * How far apart two renders of the same scene are, in display units (gamma corrected and clamped to [0,1], like the 8-bit output).
+     * Two renders that trace different paths always differ by their noise, so per-pixel errors say little.
+     * blurred_rmse compares block_size x block_size averages instead, which keeps real differences
+     * (a shifted edge, a darker material) but averages most of the noise away.
+     */
+    struct image_difference {
+        double rmse = 0;
+        double blurred_rmse = 0;
+        double mean_error = 0; // signed, b - a. A bias shows up here even when the noise hides it per pixel
+        double max_error = 0;
+    };
+
+    inline image_difference compare_images(const framebuffer& a, const framebuffer& b, int block_size = 8) {
+        image_difference d;
+        int width = std::min(a.width(), b.width()), height = std::min(a.height(), b.height());
+        if (width <= 0 || height <= 0) return d;
+        auto display = [](float linear) { return std::min(1.0, linear_to_gamma(linear)); };
+        int blocks_x = (width + block_size - 1) / block_size, blocks_y = (height + block_size - 1) / block_size;
+        std::vector<double> block_sums(size_t(blocks_x) * blocks_y * 3, 0.0);
+        std::vector<int> block_counts(size_t(blocks_x) * blocks_y, 0);
+        double squared_sum = 0, sum = 0;
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                size_t block = size_t(y / block_size) * blocks_x + x / block_size;
+                block_counts[block]++;
+                for (int c = 0; c < 3; c++) {
+                    double error = display(b.data()[(size_t(y) * b.width() + x) * 3 + c]) - display(a.data()[(size_t(y) * a.width() + x) * 3 + c]);
+                    squared_sum += error * error;
+                    sum += error;
+                    d.max_error = std::max(d.max_error, fabs(error));
+                    block_sums[block * 3 + c] += error;
+                }
+            }
+        }
+        double values = 3.0 * width * height;
+        d.rmse = sqrt(squared_sum / values);
+        d.mean_error = sum / values;
+        double block_squared_sum = 0;
+        for (size_t block = 0; block < block_counts.size(); block++) {
+            for (int c = 0; c < 3; c++) {
+                double average = block_sums[block * 3 + c] / block_counts[block];
+                block_squared_sum += average * average;
+            }
+        }
+        d.blurred_rmse = sqrt(block_squared_sum / (3.0 * block_counts.size()));
+        return d;
+    }
+}
+
+#endif
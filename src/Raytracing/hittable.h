@@ -2,15 +2,16 @@
 #define HITTABLE_H
 
 #include "project_utils.h"
-class material; //forward declaration
+#include "aabb.h"
+#include <cstdint>
 
 class hit_details {
     public:
         point3 p;
         vec3 normal;
-        double t;
+        real t;
         bool front_face;
-        shared_ptr<material> mat;
+        uint32_t mat; // index into scene_materials()
 
         void set_face_normal(const ray& r, const vec3& outward_normal) {
             // Sets the hit record normal vector.
@@ -19,10 +20,92 @@ class hit_details {
             normal = front_face ? outward_normal : -outward_normal;
         }
 };
+class hittable;
+
+/**
+ * What a closest-hit search keeps of the best hit so far: how far, and which primitive of which object.
+ * Point, normal and material are only worked out once, for the hit that is still the closest at the end
+ * (hittable::describe), instead of for every candidate a later, closer one replaces.
+ */
+struct hit_id {
+    static const uint32_t keep_material = UINT32_MAX;
+
+    real t;
+    const hittable* object; // the sphere, sphere_set or mesh that was hit. Describes the hit
+    uint32_t prim; // which of its spheres or triangles
+    real u, v; // where on the primitive, if object wants to know again (the barycentrics of a triangle)
+
+    // set by the instances around the hit, innermost first. in_instance is false for hits in world space
+    bool in_instance;
+    ray object_ray; // the ray in object's own space
+    real normal_to_world[3][3]; // takes object's normals to world space, the inverse transpose of all instance transforms
+    uint32_t material_override; // of the outermost instance that has one, or keep_material
+
+    /** a hit of object, in the space of the ray object was given. Objects call this when they find a closer hit */
+    void set(real hit_t, const hittable* hit_object, uint32_t hit_prim, real hit_u = 0, real hit_v = 0) {
+        t = hit_t;
+        object = hit_object;
+        prim = hit_prim;
+        u = hit_u;
+        v = hit_v;
+        in_instance = false;
+        material_override = keep_material;
+    }
+};
+
 class hittable {
     public:
         virtual ~hittable() = default;
-        virtual bool hits(const ray& r, range range, hit_details& rec) const = 0;
+
+        /** the closest hit within range, with all its details */
+        bool hits(const ray& r, range range, hit_details& rec) const {
+            hit_id id;
+            if (!closest_hit(r, range, id)) return false;
+            describe(r, id, rec);
+            return true;
+        }
+
+        /**
+         * The closest hit within range, only as far as hit_id goes. id is left alone when there is none.
+         * Containers hand id down to their children: a child only writes it for a hit closer than all before
+         */
+        virtual bool closest_hit(const ray& r, range range, hit_id& id) const = 0;
+
+        /** fill rec for an id that closest_hit found along r */
+        static void describe(const ray& r, const hit_id& id, hit_details& rec) {
+            if (!id.in_instance) {
+                id.object->describe_hit(r, id, rec);
+                return;
+            }
+            id.object->describe_hit(id.object_ray, id, rec);
+            // MATH: dot(d, n) keeps its sign under (M d, M^-T n), so front_face stays valid
+            const real (&m)[3][3] = id.normal_to_world;
+            const vec3& n = rec.normal;
+            rec.p = r.at(rec.t);
+            rec.normal = unit_vector(vec3(m[0][0] * n.x() + m[0][1] * n.y() + m[0][2] * n.z(),
+                                          m[1][0] * n.x() + m[1][1] * n.y() + m[1][2] * n.z(),
+                                          m[2][0] * n.x() + m[2][1] * n.y() + m[2][2] * n.z()));
+            if (id.material_override != hit_id::keep_material) rec.mat = id.material_override;
+        }
+
+        /**
+         * Is there anything at all along the ray within range? For shadow rays, which don't care what they hit or where.
+         * The fallback searches for the closest hit; objects that can stop at the first one they find override it
+         */
+        virtual bool occluded(const ray& r, range range) const {
+            hit_id ignored;
+            return closest_hit(r, range, ignored);
+        }
+
+        /** box enclosing the whole object. Acceleration structures like the BVH are built from these */
+        virtual aabb bounding_box() const = 0;
+
+    protected:
+        /**
+         * Fill rec for a hit that closest_hit reported with id.object == this, r in this object's space.
+         * Containers pass on the ids of their children, so only objects with primitives of their own are asked
+         */
+        virtual void describe_hit(const ray& /*r*/, const hit_id& /*id*/, hit_details& /*rec*/) const {}
 };
 
 #endif
\ No newline at end of file
@@ -13,27 +13,39 @@ class hittable_list : public hittable {
         hittable_list() {}
         hittable_list(shared_ptr<hittable> object) { add(object); }
 
-        void clear() { objects.clear(); }
+        void clear() {
+            objects.clear();
+            bbox = aabb();
+        }
         void add(shared_ptr<hittable> object) {
             objects.push_back(object);
+            bbox = aabb(bbox, object->bounding_box());
         }
 
-        //check if a ray hits anything in the list of objects
-        bool hits(const ray& r, range ray_range, hit_details& hit) const override {
-            double closest_t = ray_range.max;
-            hit_details closest_hit;
+        //check if a ray hits anything in the list of objects. Every object only sees the range up to the closest hit so far
+        bool closest_hit(const ray& r, range ray_range, hit_id& id) const override {
             bool hit_anything = false;
-
-            for (int i = 0; i < objects.size(); i++) {
-                auto obj = objects[i];
-                if (obj->hits(r, range(ray_range.min, closest_t), closest_hit)) {
+            for (size_t i = 0; i < objects.size(); i++) {
+                const auto& obj = objects[i]; // a reference: copying the shared_ptr would touch its refcount for every ray
+                if (obj->closest_hit(r, ray_range, id)) {
                     hit_anything = true;
-                    closest_t = closest_hit.t;
-                    hit = closest_hit;
+                    ray_range.max = id.t;
                 }
             }
             return hit_anything;
         }
+
+        bool occluded(const ray& r, range ray_range) const override {
+            for (const auto& obj : objects) {
+                if (obj->occluded(r, ray_range)) return true;
+            }
+            return false;
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+    private:
+        aabb bbox;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,184 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "hittable.h"
+#include "project_utils.h"
+
+/**
+ * An affine transform: a 3x3 matrix (rotation, scale, shear) plus a translation, stored as a 3x4 matrix.
+ * Points get the translation, vectors don't, normals get the inverse transpose so they stay perpendicular to the surface.
+ */
+class affine_transform {
+    public:
+        /** the identity */
+        affine_transform() {
+            for (int row = 0; row < 3; row++) {
+                for (int column = 0; column < 4; column++) m[row][column] = row == column ? 1 : 0;
+            }
+        }
+
+        static affine_transform translate(const vec3& offset) {
+            affine_transform t;
+            for (int row = 0; row < 3; row++) t.m[row][3] = offset[row];
+            return t;
+        }
+
+        static affine_transform scale(const vec3& factors) {
+            affine_transform t;
+            for (int row = 0; row < 3; row++) t.m[row][row] = factors[row];
+            return t;
+        }
+
+        /** rotation by degrees around the x (axis 0), y (1) or z (2) axis, counterclockwise when looking down the axis */
+        static affine_transform rotate(int axis, double degrees) {
+            affine_transform t;
+            double radians = degrees_to_radians(degrees);
+            int a = (axis + 1) % 3, b = (axis + 2) % 3;
+            t.m[a][a] = cos(radians);
+            t.m[a][b] = -sin(radians);
+            t.m[b][a] = sin(radians);
+            t.m[b][b] = cos(radians);
+            return t;
+        }
+
+        /** first apply other, then this */
+        affine_transform operator*(const affine_transform& other) const {
+            affine_transform t;
+            for (int row = 0; row < 3; row++) {
+                for (int column = 0; column < 4; column++) {
+                    real sum = column == 3 ? m[row][3] : 0;
+                    for (int k = 0; k < 3; k++) sum += m[row][k] * other.m[k][column];
+                    t.m[row][column] = sum;
+                }
+            }
+            return t;
+        }
+
+        /** MATH: the inverse of the 3x3 part from its cofactors, then the translation undone with it. Requires determinant != 0 */
+        affine_transform inverse() const {
+            affine_transform t;
+            real determinant = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+                             - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+                             + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+            real inverse_determinant = 1 / determinant;
+            for (int row = 0; row < 3; row++) {
+                for (int column = 0; column < 3; column++) {
+                    // cofactor of the transposed position, via the cyclic trick
+                    int r0 = (column + 1) % 3, r1 = (column + 2) % 3, c0 = (row + 1) % 3, c1 = (row + 2) % 3;
+                    t.m[row][column] = (m[r0][c0] * m[r1][c1] - m[r0][c1] * m[r1][c0]) * inverse_determinant;
+                }
+            }
+            for (int row = 0; row < 3; row++) {
+                t.m[row][3] = -(t.m[row][0] * m[0][3] + t.m[row][1] * m[1][3] + t.m[row][2] * m[2][3]);
+            }
+            return t;
+        }
+
+        point3 point(const point3& p) const {
+            return point3(m[0][0] * p.x() + m[0][1] * p.y() + m[0][2] * p.z() + m[0][3],
+                          m[1][0] * p.x() + m[1][1] * p.y() + m[1][2] * p.z() + m[1][3],
+                          m[2][0] * p.x() + m[2][1] * p.y() + m[2][2] * p.z() + m[2][3]);
+        }
+
+        vec3 vector(const vec3& v) const {
+            return vec3(m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(),
+                        m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+                        m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z());
+        }
+
+        /** multiply by the transposed 3x3 part. Called on the inverse, this transforms normals */
+        vec3 transposed_vector(const vec3& v) const {
+            return vec3(m[0][0] * v.x() + m[1][0] * v.y() + m[2][0] * v.z(),
+                        m[0][1] * v.x() + m[1][1] * v.y() + m[2][1] * v.z(),
+                        m[0][2] * v.x() + m[1][2] * v.y() + m[2][2] * v.z());
+        }
+
+        /** the box around the transformed box (Arvo, "Transforming Axis-Aligned Bounding Boxes", Graphics Gems 1990) */
+        aabb box(const aabb& b) const {
+            if (b.is_empty()) return b;
+            range axes[3];
+            for (int row = 0; row < 3; row++) {
+                real low = m[row][3], high = m[row][3];
+                for (int column = 0; column < 3; column++) {
+                    const range& r = b.axis_range(column);
+                    real e = m[row][column] * r.min, f = m[row][column] * r.max;
+                    low += e < f ? e : f;
+                    high += e < f ? f : e;
+                }
+                axes[row] = range(low, high);
+            }
+            return aabb(axes[0], axes[1], axes[2]);
+        }
+
+        real m[3][4];
+};
+
+/**
+ * A placed copy of a shared prototype: a sphere, a mesh, a sphere_set, a whole hittable_list or another instance.
+ * Only the transform is stored per copy, so a thousand copies of a million-triangle mesh cost a million triangles
+ * plus a thousand small instances. Put many instances into a bvh, so rays only visit the ones they pass.
+ *
+ * Rays are transformed into the prototype's space instead of the other way around. The direction is not normalized,
+ * so t is the same in both spaces and the range and hit distance need no conversion.
+ */
+class instance : public hittable {
+    public:
+        static const uint32_t keep_material = hit_id::keep_material;
+
+        /** material_override replaces the material of whatever the ray hits. Around nested instances, the outermost one wins */
+        instance(shared_ptr<hittable> prototype, const affine_transform& object_to_world, uint32_t material_override = keep_material)
+            : prototype(prototype), object_to_world(object_to_world), world_to_object(object_to_world.inverse()),
+              material_override(material_override) {
+            bbox = object_to_world.box(prototype->bounding_box());
+        }
+
+        /**
+         * The prototype's hit, plus what hittable::describe needs to bring it into world space later:
+         * the ray in the hit object's space and the normal transform through every instance around it
+         */
+        bool closest_hit(const ray& r, range ray_range, hit_id& id) const override {
+            ray object_ray(world_to_object.point(r.origin()), world_to_object.vector(r.direction()));
+            if (!prototype->closest_hit(object_ray, ray_range, id)) return false;
+
+            real (&m)[3][3] = id.normal_to_world;
+            if (!id.in_instance) {
+                id.in_instance = true;
+                id.object_ray = object_ray;
+                for (int row = 0; row < 3; row++) {
+                    for (int column = 0; column < 3; column++) m[row][column] = world_to_object.m[column][row];
+                }
+            } else {
+                // MATH: the inner instances' normal transform first, then this one's, (W^T) M
+                real inner[3][3];
+                for (int row = 0; row < 3; row++) {
+                    for (int column = 0; column < 3; column++) inner[row][column] = m[row][column];
+                }
+                for (int row = 0; row < 3; row++) {
+                    for (int column = 0; column < 3; column++) {
+                        m[row][column] = world_to_object.m[0][row] * inner[0][column] + world_to_object.m[1][row] * inner[1][column]
+                                         + world_to_object.m[2][row] * inner[2][column];
+                    }
+                }
+            }
+            if (material_override != keep_material) id.material_override = material_override;
+            return true;
+        }
+
+        bool occluded(const ray& r, range ray_range) const override {
+            ray object_ray(world_to_object.point(r.origin()), world_to_object.vector(r.direction()));
+            return prototype->occluded(object_ray, ray_range);
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        const affine_transform& transform() const { return object_to_world; }
+
+    private:
+        shared_ptr<hittable> prototype;
+        affine_transform object_to_world;
+        affine_transform world_to_object;
+        uint32_t material_override;
+        aabb bbox;
+};
+
+#endif
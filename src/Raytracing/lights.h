@@ -0,0 +1,198 @@
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+#include "project_utils.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "sampler.h"
+#include "sphere.h"
+#include "sphere_set.h"
+#include <algorithm>
+#include <vector>
+
+/** an emissive sphere */
+struct sphere_light {
+    point3 center;
+    real radius;
+    color radiance;
+    uint32_t mat; // index into scene_materials()
+};
+
+/** a direction from a shading point towards a light */
+struct light_sample {
+    vec3 direction; // unit length
+    double distance; // to the point on the light
+    color radiance; // that arrives from there, if nothing is in the way
+    double pdf; // of the direction, per unit solid angle, including the choice of the light
+};
+
+/**
+ * The lights of a scene, for next-event estimation: at every diffuse bounce the integrators pick a point on a light
+ * and send a shadow ray there. A small bright light that bounces find only by luck gets found at every bounce.
+ *
+ * The lights are the spheres with an emissive material in the hittable_lists, sphere_sets and spheres of the world.
+ * Emissive meshes and instances still glow, but only for the paths that happen to hit them.
+ * A light is picked with a probability that follows its power (radiance times area), then a direction uniformly
+ * within the cone of directions it covers, so every sample lands on the side of the sphere that faces the shading point.
+ */
+class light_list {
+    public:
+        light_list() {}
+        explicit light_list(const hittable& world) { build(world); }
+
+        /** gather the lights of world. Call it again after the scene changed */
+        void build(const hittable& world) {
+            lights.clear();
+            by_material.clear();
+            collect(world);
+            double total = 0;
+            for (const sphere_light& light : lights) total += power(light);
+            probabilities.resize(lights.size());
+            cdf.resize(lights.size());
+            double sum = 0;
+            for (size_t i = 0; i < lights.size(); i++) {
+                probabilities[i] = power(lights[i]) / total;
+                sum += power(lights[i]);
+                cdf[i] = sum / total;
+            }
+            if (!cdf.empty()) cdf.back() = 1;
+        }
+
+        bool empty() const { return lights.empty(); }
+        size_t size() const { return lights.size(); }
+        const sphere_light& operator[](size_t index) const { return lights[index]; }
+
+        /**
+         * Pick a light and a direction to it, seen from point. u.u1 picks the light and is then stretched back to [0, 1)
+         * to pick the direction together with u.u2, so both stay as evenly spread as the sampler made them.
+         * False if point is inside the light it picked
+         */
+        bool sample(const point3& point, const sample_2d& u, light_sample& s) const {
+            size_t index = std::upper_bound(cdf.begin(), cdf.end(), u.u1) - cdf.begin();
+            if (index >= lights.size()) index = lights.size() - 1;
+            double below = index > 0 ? cdf[index - 1] : 0;
+            double stretched = fmin((u.u1 - below) / (cdf[index] - below), 1 - 1e-16);
+            const sphere_light& light = lights[index];
+
+            vec3 to_center = light.center - point;
+            double distance_squared = to_center.length_squared();
+            double sin_squared = double(light.radius) * light.radius / distance_squared;
+            if (sin_squared >= 1) return false;
+            double cone = one_minus_cos(sin_squared);
+            double one_minus_cos_theta = stretched * cone;
+            double cos_theta = 1 - one_minus_cos_theta;
+            double sin_theta = sqrt(fmax(0.0, one_minus_cos_theta * (2 - one_minus_cos_theta)));
+            double phi = 2 * pi * u.u2;
+            double distance = sqrt(distance_squared);
+            s.direction = onb(to_center / distance).local(vec3(cos(phi) * sin_theta, sin(phi) * sin_theta, cos_theta));
+
+            // MATH: the nearer root of t^2 - 2ht + c = 0, written so it doesn't cancel for small, far away lights
+            double h = distance * cos_theta;
+            double c = distance_squared - double(light.radius) * light.radius;
+            s.distance = c / (h + sqrt(fmax(0.0, h * h - c)));
+            s.radiance = light.radiance;
+            s.pdf = probabilities[index] / (2 * pi * cone);
+            return true;
+        }
+
+        /** the pdf with which sample() picks the direction from point to hit, if hit is on a light. 0 if it is not */
+        double pdf(const point3& point, const hit_details& hit) const {
+            int index = find(hit);
+            if (index < 0) return 0;
+            const sphere_light& light = lights[index];
+            double sin_squared = double(light.radius) * light.radius / (light.center - point).length_squared();
+            if (sin_squared >= 1) return 0;
+            return probabilities[index] / (2 * pi * one_minus_cos(sin_squared));
+        }
+
+    private:
+        std::vector<sphere_light> lights;
+        std::vector<double> probabilities; // of picking each light
+        std::vector<double> cdf; // the sum of the probabilities up to and including each light
+        std::vector<std::vector<uint32_t>> by_material; // the lights of every material index, to find the light a bounce hit
+
+        void collect(const hittable& object) {
+            if (auto list = dynamic_cast<const hittable_list*>(&object)) {
+                for (const auto& child : list->objects) collect(*child);
+            } else if (auto spheres = dynamic_cast<const sphere_set*>(&object)) {
+                for (size_t i = 0; i < spheres->size(); i++) {
+                    point3 center(spheres->centers_x()[i], spheres->centers_y()[i], spheres->centers_z()[i]);
+                    add(center, spheres->radius_values()[i], spheres->material_slots()[i]);
+                }
+            } else if (auto single = dynamic_cast<const sphere*>(&object)) {
+                add(single->center_point(), single->radius_value(), single->material_slot());
+            }
+        }
+
+        void add(const point3& center, real radius, uint32_t mat) {
+            const material& m = scene_materials()[mat];
+            if (m.type() != material_type::emissive || radius <= 0) return;
+            sphere_light light = { center, radius, m.record().albedo, mat };
+            if (power(light) <= 0) return;
+            if (by_material.size() <= mat) by_material.resize(mat + 1);
+            by_material[mat].push_back(uint32_t(lights.size()));
+            lights.push_back(light);
+        }
+
+        /** MATH: proportional to the power of the light, pi * radiance * 4 pi r^2 */
+        static double power(const sphere_light& light) {
+            const color& l = light.radiance;
+            return (0.2126 * l.x() + 0.7152 * l.y() + 0.0722 * l.z()) * light.radius * light.radius;
+        }
+
+        /** MATH: 1 - cos of the cone's half angle, from its sin^2. 1 - sqrt(1 - s) cancels for small cones, this doesn't */
+        static double one_minus_cos(double sin_squared) {
+            return sin_squared / (1 + sqrt(1 - sin_squared));
+        }
+
+        /** the light hit lies on, -1 if none. A few lights share a material at most, so a scan is cheap */
+        int find(const hit_details& hit) const {
+            if (hit.mat >= by_material.size()) return -1;
+            int best = -1;
+            double best_error = 0;
+            for (uint32_t index : by_material[hit.mat]) {
+                const sphere_light& light = lights[index];
+                double error = fabs((hit.p - light.center).length() - light.radius);
+                if (error <= 1e-3 * light.radius + 1e-6 && (best < 0 || error < best_error)) {
+                    best = int(index);
+                    best_error = error;
+                }
+            }
+            return best;
+        }
+};
+
+/**
+ * Next-event estimation at a lambertian hit: sample a light and return the light it adds if the shadow ray
+ * (shadow within shadow_range) turns out unblocked, not yet times the path throughput.
+ * The bounce after this hit may find the same light by chance, so both count with weights that add up to one,
+ * the power heuristic pdf^2 / (light_pdf^2 + bounce_pdf^2) (Veach, "Optimally Combining Sampling Techniques
+ * for Monte Carlo Rendering", 1995). The shadow ray is one segment more, so integrators only call this where
+ * path_limits would still allow the bounce ray. False if there is nothing to trace
+ */
+inline bool sample_direct_light(const light_list& lights, const material& mat, const hit_details& hit, const sample_2d& u,
+                                ray& shadow, range& shadow_range, color& light) {
+    light_sample s;
+    if (!lights.sample(hit.p, u, s)) return false;
+    if (dot(hit.normal, s.direction) <= 0) return false; // the light is behind the surface
+    double bounce_pdf = mat.lambertian_pdf(hit, s.direction);
+    double weight_over_pdf = s.pdf / (s.pdf * s.pdf + bounce_pdf * bounce_pdf);
+    light = mat.lambertian_reflectance(hit, s.direction) * s.radiance * real(weight_over_pdf);
+    shadow = ray(hit.p, s.direction);
+    shadow_range = range(0.001, real(s.distance * (1 - 1e-3))); // stop short of the light itself
+    return true;
+}
+
+/**
+ * The weight of the light a bounce found by chance, the other half of sample_direct_light.
+ * r is the bounce ray, scatter_pdf the pdf of its direction, or 0 where no light was sampled at its origin
+ * (camera rays, specular bounces): those are the only way to see the light, so they count fully
+ */
+inline double emission_weight(const light_list& lights, const ray& r, const hit_details& hit, double scatter_pdf) {
+    if (scatter_pdf <= 0) return 1;
+    double light_pdf = lights.pdf(r.origin(), hit);
+    return scatter_pdf * scatter_pdf / (scatter_pdf * scatter_pdf + light_pdf * light_pdf);
+}
+
+#endif
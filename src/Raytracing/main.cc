@@ -1,61 +1,210 @@
 #include "material.h"
 #include "project_utils.h"
 #include "hittable_list.h"
-#include "sphere.h"
+#include "sphere_set.h"
 #include "camera.h"
+#include "scene_file.h"
+#include "scenes.h"
+#include "distributed.h"
+#include "checkpoint.h"
+#include "preview.h"
+#include "denoise.h"
+#include "animation.h"
+#include <cstring>
 
+/**
+ * Usage: Raytracing [scene file] [-o image] [--save-scene file] [options]
+ * Without a scene file it renders the cover scene.
+ * With --workers N and/or --listen PORT the frame is rendered by worker processes, see distributed.h.
+ * Raytracing [scene file] --connect HOST:PORT runs a worker for a coordinator on another machine.
+ * --preview image.png renders coarse first and refines, watching the scene file for changes, see preview.h.
+ * --checkpoint file saves the render every --checkpoint-interval seconds and resumes from it, see checkpoint.h.
+ *   --checkpoint-pass N: samples per pixel a tile takes between two chances to stop (default 4).
+ * --animation path.rta renders a sequence of frames with a moving camera and spheres, -o frame_%04d.png, see animation.h.
+ * --denoise filters the render guided by its normals, albedo and depth, see denoise.h. --aov prefix saves those as .pfm.
+ * --sampler independent|stratified|sobol|blue-noise picks where the sample numbers come from, see sampler.h.
+ * --no-light-sampling leaves emissive spheres to be found by bounces alone, without shadow rays, see lights.h.
+ * --split-samples lets several threads share the samples of expensive tiles, see camera::split_samples.
+ */
+int main(int argc, char* argv[]) {
+    camera cam;
+    cam.thread_count = 0; // one render thread per core
+    std::string scene_path; // .rts text or .rtb binary scene, see scene_file.h
+    std::string save_scene_path; // write the scene out before rendering, e.g. to turn the cover scene into a file
+    std::string output_path = "-"; // .png, .pfm or .ppm. "-" writes a binary ppm to stdout
+    std::string sample_map_path; // where to save how many samples every pixel took
+    std::string reference_path; // a .pfm to compare the render against, e.g. the double render when testing the float build
+    double diff_tolerance = 0.01; // in display units, see image_io::compare_images
+    int image_width = 0, samples_per_pixel = 0; // override the scene's settings if set
+    int max_depth = 0, max_diffuse_depth = -1, max_specular_depth = -1, max_transmission_depth = -1; // same, see path_limits
+    bool russian_roulette = true;
+    distributed::options farm; // worker processes, none by default
+    std::string coordinator; // host:port of the coordinator to work for
+    checkpoint::options checkpointing; // off unless a file is given
+    preview::options previewing; // off unless an output is given
+    bool denoising = false;
+    std::string aov_prefix; // write prefix_normal.pfm, prefix_albedo.pfm and prefix_depth.pfm
+    std::string animation_path; // render a sequence instead of a single frame
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) cam.thread_count = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--wavefront") == 0) cam.integrator = integrator_type::wavefront;
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) output_path = argv[++i];
+        else if (strcmp(argv[i], "--adaptive") == 0) cam.adaptive_sampling = true;
+        else if (strcmp(argv[i], "--split-samples") == 0) cam.split_samples = true;
+        else if (strcmp(argv[i], "--no-light-sampling") == 0) cam.light_sampling = false;
+        else if (strcmp(argv[i], "--sampler") == 0 && i + 1 < argc) {
+            if (!sampling::parse_sampler_type(argv[++i], cam.sampler)) {
+                std::cerr << "Unknown sampler " << argv[i] << "\n";
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--spp-map") == 0 && i + 1 < argc) sample_map_path = argv[++i];
+        else if (strcmp(argv[i], "--save-scene") == 0 && i + 1 < argc) save_scene_path = argv[++i];
+        else if (strcmp(argv[i], "--width") == 0 && i + 1 < argc) image_width = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--spp") == 0 && i + 1 < argc) samples_per_pixel = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--max-depth") == 0 && i + 1 < argc) max_depth = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--max-diffuse") == 0 && i + 1 < argc) max_diffuse_depth = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--max-specular") == 0 && i + 1 < argc) max_specular_depth = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--max-transmission") == 0 && i + 1 < argc) max_transmission_depth = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--no-roulette") == 0) russian_roulette = false;
+        else if (strcmp(argv[i], "--diff") == 0 && i + 1 < argc) reference_path = argv[++i];
+        else if (strcmp(argv[i], "--diff-tolerance") == 0 && i + 1 < argc) diff_tolerance = atof(argv[++i]);
+        else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) farm.local_workers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) farm.listen_port = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--connect") == 0 && i + 1 < argc) coordinator = argv[++i];
+        else if (strcmp(argv[i], "--sample-chunk") == 0 && i + 1 < argc) farm.sample_chunk = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--worker-timeout") == 0 && i + 1 < argc) farm.worker_timeout = atof(argv[++i]);
+        else if (strcmp(argv[i], "--fail-worker-after") == 0 && i + 1 < argc) farm.fail_worker_after = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) checkpointing.path = argv[++i];
+        else if (strcmp(argv[i], "--checkpoint-interval") == 0 && i + 1 < argc) checkpointing.interval = atof(argv[++i]);
+        else if (strcmp(argv[i], "--checkpoint-pass") == 0 && i + 1 < argc) checkpointing.samples_per_pass = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--preview") == 0 && i + 1 < argc) previewing.output = argv[++i];
+        else if (strcmp(argv[i], "--preview-once") == 0) previewing.watch = false;
+        else if (strcmp(argv[i], "--denoise") == 0) denoising = true;
+        else if (strcmp(argv[i], "--aov") == 0 && i + 1 < argc) aov_prefix = argv[++i];
+        else if (strcmp(argv[i], "--animation") == 0 && i + 1 < argc) animation_path = argv[++i];
+        else if (argv[i][0] != '-') scene_path = argv[i];
+    }
 
-int main() {
-    /** add all hittables to world */
     hittable_list world;
-    //ground
-    auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
-    world.add(make_shared<sphere>(point3(0,-1000,0), 1000, ground_material));
-    // create a bunch of randomized little spheres with different materials
-    for (int a = -11; a < 11; a++) {
-        for (int b = -11; b < 11; b++) {
-            auto choose_mat = random_double();
-            point3 center(a + 0.9*random_double(), 0.2, b + 0.9*random_double());
-            if ((center - point3(4, 0.2, 0)).length() > 0.9) {
-                shared_ptr<material> sphere_material;
-                if (choose_mat < 0.8) {
-                    // diffuse
-                    auto albedo = color::random() * color::random();
-                    sphere_material = make_shared<lambertian>(albedo);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                } else if (choose_mat < 0.95) {
-                    // metal
-                    auto albedo = color::random(0.5, 1);
-                    auto fuzz = random_double(0, 0.5);
-                    sphere_material = make_shared<metal>(albedo, fuzz);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                } else {
-                    // glass
-                    sphere_material = make_shared<dielectric>(1.5);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                }
-            }
+    if (scene_path.empty()) {
+        auto spheres = make_shared<sphere_set>();
+        cover_scene(*spheres, cam);
+        world.add(spheres);
+    } else {
+        std::string error;
+        if (!scene_file::load_scene(scene_path, world, cam, error)) {
+            std::cerr << "Could not load " << scene_path << ": " << error << "\n";
+            return 1;
         }
     }
-    //make the three big spheres
-    auto material1 = make_shared<dielectric>(1.5);
-    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
-    auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
-    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
-    auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
+    // the command line wins over the scene file. A function, so the preview can apply it to cameras it reads again
+    auto apply_overrides = [&](camera& c) {
+        if (image_width > 0) c.image_width = image_width;
+        if (samples_per_pixel > 0) c.samples_per_pixel = samples_per_pixel;
+        if (max_depth > 0) c.max_depth = max_depth;
+        if (max_diffuse_depth >= 0) c.max_diffuse_depth = max_diffuse_depth;
+        if (max_specular_depth >= 0) c.max_specular_depth = max_specular_depth;
+        if (max_transmission_depth >= 0) c.max_transmission_depth = max_transmission_depth;
+        c.russian_roulette = russian_roulette;
+    };
+    apply_overrides(cam);
 
-    /** Camera settings */
-    camera cam;
-    cam.aspect_ratio = 16.0 / 9.0;
-    cam.image_width = 1200;
-    cam.samples_per_pixel = 50;
-    cam.max_depth = 50;
-    cam.vertical_fov = 20;
-    cam.position = point3(13,2,3);
-    cam.viewport_position = point3(0,0,0);
-    cam.up = vec3(0,1,0);
-    cam.defocus_angle = 0.6;
-    cam.focus_dist = 10.0;
-    cam.render(world);
+    // with the overrides, as rendered. The files hold spheres and a camera; meshes don't remember where they came from
+    if (!save_scene_path.empty()) {
+        if (world.objects.size() > 1) {
+            std::cerr << "Could not write " << save_scene_path << ": --save-scene only writes spheres, and the scene has meshes\n";
+            return 1;
+        }
+        const sphere_set& spheres = static_cast<const sphere_set&>(*world.objects[0]);
+        if (!scene_file::save_scene(save_scene_path, spheres, cam)) {
+            std::cerr << "Could not write " << save_scene_path << "\n";
+            return 1;
+        }
+    }
+
+    if (!previewing.output.empty()) {
+        if (scene_path.empty()) previewing.watch = false; // nothing to watch
+        return preview::run(cam, world, scene_path, previewing, apply_overrides) ? 0 : 1;
+    }
+
+    if (!animation_path.empty()) {
+        animation::sequence seq;
+        std::string error;
+        if (!animation::load(animation_path, cam, seq, error)) {
+            std::cerr << "Could not load " << animation_path << ": " << error << "\n";
+            return 1;
+        }
+        animation::options animating;
+        if (output_path != "-") animating.output = output_path;
+        animating.denoise = denoising;
+        sphere_set& spheres = static_cast<sphere_set&>(*world.objects[0]); // the loaders put all spheres there
+        return animation::render(cam, world, spheres, seq, animating) ? 0 : 1;
+    }
+
+#ifdef RT_HAS_DISTRIBUTED
+    if (!coordinator.empty()) {
+        // a worker: the coordinator sends the frame settings and the units to render
+        size_t colon = coordinator.rfind(':');
+        int fd = colon == std::string::npos ? -1 : distributed::connect_to(coordinator.substr(0, colon), atoi(coordinator.c_str() + colon + 1));
+        if (fd < 0) {
+            std::cerr << "Could not connect to " << coordinator << "\n";
+            return 1;
+        }
+        bool ok = distributed::serve(fd, cam, world);
+        close(fd);
+        return ok ? 0 : 1;
+    }
+#endif
+
+    framebuffer image;
+    if (farm.local_workers > 0 || farm.listen_port > 0) {
+        farm.threads_per_worker = cam.thread_count;
+        if (farm.sample_chunk > 0 && cam.adaptive_sampling) std::clog << "--sample-chunk is ignored with --adaptive, every unit is a whole tile\n";
+        render_stats stats;
+        if (!distributed::render(cam, world, image, farm, stats)) return 1;
+        sample_map_path.clear(); // the workers keep their sample counts
+    } else if (!checkpointing.path.empty()) {
+        checkpoint::outcome ended = checkpoint::render(cam, world, image, checkpointing);
+        if (ended == checkpoint::outcome::stopped) return 3; // only for a stop that can be resumed, so job scripts can requeue on it
+        if (ended == checkpoint::outcome::failed) return 1;
+        sample_map_path.clear();
+    } else {
+        cam.render(world, image);
+    }
+    if (denoising || !aov_prefix.empty()) {
+        framebuffer normal, albedo, depth;
+        cam.render_aovs(world, normal, albedo, depth);
+        if (!aov_prefix.empty()) {
+            bool ok = image_io::write_image(normal, aov_prefix + "_normal.pfm") && image_io::write_image(albedo, aov_prefix + "_albedo.pfm")
+                      && image_io::write_image(depth, aov_prefix + "_depth.pfm");
+            if (!ok) {
+                std::cerr << "Could not write the AOVs " << aov_prefix << "_*.pfm\n";
+                return 1;
+            }
+        }
+        // the sample variances are there after cam.render, the other modes fall back to estimating the noise
+        if (denoising) denoise::filter(image, normal, albedo, depth, cam.pixel_variances());
+    }
+    if (!image_io::write_image(image, output_path)) {
+        std::cerr << "Could not write " << output_path << "\n";
+        return 1;
+    }
+    if (!sample_map_path.empty()) {
+        framebuffer sample_map;
+        cam.sample_count_image(sample_map);
+        image_io::write_image(sample_map, sample_map_path);
+    }
+    if (!reference_path.empty()) {
+        framebuffer reference;
+        if (!image_io::read_pfm(reference_path, reference) || reference.width() != image.width() || reference.height() != image.height()) {
+            std::cerr << "Could not read " << reference_path << " or it has a different size\n";
+            return 1;
+        }
+        image_io::image_difference d = image_io::compare_images(reference, image);
+        bool within = d.blurred_rmse <= diff_tolerance && fabs(d.mean_error) <= diff_tolerance;
+        std::cerr << "Difference to " << reference_path << ": rmse " << d.rmse << ", blurred rmse " << d.blurred_rmse
+                  << ", mean " << d.mean_error << ", max " << d.max_error << (within ? " (ok)\n" : " (above tolerance)\n");
+        if (!within) return 2;
+    }
 }
\ No newline at end of file
@@ -0,0 +1,70 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define RT_HAS_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/** the whole file, memory mapped where the OS supports it, read into memory otherwise */
+class mapped_file {
+    public:
+        explicit mapped_file(const std::string& path) {
+#ifdef RT_HAS_MMAP
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) return;
+            struct stat info;
+            if (fstat(fd, &info) == 0 && info.st_size > 0) {
+                void* mapped = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mapped != MAP_FAILED) {
+                    bytes = static_cast<const uint8_t*>(mapped);
+                    length = size_t(info.st_size);
+                    is_mapped = true;
+                }
+            }
+            close(fd);
+            if (is_mapped) return;
+#endif
+            FILE* in = fopen(path.c_str(), "rb");
+            if (!in) return;
+            fseek(in, 0, SEEK_END);
+            long size = ftell(in);
+            fseek(in, 0, SEEK_SET);
+            if (size > 0) {
+                buffer.resize(size_t(size));
+                if (fread(buffer.data(), 1, buffer.size(), in) == buffer.size()) {
+                    bytes = buffer.data();
+                    length = buffer.size();
+                }
+            }
+            fclose(in);
+        }
+
+        ~mapped_file() {
+#ifdef RT_HAS_MMAP
+            if (is_mapped) munmap(const_cast<uint8_t*>(bytes), length);
+#endif
+        }
+
+        mapped_file(const mapped_file&) = delete;
+        mapped_file& operator=(const mapped_file&) = delete;
+
+        const uint8_t* data() const { return bytes; }
+        size_t size() const { return length; }
+
+    private:
+        const uint8_t* bytes = nullptr;
+        size_t length = 0;
+        bool is_mapped = false;
+        std::vector<uint8_t> buffer;
+};
+
+#endif
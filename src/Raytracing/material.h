@@ -3,46 +3,113 @@
 
 #include "project_utils.h"
 #include "hittable.h"
-// class hit_details;  //forward declaration of hit_details
+#include "sampler.h"
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <vector>
 
-class material {
-    public:
-        virtual ~material() = default;
+/** which class a material is. scatter() switches on it instead of making a virtual call */
+enum class material_type { none, lambertian, metal, dielectric, emissive, count };
+
+/** the parameters of a material as plain data. Scene files store materials like this */
+struct material_record {
+    material_type type = material_type::none;
+    color albedo; // lambertian, metal. The emitted radiance of emissive
+    double fuzz = 0; // metal
+    double refractive_index = 1; // dielectric
 
-        /** given the incoming ray and the  hit details, 
-         * this function sets the outgoing ray and color */
-        virtual bool scatter(const ray& r_in, const hit_details& hit, color& attenuation, ray& scattered) const {
-            return false;
+    bool operator<(const material_record& other) const {
+        if (type != other.type) return type < other.type;
+        for (int i = 0; i < 3; i++) {
+            if (albedo[i] != other.albedo[i]) return albedo[i] < other.albedo[i];
         }
+        if (fuzz != other.fuzz) return fuzz < other.fuzz;
+        return refractive_index < other.refractive_index;
+    }
 };
 
-/** NOTE: Very important to specify public inheritance or main won't know that lambertian is a material */
-class lambertian : public material {
+/**
+ * A material is plain data: its type plus the parameters of that type.
+ * Materials live in the material_table and hits refer to them by a 32-bit index,
+ * so no hit ever copies a shared_ptr (an atomic refcount change) and no bounce makes a virtual call.
+ * lambertian, metal, dielectric and emissive below are just convenient constructors.
+ */
+class material {
     public:
-        lambertian(const color& albedo) : albedo(albedo) {}
+        material() {}
+        explicit material(const material_record& record)
+            : kind(record.type), albedo(record.albedo), fuzz(record.fuzz < 1 ? record.fuzz : 1), refractive_index(record.refractive_index) {}
+
+        material_type type() const { return kind; }
+
+        /** the parameters of this material */
+        material_record record() const {
+            material_record r;
+            r.type = kind;
+            r.albedo = albedo;
+            r.fuzz = fuzz;
+            r.refractive_index = refractive_index;
+            return r;
+        }
+
+        /** given the incoming ray and the  hit details,
+         * this function sets the outgoing ray and color.
+         * u is the sample of this bounce (see sample_sequence), it picks the outgoing direction.
+         * Any other randomness comes from gen, which is seeded for this exact pixel, sample and bounce */
+        bool scatter(const ray& r_in, const hit_details& hit, color& attenuation, ray& scattered, const sample_2d& u, rng& gen) const {
+            switch (kind) {
+                case material_type::lambertian: return scatter_lambertian(r_in, hit, attenuation, scattered, u, gen);
+                case material_type::metal: return scatter_metal(r_in, hit, attenuation, scattered, u, gen);
+                case material_type::dielectric: return scatter_dielectric(r_in, hit, attenuation, scattered, u, gen);
+                default: return false;
+            }
+        }
+
+        /** the same with independent numbers: u drawn from gen */
+        bool scatter(const ray& r_in, const hit_details& hit, color& attenuation, ray& scattered, rng& gen) const {
+            double u1 = random_double(gen);
+            sample_2d u = { u1, random_double(gen) };
+            return scatter(r_in, hit, attenuation, scattered, u, gen);
+        }
+
+        /** the color of the surface for the denoiser's albedo buffer: the attenuation of lambertian and metal, white for glass and lights */
+        color surface_albedo() const { return kind == material_type::dielectric || kind == material_type::emissive ? color(1,1,1) : albedo; }
+
+        /** the radiance an emissive surface sends out of the hit side. Only the front face (the outside of a sphere) glows */
+        color emitted(const hit_details& hit) const {
+            return kind == material_type::emissive && hit.front_face ? albedo : color(0,0,0);
+        }
+
+        /** The scatter kernels of every type. Batched integrators that already sorted their hits by type call them directly */
 
         /** NOTE: method with const keyword makes it so that class properties cannot be changed */
         /** NOTE: const parameters cannot be changed --> all others are being changed :/ */
-        bool scatter(const ray& r_in, const hit_details& hit, color& attenuation, ray& scattered) const override {
-            auto scatter_direction = hit.normal + random_on_hemisphere(hit.normal);
-            if (scatter_direction.near_zero()) scatter_direction = hit.normal;
-
+        /**
+         * MATH: attenuation is the weight f * cos / pdf of the sampled direction. Sampling directions with the cosine
+         * (cosine_hemisphere around the normal) cancels everything but the albedo: (albedo / pi) * cos / (cos / pi)
+         */
+        bool scatter_lambertian(const ray& /*r_in*/, const hit_details& hit, color& attenuation, ray& scattered, const sample_2d& u, rng& /*gen*/) const {
+            vec3 scatter_direction = onb(hit.normal).local(cosine_hemisphere(u.u1, u.u2));
             scattered = ray(hit.p, scatter_direction);
             attenuation = albedo;
             return true;
         }
 
-    private:
-        color albedo;
-};
-
-class metal : public material {
-    public:
-        metal(const color& albedo, double fuzz) : albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1) {}
+        /**
+         * For estimators that pick directions some other way (light sampling, MIS): the reflected light per unit of
+         * incoming light from unit direction, f * cos, and the pdf with which scatter_lambertian picks that direction
+         */
+        color lambertian_reflectance(const hit_details& hit, const vec3& direction) const {
+            return albedo * real(fmax(0.0, double(dot(hit.normal, direction))) / pi);
+        }
+        double lambertian_pdf(const hit_details& hit, const vec3& direction) const {
+            return cosine_hemisphere_pdf(dot(hit.normal, direction));
+        }
 
-        bool scatter(const ray& r_in, const hit_details& hit, color& attenuation, ray& scattered) const override {
+        bool scatter_metal(const ray& r_in, const hit_details& hit, color& attenuation, ray& scattered, const sample_2d& u, rng& /*gen*/) const {
             vec3 scatter_direction = reflect(r_in.direction(), hit.normal);
-            scatter_direction = unit_vector(scatter_direction) + random_unit_vector() * fuzz;
+            scatter_direction = unit_vector(scatter_direction) + uniform_sphere(u.u1, u.u2) * fuzz;
             scattered = ray(hit.p, scatter_direction);
             attenuation = albedo;
 
@@ -50,21 +117,14 @@ class metal : public material {
             bool scatter_toward_normal = dot(scatter_direction, hit.normal) > 0;
             return scatter_toward_normal;
         }
-    private:
-        color albedo;
-        double fuzz;
-};
 
-class dielectric : public material {
-    public:
-        dielectric(double refractive_index) : refractive_index(refractive_index) {}
-        bool scatter(const ray& r_in, const hit_details& hit, color& attenuation, ray& scattered) const override {
-            double relative_ri = hit.front_face ? 1.0/refractive_index : refractive_index;
+        bool scatter_dielectric(const ray& r_in, const hit_details& hit, color& attenuation, ray& scattered, const sample_2d& u, rng& /*gen*/) const {
+            real relative_ri = hit.front_face ? 1/refractive_index : refractive_index;
             vec3 unit_incoming_direction = unit_vector(r_in.direction());
 
             /** If we can't refract, then we reflect the ray instead */
             vec3 outgoing_direction;
-            if (can_refract(unit_incoming_direction, hit.normal, relative_ri)) {
+            if (can_refract(unit_incoming_direction, hit.normal, relative_ri, u.u1)) {
                 outgoing_direction = refract(unit_incoming_direction, hit.normal, relative_ri);
             } else {
                 outgoing_direction = reflect(unit_incoming_direction, hit.normal);
@@ -74,37 +134,153 @@ class dielectric : public material {
             return true;
         }
 
-    private:
-        double refractive_index;
+    protected:
+        material_type kind = material_type::none;
+        color albedo; // lambertian, metal. Radiance of emissive
+        real fuzz = 0; // metal
+        real refractive_index = 1; // dielectric
 
-       
-        static bool can_refract(vec3 unit_incoming_ray, vec3 normal, double relative_ri) {
-             /** 
+    private:
+        /** u: a uniform number in [0, 1) that picks reflection or refraction */
+        static bool can_refract(vec3 unit_incoming_ray, vec3 normal, real relative_ri, double u) {
+             /**
              * MATH: there are cases when Snell's Law fails, because it returns a refractive angle greater than 90 degrees
              * Since that doesn't make any sense, that means that it literally cannot refract
              */
-            double cos_theta = fmin(dot(-unit_incoming_ray, normal), 1.0);
-            double sin_theta = sqrt(1.0 - cos_theta*cos_theta);
+            real cos_theta = fmin(dot(-unit_incoming_ray, normal), real(1));
+            real sin_theta = sqrt(1 - cos_theta*cos_theta);
             bool cannot_refract = relative_ri * sin_theta > 1.0;
             if (cannot_refract) return false;
             /** Check for Schlick reflectance */
-            bool schlick_refracts = schlick_reflectance(cos_theta, relative_ri) <= random_double();
+            bool schlick_refracts = schlick_reflectance(cos_theta, relative_ri) <= u;
             return schlick_refracts;
         }
 
-        /** 
+        /**
          * MATH: Returns a value between 0 and 1 depending on the angle of incidence
-         * If the angle of incidence is shallow, it returns a high value. 
+         * If the angle of incidence is shallow, it returns a high value.
          * If the reflectance is lower than a random double, it refracts. If it is higher, it reflects
          */
-        static double schlick_reflectance(double cosine, double refraction_index) {
+        static real schlick_reflectance(real cosine, real refraction_index) {
             // Use Schlick's approximation for reflectance.
             auto r0 = (1 - refraction_index) / (1 + refraction_index);
             r0 = r0*r0;
-            double reflectance = r0 + (1-r0)*pow((1 - cosine),5);
+            real reflectance = r0 + (1-r0)*pow((1 - cosine),5);
             return reflectance;
         }
+};
 
+/** NOTE: Very important to specify public inheritance or main won't know that lambertian is a material */
+class lambertian : public material {
+    public:
+        lambertian(const color& albedo) {
+            this->kind = material_type::lambertian;
+            this->albedo = albedo;
+        }
+};
+
+class metal : public material {
+    public:
+        metal(const color& albedo, double fuzz) {
+            this->kind = material_type::metal;
+            this->albedo = albedo;
+            this->fuzz = fuzz < 1 ? fuzz : 1;
+        }
+};
+
+class dielectric : public material {
+    public:
+        dielectric(double refractive_index) {
+            this->kind = material_type::dielectric;
+            this->refractive_index = refractive_index;
+        }
+};
+
+/** a light: emits radiance and absorbs whatever hits it. Lights made of spheres are sampled directly, see lights.h */
+class emissive : public material {
+    public:
+        emissive(const color& radiance) {
+            this->kind = material_type::emissive;
+            this->albedo = radiance;
+        }
+};
+
+/** create the material a record describes. Returns nullptr for records without a known type */
+inline shared_ptr<material> make_material(const material_record& r) {
+    if (r.type == material_type::none || r.type >= material_type::count) return nullptr;
+    return make_shared<material>(r);
+}
+
+/**
+ * Every material of the scene in one contiguous array. Hits refer to materials by their index in here.
+ * Adding a material with the same parameters twice gives the same index.
+ * Fill it while building the scene; it must not change while a render is running.
+ */
+class material_table {
+    public:
+        uint32_t add(const material& mat) {
+            std::lock_guard<std::mutex> lock(guard);
+            material_record record = mat.record();
+            auto found = lookup.find(record);
+            if (found != lookup.end()) return found->second;
+            uint32_t index = uint32_t(entries.size());
+            entries.push_back(mat);
+            lookup[record] = index;
+            return index;
+        }
+
+        const material& operator[](uint32_t index) const { return entries[index]; }
+        size_t size() const { return entries.size(); }
+
+        /** a key of every material in table order, so two processes can check that they have the same materials */
+        uint64_t key() const {
+            uint64_t key = hash_key(uint64_t(entries.size()));
+            for (const material& mat : entries) {
+                material_record r = mat.record();
+                double values[] = { double(r.type), double(r.albedo[0]), double(r.albedo[1]), double(r.albedo[2]), r.fuzz, r.refractive_index };
+                for (double value : values) {
+                    uint64_t bits;
+                    memcpy(&bits, &value, sizeof(bits));
+                    key = hash_key(key, bits);
+                }
+            }
+            return key;
+        }
+
+    private:
+        std::vector<material> entries;
+        std::map<material_record, uint32_t> lookup;
+        std::mutex guard; // scenes may be built on several threads
+};
+
+/** the table scene_materials() refers to. Swapped by material_scope */
+inline shared_ptr<material_table>& current_material_table() {
+    static shared_ptr<material_table> table = make_shared<material_table>();
+    return table;
+}
+
+/** the material table of the scene. Sphere constructors put their materials in here */
+inline material_table& scene_materials() {
+    return *current_material_table();
+}
+
+/**
+ * Gives a scene that is being loaded a material table of its own, so loading scene after scene (preview reloads)
+ * doesn't pile up the materials of all of them. keep() makes the new table the scene table for good; a scope that
+ * ends without it brings the old table back, and the scene that is still loaded keeps its materials.
+ */
+class material_scope {
+    public:
+        material_scope() : previous(current_material_table()) { current_material_table() = make_shared<material_table>(); }
+        ~material_scope() {
+            if (!kept) current_material_table() = previous;
+        }
+
+        void keep() { kept = true; }
+
+    private:
+        shared_ptr<material_table> previous;
+        bool kept = false;
 };
 
-#endif
\ No newline at end of file
+#endif
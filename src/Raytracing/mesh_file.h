@@ -0,0 +1,571 @@
+#ifndef MESH_FILE_H
+#define MESH_FILE_H
+
+#include "project_utils.h"
+#include "triangle_mesh.h"
+#include "mapped_file.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Triangle meshes from Wavefront OBJ and Stanford PLY files.
+ *
+ * Both loaders work on the memory mapped file and write straight into the float and index buffers of the mesh,
+ * whose sizes are counted up front, so loading a model costs little more memory than the finished mesh.
+ * Polygons are split into triangle fans.
+ *
+ * OBJ: v, vn and f statements. Texture coordinates, groups and materials are skipped.
+ * Vertices are shared between the faces that use them. OBJ indexes normals separately from positions,
+ * so a position that is used with two different normals (a hard edge) is split into two vertices.
+ * PLY: ascii, binary_little_endian and binary_big_endian, x/y/z and optional nx/ny/nz vertex properties
+ * of any numeric type, and a vertex_indices (or vertex_index) face list.
+ */
+namespace mesh_file {
+    /** reads words and numbers out of a buffer that is not null terminated */
+    class text_cursor {
+        public:
+            text_cursor(const char* begin, const char* end) : p(begin), end(end) {}
+
+            bool at_end() const { return p >= end; }
+            void skip_spaces() { while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++; }
+            bool at_line_end() {
+                skip_spaces();
+                return p >= end || *p == '\n';
+            }
+            void next_line() {
+                const char* newline = static_cast<const char*>(memchr(p, '\n', size_t(end - p)));
+                p = newline ? newline + 1 : end;
+            }
+
+            /** true and skips it if the line continues with word followed by whitespace */
+            bool keyword(const char* word) {
+                skip_spaces();
+                size_t length = strlen(word);
+                if (size_t(end - p) <= length || memcmp(p, word, length) != 0) return false;
+                char after = p[length];
+                if (after != ' ' && after != '\t') return false;
+                p += length;
+                return true;
+            }
+
+            std::string word() {
+                skip_spaces();
+                const char* start = p;
+                while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') p++;
+                return std::string(start, p);
+            }
+
+            /** decimal numbers like -1.5e-3. Faster than strtod and never reads past the end of the buffer */
+            bool read_number(double& value) {
+                skip_spaces();
+                const char* start = p;
+                bool negative = false;
+                if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+                uint64_t mantissa = 0;
+                int exponent = 0, digits = 0;
+                for (; p < end && *p >= '0' && *p <= '9'; p++, digits++) {
+                    if (mantissa < 100000000000000000ULL) mantissa = 10 * mantissa + uint64_t(*p - '0');
+                    else exponent++; // digits past double precision only count for the magnitude
+                }
+                if (p < end && *p == '.') {
+                    for (p++; p < end && *p >= '0' && *p <= '9'; p++, digits++) {
+                        if (mantissa < 100000000000000000ULL) {
+                            mantissa = 10 * mantissa + uint64_t(*p - '0');
+                            exponent--;
+                        }
+                    }
+                }
+                if (digits == 0) {
+                    p = start;
+                    return false;
+                }
+                if (p < end && (*p == 'e' || *p == 'E')) {
+                    long long power;
+                    p++;
+                    if (!read_integer(power)) return false;
+                    exponent += int(power);
+                }
+                value = exponent < 0 ? double(mantissa) / pow(10.0, -exponent) : double(mantissa) * pow(10.0, exponent);
+                if (negative) value = -value;
+                return true;
+            }
+
+            bool read_integer(long long& value) {
+                const char* start = p;
+                bool negative = false;
+                if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+                value = 0;
+                const char* digits = p;
+                for (; p < end && *p >= '0' && *p <= '9'; p++) value = 10 * value + (*p - '0');
+                if (p == digits) {
+                    p = start;
+                    return false;
+                }
+                if (negative) value = -value;
+                return true;
+            }
+
+            bool peek(char c) const { return p < end && *p == c; }
+            void skip() { p++; }
+
+            const char* position() const { return p; }
+
+        private:
+            const char* p;
+            const char* end;
+    };
+
+    /** how many lines start with each statement, so the buffers can be allocated once */
+    struct obj_counts {
+        size_t positions = 0, normals = 0, faces = 0;
+    };
+
+    inline obj_counts count_obj_statements(const char* begin, const char* end) {
+        obj_counts counts;
+        text_cursor cursor(begin, end);
+        while (!cursor.at_end()) {
+            if (cursor.keyword("v")) counts.positions++;
+            else if (cursor.keyword("vn")) counts.normals++;
+            else if (cursor.keyword("f")) counts.faces++;
+            cursor.next_line();
+        }
+        return counts;
+    }
+
+    inline bool load_obj(const mapped_file& file, triangle_mesh& mesh, std::string& error) {
+        const char* begin = reinterpret_cast<const char*>(file.data());
+        const char* end = begin + file.size();
+        obj_counts counts = count_obj_statements(begin, end);
+
+        std::vector<float> positions, file_normals;
+        std::vector<uint32_t> indices;
+        positions.reserve(3 * counts.positions);
+        file_normals.reserve(3 * counts.normals);
+        indices.reserve(3 * counts.faces); // exact for triangle meshes, polygons grow it
+
+        /**
+         * Vertex i is position i with the first normal a face used it with (vertex_normal[i]).
+         * Corners that use a position with another normal get an extra vertex, listed in split_vertices.
+         * Their indices are marked with split_flag until the number of positions is known.
+         */
+        const uint32_t no_normal = UINT32_MAX, split_flag = 0x80000000u;
+        std::vector<uint32_t> vertex_normal;
+        std::vector<std::pair<uint32_t, uint32_t>> split_vertices; // position, normal
+        std::unordered_map<uint64_t, uint32_t> split_lookup;
+        if (counts.normals > 0) vertex_normal.assign(counts.positions, no_normal);
+
+        text_cursor cursor(begin, end);
+        std::vector<uint32_t> polygon;
+        int line_number = 0;
+        auto fail = [&](const std::string& message) {
+            error = "line " + std::to_string(line_number) + ": " + message;
+            return false;
+        };
+        // OBJ indices start at 1, negative ones count back from the newest element
+        auto resolve = [](long long index, size_t count, uint32_t& resolved) {
+            long long i = index < 0 ? (long long)count + index : index - 1;
+            if (i < 0 || i >= (long long)count) return false;
+            resolved = uint32_t(i);
+            return true;
+        };
+
+        while (!cursor.at_end()) {
+            line_number++;
+            if (cursor.keyword("v")) {
+                double v[3];
+                for (int axis = 0; axis < 3; axis++) {
+                    if (!cursor.read_number(v[axis])) return fail("cannot parse vertex");
+                    positions.push_back(float(v[axis]));
+                }
+            } else if (cursor.keyword("vn")) {
+                double n[3];
+                for (int axis = 0; axis < 3; axis++) {
+                    if (!cursor.read_number(n[axis])) return fail("cannot parse normal");
+                    file_normals.push_back(float(n[axis]));
+                }
+            } else if (cursor.keyword("f")) {
+                polygon.clear();
+                size_t position_count = positions.size() / 3, normal_count = file_normals.size() / 3;
+                while (!cursor.at_line_end()) {
+                    // v, v/vt, v//vn or v/vt/vn
+                    long long index, unused, normal_index;
+                    uint32_t position, normal = no_normal;
+                    if (!cursor.read_integer(index) || !resolve(index, position_count, position)) return fail("bad vertex index");
+                    if (cursor.peek('/')) {
+                        cursor.skip();
+                        if (!cursor.peek('/')) cursor.read_integer(unused);
+                        if (cursor.peek('/')) {
+                            cursor.skip();
+                            if (!cursor.read_integer(normal_index) || !resolve(normal_index, normal_count, normal)) return fail("bad normal index");
+                        }
+                    }
+                    uint32_t vertex = position;
+                    if (normal != no_normal && position < vertex_normal.size()) {
+                        if (vertex_normal[position] == no_normal) vertex_normal[position] = normal;
+                        else if (vertex_normal[position] != normal) {
+                            uint64_t key = (uint64_t(position) << 32) | normal;
+                            auto found = split_lookup.find(key);
+                            if (found == split_lookup.end()) {
+                                found = split_lookup.emplace(key, uint32_t(split_vertices.size()) | split_flag).first;
+                                split_vertices.push_back(std::make_pair(position, normal));
+                            }
+                            vertex = found->second;
+                        }
+                    }
+                    polygon.push_back(vertex);
+                }
+                if (polygon.size() < 3) return fail("face with less than 3 corners");
+                for (size_t i = 2; i < polygon.size(); i++) {
+                    indices.push_back(polygon[0]);
+                    indices.push_back(polygon[i-1]);
+                    indices.push_back(polygon[i]);
+                }
+            }
+            cursor.next_line();
+        }
+        if (indices.empty()) {
+            error = "no faces";
+            return false;
+        }
+
+        size_t position_count = positions.size() / 3;
+        if (split_vertices.size() > 0) {
+            positions.reserve(positions.size() + 3 * split_vertices.size());
+            for (const auto& split : split_vertices) {
+                for (int axis = 0; axis < 3; axis++) positions.push_back(positions[3*size_t(split.first) + axis]);
+            }
+            for (uint32_t& index : indices) {
+                if (index & split_flag) index = uint32_t(position_count + (index & ~split_flag));
+            }
+        }
+        std::vector<float> normals;
+        if (!file_normals.empty()) {
+            normals.assign(positions.size(), 0); // vertices no face gave a normal get a zero one: they are shaded flat
+            for (size_t i = 0; i < vertex_normal.size(); i++) {
+                if (vertex_normal[i] == no_normal) continue;
+                for (int axis = 0; axis < 3; axis++) normals[3*i + axis] = file_normals[3*size_t(vertex_normal[i]) + axis];
+            }
+            for (size_t i = 0; i < split_vertices.size(); i++) {
+                for (int axis = 0; axis < 3; axis++)
+                    normals[3*(position_count + i) + axis] = file_normals[3*size_t(split_vertices[i].second) + axis];
+            }
+        }
+        mesh.assign(std::move(positions), std::move(normals), std::move(indices));
+        return true;
+    }
+
+    /** the scalar types of PLY properties */
+    enum class ply_type { none, int8, uint8, int16, uint16, int32, uint32, float32, float64 };
+
+    inline ply_type parse_ply_type(const std::string& name) {
+        if (name == "char" || name == "int8") return ply_type::int8;
+        if (name == "uchar" || name == "uint8") return ply_type::uint8;
+        if (name == "short" || name == "int16") return ply_type::int16;
+        if (name == "ushort" || name == "uint16") return ply_type::uint16;
+        if (name == "int" || name == "int32") return ply_type::int32;
+        if (name == "uint" || name == "uint32") return ply_type::uint32;
+        if (name == "float" || name == "float32") return ply_type::float32;
+        if (name == "double" || name == "float64") return ply_type::float64;
+        return ply_type::none;
+    }
+
+    inline size_t ply_type_size(ply_type type) {
+        switch (type) {
+            case ply_type::int8: case ply_type::uint8: return 1;
+            case ply_type::int16: case ply_type::uint16: return 2;
+            case ply_type::int32: case ply_type::uint32: case ply_type::float32: return 4;
+            case ply_type::float64: return 8;
+            default: return 0;
+        }
+    }
+
+    struct ply_property {
+        std::string name;
+        ply_type type = ply_type::none; // of the value, or of the items for a list
+        ply_type count_type = ply_type::none; // lists only
+        bool is_list() const { return count_type != ply_type::none; }
+    };
+
+    struct ply_element {
+        std::string name;
+        size_t count = 0;
+        std::vector<ply_property> properties;
+    };
+
+    enum class ply_format { ascii, binary_little_endian, binary_big_endian };
+
+    /** reads one property value at a time, from text or binary data */
+    class ply_reader {
+        public:
+            ply_reader(ply_format format, const char* begin, const char* end) : format(format), text(begin, end), p(begin), end(end) {
+                uint16_t probe = 1;
+                uint8_t first_byte;
+                memcpy(&first_byte, &probe, 1);
+                swap_bytes = (format == ply_format::binary_big_endian) == (first_byte == 1);
+            }
+
+            bool read(ply_type type, double& value) {
+                if (format == ply_format::ascii) return text.read_number(value);
+                size_t size = ply_type_size(type);
+                if (size_t(end - p) < size) return false;
+                uint8_t bytes[8];
+                memcpy(bytes, p, size);
+                p += size;
+                if (swap_bytes) std::reverse(bytes, bytes + size);
+                switch (type) {
+                    case ply_type::int8: value = double(int8_t(bytes[0])); break;
+                    case ply_type::uint8: value = double(bytes[0]); break;
+                    case ply_type::int16: { int16_t v; memcpy(&v, bytes, 2); value = v; break; }
+                    case ply_type::uint16: { uint16_t v; memcpy(&v, bytes, 2); value = v; break; }
+                    case ply_type::int32: { int32_t v; memcpy(&v, bytes, 4); value = v; break; }
+                    case ply_type::uint32: { uint32_t v; memcpy(&v, bytes, 4); value = v; break; }
+                    case ply_type::float32: { float v; memcpy(&v, bytes, 4); value = v; break; }
+                    case ply_type::float64: { double v; memcpy(&v, bytes, 8); value = v; break; }
+                    default: return false;
+                }
+                return true;
+            }
+
+            /** bytes left to read. Every value takes at least one, which bounds the counts in the file */
+            size_t remaining() const { return size_t(end - (format == ply_format::ascii ? text.position() : p)); }
+
+            /** ascii PLY has one element per line */
+            void end_element() {
+                if (format == ply_format::ascii) text.next_line();
+            }
+
+        private:
+            ply_format format;
+            text_cursor text;
+            const char* p;
+            const char* end;
+            bool swap_bytes;
+    };
+
+    inline bool load_ply(const mapped_file& file, triangle_mesh& mesh, std::string& error) {
+        const char* begin = reinterpret_cast<const char*>(file.data());
+        const char* end = begin + file.size();
+        text_cursor header(begin, end);
+        if (header.word() != "ply") {
+            error = "not a PLY file";
+            return false;
+        }
+        header.next_line();
+        ply_format format = ply_format::ascii;
+        std::vector<ply_element> elements;
+        bool header_done = false;
+        while (!header.at_end() && !header_done) {
+            std::string keyword = header.word();
+            if (keyword == "format") {
+                std::string name = header.word();
+                if (name == "ascii") format = ply_format::ascii;
+                else if (name == "binary_little_endian") format = ply_format::binary_little_endian;
+                else if (name == "binary_big_endian") format = ply_format::binary_big_endian;
+                else {
+                    error = "unknown format " + name;
+                    return false;
+                }
+            } else if (keyword == "element") {
+                ply_element element;
+                element.name = header.word();
+                double count;
+                // every element takes at least a byte, so a count past the file size can only be a broken file
+                if (!header.read_number(count) || !(count >= 0) || count > double(file.size()) || count != std::floor(count)) {
+                    error = "bad element count";
+                    return false;
+                }
+                element.count = size_t(count);
+                elements.push_back(element);
+            } else if (keyword == "property" && !elements.empty()) {
+                ply_property property;
+                std::string type = header.word();
+                if (type == "list") {
+                    property.count_type = parse_ply_type(header.word());
+                    type = header.word();
+                    if (property.count_type == ply_type::none) {
+                        error = "unknown list count type";
+                        return false;
+                    }
+                }
+                property.type = parse_ply_type(type);
+                property.name = header.word();
+                if (property.type == ply_type::none) {
+                    error = "unknown property type " + type;
+                    return false;
+                }
+                elements.back().properties.push_back(property);
+            } else if (keyword == "end_header") {
+                header_done = true;
+            }
+            header.next_line();
+        }
+        if (!header_done) {
+            error = "no end_header";
+            return false;
+        }
+
+        std::vector<float> positions, normals;
+        std::vector<uint32_t> indices;
+        size_t vertex_count = 0;
+        ply_reader reader(format, header.position(), end);
+        std::vector<double> list;
+        for (const ply_element& element : elements) {
+            bool is_vertex = element.name == "vertex", is_face = element.name == "face";
+            // where each property goes: 0-2 position, 3-5 normal, -1 nowhere
+            std::vector<int> targets;
+            bool with_normals = false;
+            for (const ply_property& property : element.properties) {
+                const char* names[] = { "x", "y", "z", "nx", "ny", "nz" };
+                int target = -1;
+                for (int i = 0; i < 6 && is_vertex && !property.is_list(); i++) {
+                    if (property.name == names[i]) target = i;
+                }
+                with_normals = with_normals || target >= 3;
+                targets.push_back(target);
+            }
+            if (is_vertex) {
+                vertex_count = element.count;
+                positions.resize(3 * element.count);
+                if (with_normals) normals.resize(3 * element.count);
+            }
+            if (is_face) indices.reserve(3 * element.count); // exact for triangle meshes
+
+            for (size_t item = 0; item < element.count; item++) {
+                for (size_t k = 0; k < element.properties.size(); k++) {
+                    const ply_property& property = element.properties[k];
+                    double value;
+                    if (!property.is_list()) {
+                        if (!reader.read(property.type, value)) {
+                            error = "unexpected end of " + element.name + " data";
+                            return false;
+                        }
+                        if (targets[k] >= 0 && targets[k] < 3) positions[3*item + targets[k]] = float(value);
+                        else if (targets[k] >= 3) normals[3*item + targets[k] - 3] = float(value);
+                        continue;
+                    }
+                    double count;
+                    if (!reader.read(property.count_type, count)) {
+                        error = "unexpected end of " + element.name + " data";
+                        return false;
+                    }
+                    if (!(count >= 0) || count > double(reader.remaining()) || count != std::floor(count)) {
+                        error = element.name + " " + std::to_string(item) + " has a bad list length";
+                        return false;
+                    }
+                    list.resize(size_t(count));
+                    for (double& v : list) {
+                        if (!reader.read(property.type, v)) {
+                            error = "unexpected end of " + element.name + " data";
+                            return false;
+                        }
+                    }
+                    if (!is_face || (property.name != "vertex_indices" && property.name != "vertex_index")) continue;
+                    for (double v : list) {
+                        if (v < 0 || v >= double(vertex_count)) {
+                            error = "face " + std::to_string(item) + " has a bad vertex index";
+                            return false;
+                        }
+                    }
+                    for (size_t i = 2; i < list.size(); i++) {
+                        indices.push_back(uint32_t(list[0]));
+                        indices.push_back(uint32_t(list[i-1]));
+                        indices.push_back(uint32_t(list[i]));
+                    }
+                }
+                reader.end_element();
+            }
+        }
+        if (indices.empty()) {
+            error = "no faces";
+            return false;
+        }
+        mesh.assign(std::move(positions), std::move(normals), std::move(indices));
+        return true;
+    }
+
+    /** Load an OBJ or PLY file into mesh and build its BVH. PLY files are recognized by their first bytes, everything else is read as OBJ */
+    inline bool load_mesh(const std::string& path, triangle_mesh& mesh, std::string& error) {
+        bool ok;
+        {
+            mapped_file file(path);
+            if (!file.data()) {
+                error = "cannot read " + path;
+                return false;
+            }
+            bool is_ply = file.size() >= 3 && memcmp(file.data(), "ply", 3) == 0;
+            ok = is_ply ? load_ply(file, mesh, error) : load_obj(file, mesh, error);
+        } // unmap before the build, the buffers are all in the mesh now
+        if (ok) mesh.build();
+        return ok;
+    }
+
+    /** write the mesh as OBJ. The vertex order is kept, the triangles are in BVH order */
+    inline bool save_obj(const std::string& path, const triangle_mesh& mesh) {
+        FILE* out = fopen(path.c_str(), "w");
+        if (!out) return false;
+        const std::vector<float>& p = mesh.vertex_positions();
+        const std::vector<float>& n = mesh.vertex_normals();
+        const std::vector<uint32_t>& indices = mesh.triangle_indices();
+        for (size_t i = 0; i < p.size(); i += 3) fprintf(out, "v %.9g %.9g %.9g\n", p[i], p[i+1], p[i+2]);
+        for (size_t i = 0; i < n.size(); i += 3) fprintf(out, "vn %.9g %.9g %.9g\n", n[i], n[i+1], n[i+2]);
+        for (size_t i = 0; i < indices.size(); i += 3) {
+            unsigned a = indices[i] + 1, b = indices[i+1] + 1, c = indices[i+2] + 1;
+            if (n.empty()) fprintf(out, "f %u %u %u\n", a, b, c);
+            else fprintf(out, "f %u//%u %u//%u %u//%u\n", a, a, b, b, c, c);
+        }
+        return fclose(out) == 0;
+    }
+
+    /** write the mesh as binary little endian PLY, with float vertices and uchar/int face lists */
+    inline bool save_ply(const std::string& path, const triangle_mesh& mesh) {
+        FILE* out = fopen(path.c_str(), "wb");
+        if (!out) return false;
+        const std::vector<float>& p = mesh.vertex_positions();
+        const std::vector<float>& n = mesh.vertex_normals();
+        const std::vector<uint32_t>& indices = mesh.triangle_indices();
+        fprintf(out, "ply\nformat binary_little_endian 1.0\nelement vertex %zu\n", mesh.vertex_count());
+        fprintf(out, "property float x\nproperty float y\nproperty float z\n");
+        if (!n.empty()) fprintf(out, "property float nx\nproperty float ny\nproperty float nz\n");
+        fprintf(out, "element face %zu\nproperty list uchar int vertex_indices\nend_header\n", mesh.triangle_count());
+
+        uint16_t probe = 1;
+        uint8_t first_byte;
+        memcpy(&first_byte, &probe, 1);
+        bool swap_bytes = first_byte != 1;
+        std::vector<uint8_t> buffer;
+        auto put = [&](const void* value, size_t size) {
+            const uint8_t* bytes = static_cast<const uint8_t*>(value);
+            size_t at = buffer.size();
+            buffer.insert(buffer.end(), bytes, bytes + size);
+            if (swap_bytes) std::reverse(buffer.begin() + at, buffer.end());
+        };
+        // written in chunks, so a big mesh never needs a second copy in memory
+        auto flush = [&](bool force) {
+            if (buffer.size() < (1 << 20) && !force) return;
+            fwrite(buffer.data(), 1, buffer.size(), out);
+            buffer.clear();
+        };
+        for (size_t i = 0; i < mesh.vertex_count(); i++) {
+            put(&p[3*i], 4); put(&p[3*i+1], 4); put(&p[3*i+2], 4);
+            if (!n.empty()) { put(&n[3*i], 4); put(&n[3*i+1], 4); put(&n[3*i+2], 4); }
+            flush(false);
+        }
+        const uint8_t corner_count = 3;
+        for (size_t i = 0; i < indices.size(); i += 3) {
+            put(&corner_count, 1);
+            for (int corner = 0; corner < 3; corner++) {
+                int32_t index = int32_t(indices[i + corner]);
+                put(&index, 4);
+            }
+            flush(false);
+        }
+        flush(true);
+        return fclose(out) == 0;
+    }
+}
+
+#endif
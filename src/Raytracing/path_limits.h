@@ -0,0 +1,55 @@
+#ifndef PATH_LIMITS_H
+#define PATH_LIMITS_H
+
+#include "project_utils.h"
+#include "material.h"
+
+/** the kind of bounce a material makes. Each kind can have its own depth limit */
+enum class bounce_kind { diffuse, specular, transmission, count };
+
+inline bounce_kind bounce_kind_of(material_type type) {
+    if (type == material_type::metal) return bounce_kind::specular;
+    if (type == material_type::dielectric) return bounce_kind::transmission;
+    return bounce_kind::diffuse;
+}
+
+/**
+ * When a path stops. Shared by every integrator, so they all end the same paths at the same bounce.
+ *   - max_depth: bounces of any kind
+ *   - max_diffuse/specular/transmission_depth: bounces of one kind, 0 means only max_depth applies.
+ *     E.g. a low transmission limit keeps stacks of glass spheres from bouncing paths back and forth 50 times
+ *   - Russian roulette: from roulette_depth bounces on, a path survives each bounce with a probability
+ *     that follows its throughput. Paths that carry almost nothing end early, the survivors are weighted up
+ */
+struct path_limits {
+    int max_depth = 10;
+    int max_diffuse_depth = 0;
+    int max_specular_depth = 0;
+    int max_transmission_depth = 0;
+    bool russian_roulette = true;
+    int roulette_depth = 3;
+
+    /** count a bounce of this kind. False if that is one bounce more than its limit allows */
+    bool allows_bounce(bounce_kind kind, uint16_t* bounce_counts) const {
+        int limit = kind == bounce_kind::diffuse ? max_diffuse_depth
+                  : kind == bounce_kind::specular ? max_specular_depth : max_transmission_depth;
+        int count = ++bounce_counts[int(kind)];
+        return limit <= 0 || count <= limit;
+    }
+
+    /**
+     * MATH: continuing with probability p and dividing the throughput by p keeps the expected value the same,
+     * so the image is not darkened, only paths that contribute little get cut short.
+     * p is the brightest channel of the throughput (capped at 0.95, so even white glass paths end eventually).
+     * Draws from gen after scatter did, so the order of random numbers is fixed.
+     */
+    bool survives_roulette(int bounce, color& throughput, rng& gen) const {
+        if (!russian_roulette || bounce < roulette_depth) return true;
+        double p = fmin(0.95, fmax(throughput.x(), fmax(throughput.y(), throughput.z())));
+        if (random_double(gen) >= p) return false;
+        throughput /= p;
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,229 @@
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include "project_utils.h"
+#include "camera.h"
+#include "distributed.h"
+#include "framebuffer.h"
+#include "hittable_list.h"
+#include "scene_file.h"
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define RT_HAS_STAT 1
+#include <sys/stat.h>
+#endif
+
+/**
+ * Interactive preview, for placing the camera without waiting for whole renders.
+ *
+ * The frame shows up coarse first and gets better: 1 sample per pixel at 1/8, 1/4 and 1/2 of the resolution,
+ * then the full resolution with more and more samples. Every step is written to the output image, which a viewer
+ * can poll. The image is written under another name and renamed over the output, so the viewer never reads half a file.
+ *
+ * Meanwhile the scene file is watched. When it is saved, only its camera statements are read again (scene_file::scan_scene):
+ *   - the geometry changed: the scene is loaded again and the preview starts over
+ *   - the camera view changed (position, viewport_position, vertical_fov, defocus_angle, ...): the preview starts over
+ *   - nothing that changes the picture did (a comment, more samples_per_pixel): the samples so far are kept
+ */
+namespace preview {
+    struct options {
+        std::string output; // the image the viewer polls, .png, .ppm or .pfm
+        int coarse_levels = 3; // reduced resolution steps before the full one: 1/8, 1/4, 1/2
+        double pass_seconds = 0.5; // how long a refinement step may take, so changes are picked up quickly
+        double poll_interval = 0.2; // seconds between two looks at the scene file once the image is done
+        bool watch = true; // keep watching the scene file after the last sample. Otherwise return then
+    };
+
+    /** write image to path so that readers see either the old or the new file: "out.png" is written as "out.partial.png" first */
+    inline bool publish(const framebuffer& image, const std::string& path) {
+        size_t dot = path.find_last_of('.');
+        size_t slash = path.find_last_of('/');
+        bool has_extension = dot != std::string::npos && (slash == std::string::npos || dot > slash);
+        std::string temporary = has_extension ? path.substr(0, dot) + ".partial" + path.substr(dot) : path + ".partial";
+        return image_io::write_image(image, temporary) && rename(temporary.c_str(), path.c_str()) == 0;
+    }
+
+    /** when and how big the file was last written. Changes when it is saved */
+    struct file_stamp {
+        long long seconds = 0, nanoseconds = 0, size = -1;
+        uint64_t content_key = 0; // without stat(): a hash of the file, read every time
+
+        bool operator==(const file_stamp& other) const {
+            return seconds == other.seconds && nanoseconds == other.nanoseconds && size == other.size && content_key == other.content_key;
+        }
+        bool operator!=(const file_stamp& other) const { return !(*this == other); }
+    };
+
+#ifdef RT_HAS_STAT
+    inline file_stamp stamp_of(const std::string& path) {
+        file_stamp stamp;
+        struct stat info;
+        if (stat(path.c_str(), &info) != 0) return stamp;
+        stamp.seconds = (long long)info.st_mtime;
+#ifdef __linux__
+        stamp.nanoseconds = (long long)info.st_mtim.tv_nsec;
+#endif
+        stamp.size = (long long)info.st_size;
+        return stamp;
+    }
+#else
+    /** no file times here: read the file and compare its contents. Scene files are small, meshes are not read */
+    inline file_stamp stamp_of(const std::string& path) {
+        file_stamp stamp;
+        FILE* file = fopen(path.c_str(), "rb");
+        if (!file) return stamp;
+        std::vector<char> buffer(1 << 16);
+        stamp.size = 0;
+        stamp.content_key = 14695981039346656037ull;
+        size_t count;
+        while ((count = fread(buffer.data(), 1, buffer.size(), file)) > 0) {
+            stamp.content_key = scene_file::hash_bytes(stamp.content_key, buffer.data(), count);
+            stamp.size += (long long)count;
+        }
+        fclose(file);
+        return stamp;
+    }
+#endif
+
+    /** everything about the camera that changes the picture, except the number of samples */
+    inline distributed::frame_settings view_of(const camera& cam, const hittable& world) {
+        distributed::frame_settings view = distributed::get_frame_settings(cam, world);
+        view.samples_per_pixel = 0;
+        return view;
+    }
+
+    /** the average of the samples so far, nearest neighbor scaled up to width x height if the pixels are a coarse level */
+    inline void resolve(const std::vector<pixel_accumulator>& pixels, int pixels_width, int pixels_height, int width, int height,
+                        framebuffer& image) {
+        image.resize(width, height);
+        for (int y = 0; y < height; y++) {
+            int source_y = int(int64_t(y) * pixels_height / height);
+            for (int x = 0; x < width; x++) {
+                const pixel_accumulator& pixel = pixels[size_t(source_y) * pixels_width + int(int64_t(x) * pixels_width / width)];
+                color c = pixel.sum;
+                c /= pixel.samples > 0 ? pixel.samples : 1;
+                image.set(x, y, c);
+            }
+        }
+    }
+
+    /**
+     * Run the preview of world through cam until the image has all its samples, or forever with opts.watch.
+     * scene_path is the file to watch, empty for a built-in scene. apply_overrides is called on every camera
+     * read from the file, to put the command line settings back on top. Returns false if the output can't be written.
+     */
+    inline bool run(camera& cam, hittable_list& world, const std::string& scene_path, const options& opts,
+                    const std::function<void(camera&)>& apply_overrides) {
+        typedef std::chrono::steady_clock clock;
+        int width = 0, height = 0;
+        std::vector<pixel_accumulator> pixels;
+        int level = 0, samples_done = 0, pass_samples = 1;
+        distributed::frame_settings view;
+        framebuffer image;
+        clock::time_point restart_time;
+        bool first_frame = true;
+        auto restart = [&] {
+            width = cam.image_width;
+            height = cam.get_image_height();
+            pixels.assign(size_t(width) * height, pixel_accumulator());
+            level = 0;
+            samples_done = 0;
+            pass_samples = 1;
+            view = view_of(cam, world);
+            restart_time = clock::now();
+            first_frame = true;
+        };
+        restart();
+
+        file_stamp stamp = stamp_of(scene_path);
+        uint64_t geometry_key = 0;
+        std::string error;
+        if (!scene_path.empty()) {
+            camera scanned = cam;
+            scene_file::scan_scene(scene_path, scanned, geometry_key, error);
+        }
+        auto last_poll = clock::now();
+        while (true) {
+            bool done = level >= opts.coarse_levels && samples_done >= cam.samples_per_pixel;
+            double since_poll = std::chrono::duration<double>(clock::now() - last_poll).count();
+            if (!scene_path.empty() && (!done || since_poll >= opts.poll_interval) && stamp_of(scene_path) != stamp) {
+                // the scene file was saved: find out what changed
+                stamp = stamp_of(scene_path);
+                camera scanned = cam;
+                uint64_t key = 0;
+                if (!scene_file::scan_scene(scene_path, scanned, key, error)) {
+                    std::clog << "\n" << scene_path << ": " << error << ", keeping the last scene\n";
+                } else if (key != geometry_key) {
+                    hittable_list loaded;
+                    if (scene_file::load_scene(scene_path, loaded, scanned, error)) {
+                        apply_overrides(scanned);
+                        world = loaded;
+                        cam = scanned;
+                        geometry_key = key;
+                        std::clog << "\nScene changed, starting over\n";
+                        restart();
+                    } else {
+                        std::clog << "\n" << scene_path << ": " << error << ", keeping the last scene\n";
+                    }
+                } else {
+                    apply_overrides(scanned);
+                    distributed::frame_settings new_view = view_of(scanned, world);
+                    cam = scanned;
+                    if (memcmp(&new_view, &view, sizeof(view)) != 0) {
+                        std::clog << "\nCamera changed, starting over\n";
+                        restart();
+                    }
+                }
+            }
+            last_poll = clock::now();
+
+            if (level < opts.coarse_levels) {
+                // one sample per pixel at a fraction of the resolution
+                int factor = 1 << (opts.coarse_levels - level);
+                level++;
+                camera coarse = cam;
+                coarse.image_width = std::max(1, width / factor);
+                coarse.samples_per_pixel = 1;
+                int coarse_height = coarse.get_image_height();
+                if (coarse.image_width < 8 || coarse_height < 1) continue;
+                std::vector<pixel_accumulator> coarse_pixels(size_t(coarse.image_width) * coarse_height);
+                coarse.accumulate_pass(world, coarse_pixels, 1);
+                resolve(coarse_pixels, coarse.image_width, coarse_height, width, height, image);
+            } else if (samples_done < cam.samples_per_pixel) {
+                // more samples at the full resolution. Aim for passes of pass_seconds, growing at most 2x at a time
+                int sample_end = std::min(samples_done + pass_samples, cam.samples_per_pixel);
+                auto start = clock::now();
+                cam.accumulate_pass(world, pixels, sample_end);
+                double seconds = std::chrono::duration<double>(clock::now() - start).count();
+                double seconds_per_sample = seconds / (sample_end - samples_done);
+                samples_done = sample_end;
+                pass_samples = std::max(1, std::min(samples_done, int(opts.pass_seconds / std::max(seconds_per_sample, 1e-6))));
+                resolve(pixels, width, height, width, height, image);
+            } else {
+                if (!opts.watch) return true;
+                std::this_thread::sleep_for(std::chrono::duration<double>(opts.poll_interval));
+                continue;
+            }
+
+            if (!publish(image, opts.output)) {
+                std::cerr << "\nCould not write " << opts.output << "\n";
+                return false;
+            }
+            if (first_frame) {
+                double seconds = std::chrono::duration<double>(clock::now() - restart_time).count();
+                std::clog << "First preview after " << 1000 * seconds << " ms\n";
+                first_frame = false;
+            }
+            std::clog << "\rPreview: " << (samples_done > 0 ? samples_done : 1) << " of " << cam.samples_per_pixel
+                      << " samples per pixel" << (samples_done > 0 ? "" : " (coarse)") << "      " << std::flush;
+        }
+    }
+}
+
+#endif
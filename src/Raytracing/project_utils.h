@@ -6,12 +6,27 @@
 #include <limits>
 #include <memory>
 #include <cstdlib>
+#include <cstdint>
 
 // C++ Std Usings
 using std::make_shared;
 using std::shared_ptr;
 using std::sqrt;
 using std::fabs;
+using std::fmin;
+using std::fmax;
+
+/**
+ * The scalar type of all geometry: vectors, rays, ranges, boxes, spheres.
+ * Build with RT_SINGLE_PRECISION defined (the RaytracingFloat target) to use float, which halves the memory
+ * of every vector and BVH node and fits twice as many lanes into a SIMD register.
+ * Settings like the camera's field of view and all random number generation stay double.
+ */
+#ifdef RT_SINGLE_PRECISION
+typedef float real;
+#else
+typedef double real;
+#endif
 
 // Constants
 const double infinity = std::numeric_limits<double>::infinity();
@@ -22,11 +37,68 @@ inline double degrees_to_radians(double degrees) {
     return degrees * pi / 180.0;
 }
 
+/**
+ * PCG32 random number generator (permuted congruential generator, pcg-random.org).
+ * All of its state lives in the object, so every pixel sample can carry its own generator:
+ * no hidden shared state between threads and every pixel can be reproduced on its own.
+ */
+class rng {
+    public:
+        explicit rng(uint64_t seed = 0x853c49e6748fea9bULL, uint64_t stream = 0xda3e39cb94b95bdbULL) {
+            state = 0;
+            increment = (stream << 1u) | 1u; // the increment has to be odd
+            next_uint();
+            state += seed;
+            next_uint();
+        }
+
+        uint32_t next_uint() {
+            uint64_t old_state = state;
+            state = old_state * 6364136223846793005ULL + increment;
+            uint32_t xorshifted = uint32_t(((old_state >> 18u) ^ old_state) >> 27u);
+            uint32_t rotation = uint32_t(old_state >> 59u);
+            return (xorshifted >> rotation) | (xorshifted << ((-rotation) & 31));
+        }
+
+        /** uniform double in [0,1) */
+        double next_double() {
+            return next_uint() * (1.0 / 4294967296.0);
+        }
+
+    private:
+        uint64_t state;
+        uint64_t increment;
+};
+
+/** SplitMix64 finalizer. Scrambles the bits of a key so that neighbouring keys give unrelated seeds */
+inline uint64_t hash_key(uint64_t key) {
+    key += 0x9e3779b97f4a7c15ULL;
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+    return key ^ (key >> 31);
+}
+/** derive a new key from a parent key and an index, e.g. frame seed -> pixel -> sample -> bounce */
+inline uint64_t hash_key(uint64_t parent, uint64_t index) {
+    return hash_key(parent ^ hash_key(index));
+}
+
+inline double random_double(rng& gen) {
+    return gen.next_double();
+}
+inline double random_double(rng& gen, double min, double max) {
+    return min + random_double(gen) * (max-min);
+}
+
+/** Generator for building scenes on the main thread. Rendering never touches it */
+inline rng& scene_rng() {
+    static thread_local rng generator;
+    return generator;
+}
 inline double random_double() {
-    return rand() / (RAND_MAX + 1.0);
+    return random_double(scene_rng());
 }
 inline double random_double(double min, double max) {
-    return min + random_double() * (max-min);
+    return random_double(scene_rng(), min, max);
 }
 
 // Common Headers
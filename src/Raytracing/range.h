@@ -5,22 +5,29 @@
 
 class range {
     public:
-        double min, max;
+        real min, max;
         range() : min(+infinity), max(-infinity) {} // Default interval is empty
-        range(double min, double max) : min(min), max(max) {}
+        range(real min, real max) : min(min), max(max) {}
+        /** the tightest range that encloses both a and b */
+        range(const range& a, const range& b) : min(fmin(a.min, b.min)), max(fmax(a.max, b.max)) {}
         
-        double size() const {
+        real size() const {
             return max - min;
         }
-        bool contains(double x) const {
+        bool contains(real x) const {
             return min <= x && x <= max;
         }
-        bool surrounds(double x) const {
+        bool surrounds(real x) const {
             return min < x && x < max;
         }
+        /** grow the range by delta in total, half on each side */
+        range expand(real delta) const {
+            auto padding = delta/2;
+            return range(min - padding, max + padding);
+        }
         static const range empty, universe;
 
-        double clamp(double x) const {
+        real clamp(real x) const {
             if (x < min) return min;
             if (x > max) return max;
             return x;
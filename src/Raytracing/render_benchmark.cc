@@ -0,0 +1,262 @@
+/**
+ * Render benchmark: renders the built-in scenes with fixed seeds at several resolutions,
+ * sample counts and object counts, and reports rays/sec and friends as JSON.
+ *
+ * `build/RaytracingRenderBenchmark -o results.json` saves the results,
+ * `build/RaytracingRenderBenchmark --compare results.json` renders again and compares against them.
+ * Options: --threads N, --quick (a small subset, for a quick check), --tolerance 0.1 (allowed slowdown),
+ * --repeat 3 (renders per case. The fastest one counts, which filters out most of the noise of a busy machine),
+ * --no-roulette (follow every path to max_depth, to see what Russian roulette saves)
+ */
+#include "project_utils.h"
+#include "hittable_list.h"
+#include "sphere_set.h"
+#include "camera.h"
+#include "scenes.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+
+/** one render of the suite */
+struct benchmark_case {
+    std::string scene;
+    int objects; // requested number of spheres, triangles for the mesh scene, copies for the instance scene. The cover scene always has the same ones
+    int width;
+    int samples_per_pixel;
+    bool quick; // part of the --quick subset
+};
+
+struct benchmark_result {
+    benchmark_case settings;
+    size_t spheres = 0;
+    size_t triangles = 0;
+    int height = 0;
+    int threads = 0;
+    double wall_seconds = 0;
+    double cpu_seconds = 0; // summed over all threads
+    render_stats stats;
+
+    /** cases are matched by this in --compare mode */
+    std::string id() const {
+        return settings.scene + "/" + std::to_string(settings.objects) + "/" + std::to_string(settings.width) + "x" + std::to_string(height)
+               + "/" + std::to_string(settings.samples_per_pixel) + "spp";
+    }
+    double primary_rays_per_second() const { return stats.primary_rays / wall_seconds; }
+    double rays_per_second() const { return stats.rays / wall_seconds; }
+};
+
+static std::vector<benchmark_case> benchmark_cases() {
+    return {
+        // the cover scene at growing resolution and sample count
+        { "cover", 0, 320, 4, true },
+        { "cover", 0, 640, 4, false },
+        { "cover", 0, 640, 16, false },
+        { "cover", 0, 1280, 4, false },
+        // the grid with growing object count at a fixed image size
+        { "grid", 1000, 320, 4, true },
+        { "grid", 1000, 640, 4, false },
+        { "grid", 10000, 640, 4, false },
+        { "grid", 100000, 640, 4, false },
+        // long refraction paths
+        { "glass", 100, 320, 4, true },
+        { "glass", 100, 640, 16, false },
+        { "glass", 1000, 640, 4, false },
+        // triangles: mesh BVH and the watertight triangle test
+        { "mesh", 10000, 320, 4, true },
+        { "mesh", 100000, 640, 4, false },
+        { "mesh", 1000000, 640, 4, false },
+        // copies of one shared prototype: transformed rays, nested instances
+        { "instances", 100, 320, 4, true },
+        { "instances", 10000, 640, 4, false },
+    };
+}
+
+static void build_scene(const benchmark_case& settings, hittable_list& world, camera& cam) {
+    if (settings.scene == "mesh") {
+        mesh_scene(world, cam, settings.objects);
+        return;
+    }
+    if (settings.scene == "instances") {
+        instance_scene(world, cam, settings.objects);
+        return;
+    }
+    auto spheres = make_shared<sphere_set>();
+    if (settings.scene == "grid") sphere_grid_scene(*spheres, cam, settings.objects);
+    else if (settings.scene == "glass") glass_scene(*spheres, cam, settings.objects);
+    else cover_scene(*spheres, cam);
+    world.add(spheres);
+}
+
+static benchmark_result run_case(const benchmark_case& settings, int thread_count, int repeat, bool russian_roulette) {
+    hittable_list world;
+    camera cam;
+    build_scene(settings, world, cam);
+    cam.image_width = settings.width;
+    cam.samples_per_pixel = settings.samples_per_pixel;
+    cam.thread_count = thread_count;
+    cam.seed = 1;
+    cam.russian_roulette = russian_roulette;
+
+    benchmark_result result;
+    result.settings = settings;
+    for (const auto& object : world.objects) {
+        if (auto spheres = dynamic_cast<const sphere_set*>(object.get())) result.spheres += spheres->size();
+        if (auto mesh = dynamic_cast<const triangle_mesh*>(object.get())) result.triangles += mesh->triangle_count();
+    }
+    result.threads = thread_count > 0 ? thread_count : int(std::thread::hardware_concurrency());
+
+    framebuffer image;
+    for (int i = 0; i < repeat; i++) {
+        std::clock_t cpu_start = std::clock(); // process time, so it covers the render threads too
+        auto wall_start = std::chrono::steady_clock::now();
+        cam.render(world, image);
+        double wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+        if (i == 0 || wall_seconds < result.wall_seconds) {
+            result.wall_seconds = wall_seconds;
+            result.cpu_seconds = double(std::clock() - cpu_start) / CLOCKS_PER_SEC;
+        }
+    }
+    result.height = image.height();
+    result.stats = cam.stats();
+    return result;
+}
+
+static void write_json(FILE* out, const std::vector<benchmark_result>& results) {
+    fprintf(out, "{\n  \"benchmark\": \"render\",\n  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const benchmark_result& r = results[i];
+        fprintf(out, "    {\"id\": \"%s\", \"scene\": \"%s\", \"spheres\": %zu, \"triangles\": %zu, \"width\": %d, \"height\": %d, \"spp\": %d, \"threads\": %d,\n",
+                r.id().c_str(), r.settings.scene.c_str(), r.spheres, r.triangles, r.settings.width, r.height, r.settings.samples_per_pixel, r.threads);
+        fprintf(out, "     \"wall_seconds\": %.6f, \"cpu_seconds\": %.6f, \"primary_rays\": %llu, \"total_rays\": %llu,\n",
+                r.wall_seconds, r.cpu_seconds, (unsigned long long)r.stats.primary_rays, (unsigned long long)r.stats.rays);
+        fprintf(out, "     \"primary_rays_per_second\": %.1f, \"total_rays_per_second\": %.1f, \"intersection_tests_per_ray\": %.4f, \"average_path_depth\": %.4f}%s\n",
+                r.primary_rays_per_second(), r.rays_per_second(), r.stats.tests_per_ray(), r.stats.average_path_depth(),
+                i + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+/**
+ * Reads back what write_json wrote: the flat objects of the "results" array, as key -> value text.
+ * Not a general JSON parser, it only needs to understand our own files.
+ */
+static std::vector<std::map<std::string, std::string>> read_results(const std::string& text) {
+    std::vector<std::map<std::string, std::string>> results;
+    size_t pos = text.find("\"results\"");
+    while (pos != std::string::npos && (pos = text.find('{', pos)) != std::string::npos) {
+        size_t end = text.find('}', pos);
+        if (end == std::string::npos) break;
+        std::map<std::string, std::string> values;
+        size_t p = pos + 1;
+        while (true) {
+            size_t key_start = text.find('"', p);
+            if (key_start == std::string::npos || key_start > end) break;
+            size_t key_end = text.find('"', key_start + 1);
+            size_t colon = text.find(':', key_end);
+            size_t value_start = text.find_first_not_of(" \t\r\n", colon + 1);
+            size_t value_end;
+            std::string value;
+            if (text[value_start] == '"') {
+                value_end = text.find('"', value_start + 1);
+                value = text.substr(value_start + 1, value_end - value_start - 1);
+                value_end++;
+            } else {
+                value_end = text.find_first_of(",}", value_start);
+                value = text.substr(value_start, value_end - value_start);
+            }
+            values[text.substr(key_start + 1, key_end - key_start - 1)] = value;
+            p = value_end;
+        }
+        results.push_back(values);
+        pos = end + 1;
+    }
+    return results;
+}
+
+/** print how every case changed against the baseline. Returns false if any case got slower than tolerance allows */
+static bool compare(const std::vector<benchmark_result>& results, const std::string& baseline_path, double tolerance) {
+    FILE* in = fopen(baseline_path.c_str(), "rb");
+    if (!in) {
+        fprintf(stderr, "Could not read %s\n", baseline_path.c_str());
+        return false;
+    }
+    std::string text;
+    char buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0) text.append(buffer, n);
+    fclose(in);
+
+    std::map<std::string, std::map<std::string, std::string>> baseline;
+    for (const auto& values : read_results(text)) {
+        auto id = values.find("id");
+        if (id != values.end()) baseline[id->second] = values;
+    }
+
+    bool ok = true;
+    fprintf(stderr, "\n%-32s %14s %14s %9s %16s\n", "case", "baseline [r/s]", "now [r/s]", "change", "tests/ray change");
+    for (const benchmark_result& r : results) {
+        auto found = baseline.find(r.id());
+        if (found == baseline.end()) {
+            fprintf(stderr, "%-32s %14s\n", r.id().c_str(), "not in baseline");
+            continue;
+        }
+        double before = atof(found->second["total_rays_per_second"].c_str());
+        double tests_before = atof(found->second["intersection_tests_per_ray"].c_str());
+        double change = before > 0 ? r.rays_per_second() / before - 1 : 0;
+        double tests_change = tests_before > 0 ? r.stats.tests_per_ray() / tests_before - 1 : 0;
+        bool slower = change < -tolerance;
+        ok = ok && !slower;
+        fprintf(stderr, "%-32s %14.0f %14.0f %+8.1f%% %+15.1f%%%s\n", r.id().c_str(), before, r.rays_per_second(),
+                100 * change, 100 * tests_change, slower ? "  REGRESSION" : "");
+    }
+    return ok;
+}
+
+int main(int argc, char* argv[]) {
+    int thread_count = 0, repeat = 3;
+    bool quick = false, russian_roulette = true;
+    std::string output_path, baseline_path;
+    double tolerance = 0.1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) thread_count = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--quick") == 0) quick = true;
+        else if (strcmp(argv[i], "--no-roulette") == 0) russian_roulette = false;
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) output_path = argv[++i];
+        else if (strcmp(argv[i], "--compare") == 0 && i + 1 < argc) baseline_path = argv[++i];
+        else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) repeat = std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) tolerance = atof(argv[++i]);
+    }
+
+    // the camera's progress output would drown the table
+    std::streambuf* clog_buffer = std::clog.rdbuf(nullptr);
+    fprintf(stderr, "%-32s %8s %10s %10s %14s %14s %10s %8s\n", "case", "objects", "wall [s]", "cpu [s]",
+            "primary [r/s]", "total [r/s]", "tests/ray", "depth");
+    std::vector<benchmark_result> results;
+    for (const benchmark_case& settings : benchmark_cases()) {
+        if (quick && !settings.quick) continue;
+        benchmark_result r = run_case(settings, thread_count, repeat, russian_roulette);
+        fprintf(stderr, "%-32s %8zu %10.3f %10.3f %14.0f %14.0f %10.2f %8.3f\n", r.id().c_str(), r.spheres + r.triangles, r.wall_seconds,
+                r.cpu_seconds, r.primary_rays_per_second(), r.rays_per_second(), r.stats.tests_per_ray(), r.stats.average_path_depth());
+        results.push_back(r);
+    }
+    std::clog.rdbuf(clog_buffer);
+
+    if (output_path.empty() && baseline_path.empty()) {
+        write_json(stdout, results);
+    } else if (!output_path.empty()) {
+        FILE* out = fopen(output_path.c_str(), "w");
+        if (!out) {
+            fprintf(stderr, "Could not write %s\n", output_path.c_str());
+            return 1;
+        }
+        write_json(out, results);
+        fclose(out);
+    }
+    if (!baseline_path.empty() && !compare(results, baseline_path, tolerance)) return 1;
+    return 0;
+}
@@ -0,0 +1,45 @@
+#ifndef RENDER_STATS_H
+#define RENDER_STATS_H
+
+#include <cstdint>
+
+/**
+ * Counters of the work a render does. Every thread counts into its own thread_stats(),
+ * so counting costs a plain increment and no atomic or lock.
+ * camera::render adds up what its tiles counted, see camera::stats().
+ */
+struct render_stats {
+    uint64_t primary_rays = 0; // camera rays, one per pixel sample
+    uint64_t rays = 0; // every ray traced into the scene: camera rays plus one per bounce
+    uint64_t intersection_tests = 0; // ray-primitive tests. Box tests of the BVH are not counted
+    uint64_t shadow_rays = 0; // towards light samples, see lights.h. Not in rays
+
+    render_stats& operator+=(const render_stats& other) {
+        primary_rays += other.primary_rays;
+        rays += other.rays;
+        intersection_tests += other.intersection_tests;
+        shadow_rays += other.shadow_rays;
+        return *this;
+    }
+
+    render_stats operator-(const render_stats& other) const {
+        render_stats difference;
+        difference.primary_rays = primary_rays - other.primary_rays;
+        difference.rays = rays - other.rays;
+        difference.intersection_tests = intersection_tests - other.intersection_tests;
+        difference.shadow_rays = shadow_rays - other.shadow_rays;
+        return difference;
+    }
+
+    /** segments per path: the camera ray plus every bounce */
+    double average_path_depth() const { return primary_rays ? double(rays) / primary_rays : 0; }
+    double tests_per_ray() const { return rays ? double(intersection_tests) / rays : 0; }
+};
+
+/** the counters of the calling thread. They only ever grow, take the difference of two snapshots */
+inline render_stats& thread_stats() {
+    static thread_local render_stats stats;
+    return stats;
+}
+
+#endif
@@ -0,0 +1,265 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "project_utils.h"
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+/**
+ * Where the numbers of a pixel sample come from: its position in the pixel, its point on the lens and
+ * the directions of its bounces. Independent random numbers leave gaps and clumps, so the error falls
+ * like 1 / sqrt(samples). Spreading the samples of a pixel evenly over every dimension makes it fall faster.
+ */
+enum class sampler_type {
+    independent, // every number from the sample's own generator
+    stratified,  // one jittered point per cell of a grid, the cells shuffled per pixel and dimension
+    sobol,       // Owen-scrambled Sobol points, scrambled per pixel and dimension
+    blue_noise   // one Owen-scrambled Sobol sequence for all pixels, shifted per pixel by a blue noise mask
+};
+
+/** two uniform numbers in [0, 1): one 2D dimension of a sample */
+struct sample_2d {
+    double u1, u2;
+};
+
+namespace sampling {
+    inline uint32_t reverse_bits(uint32_t x) {
+        x = (x << 16) | (x >> 16);
+        x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+        x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+        x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+        x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+        return x;
+    }
+
+    /**
+     * MATH: Owen scrambling flips every digit of a point depending on the digits above it, which keeps the strata of the
+     * Sobol points and randomizes everything else. Hashing does it in a few instructions (Burley, "Practical Hash-based
+     * Owen Scrambling", JCGT 2020): the Laine-Karras permutation only lets lower bits depend on higher ones, so run on
+     * the reversed bits it is an Owen scramble with the first digit at the top
+     */
+    inline uint32_t owen_scramble(uint32_t x, uint32_t seed) {
+        x = reverse_bits(x);
+        x += seed;
+        x ^= x * 0x6c50b47cu;
+        x ^= x * 0xb82f1e52u;
+        x ^= x * 0xc7afe638u;
+        x ^= x * 0x8d22f6e6u;
+        return reverse_bits(x);
+    }
+
+    /**
+     * The first two dimensions of the Sobol sequence, a (0,2)-sequence: the first 2^k points have one point in every
+     * cell of every 2^a x 2^b grid with a + b = k. Bits count from the top, 1 << 31 is 1/2
+     */
+    inline uint32_t sobol_first(uint32_t index) { return reverse_bits(index); }
+
+    inline uint32_t sobol_second(uint32_t index) {
+        uint32_t result = 0;
+        for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+            if (index & 1) result ^= v;
+        }
+        return result;
+    }
+
+    inline double to_unit(uint32_t x) { return x * (1.0 / 4294967296.0); }
+
+    /** point index of a 2D Owen-scrambled Sobol sequence. The index is shuffled too, so the dimensions don't line up */
+    inline sample_2d sobol_2d(uint32_t index, uint64_t key) {
+        uint32_t shuffled = owen_scramble(index, uint32_t(hash_key(key, 0)));
+        return { to_unit(owen_scramble(sobol_first(shuffled), uint32_t(hash_key(key, 1)))),
+                 to_unit(owen_scramble(sobol_second(shuffled), uint32_t(hash_key(key, 2)))) };
+    }
+
+    /**
+     * A random permutation of 0..length-1 as a function: where index goes under the permutation picked by seed.
+     * Kensler, "Correlated Multi-Jittered Sampling" (2013): a hash that is invertible on the next power of two,
+     * applied again while the result is out of range
+     */
+    inline uint32_t permute(uint32_t index, uint32_t length, uint32_t seed) {
+        uint32_t w = length - 1;
+        w |= w >> 1;
+        w |= w >> 2;
+        w |= w >> 4;
+        w |= w >> 8;
+        w |= w >> 16;
+        do {
+            index ^= seed; index *= 0xe170893d; index ^= seed >> 16;
+            index ^= (index & w) >> 4; index ^= seed >> 8; index *= 0x0929eb3f; index ^= seed >> 23;
+            index ^= (index & w) >> 1; index *= 1 | seed >> 27; index *= 0x6935fa69; index ^= (index & w) >> 11;
+            index *= 0x74dcb303; index ^= (index & w) >> 2; index *= 0x9e501cc3; index ^= (index & w) >> 2;
+            index *= 0xc860a3df; index &= w; index ^= index >> 5;
+        } while (index >= length);
+        return (index + seed) % length;
+    }
+
+    /** cell index of a grid of about count cells, jittered within the cell */
+    inline sample_2d stratified_2d(uint32_t index, uint32_t count, uint64_t key) {
+        uint32_t columns = uint32_t(ceil(sqrt(double(count))));
+        uint32_t rows = (count + columns - 1) / columns;
+        uint32_t cell = permute(index % (columns * rows), columns * rows, uint32_t(hash_key(key, 0)));
+        uint64_t jitter = hash_key(key, uint64_t(index) + 1);
+        return { (cell % columns + to_unit(uint32_t(jitter))) / columns, (cell / columns + to_unit(uint32_t(jitter >> 32))) / rows };
+    }
+
+    const int blue_noise_size = 64;
+
+    /**
+     * A 64x64 blue noise mask: the values 0..1 in a toroidal image where every range of values is spread out evenly
+     * without a visible pattern. Made once, by Ulichney's void-and-cluster method ("The void-and-cluster method for
+     * dither array generation", 1993): points are ranked by adding them where they are furthest from all others
+     * (the largest void) and removing them where they are closest (the tightest cluster), measured with a Gaussian
+     */
+    inline const std::vector<float>& blue_noise_mask() {
+        static const std::vector<float> mask = [] {
+            const int n = blue_noise_size, pixel_count = n * n;
+            const double sigma = 1.5;
+            std::vector<double> kernel(pixel_count); // the Gaussian by toroidal offset
+            for (int dy = 0; dy < n; dy++) {
+                for (int dx = 0; dx < n; dx++) {
+                    int x = dx < n / 2 ? dx : dx - n, y = dy < n / 2 ? dy : dy - n;
+                    kernel[dy * n + dx] = exp(-(x * x + y * y) / (2 * sigma * sigma));
+                }
+            }
+            std::vector<char> on(pixel_count, 0);
+            std::vector<double> energy(pixel_count, 0.0); // sum of the Gaussians of all points that are on
+            auto toggle = [&](int p, bool value) {
+                on[p] = value;
+                double sign = value ? 1 : -1;
+                int px = p % n, py = p / n;
+                for (int q = 0; q < pixel_count; q++) {
+                    int dx = (q % n - px + n) % n, dy = (q / n - py + n) % n;
+                    energy[q] += sign * kernel[dy * n + dx];
+                }
+            };
+            auto tightest_cluster = [&] {
+                int best = -1;
+                for (int p = 0; p < pixel_count; p++) if (on[p] && (best < 0 || energy[p] > energy[best])) best = p;
+                return best;
+            };
+            auto largest_void = [&] {
+                int best = -1;
+                for (int p = 0; p < pixel_count; p++) if (!on[p] && (best < 0 || energy[p] < energy[best])) best = p;
+                return best;
+            };
+
+            // a random tenth of the pixels, then moved from clusters to voids until that changes nothing
+            rng gen(0x5eed);
+            int initial_count = pixel_count / 10;
+            for (int placed = 0; placed < initial_count; ) {
+                int p = int(random_double(gen) * pixel_count) % pixel_count;
+                if (!on[p]) {
+                    toggle(p, true);
+                    placed++;
+                }
+            }
+            for (int step = 0; step < pixel_count; step++) {
+                int cluster = tightest_cluster();
+                toggle(cluster, false);
+                int gap = largest_void();
+                toggle(gap, true);
+                if (gap == cluster) break;
+            }
+            std::vector<char> initial = on;
+            std::vector<double> initial_energy = energy;
+
+            std::vector<int> rank(pixel_count);
+            for (int r = initial_count - 1; r >= 0; r--) {
+                int cluster = tightest_cluster();
+                toggle(cluster, false);
+                rank[cluster] = r;
+            }
+            on = initial;
+            energy = initial_energy;
+            for (int r = initial_count; r < pixel_count; r++) {
+                int gap = largest_void();
+                toggle(gap, true);
+                rank[gap] = r;
+            }
+            std::vector<float> values(pixel_count);
+            for (int p = 0; p < pixel_count; p++) values[p] = float((rank[p] + 0.5) / pixel_count);
+            return values;
+        }();
+        return mask;
+    }
+
+    /**
+     * MATH: a Cranley-Patterson rotation: the same points for every pixel, shifted (mod 1) by the pixel's blue noise value.
+     * Georgiev and Fajardo, "Blue-noise Dithered Sampling" (2016): neighbouring pixels get very different shifts, so their
+     * errors differ too, and what noise is left is fine grained instead of blotchy. Every dimension reads the mask
+     * at another offset
+     */
+    inline sample_2d blue_noise_2d(uint32_t index, int x, int y, uint64_t frame_key) {
+        sample_2d point = sobol_2d(index, frame_key);
+        uint64_t offsets = hash_key(frame_key, 3);
+        const std::vector<float>& mask = blue_noise_mask();
+        const int n = blue_noise_size;
+        double shift1 = mask[((y + int(offsets & 63)) % n) * n + (x + int((offsets >> 6) & 63)) % n];
+        double shift2 = mask[((y + int((offsets >> 12) & 63)) % n) * n + (x + int((offsets >> 18) & 63)) % n];
+        point.u1 += shift1;
+        point.u2 += shift2;
+        if (point.u1 >= 1) point.u1 -= 1;
+        if (point.u2 >= 1) point.u2 -= 1;
+        return point;
+    }
+
+    /** the sampler_type named on the command line. False for names it doesn't know */
+    inline bool parse_sampler_type(const char* name, sampler_type& type) {
+        if (strcmp(name, "independent") == 0) type = sampler_type::independent;
+        else if (strcmp(name, "stratified") == 0) type = sampler_type::stratified;
+        else if (strcmp(name, "sobol") == 0) type = sampler_type::sobol;
+        else if (strcmp(name, "blue-noise") == 0) type = sampler_type::blue_noise;
+        else return false;
+        return true;
+    }
+}
+
+/**
+ * The numbers of one pixel sample, as 2D dimensions: pixel_dimension places the sample in its pixel, lens_dimension
+ * on the lens, bounce_dimension(b) picks the direction of bounce b and light_dimension(b) the point on a light
+ * its shadow ray goes to (see lights.h). Every pixel and every dimension gets
+ * its own scramble (stratified, sobol) or mask offset (blue_noise), so nothing lines up across them.
+ * Past max_dimensions, and always for the independent sampler, the numbers come from the sample's generator instead,
+ * in the order the generator would have given them anyway. A small value type, the wavefront integrator keeps one per path.
+ */
+class sample_sequence {
+    public:
+        static const int pixel_dimension = 0, lens_dimension = 1, first_bounce_dimension = 2;
+        static const int bounce_count = 8; // bounces with dimensions of their own. Deeper bounces add little to the image
+        static const int first_light_dimension = first_bounce_dimension + bounce_count;
+        static const int max_dimensions = first_light_dimension + bounce_count;
+
+        static int bounce_dimension(int bounce) { return bounce < bounce_count ? first_bounce_dimension + bounce : max_dimensions; }
+        static int light_dimension(int bounce) { return bounce < bounce_count ? first_light_dimension + bounce : max_dimensions; }
+
+        sample_sequence() {}
+
+        /**
+         * Sample index of sample_count samples of the pixel (x, y). pixel_key seeds the scrambles of the pixel,
+         * frame_key the sequence that blue_noise shares among all pixels
+         */
+        sample_sequence(sampler_type type, uint64_t pixel_key, uint64_t frame_key, int x, int y, int index, int sample_count)
+            : pixel_key(pixel_key), frame_key(frame_key), index(uint32_t(index)), count(uint32_t(sample_count > 0 ? sample_count : 1)),
+              x(x), y(y), type(type) {}
+
+        sample_2d get_2d(int dimension, rng& gen) const {
+            if (type == sampler_type::independent || dimension >= max_dimensions) {
+                double u1 = random_double(gen);
+                return { u1, random_double(gen) };
+            }
+            switch (type) {
+                case sampler_type::stratified: return sampling::stratified_2d(index, count, hash_key(pixel_key, uint64_t(dimension)));
+                case sampler_type::sobol: return sampling::sobol_2d(index, hash_key(pixel_key, uint64_t(dimension)));
+                default: return sampling::blue_noise_2d(index, x, y, hash_key(frame_key, uint64_t(dimension)));
+            }
+        }
+
+    private:
+        uint64_t pixel_key = 0, frame_key = 0;
+        uint32_t index = 0, count = 1;
+        int32_t x = 0, y = 0;
+        sampler_type type = sampler_type::independent;
+};
+
+#endif
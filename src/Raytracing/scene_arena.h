@@ -0,0 +1,196 @@
+#ifndef SCENE_ARENA_H
+#define SCENE_ARENA_H
+
+#include "project_utils.h"
+#include <cstddef>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define RT_HAS_MMAP 1
+#include <sys/mman.h>
+#endif
+
+/**
+ * Memory for the objects of a scene: spheres, materials, instances, whatever a scene builder creates one by one.
+ *
+ * make_shared puts every object (with its reference count) into an allocation of its own, wherever the heap has room.
+ * Built in a loop that also makes a material per sphere, the spheres end up interleaved with materials
+ * and control blocks, and a ray walking a BVH leaf jumps between far apart cache lines.
+ * The arena keeps one pool per type and places the objects of a type next to each other in big blocks,
+ * in the order they are made. Nothing is freed on its own: the arena goes away as a whole.
+ * Where there is mmap, all blocks are cut from one range of address space reserved up front (pages only take memory
+ * once they are touched), so that is a single munmap. Elsewhere, or when the range is used up, it is one free per block.
+ *
+ * make() hands out a shared_ptr like make_shared, so code that builds a hittable_list doesn't change:
+ *     auto arena = make_shared<scene_arena>();
+ *     world.add(arena->make<sphere>(center, 0.2, arena->make<lambertian>(albedo)));
+ * The pointers share the arena's reference count instead of having their own (the aliasing constructor of shared_ptr),
+ * so the arena lives until the last object of it is let go. Not thread safe: build a scene on one thread.
+ *
+ * NOTE: an arena object must not hold a make() pointer to another object of the same arena: the arena would own
+ * a reference to itself and never be freed. Inside the arena, refer to objects by the raw pointer create() returns,
+ * or by borrow(), a shared_ptr that doesn't own anything.
+ *     auto mesh = arena->make<triangle_mesh>(...);           // held by the world, keeps the arena alive
+ *     world.add(arena->make<instance>(scene_arena::borrow(mesh.get()), transform));
+ */
+class scene_arena : public std::enable_shared_from_this<scene_arena> {
+    public:
+        explicit scene_arena(size_t first_block_bytes = 64 * 1024) : first_block_bytes(first_block_bytes) {
+#ifdef RT_HAS_MMAP
+            if (sizeof(void*) >= 8) {
+                void* reserved = mmap(nullptr, reserve_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+                if (reserved != MAP_FAILED) region = static_cast<char*>(reserved);
+            }
+#endif
+        }
+
+        scene_arena(const scene_arena&) = delete;
+        scene_arena& operator=(const scene_arena&) = delete;
+
+        ~scene_arena() {
+            for (pool& p : pools) {
+                if (p.destroy) {
+                    for (block& b : p.blocks) {
+                        for (size_t offset = 0; offset < b.used; offset += p.object_size) p.destroy(b.bytes + offset);
+                    }
+                }
+                for (block& b : p.blocks) {
+                    if (!in_region(b.bytes)) std::free(b.bytes);
+                }
+            }
+#ifdef RT_HAS_MMAP
+            if (region) munmap(region, reserve_bytes);
+#endif
+        }
+
+        /**
+         * A shared_ptr to an arena object that doesn't keep anything alive, for objects inside the arena that point at
+         * each other (see the NOTE above). Only valid while the arena is.
+         */
+        template <typename T>
+        static shared_ptr<T> borrow(T* object) {
+            return shared_ptr<T>(shared_ptr<T>(), object);
+        }
+
+        /** construct a T in the pool of its type. Lives as long as the arena */
+        template <typename T, typename... Args>
+        T* create(Args&&... args) {
+            pool& p = pool_of<T>();
+            make_room(p, 1);
+            block& b = p.blocks.back();
+            T* object = new (b.bytes + b.used) T(std::forward<Args>(args)...);
+            b.used += p.object_size; // only now, a constructor that throws leaves nothing to destroy
+            return object;
+        }
+
+        /** make room for count more objects of type T in one block, e.g. when a loader knows how many are coming */
+        template <typename T>
+        void reserve(size_t count) {
+            make_room(pool_of<T>(), count);
+        }
+
+        /** create() as a shared_ptr that keeps the arena alive. The arena itself has to be owned by a shared_ptr */
+        template <typename T, typename... Args>
+        shared_ptr<T> make(Args&&... args) {
+            T* object = create<T>(std::forward<Args>(args)...);
+            return shared_ptr<T>(shared_from_this(), object);
+        }
+
+        /** bytes taken by the blocks of all pools */
+        size_t reserved_bytes() const {
+            size_t bytes = 0;
+            for (const pool& p : pools) {
+                for (const block& b : p.blocks) bytes += b.size;
+            }
+            return bytes;
+        }
+
+        size_t block_count() const {
+            size_t count = 0;
+            for (const pool& p : pools) count += p.blocks.size();
+            return count;
+        }
+
+        /** how many frees (or munmaps) the teardown takes */
+        size_t release_count() const {
+            size_t count = region ? 1 : 0;
+            for (const pool& p : pools) {
+                for (const block& b : p.blocks) count += in_region(b.bytes) ? 0 : 1;
+            }
+            return count;
+        }
+
+    private:
+        struct block {
+            char* bytes;
+            size_t size, used;
+        };
+
+        /** the objects of one type, back to back. Blocks double in size, so a million spheres take about a dozen */
+        struct pool {
+            size_t object_size = 0;
+            void (*destroy)(void*) = nullptr; // null for types without a destructor to call
+            std::vector<block> blocks;
+        };
+
+        static const size_t reserve_bytes = size_t(1) << (sizeof(void*) >= 8 ? 38 : 30); // 256 GiB of address space, not memory. 64-bit only
+        size_t first_block_bytes;
+        std::vector<pool> pools; // indexed by type_index<T>()
+        char* region = nullptr; // the reserved range, null without mmap
+        size_t region_used = 0;
+
+        bool in_region(const char* bytes) const { return region && bytes >= region && bytes < region + reserve_bytes; }
+
+        /** start a new block in p unless its last one has room for count more objects */
+        void make_room(pool& p, size_t count) {
+            if (!p.blocks.empty() && p.blocks.back().used + count * p.object_size <= p.blocks.back().size) return;
+            size_t size = p.blocks.empty() ? first_block_bytes : 2 * p.blocks.back().size;
+            if (size < count * p.object_size) size = count * p.object_size;
+            block b = { nullptr, size, 0 };
+            size_t start = (region_used + alignof(std::max_align_t) - 1) / alignof(std::max_align_t) * alignof(std::max_align_t);
+            if (region && start <= reserve_bytes && size <= reserve_bytes - start) {
+                b.bytes = region + start;
+                region_used = start + size;
+            } else {
+                b.bytes = static_cast<char*>(std::malloc(size));
+                if (!b.bytes) throw std::bad_alloc();
+            }
+            p.blocks.push_back(b);
+        }
+
+        static size_t next_type_index() {
+            static size_t count = 0;
+            return count++;
+        }
+
+        /** a small number per type, so finding the pool is a vector lookup */
+        template <typename T>
+        static size_t type_index() {
+            static const size_t index = next_type_index();
+            return index;
+        }
+
+        template <typename T>
+        static void destroy_object(void* object) { static_cast<T*>(object)->~T(); }
+
+        template <typename T>
+        pool& pool_of() {
+            static_assert(alignof(T) <= alignof(std::max_align_t), "malloc'ed blocks are not aligned enough for this type");
+            size_t index = type_index<T>();
+            if (index >= pools.size()) pools.resize(index + 1);
+            pool& p = pools[index];
+            if (p.object_size == 0) {
+                // the stride keeps every object aligned
+                p.object_size = (sizeof(T) + alignof(T) - 1) / alignof(T) * alignof(T);
+                p.destroy = std::is_trivially_destructible<T>::value ? nullptr : &destroy_object<T>;
+            }
+            return p;
+        }
+};
+
+#endif
@@ -0,0 +1,637 @@
+#ifndef SCENE_FILE_H
+#define SCENE_FILE_H
+
+#include "project_utils.h"
+#include "camera.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "sphere_set.h"
+#include "mapped_file.h"
+#include "triangle_mesh.h"
+#include "mesh_file.h"
+#include "instance.h"
+#include "scene_arena.h"
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+ * Scene files, so a shot can change without recompiling.
+ *
+ * Text format (.rts), one statement per line, # starts a comment:
+ *     camera image_width 1200                  any public camera field, vectors as three numbers
+ *     camera position 13 2 3
+ *     material ground lambertian 0.5 0.5 0.5   material <name> lambertian <r g b>
+ *     material shiny metal 0.7 0.6 0.5 0.0     material <name> metal <r g b> <fuzz>
+ *     material glass dielectric 1.5            material <name> dielectric <refractive index>
+ *     material lamp emissive 10 9 8            material <name> emissive <r g b>: emitted radiance, see lights.h
+ *     sphere 0 -1000 0 1000 ground             sphere <x y z> <radius> <material name>
+ *     mesh bunny.obj shiny                     mesh <OBJ or PLY file> <material name> [transforms], see mesh_file.h.
+ *                                              Relative paths start at the directory of the scene file
+ *     mesh bunny.obj red scale 2 rotate_y 90 translate 4 0 1
+ *                                              transforms apply left to right: translate <x y z>, scale <s> or <x y z>,
+ *                                              rotate_x/rotate_y/rotate_z <degrees>. Every file is loaded once,
+ *                                              more lines with it add instances that share its triangles
+ *
+ * Binary format (.rtb), spheres only: a header, the camera, the material records, the sphere arrays and the BVH nodes,
+ * laid out exactly like sphere_set keeps them in memory. Loading maps the file and copies the arrays over,
+ * no parsing and no BVH build. Both loaders merge materials with identical parameters.
+ * The arrays are in BVH order; since version 2 the file also stores the order the spheres were added in
+ * (sphere_set::added_indices), so sphere numbers (the animation's move statements) mean the same in both formats.
+ * Text files are written in that order too.
+ * A file written by a build with the other scalar type (float vs double, see real) still loads:
+ * its arrays get converted and the BVH is built again.
+ */
+namespace scene_file {
+
+    /** the camera fields a scene file sets */
+    struct camera_block {
+        double aspect_ratio, vertical_fov, max_depth, defocus_angle, focus_dist;
+        double position[3], viewport_position[3], up[3];
+        int32_t image_width, samples_per_pixel;
+        uint64_t seed;
+    };
+
+    struct material_block {
+        uint32_t type;
+        uint32_t reserved;
+        double albedo[3];
+        double fuzz;
+        double refractive_index;
+    };
+
+    struct header {
+        char magic[8];
+        uint32_t version;
+        uint32_t material_count;
+        uint64_t sphere_count;
+        uint64_t node_count; // 0 if the spheres were saved without a BVH
+        uint32_t node_size; // sizeof(bvh_node) of the program that wrote the file
+        uint32_t scalar_size; // sizeof(real) of the program that wrote the file. 0 in older files, which were all double
+        camera_block cam;
+    };
+
+    static const char binary_magic[8] = { 'R', 'T', 'S', 'C', 'E', 'N', 'E', 0 };
+    static const uint32_t binary_version = 2; // 2: added_indices after the material slots
+
+    inline size_t align8(size_t size) { return (size + 7) & ~size_t(7); }
+
+    /** move offset past an array of count elements of size bytes. False if the array would end past limit */
+    inline bool add_array(size_t& offset, uint64_t count, size_t size, size_t limit) {
+        if (offset > limit) return false;
+        if (size > 0 && count > (limit - offset) / size) return false;
+        offset += size_t(count) * size;
+        return true;
+    }
+
+    inline camera_block to_block(const camera& cam) {
+        camera_block block;
+        block.aspect_ratio = cam.aspect_ratio;
+        block.vertical_fov = cam.vertical_fov;
+        block.max_depth = cam.max_depth;
+        block.defocus_angle = cam.defocus_angle;
+        block.focus_dist = cam.focus_dist;
+        for (int i = 0; i < 3; i++) {
+            block.position[i] = cam.position[i];
+            block.viewport_position[i] = cam.viewport_position[i];
+            block.up[i] = cam.up[i];
+        }
+        block.image_width = cam.image_width;
+        block.samples_per_pixel = cam.samples_per_pixel;
+        block.seed = cam.seed;
+        return block;
+    }
+
+    /** image_width, samples_per_pixel and max_depth: whole numbers from 1 up */
+    inline bool valid_count(double value) { return value >= 1 && value <= INT_MAX && value == floor(value); }
+
+    /** false, with the field in error, if the block has a count below 1 */
+    inline bool from_block(const camera_block& block, camera& cam, std::string& error) {
+        const char* bad = block.image_width < 1 ? "image_width" : block.samples_per_pixel < 1 ? "samples_per_pixel"
+                        : !valid_count(block.max_depth) ? "max_depth" : nullptr;
+        if (bad) {
+            error = std::string("the camera's ") + bad + " must be a whole number from 1 to " + std::to_string(INT_MAX);
+            return false;
+        }
+        cam.aspect_ratio = block.aspect_ratio;
+        cam.vertical_fov = block.vertical_fov;
+        cam.max_depth = block.max_depth;
+        cam.defocus_angle = block.defocus_angle;
+        cam.focus_dist = block.focus_dist;
+        cam.position = point3(block.position[0], block.position[1], block.position[2]);
+        cam.viewport_position = point3(block.viewport_position[0], block.viewport_position[1], block.viewport_position[2]);
+        cam.up = vec3(block.up[0], block.up[1], block.up[2]);
+        cam.image_width = block.image_width;
+        cam.samples_per_pixel = block.samples_per_pixel;
+        cam.seed = block.seed;
+        return true;
+    }
+
+    /**
+     * Hands out one material slot per distinct set of parameters,
+     * so a scene with a million identical lambertians stores that material once.
+     */
+    class material_deduplicator {
+        public:
+            explicit material_deduplicator(sphere_set& spheres) : spheres(spheres) {}
+
+            bool slot_for(const material_record& record, uint32_t& slot) {
+                auto found = slots.find(record);
+                if (found != slots.end()) {
+                    slot = found->second;
+                    return true;
+                }
+                auto mat = make_material(record);
+                if (!mat) return false;
+                slot = spheres.add_material(mat);
+                slots[record] = slot;
+                return true;
+            }
+
+        private:
+            sphere_set& spheres;
+            std::map<material_record, uint32_t> slots;
+    };
+
+    template <typename stored_scalar>
+    inline void convert_array(const stored_scalar* stored, std::vector<real>& values) {
+        for (size_t i = 0; i < values.size(); i++) values[i] = real(stored[i]);
+    }
+
+    inline bool load_binary(const mapped_file& file, sphere_set& spheres, camera& cam, std::string& error) {
+        if (file.size() < sizeof(header)) {
+            error = "file too short for a scene header";
+            return false;
+        }
+        header head;
+        memcpy(&head, file.data(), sizeof(head));
+        if (head.version < 1 || head.version > binary_version) {
+            error = "unsupported scene file version " + std::to_string(head.version);
+            return false;
+        }
+        size_t scalar_size = head.scalar_size ? head.scalar_size : sizeof(double);
+        if (scalar_size != sizeof(float) && scalar_size != sizeof(double)) {
+            error = "unsupported scalar size " + std::to_string(scalar_size);
+            return false;
+        }
+        // a BVH from a build with different node or scalar layout can't be used, the spheres get a new one. So do files without one
+        bool use_stored_bvh = head.node_count > 0 && head.sphere_count > 0 && head.node_size == sizeof(bvh_node) && scalar_size == sizeof(real);
+        // every count comes from the file, so each array is checked against the bytes that are left before it is added
+        size_t materials_offset = align8(sizeof(header));
+        size_t spheres_offset = materials_offset;
+        bool fits = add_array(spheres_offset, head.material_count, sizeof(material_block), file.size());
+        size_t slots_offset = spheres_offset;
+        fits = fits && add_array(slots_offset, head.sphere_count, 4 * scalar_size, file.size());
+        size_t added_offset = slots_offset;
+        fits = fits && add_array(added_offset, head.sphere_count, sizeof(uint32_t), file.size());
+        size_t added_end = added_offset;
+        if (head.version >= 2) fits = fits && add_array(added_end, head.sphere_count, sizeof(uint32_t), file.size());
+        size_t nodes_offset = align8(added_end);
+        size_t end = nodes_offset;
+        if (!fits || !add_array(end, head.node_count, head.node_size, file.size())) {
+            error = "scene file is truncated";
+            return false;
+        }
+        size_t n = size_t(head.sphere_count);
+        if (n > UINT32_MAX) {
+            error = "too many spheres in the scene file";
+            return false;
+        }
+        const bvh_node* nodes = reinterpret_cast<const bvh_node*>(file.data() + nodes_offset);
+        if (use_stored_bvh && !valid_bvh(nodes, size_t(head.node_count), n)) {
+            error = "scene file has a broken BVH";
+            return false;
+        }
+        if (!from_block(head.cam, cam, error)) return false;
+
+        // materials with the same parameters end up in the same slot
+        material_deduplicator deduplicator(spheres);
+        std::vector<uint32_t> remap(head.material_count);
+        for (uint32_t i = 0; i < head.material_count; i++) {
+            material_block block;
+            memcpy(&block, file.data() + materials_offset + i * sizeof(material_block), sizeof(block));
+            material_record record;
+            record.type = material_type(block.type);
+            record.albedo = color(block.albedo[0], block.albedo[1], block.albedo[2]);
+            record.fuzz = block.fuzz;
+            record.refractive_index = block.refractive_index;
+            if (!deduplicator.slot_for(record, remap[i])) {
+                error = "unknown material type " + std::to_string(block.type);
+                return false;
+            }
+        }
+
+        const real* arrays = reinterpret_cast<const real*>(file.data() + spheres_offset);
+        std::vector<real> converted;
+        if (scalar_size != sizeof(real)) {
+            converted.resize(4 * n);
+            if (scalar_size == sizeof(double)) convert_array(reinterpret_cast<const double*>(file.data() + spheres_offset), converted);
+            else convert_array(reinterpret_cast<const float*>(file.data() + spheres_offset), converted);
+            arrays = converted.data();
+        }
+        std::vector<uint32_t> slots(n);
+        const uint32_t* stored_slots = reinterpret_cast<const uint32_t*>(file.data() + slots_offset);
+        for (size_t i = 0; i < n; i++) {
+            if (stored_slots[i] >= head.material_count) {
+                error = "sphere " + std::to_string(i) + " refers to a missing material";
+                return false;
+            }
+            slots[i] = remap[stored_slots[i]];
+        }
+        std::vector<uint32_t> added;
+        if (head.version >= 2) {
+            // a permutation of 0..n-1, or sphere numbers would be ambiguous
+            added.resize(n);
+            memcpy(added.data(), file.data() + added_offset, n * sizeof(uint32_t));
+            std::vector<bool> seen(n, false);
+            for (size_t i = 0; i < n; i++) {
+                if (added[i] >= n || seen[added[i]]) {
+                    error = "scene file has a broken sphere order";
+                    return false;
+                }
+                seen[added[i]] = true;
+            }
+        }
+        const uint32_t* added_indices = added.empty() ? nullptr : added.data();
+        if (use_stored_bvh) {
+            spheres.assign(n, arrays, arrays + n, arrays + 2 * n, arrays + 3 * n, slots.data(), nodes, size_t(head.node_count), added_indices);
+        } else {
+            spheres.assign(n, arrays, arrays + n, arrays + 2 * n, arrays + 3 * n, slots.data(), nullptr, 0, added_indices);
+            spheres.build();
+        }
+        return true;
+    }
+
+    /** one line of the text format, split into whitespace separated words */
+    inline int split_words(char* line, char* words[], int max_words) {
+        int count = 0;
+        char* p = line;
+        while (*p && count < max_words) {
+            while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+            if (!*p || *p == '#') break;
+            words[count++] = p;
+            while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') p++;
+            if (*p) *p++ = 0;
+        }
+        return count;
+    }
+
+    inline bool parse_number(const char* word, double& value) {
+        char* end = nullptr;
+        value = strtod(word, &end);
+        return end != word && *end == 0;
+    }
+
+    inline bool parse_numbers(char* words[], int count, double* values) {
+        for (int i = 0; i < count; i++) {
+            if (!parse_number(words[i], values[i])) return false;
+        }
+        return true;
+    }
+
+    /** false if the words don't parse; a count below 1 also says so in error */
+    inline bool set_camera_field(camera& cam, const std::string& field, char* words[], int count, std::string& error) {
+        double v[3];
+        if (!parse_numbers(words, count, v)) return false;
+        if (count == 3) {
+            if (field == "position") cam.position = point3(v[0], v[1], v[2]);
+            else if (field == "viewport_position") cam.viewport_position = point3(v[0], v[1], v[2]);
+            else if (field == "up") cam.up = vec3(v[0], v[1], v[2]);
+            else return false;
+            return true;
+        }
+        if (count != 1) return false;
+        if ((field == "image_width" || field == "samples_per_pixel" || field == "max_depth") && !valid_count(v[0])) {
+            error = field + " must be a whole number from 1 to " + std::to_string(INT_MAX);
+            return false;
+        }
+        if (field == "aspect_ratio") cam.aspect_ratio = v[0];
+        else if (field == "image_width") cam.image_width = int(v[0]);
+        else if (field == "samples_per_pixel") cam.samples_per_pixel = int(v[0]);
+        else if (field == "max_depth") cam.max_depth = int(v[0]);
+        else if (field == "vertical_fov") cam.vertical_fov = v[0];
+        else if (field == "defocus_angle") cam.defocus_angle = v[0];
+        else if (field == "focus_dist") cam.focus_dist = v[0];
+        else if (field == "seed") cam.seed = uint64_t(v[0]);
+        else return false;
+        return true;
+    }
+
+    /** the transform words after a mesh statement, e.g. "scale 2 translate 0 1 0". False if they don't parse */
+    inline bool parse_transform(char* words[], int count, affine_transform& transform) {
+        for (int i = 0; i < count; ) {
+            std::string op = words[i];
+            double v[3];
+            int args = op == "translate" ? 3 : (op == "scale" && i + 3 < count && parse_numbers(words + i + 1, 3, v)) ? 3 : 1;
+            if (i + args >= count || !parse_numbers(words + i + 1, args, v)) return false;
+            affine_transform step;
+            if (op == "translate") step = affine_transform::translate(vec3(v[0], v[1], v[2]));
+            else if (op == "scale") step = affine_transform::scale(args == 3 ? vec3(v[0], v[1], v[2]) : vec3(v[0], v[0], v[0]));
+            else if (op == "rotate_x" || op == "rotate_y" || op == "rotate_z") step = affine_transform::rotate(op[7] - 'x', v[0]);
+            else return false;
+            transform = step * transform;
+            i += 1 + args;
+        }
+        return true;
+    }
+
+    /**
+     * streams the file line by line, nothing but the current line is held in memory.
+     * Meshes and their instances go into objects, relative mesh paths are looked up in directory
+     */
+    inline bool load_text(FILE* in, sphere_set& spheres, std::vector<shared_ptr<hittable>>& objects, camera& cam,
+                          const std::string& directory, std::string& error) {
+        std::map<std::string, shared_ptr<triangle_mesh>> loaded_meshes;
+        auto arena = make_shared<scene_arena>(); // the instances, side by side
+        material_deduplicator deduplicator(spheres);
+        std::map<std::string, uint32_t> named_materials;
+        char line[1024];
+        char* words[32];
+        int line_number = 0;
+        while (fgets(line, sizeof(line), in)) {
+            line_number++;
+            int count = split_words(line, words, 32);
+            if (count == 0) continue;
+            std::string keyword = words[0];
+            bool ok = false;
+            if (keyword == "camera" && count >= 3) {
+                std::string field_error;
+                ok = set_camera_field(cam, words[1], words + 2, count - 2, field_error);
+                if (!field_error.empty()) {
+                    error = "line " + std::to_string(line_number) + ": " + field_error;
+                    return false;
+                }
+            } else if (keyword == "material" && count >= 4) {
+                material_record record;
+                std::string type = words[2];
+                double v[4];
+                if (type == "lambertian" && count == 6 && parse_numbers(words + 3, 3, v)) {
+                    record.type = material_type::lambertian;
+                    record.albedo = color(v[0], v[1], v[2]);
+                    ok = true;
+                } else if (type == "metal" && count == 7 && parse_numbers(words + 3, 4, v)) {
+                    record.type = material_type::metal;
+                    record.albedo = color(v[0], v[1], v[2]);
+                    record.fuzz = v[3] < 1 ? v[3] : 1; // the same clamp as the metal constructor
+                    ok = true;
+                } else if (type == "dielectric" && count == 4 && parse_numbers(words + 3, 1, v)) {
+                    record.type = material_type::dielectric;
+                    record.refractive_index = v[0];
+                    ok = true;
+                } else if (type == "emissive" && count == 6 && parse_numbers(words + 3, 3, v)) {
+                    record.type = material_type::emissive;
+                    record.albedo = color(v[0], v[1], v[2]);
+                    ok = true;
+                }
+                uint32_t slot = 0;
+                ok = ok && deduplicator.slot_for(record, slot);
+                if (ok) named_materials[words[1]] = slot;
+            } else if (keyword == "sphere" && count == 6) {
+                double v[4];
+                auto mat = named_materials.find(words[5]);
+                if (mat == named_materials.end()) {
+                    error = "line " + std::to_string(line_number) + ": unknown material " + words[5];
+                    return false;
+                }
+                ok = parse_numbers(words + 1, 4, v);
+                if (ok) spheres.add(point3(v[0], v[1], v[2]), v[3], mat->second);
+            } else if (keyword == "mesh" && count >= 3) {
+                auto mat = named_materials.find(words[2]);
+                if (mat == named_materials.end()) {
+                    error = "line " + std::to_string(line_number) + ": unknown material " + words[2];
+                    return false;
+                }
+                affine_transform transform;
+                if (!parse_transform(words + 3, count - 3, transform)) {
+                    error = "line " + std::to_string(line_number) + ": cannot parse the transform of the mesh";
+                    return false;
+                }
+                std::string path = words[1];
+                if (path[0] != '/' && !directory.empty()) path = directory + "/" + path;
+                shared_ptr<triangle_mesh>& mesh = loaded_meshes[path];
+                bool first_use = !mesh;
+                if (first_use) {
+                    mesh = make_shared<triangle_mesh>(mat->second);
+                    std::string mesh_error;
+                    if (!mesh_file::load_mesh(path, *mesh, mesh_error)) {
+                        error = "line " + std::to_string(line_number) + ": " + path + ": " + mesh_error;
+                        return false;
+                    }
+                }
+                if (first_use && count == 3) objects.push_back(mesh);
+                else objects.push_back(arena->make<instance>(mesh, transform, mat->second));
+                ok = true;
+            }
+            if (!ok) {
+                error = "line " + std::to_string(line_number) + ": cannot parse '" + keyword + "' statement";
+                return false;
+            }
+        }
+        spheres.build();
+        return true;
+    }
+
+    /**
+     * Load a scene file into world and cam. The format is recognized by its first bytes, not by the extension.
+     * All spheres go into one sphere_set that is added to world first. Meshes and mesh instances follow,
+     * in a bvh of their own if there are several.
+     * The scene gets a fresh scene_materials() table. If loading fails, the table of the previous scene stays.
+     */
+    inline bool load_scene(const std::string& path, hittable_list& world, camera& cam, std::string& error) {
+        material_scope materials;
+        auto spheres = make_shared<sphere_set>();
+        {
+            mapped_file file(path);
+            if (!file.data()) {
+                error = "cannot read " + path;
+                return false;
+            }
+            if (file.size() >= sizeof(binary_magic) && memcmp(file.data(), binary_magic, sizeof(binary_magic)) == 0) {
+                if (!load_binary(file, *spheres, cam, error)) return false;
+                world.add(spheres);
+                materials.keep();
+                return true;
+            }
+        }
+        FILE* in = fopen(path.c_str(), "r");
+        if (!in) {
+            error = "cannot read " + path;
+            return false;
+        }
+        std::vector<shared_ptr<hittable>> objects;
+        size_t slash = path.find_last_of('/');
+        std::string directory = slash == std::string::npos ? "" : path.substr(0, slash);
+        bool ok = load_text(in, *spheres, objects, cam, directory, error);
+        fclose(in);
+        if (!ok) return false;
+        world.add(spheres);
+        if (objects.size() == 1) world.add(objects[0]);
+        else if (objects.size() > 1) world.add(make_shared<bvh>(objects));
+        materials.keep();
+        return true;
+    }
+
+    /** FNV-1a, continued from key */
+    inline uint64_t hash_bytes(uint64_t key, const void* data, size_t size) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; i++) key = (key ^ bytes[i]) * 1099511628211ull;
+        return key;
+    }
+
+    /**
+     * A quick look at a scene file, for the preview: sets the camera fields the file has and returns a key of everything else.
+     * A new camera in the file then doesn't need the geometry loaded again, and a changed key says the geometry did change.
+     * Only the scene file counts, edits to the mesh files it names go unnoticed.
+     */
+    inline bool scan_scene(const std::string& path, camera& cam, uint64_t& geometry_key, std::string& error) {
+        geometry_key = 14695981039346656037ull;
+        mapped_file file(path);
+        if (!file.data()) {
+            error = "cannot read " + path;
+            return false;
+        }
+        if (file.size() >= sizeof(header) && memcmp(file.data(), binary_magic, sizeof(binary_magic)) == 0) {
+            header h;
+            memcpy(&h, file.data(), sizeof(h));
+            if (!from_block(h.cam, cam, error)) return false;
+            geometry_key = hash_bytes(geometry_key, file.data() + sizeof(h), file.size() - sizeof(h));
+            return true;
+        }
+        FILE* in = fopen(path.c_str(), "r");
+        if (!in) {
+            error = "cannot read " + path;
+            return false;
+        }
+        char line[1024];
+        char* words[32];
+        int line_number = 0;
+        bool ok = true;
+        while (ok && fgets(line, sizeof(line), in)) {
+            line_number++;
+            int count = split_words(line, words, 32);
+            if (count == 0) continue;
+            if (strcmp(words[0], "camera") == 0) {
+                std::string field_error;
+                ok = count >= 3 && set_camera_field(cam, words[1], words + 2, count - 2, field_error);
+                if (!ok) error = "line " + std::to_string(line_number) + ": " + (field_error.empty() ? "cannot parse 'camera' statement" : field_error);
+                continue;
+            }
+            for (int i = 0; i < count; i++) geometry_key = hash_bytes(geometry_key, words[i], strlen(words[i]) + 1);
+        }
+        fclose(in);
+        return ok;
+    }
+
+    inline void write_material_line(FILE* out, const std::string& name, const material_record& r) {
+        if (r.type == material_type::lambertian)
+            fprintf(out, "material %s lambertian %.17g %.17g %.17g\n", name.c_str(), r.albedo[0], r.albedo[1], r.albedo[2]);
+        else if (r.type == material_type::metal)
+            fprintf(out, "material %s metal %.17g %.17g %.17g %.17g\n", name.c_str(), r.albedo[0], r.albedo[1], r.albedo[2], r.fuzz);
+        else if (r.type == material_type::dielectric)
+            fprintf(out, "material %s dielectric %.17g\n", name.c_str(), r.refractive_index);
+        else if (r.type == material_type::emissive)
+            fprintf(out, "material %s emissive %.17g %.17g %.17g\n", name.c_str(), r.albedo[0], r.albedo[1], r.albedo[2]);
+    }
+
+    /**
+     * The materials the spheres use, numbered from 0 in order of first use.
+     * scene_materials() may also hold materials only meshes or instances use, which do not belong in the file.
+     */
+    inline void used_materials(const sphere_set& spheres, std::vector<material_record>& records, std::vector<uint32_t>& slots) {
+        std::map<uint32_t, uint32_t> local;
+        slots.resize(spheres.size());
+        for (size_t i = 0; i < spheres.size(); i++) {
+            uint32_t global = spheres.material_slots()[i];
+            auto found = local.find(global);
+            if (found == local.end()) {
+                found = local.insert(std::make_pair(global, uint32_t(records.size()))).first;
+                records.push_back(scene_materials()[global].record());
+            }
+            slots[i] = found->second;
+        }
+    }
+
+    inline bool save_text(FILE* out, const sphere_set& spheres, const camera& cam) {
+        camera_block c = to_block(cam);
+        fprintf(out, "# scene file, see scene_file.h for the format\n");
+        fprintf(out, "camera aspect_ratio %.17g\ncamera image_width %d\ncamera samples_per_pixel %d\n", c.aspect_ratio, c.image_width, c.samples_per_pixel);
+        fprintf(out, "camera max_depth %.17g\ncamera vertical_fov %.17g\n", c.max_depth, c.vertical_fov);
+        fprintf(out, "camera position %.17g %.17g %.17g\n", c.position[0], c.position[1], c.position[2]);
+        fprintf(out, "camera viewport_position %.17g %.17g %.17g\n", c.viewport_position[0], c.viewport_position[1], c.viewport_position[2]);
+        fprintf(out, "camera up %.17g %.17g %.17g\n", c.up[0], c.up[1], c.up[2]);
+        fprintf(out, "camera defocus_angle %.17g\ncamera focus_dist %.17g\ncamera seed %llu\n", c.defocus_angle, c.focus_dist, (unsigned long long)c.seed);
+        std::vector<material_record> materials;
+        std::vector<uint32_t> slots;
+        used_materials(spheres, materials, slots);
+        for (size_t i = 0; i < materials.size(); i++)
+            write_material_line(out, "m" + std::to_string(i), materials[i]);
+        // in the order of add(), so the sphere numbers stay the same
+        std::vector<uint32_t> stored_at(spheres.size());
+        for (size_t i = 0; i < spheres.size(); i++) stored_at[spheres.added_indices()[i]] = uint32_t(i);
+        for (uint32_t i : stored_at) {
+            fprintf(out, "sphere %.17g %.17g %.17g %.17g m%u\n", spheres.centers_x()[i], spheres.centers_y()[i], spheres.centers_z()[i],
+                    spheres.radius_values()[i], slots[i]);
+        }
+        return !ferror(out);
+    }
+
+    inline bool save_binary(FILE* out, const sphere_set& spheres, const camera& cam) {
+        std::vector<material_record> materials;
+        std::vector<uint32_t> slots;
+        used_materials(spheres, materials, slots);
+        const auto& nodes = spheres.bvh_nodes();
+        size_t n = spheres.size();
+
+        header head;
+        memset(&head, 0, sizeof(head));
+        memcpy(head.magic, binary_magic, sizeof(binary_magic));
+        head.version = binary_version;
+        head.material_count = uint32_t(materials.size());
+        head.sphere_count = n;
+        head.node_count = nodes.size();
+        head.node_size = uint32_t(sizeof(bvh_node));
+        head.scalar_size = uint32_t(sizeof(real));
+        head.cam = to_block(cam);
+
+        // build the file in memory and write it in one go, like the image encoders
+        std::vector<uint8_t> file(align8(sizeof(header)));
+        memcpy(file.data(), &head, sizeof(head));
+        auto append = [&file](const void* data, size_t size) {
+            const uint8_t* bytes = static_cast<const uint8_t*>(data);
+            file.insert(file.end(), bytes, bytes + size);
+        };
+        for (const material_record& r : materials) {
+            material_block block;
+            memset(&block, 0, sizeof(block));
+            block.type = uint32_t(r.type);
+            for (int i = 0; i < 3; i++) block.albedo[i] = r.albedo[i];
+            block.fuzz = r.fuzz;
+            block.refractive_index = r.refractive_index;
+            append(&block, sizeof(block));
+        }
+        append(spheres.centers_x().data(), n * sizeof(real));
+        append(spheres.centers_y().data(), n * sizeof(real));
+        append(spheres.centers_z().data(), n * sizeof(real));
+        append(spheres.radius_values().data(), n * sizeof(real));
+        append(slots.data(), n * sizeof(uint32_t));
+        append(spheres.added_indices().data(), n * sizeof(uint32_t));
+        file.resize(align8(file.size()), 0);
+        if (!nodes.empty()) append(nodes.data(), nodes.size() * sizeof(bvh_node));
+        return fwrite(file.data(), 1, file.size(), out) == file.size();
+    }
+
+    /** save spheres and camera. Paths ending in .rtb get the binary format, everything else the text format */
+    inline bool save_scene(const std::string& path, const sphere_set& spheres, const camera& cam) {
+        bool binary = path.size() >= 4 && path.compare(path.size() - 4, 4, ".rtb") == 0;
+        FILE* out = fopen(path.c_str(), binary ? "wb" : "w");
+        if (!out) return false;
+        bool ok = binary ? save_binary(out, spheres, cam) : save_text(out, spheres, cam);
+        return fclose(out) == 0 && ok;
+    }
+}
+
+#endif
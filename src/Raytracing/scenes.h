@@ -0,0 +1,297 @@
+#ifndef SCENES_H
+#define SCENES_H
+
+#include "project_utils.h"
+#include "material.h"
+#include "sphere_set.h"
+#include "triangle_mesh.h"
+#include "instance.h"
+#include "scene_arena.h"
+#include "bvh.h"
+#include "hittable_list.h"
+#include "camera.h"
+#include <algorithm>
+#include <vector>
+
+/**
+ * Built-in scenes. Each one fills a sphere_set (and maybe meshes), builds the BVHs and sets up the camera.
+ * They are seeded, so a scene comes out the same every time, which the render benchmark relies on.
+ */
+
+/** the cover image of the book. Used when no scene file is given */
+inline void cover_scene(sphere_set& spheres, camera& cam) {
+    scene_rng() = rng(); // start from the same seed every time, so the scene is always the same
+    /** all spheres go into one sphere_set, which tests several of them per SIMD instruction */
+    //ground
+    auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    spheres.add(point3(0,-1000,0), 1000, ground_material);
+    // create a bunch of randomized little spheres with different materials
+    for (int a = -11; a < 11; a++) {
+        for (int b = -11; b < 11; b++) {
+            auto choose_mat = random_double();
+            point3 center(a + 0.9*random_double(), 0.2, b + 0.9*random_double());
+            if ((center - point3(4, 0.2, 0)).length() > 0.9) {
+                shared_ptr<material> sphere_material;
+                if (choose_mat < 0.8) {
+                    // diffuse
+                    auto albedo = color::random() * color::random();
+                    sphere_material = make_shared<lambertian>(albedo);
+                    spheres.add(center, 0.2, sphere_material);
+                } else if (choose_mat < 0.95) {
+                    // metal
+                    auto albedo = color::random(0.5, 1);
+                    auto fuzz = random_double(0, 0.5);
+                    sphere_material = make_shared<metal>(albedo, fuzz);
+                    spheres.add(center, 0.2, sphere_material);
+                } else {
+                    // glass
+                    sphere_material = make_shared<dielectric>(1.5);
+                    spheres.add(center, 0.2, sphere_material);
+                }
+            }
+        }
+    }
+    //make the three big spheres
+    auto material1 = make_shared<dielectric>(1.5);
+    spheres.add(point3(0, 1, 0), 1.0, material1);
+    auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
+    spheres.add(point3(-4, 1, 0), 1.0, material2);
+    auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
+    spheres.add(point3(4, 1, 0), 1.0, material3);
+    // sort the spheres into a BVH, so rays only test the spheres whose boxes they pass through
+    spheres.build();
+
+    /** Camera settings */
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width = 1200;
+    cam.samples_per_pixel = 50;
+    cam.max_depth = 50;
+    cam.vertical_fov = 20;
+    cam.position = point3(13,2,3);
+    cam.viewport_position = point3(0,0,0);
+    cam.up = vec3(0,1,0);
+    cam.defocus_angle = 0.6;
+    cam.focus_dist = 10.0;
+}
+
+/**
+ * A square field of sphere_count small spheres on a ground plane, seen at a low angle.
+ * Lots of geometry that is close together: tests the BVH more than the materials.
+ */
+inline void sphere_grid_scene(sphere_set& spheres, camera& cam, int sphere_count) {
+    rng gen = rng(2);
+    spheres.add(point3(0,-1000,0), 1000, make_shared<lambertian>(color(0.5, 0.5, 0.5)));
+    int side = int(ceil(sqrt(double(sphere_count))));
+    double spacing = 1.0;
+    double half = 0.5 * side * spacing;
+    for (int i = 0; i < sphere_count; i++) {
+        point3 center(-half + (i % side + 0.5) * spacing, 0.4, -half + (i / side + 0.5) * spacing);
+        if (random_double(gen) < 0.7) {
+            spheres.add(center, 0.4, make_shared<lambertian>(color::random(gen) * color::random(gen)));
+        } else {
+            spheres.add(center, 0.4, make_shared<metal>(color::random(gen, 0.5, 1), random_double(gen, 0, 0.3)));
+        }
+    }
+    spheres.build();
+
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width = 400;
+    cam.samples_per_pixel = 16;
+    cam.max_depth = 50;
+    cam.vertical_fov = 40;
+    cam.position = point3(0, 0.25 * half + 3, half + 4);
+    cam.viewport_position = point3(0, 0, 0);
+    cam.up = vec3(0,1,0);
+    cam.defocus_angle = 0;
+    cam.focus_dist = 10.0;
+}
+
+/**
+ * sphere_count glass spheres, some of them hollow bubbles, in front of a few diffuse ones.
+ * Paths refract many times before they leave, so this scene is all about long paths.
+ */
+inline void glass_scene(sphere_set& spheres, camera& cam, int sphere_count) {
+    rng gen = rng(3);
+    spheres.add(point3(0,-1000,0), 1000, make_shared<lambertian>(color(0.2, 0.3, 0.5)));
+    auto glass = make_shared<dielectric>(1.5);
+    auto bubble = make_shared<dielectric>(1.0 / 1.5); // an air pocket inside glass
+    double side = 2 * sqrt(double(sphere_count));
+    for (int i = 0; i < sphere_count; i++) {
+        double radius = random_double(gen, 0.3, 0.7);
+        point3 center(random_double(gen, -side / 2, side / 2), radius, random_double(gen, -side / 2, side / 2));
+        spheres.add(center, radius, glass);
+        if (random_double(gen) < 0.3) spheres.add(center, 0.8 * radius, bubble);
+    }
+    for (int i = -2; i <= 2; i++)
+        spheres.add(point3(3 * i, 1, -side / 2 - 2), 1, make_shared<lambertian>(color::random(gen, 0.2, 0.9)));
+    spheres.build();
+
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width = 400;
+    cam.samples_per_pixel = 16;
+    cam.max_depth = 50;
+    cam.vertical_fov = 35;
+    cam.position = point3(0, side / 3 + 2, side / 2 + 6);
+    cam.viewport_position = point3(0, 0.5, 0);
+    cam.up = vec3(0,1,0);
+    cam.defocus_angle = 0;
+    cam.focus_dist = 10.0;
+}
+
+/**
+ * A closed room lit by one small lamp on the ceiling, no sky gets in. The walls are spheres so big that they look flat.
+ * All light comes from the lamp, which is what next-event estimation is for (see lights.h).
+ */
+inline void room_scene(sphere_set& spheres, camera& cam) {
+    auto white = make_shared<lambertian>(color(0.75, 0.75, 0.75));
+    spheres.add(point3(0, -1000, 0), 1000, white); // floor
+    spheres.add(point3(0, 1006, 0), 1000, white); // ceiling
+    spheres.add(point3(0, 3, -1003), 1000, white); // back
+    spheres.add(point3(0, 3, 1010), 1000, white); // behind the camera
+    spheres.add(point3(-1003, 3, 0), 1000, make_shared<lambertian>(color(0.75, 0.25, 0.25)));
+    spheres.add(point3(1003, 3, 0), 1000, make_shared<lambertian>(color(0.25, 0.25, 0.75)));
+    spheres.add(point3(0, 5.6, 0), 0.25, make_shared<emissive>(color(300, 280, 250)));
+    spheres.add(point3(-1.4, 1, -1), 1, make_shared<metal>(color(0.8, 0.8, 0.8), 0.0));
+    spheres.add(point3(1.3, 1, 0.5), 1, make_shared<dielectric>(1.5));
+    spheres.add(point3(0, 0.5, 2), 0.5, make_shared<lambertian>(color(0.8, 0.6, 0.2)));
+    spheres.build();
+
+    cam.aspect_ratio = 1;
+    cam.image_width = 400;
+    cam.samples_per_pixel = 16;
+    cam.max_depth = 10;
+    cam.vertical_fov = 40;
+    cam.position = point3(0, 3, 9.5);
+    cam.viewport_position = point3(0, 2.5, 0);
+    cam.up = vec3(0,1,0);
+    cam.defocus_angle = 0;
+    cam.focus_dist = 10.0;
+}
+
+/**
+ * A sphere of about triangle_count triangles with a wavy surface, with smooth vertex normals.
+ * Procedural, so the benchmarks can make meshes of any size without shipping model files.
+ */
+inline shared_ptr<triangle_mesh> bumpy_sphere_mesh(const point3& center, double radius, int triangle_count, shared_ptr<material> mat) {
+    auto mesh = make_shared<triangle_mesh>(mat);
+    // a UV sphere: rings of segments vertices between the two poles, 2 * segments * (rings - 1) triangles
+    int rings = std::max(3, int(sqrt(triangle_count / 4.0)));
+    int segments = 2 * rings;
+    std::vector<point3> points;
+    points.push_back(center + vec3(0, radius, 0));
+    for (int ring = 1; ring < rings; ring++) {
+        double theta = pi * ring / rings;
+        for (int segment = 0; segment < segments; segment++) {
+            double phi = 2 * pi * segment / segments;
+            double r = radius * (1 + 0.08 * sin(7 * theta) * sin(9 * phi));
+            points.push_back(center + r * vec3(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi)));
+        }
+    }
+    points.push_back(center - vec3(0, radius, 0));
+
+    std::vector<uint32_t> triangles;
+    auto ring_vertex = [&](int ring, int segment) { return uint32_t(1 + (ring - 1) * segments + segment % segments); };
+    uint32_t bottom = uint32_t(points.size() - 1);
+    for (int segment = 0; segment < segments; segment++) {
+        uint32_t top_fan[] = { 0, ring_vertex(1, segment + 1), ring_vertex(1, segment) };
+        uint32_t bottom_fan[] = { bottom, ring_vertex(rings - 1, segment), ring_vertex(rings - 1, segment + 1) };
+        triangles.insert(triangles.end(), top_fan, top_fan + 3);
+        triangles.insert(triangles.end(), bottom_fan, bottom_fan + 3);
+        for (int ring = 1; ring < rings - 1; ring++) {
+            uint32_t a = ring_vertex(ring, segment), b = ring_vertex(ring, segment + 1);
+            uint32_t c = ring_vertex(ring + 1, segment), d = ring_vertex(ring + 1, segment + 1);
+            uint32_t quad[] = { a, b, d, a, d, c };
+            triangles.insert(triangles.end(), quad, quad + 6);
+        }
+    }
+
+    // vertex normals: the sum of the (area weighted) normals of the triangles around a vertex
+    std::vector<vec3> normals(points.size(), vec3(0, 0, 0));
+    for (size_t i = 0; i < triangles.size(); i += 3) {
+        const point3& a = points[triangles[i]];
+        vec3 n = cross(points[triangles[i+1]] - a, points[triangles[i+2]] - a);
+        for (int corner = 0; corner < 3; corner++) normals[triangles[i + corner]] += n;
+    }
+    mesh->reserve(points.size(), triangles.size() / 3);
+    for (size_t i = 0; i < points.size(); i++) mesh->add_vertex(points[i], unit_vector(normals[i]));
+    for (size_t i = 0; i < triangles.size(); i += 3) mesh->add_triangle(triangles[i], triangles[i+1], triangles[i+2]);
+    mesh->build();
+    return mesh;
+}
+
+/** a big bumpy mesh of about triangle_count triangles between a glass and a metal sphere. Tests the triangle path */
+inline void mesh_scene(hittable_list& world, camera& cam, int triangle_count) {
+    auto spheres = make_shared<sphere_set>();
+    spheres->add(point3(0,-1000,0), 1000, make_shared<lambertian>(color(0.5, 0.5, 0.5)));
+    spheres->add(point3(-3, 1, 0.5), 1, make_shared<dielectric>(1.5));
+    spheres->add(point3(3, 1, 0.5), 1, make_shared<metal>(color(0.7, 0.6, 0.5), 0.05));
+    spheres->build();
+    world.add(spheres);
+    world.add(bumpy_sphere_mesh(point3(0, 1.5, 0), 1.5, triangle_count, make_shared<lambertian>(color(0.7, 0.3, 0.2))));
+
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width = 400;
+    cam.samples_per_pixel = 16;
+    cam.max_depth = 50;
+    cam.vertical_fov = 30;
+    cam.position = point3(0, 3, 12);
+    cam.viewport_position = point3(0, 1.2, 0);
+    cam.up = vec3(0,1,0);
+    cam.defocus_angle = 0;
+    cam.focus_dist = 10.0;
+}
+
+/**
+ * instance_count copies of one prototype on a grid, each with its own rotation, size and (mostly) material.
+ * The prototype is a group: a 20k triangle blob, itself an instance of a mesh, standing on three metal spheres.
+ * Only one blob and three spheres exist in memory, however many copies there are.
+ */
+inline void instance_scene(hittable_list& world, camera& cam, int instance_count) {
+    rng gen = rng(4);
+    auto ground = make_shared<sphere_set>();
+    ground->add(point3(0,-1000,0), 1000, make_shared<lambertian>(color(0.5, 0.5, 0.5)));
+    ground->build();
+    world.add(ground);
+
+    auto blob = bumpy_sphere_mesh(point3(0, 0, 0), 1, 20000, make_shared<lambertian>(color(0.7, 0.3, 0.2)));
+    auto feet = make_shared<sphere_set>();
+    auto chrome = make_shared<metal>(color(0.8, 0.8, 0.8), 0.1);
+    for (int i = 0; i < 3; i++) feet->add(point3(0.5 * cos(2 * pi * i / 3), 0.25, 0.5 * sin(2 * pi * i / 3)), 0.25, chrome);
+    feet->build();
+    auto group = make_shared<hittable_list>();
+    group->add(make_shared<instance>(blob, affine_transform::translate(vec3(0, 1.1, 0)) * affine_transform::scale(vec3(0.6, 0.8, 0.6))));
+    group->add(feet);
+
+    uint32_t palette[] = { instance::keep_material,
+                           scene_materials().add(lambertian(color(0.2, 0.4, 0.8))),
+                           scene_materials().add(lambertian(color(0.3, 0.7, 0.3))),
+                           scene_materials().add(metal(color(0.9, 0.8, 0.5), 0.2)),
+                           scene_materials().add(dielectric(1.5)) };
+    std::vector<shared_ptr<hittable>> copies;
+    auto arena = make_shared<scene_arena>();
+    arena->reserve<instance>(instance_count);
+    int side = int(ceil(sqrt(double(instance_count))));
+    double spacing = 2.5;
+    double half = 0.5 * side * spacing;
+    for (int i = 0; i < instance_count; i++) {
+        vec3 position(-half + (i % side + 0.5) * spacing, 0, -half + (i / side + 0.5) * spacing);
+        double size = random_double(gen, 0.6, 1.2);
+        affine_transform placement = affine_transform::translate(position) * affine_transform::rotate(1, random_double(gen, 0, 360))
+                                     * affine_transform::scale(vec3(size, size, size));
+        copies.push_back(arena->make<instance>(group, placement, palette[int(random_double(gen) * 5)]));
+    }
+    world.add(make_shared<bvh>(copies));
+
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width = 400;
+    cam.samples_per_pixel = 16;
+    cam.max_depth = 50;
+    cam.vertical_fov = 40;
+    cam.position = point3(0, 0.3 * half + 3, half + 5);
+    cam.viewport_position = point3(0, 0, 0);
+    cam.up = vec3(0,1,0);
+    cam.defocus_angle = 0;
+    cam.focus_dist = 10.0;
+}
+
+#endif
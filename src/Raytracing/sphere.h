@@ -4,14 +4,57 @@
 #include <assert.h>
 #include "hittable.h"
 #include "project_utils.h"
+#include "material.h"
+#include "render_stats.h"
 
 class sphere : public hittable {
     public:
-        sphere(const point3& center, double radius, shared_ptr<material> mat)
-            : center(center), radius(fmax(0,radius)), mat(mat) {}
+        sphere(const point3& center, real radius, shared_ptr<material> mat)
+            : sphere(center, radius, scene_materials().add(*mat)) {}
+
+        /** a sphere whose material is already in scene_materials() */
+        sphere(const point3& center, real radius, uint32_t mat)
+            : center(center), radius(fmax(0,radius)), mat(mat) {
+            auto radius_vector = vec3(this->radius, this->radius, this->radius);
+            bbox = aabb(center - radius_vector, center + radius_vector);
+        }
         
-        /**if the ray hits this sphere, set rec with this hit and return true */
-        bool hits(const ray& r, range range, hit_details& rec) const override {
+        bool closest_hit(const ray& r, range range, hit_id& id) const override {
+            real t;
+            if (!intersect(r, range, t)) return false;
+            id.set(t, this, 0);
+            return true;
+        }
+
+        bool occluded(const ray& r, range range) const override {
+            real t;
+            return intersect(r, range, t);
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        point3 center_point() const { return center; }
+        real radius_value() const { return radius; }
+        uint32_t material_slot() const { return mat; }
+    protected:
+        void describe_hit(const ray& r, const hit_id& id, hit_details& rec) const override {
+            rec.t = id.t;
+            rec.p = r.at(rec.t);
+            rec.mat = mat;
+            auto outward_normal = (rec.p - center) / radius;
+            assert(outward_normal.length() > 0.99 && outward_normal.length() < 1.01);
+            rec.set_face_normal(r, outward_normal);
+        }
+
+    private:
+        point3 center;
+        real radius;
+        uint32_t mat;
+        aabb bbox;
+
+        /**if the ray hits this sphere within range, set t to the nearer hit and return true */
+        bool intersect(const ray& r, range range, real& t) const {
+            thread_stats().intersection_tests++;
             //solve quadratic equation to find where the ray intersects with the sphere
             vec3 oc = center - r.origin();
             auto a = r.direction().length_squared();
@@ -21,7 +64,7 @@ class sphere : public hittable {
             if (discriminant < 0)
                 return false;
             auto sqrtd = sqrt(discriminant);
-            auto t = (h - sqrtd) / a;
+            t = (h - sqrtd) / a;
 
             /**
              * check that t is within the (min_t, max_t) range  
@@ -33,19 +76,7 @@ class sphere : public hittable {
                 if (!range.contains(t))
                     return false;
             }
-
-            //set rec 
-            rec.t = t;
-            rec.p = r.at(t);
-            rec.mat = mat;
-            auto outward_normal = (rec.p - center) / radius;
-            assert(outward_normal.length() > 0.99 && outward_normal.length() < 1.01);
-            rec.set_face_normal(r, outward_normal);
             return true;
         }
-    private:
-        point3 center;
-        double radius;
-        shared_ptr<material> mat;
 };
 #endif
\ No newline at end of file
@@ -0,0 +1,208 @@
+#ifndef SPHERE_SET_H
+#define SPHERE_SET_H
+
+#include "hittable.h"
+#include "project_utils.h"
+#include "bvh.h"
+#include "sphere_simd.h"
+#include "material.h"
+#include "render_stats.h"
+#include <vector>
+
+/**
+ * Many spheres in one hittable, stored as a structure of arrays: centers, radii and material indices each in their own array.
+ * build() sorts them into a BVH whose leaves hold up to 16 neighbouring spheres,
+ * and every leaf is tested with one call of the widest SIMD kernel the CPU supports.
+ * Behaves exactly like the same spheres as separate sphere objects in a bvh, it is just a lot faster.
+ */
+class sphere_set : public hittable {
+    public:
+        sphere_set() : kernel(get_sphere_kernel(best_simd_level())) {}
+
+        void add(const point3& center, real radius, shared_ptr<material> mat) {
+            add(center, radius, add_material(mat));
+        }
+
+        /** add a sphere whose material is already in scene_materials() */
+        void add(const point3& center, real radius, uint32_t material_slot) {
+            center_x.push_back(center.x());
+            center_y.push_back(center.y());
+            center_z.push_back(center.z());
+            radii.push_back(fmax(0, radius));
+            material_index.push_back(material_slot);
+            added_index.push_back(uint32_t(added_index.size()));
+            nodes.clear(); // the BVH is out of date until the next build()
+            auto radius_vector = vec3(radii.back(), radii.back(), radii.back());
+            bbox = aabb(bbox, aabb(center - radius_vector, center + radius_vector));
+        }
+
+        /** the index of mat in scene_materials(). Materials with the same parameters share one index */
+        static uint32_t add_material(const shared_ptr<material>& mat) {
+            return scene_materials().add(*mat);
+        }
+
+        /**
+         * Bulk load a whole set, for example straight out of a memory mapped scene file.
+         * If bvh_nodes is not empty, the spheres have to be in the order that BVH was built for, and build() is not needed.
+         * added_indices is what added_indices() returned for the arrays; null means they are in the order of add().
+         */
+        void assign(size_t count, const real* xs, const real* ys, const real* zs, const real* rs, const uint32_t* material_slots,
+                    const bvh_node* bvh_nodes, size_t node_count, const uint32_t* added_indices = nullptr) {
+            center_x.assign(xs, xs + count);
+            center_y.assign(ys, ys + count);
+            center_z.assign(zs, zs + count);
+            radii.assign(rs, rs + count);
+            material_index.assign(material_slots, material_slots + count);
+            added_index.resize(count);
+            for (size_t i = 0; i < count; i++) added_index[i] = added_indices ? added_indices[i] : uint32_t(i);
+            nodes.assign(bvh_nodes, bvh_nodes + node_count);
+            bbox = aabb();
+            if (!nodes.empty()) {
+                bbox = nodes[0].box;
+                return;
+            }
+            for (size_t i = 0; i < count; i++) {
+                auto radius_vector = vec3(radii[i], radii[i], radii[i]);
+                auto center = point3(center_x[i], center_y[i], center_z[i]);
+                bbox = aabb(bbox, aabb(center - radius_vector, center + radius_vector));
+            }
+        }
+
+        /** read access to the arrays, e.g. for saving the set to a scene file */
+        const std::vector<real>& centers_x() const { return center_x; }
+        const std::vector<real>& centers_y() const { return center_y; }
+        const std::vector<real>& centers_z() const { return center_z; }
+        const std::vector<real>& radius_values() const { return radii; }
+        const std::vector<uint32_t>& material_slots() const { return material_index; }
+        const std::vector<bvh_node>& bvh_nodes() const { return nodes; }
+
+        /** which sphere sits where: the order of add() (or of the arrays given to assign()) of every stored sphere */
+        const std::vector<uint32_t>& added_indices() const { return added_index; }
+
+        /** Build the BVH. Call it after the last add(), without it every ray tests every sphere */
+        void build() {
+            std::vector<aabb> boxes(size());
+            for (size_t i = 0; i < size(); i++) boxes[i] = sphere_box(i);
+            bvh_builder builder;
+            builder.max_leaf_size = 16; // two AVX-512 registers worth of double spheres, one of float ones. Wide leaves keep the kernels busy and the tree shallow
+            std::vector<uint32_t> order;
+            builder.build(boxes, nodes, order);
+
+            // store the spheres in leaf order, so a leaf is a contiguous run of every array
+            reorder(center_x, order);
+            reorder(center_y, order);
+            reorder(center_z, order);
+            reorder(radii, order);
+            reorder(material_index, order);
+            reorder(added_index, order);
+        }
+
+        /** move the sphere stored at index (see added_indices). Call refit() or build() after the last move, before rendering */
+        void move_sphere(size_t index, const point3& center) {
+            center_x[index] = center.x();
+            center_y[index] = center.y();
+            center_z[index] = center.z();
+        }
+
+        /** update the BVH to moved spheres without building it again, see refit_bvh */
+        void refit() {
+            if (nodes.empty()) {
+                bbox = aabb();
+                for (size_t i = 0; i < size(); i++) bbox = aabb(bbox, sphere_box(i));
+                return;
+            }
+            refit_bvh(nodes, [this](uint32_t first, uint32_t count) {
+                aabb box;
+                for (uint32_t i = first; i < first + count; i++) box = aabb(box, sphere_box(i));
+                return box;
+            });
+            bbox = nodes[0].box;
+        }
+
+        size_t size() const { return radii.size(); }
+
+        /** force a specific instruction set. Used by the benchmarks to compare the kernels */
+        void use_simd_level(simd_level level) { kernel = get_sphere_kernel(level); }
+
+        bool closest_hit(const ray& r, range ray_range, hit_id& id) const override {
+            if (size() == 0) return false;
+            sphere_arrays arrays = { center_x.data(), center_y.data(), center_z.data(), radii.data() };
+            sphere_kernel_ray kernel_ray(r);
+            uint32_t hit_index = 0;
+            bool hit_anything = false;
+            render_stats& stats = thread_stats();
+
+            if (nodes.empty()) {
+                stats.intersection_tests += size();
+                hit_anything = kernel(arrays, 0, uint32_t(size()), kernel_ray, ray_range.min, ray_range.max, hit_index);
+            } else {
+                traverse_bvh(nodes, r, ray_range, [&](uint32_t first, uint32_t count, range& current_range) {
+                    stats.intersection_tests += count;
+                    if (kernel(arrays, first, count, kernel_ray, current_range.min, current_range.max, hit_index))
+                        hit_anything = true;
+                });
+            }
+            if (!hit_anything) return false;
+            id.set(ray_range.max, this, hit_index);
+            return true;
+        }
+
+        /** any sphere will do: the first leaf with a hit empties the range, which ends the traversal */
+        bool occluded(const ray& r, range ray_range) const override {
+            if (size() == 0) return false;
+            sphere_arrays arrays = { center_x.data(), center_y.data(), center_z.data(), radii.data() };
+            sphere_kernel_ray kernel_ray(r);
+            uint32_t hit_index = 0;
+            render_stats& stats = thread_stats();
+            if (nodes.empty()) {
+                stats.intersection_tests += size();
+                return kernel(arrays, 0, uint32_t(size()), kernel_ray, ray_range.min, ray_range.max, hit_index);
+            }
+            bool blocked = false;
+            traverse_bvh(nodes, r, ray_range, [&](uint32_t first, uint32_t count, range& current_range) {
+                stats.intersection_tests += count;
+                if (kernel(arrays, first, count, kernel_ray, current_range.min, current_range.max, hit_index)) {
+                    blocked = true;
+                    current_range.max = -infinity; // ends the traversal
+                }
+            });
+            return blocked;
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+    protected:
+        /** only the closest sphere gets a full hit record */
+        void describe_hit(const ray& r, const hit_id& id, hit_details& rec) const override {
+            auto center = point3(center_x[id.prim], center_y[id.prim], center_z[id.prim]);
+            rec.t = id.t;
+            rec.p = r.at(rec.t);
+            rec.mat = material_index[id.prim];
+            auto outward_normal = (rec.p - center) / radii[id.prim];
+            rec.set_face_normal(r, outward_normal);
+        }
+
+    private:
+        std::vector<real> center_x, center_y, center_z, radii;
+        std::vector<uint32_t> material_index; // indices into scene_materials()
+        std::vector<uint32_t> added_index; // see added_indices()
+        std::vector<bvh_node> nodes;
+        aabb bbox;
+        sphere_kernel kernel;
+
+        aabb sphere_box(size_t i) const {
+            auto radius_vector = vec3(radii[i], radii[i], radii[i]);
+            auto center = point3(center_x[i], center_y[i], center_z[i]);
+            return aabb(center - radius_vector, center + radius_vector);
+        }
+
+        template <typename T>
+        static void reorder(std::vector<T>& values, const std::vector<uint32_t>& order) {
+            std::vector<T> sorted;
+            sorted.reserve(values.size());
+            for (uint32_t index : order) sorted.push_back(values[index]);
+            values.swap(sorted);
+        }
+};
+
+#endif
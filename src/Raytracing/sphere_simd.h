@@ -0,0 +1,399 @@
+#ifndef SPHERE_SIMD_H
+#define SPHERE_SIMD_H
+
+#include "project_utils.h"
+#include <cstdint>
+
+/**
+ * Ray against many spheres at once.
+ * The spheres are stored as a structure of arrays (all x coordinates, then all y coordinates, ...),
+ * so one SIMD register holds the same component of 2 (SSE2), 4 (AVX2) or 8 (AVX-512) neighbouring spheres,
+ * or twice as many in a float build (RT_SINGLE_PRECISION).
+ * Every kernel finds the closest sphere of a run whose hit lies inside (t_min, t_max) and does the exact same
+ * floating point operations as sphere::hits, so every kernel gives the same picture.
+ * The best kernel the CPU supports is picked at runtime, with a plain scalar loop as the fallback.
+ */
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define RT_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+enum class simd_level { scalar, sse2, avx2, avx512 };
+
+inline const char* simd_level_name(simd_level level) {
+    switch (level) {
+        case simd_level::sse2: return "sse2";
+        case simd_level::avx2: return "avx2";
+        case simd_level::avx512: return "avx512";
+        default: return "scalar";
+    }
+}
+
+/** the sphere arrays a kernel reads from */
+struct sphere_arrays {
+    const real* center_x;
+    const real* center_y;
+    const real* center_z;
+    const real* radius;
+};
+
+/** the ray, split into components, with its squared length precomputed */
+struct sphere_kernel_ray {
+    real ox, oy, oz;
+    real dx, dy, dz;
+    real a;
+
+    sphere_kernel_ray(const ray& r) {
+        ox = r.origin().x(); oy = r.origin().y(); oz = r.origin().z();
+        dx = r.direction().x(); dy = r.direction().y(); dz = r.direction().z();
+        a = r.direction().length_squared();
+    }
+};
+
+/** Test spheres [first, first+count). On a hit closer than t_max, sets t_max and hit_index and returns true */
+typedef bool (*sphere_kernel)(const sphere_arrays& s, uint32_t first, uint32_t count, const sphere_kernel_ray& r,
+                              real t_min, real& t_max, uint32_t& hit_index);
+
+inline bool intersect_spheres_scalar(const sphere_arrays& s, uint32_t first, uint32_t count, const sphere_kernel_ray& r,
+                                     real t_min, real& t_max, uint32_t& hit_index) {
+    bool found = false;
+    for (uint32_t i = first; i < first + count; i++) {
+        real ocx = s.center_x[i] - r.ox;
+        real ocy = s.center_y[i] - r.oy;
+        real ocz = s.center_z[i] - r.oz;
+        real h = r.dx*ocx + r.dy*ocy + r.dz*ocz;
+        real c = (ocx*ocx + ocy*ocy + ocz*ocz) - s.radius[i]*s.radius[i];
+        real discriminant = h*h - r.a*c;
+        if (discriminant < 0) continue;
+        real sqrtd = sqrt(discriminant);
+        real t = (h - sqrtd) / r.a;
+        if (!(t_min < t && t < t_max)) {
+            t = (h + sqrtd) / r.a;
+            if (!(t_min <= t && t <= t_max)) continue;
+        }
+        t_max = t;
+        hit_index = i;
+        found = true;
+    }
+    return found;
+}
+
+#if defined(RT_SIMD_X86) && !defined(RT_SINGLE_PRECISION)
+
+/** pick the smallest t out of the per-lane results. Lane indices are kept as doubles so they can be blended like the t values */
+inline bool reduce_lanes(const double* lane_t, const double* lane_index, int lanes, double& t_max, uint32_t& hit_index) {
+    bool found = false;
+    for (int lane = 0; lane < lanes; lane++) {
+        if (lane_index[lane] >= 0 && lane_t[lane] <= t_max) {
+            if (found && lane_t[lane] == t_max && uint32_t(lane_index[lane]) > hit_index) continue; // ties go to the first sphere
+            t_max = lane_t[lane];
+            hit_index = uint32_t(lane_index[lane]);
+            found = true;
+        }
+    }
+    return found;
+}
+
+__attribute__((target("sse2")))
+inline bool intersect_spheres_sse2(const sphere_arrays& s, uint32_t first, uint32_t count, const sphere_kernel_ray& r,
+                                   double t_min, double& t_max, uint32_t& hit_index) {
+    const __m128d ox = _mm_set1_pd(r.ox), oy = _mm_set1_pd(r.oy), oz = _mm_set1_pd(r.oz);
+    const __m128d dx = _mm_set1_pd(r.dx), dy = _mm_set1_pd(r.dy), dz = _mm_set1_pd(r.dz);
+    const __m128d a = _mm_set1_pd(r.a);
+    const __m128d zero = _mm_setzero_pd();
+    const __m128d t_min_v = _mm_set1_pd(t_min);
+    __m128d best_t = _mm_set1_pd(t_max);
+    __m128d best_index = _mm_set1_pd(-1);
+
+    uint32_t i = first, end = first + count;
+    for (; i + 2 <= end; i += 2) {
+        __m128d ocx = _mm_sub_pd(_mm_loadu_pd(s.center_x + i), ox);
+        __m128d ocy = _mm_sub_pd(_mm_loadu_pd(s.center_y + i), oy);
+        __m128d ocz = _mm_sub_pd(_mm_loadu_pd(s.center_z + i), oz);
+        __m128d radius = _mm_loadu_pd(s.radius + i);
+        __m128d h = _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, ocx), _mm_mul_pd(dy, ocy)), _mm_mul_pd(dz, ocz));
+        __m128d c = _mm_sub_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(ocx, ocx), _mm_mul_pd(ocy, ocy)), _mm_mul_pd(ocz, ocz)),
+                               _mm_mul_pd(radius, radius));
+        __m128d discriminant = _mm_sub_pd(_mm_mul_pd(h, h), _mm_mul_pd(a, c));
+        __m128d valid = _mm_cmpge_pd(discriminant, zero);
+        __m128d sqrtd = _mm_sqrt_pd(discriminant);
+        __m128d t_near = _mm_div_pd(_mm_sub_pd(h, sqrtd), a);
+        __m128d t_far = _mm_div_pd(_mm_add_pd(h, sqrtd), a);
+        __m128d near_ok = _mm_and_pd(_mm_cmpgt_pd(t_near, t_min_v), _mm_cmplt_pd(t_near, best_t));
+        __m128d far_ok = _mm_and_pd(_mm_cmpge_pd(t_far, t_min_v), _mm_cmple_pd(t_far, best_t));
+        __m128d t = _mm_or_pd(_mm_and_pd(near_ok, t_near), _mm_andnot_pd(near_ok, t_far));
+        __m128d hit = _mm_and_pd(valid, _mm_or_pd(near_ok, far_ok));
+        __m128d index = _mm_set_pd(double(i + 1), double(i));
+        best_t = _mm_or_pd(_mm_and_pd(hit, t), _mm_andnot_pd(hit, best_t));
+        best_index = _mm_or_pd(_mm_and_pd(hit, index), _mm_andnot_pd(hit, best_index));
+    }
+    double lane_t[2], lane_index[2];
+    _mm_storeu_pd(lane_t, best_t);
+    _mm_storeu_pd(lane_index, best_index);
+    bool found = reduce_lanes(lane_t, lane_index, 2, t_max, hit_index);
+    if (i < end && intersect_spheres_scalar(s, i, end - i, r, t_min, t_max, hit_index)) found = true;
+    return found;
+}
+
+__attribute__((target("avx2")))
+inline bool intersect_spheres_avx2(const sphere_arrays& s, uint32_t first, uint32_t count, const sphere_kernel_ray& r,
+                                   double t_min, double& t_max, uint32_t& hit_index) {
+    const __m256d ox = _mm256_set1_pd(r.ox), oy = _mm256_set1_pd(r.oy), oz = _mm256_set1_pd(r.oz);
+    const __m256d dx = _mm256_set1_pd(r.dx), dy = _mm256_set1_pd(r.dy), dz = _mm256_set1_pd(r.dz);
+    const __m256d a = _mm256_set1_pd(r.a);
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d t_min_v = _mm256_set1_pd(t_min);
+    const __m256d lane_offsets = _mm256_set_pd(3, 2, 1, 0);
+    __m256d best_t = _mm256_set1_pd(t_max);
+    __m256d best_index = _mm256_set1_pd(-1);
+
+    uint32_t i = first, end = first + count;
+    for (; i + 4 <= end; i += 4) {
+        __m256d ocx = _mm256_sub_pd(_mm256_loadu_pd(s.center_x + i), ox);
+        __m256d ocy = _mm256_sub_pd(_mm256_loadu_pd(s.center_y + i), oy);
+        __m256d ocz = _mm256_sub_pd(_mm256_loadu_pd(s.center_z + i), oz);
+        __m256d radius = _mm256_loadu_pd(s.radius + i);
+        __m256d h = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, ocx), _mm256_mul_pd(dy, ocy)), _mm256_mul_pd(dz, ocz));
+        __m256d c = _mm256_sub_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, ocx), _mm256_mul_pd(ocy, ocy)), _mm256_mul_pd(ocz, ocz)),
+                                  _mm256_mul_pd(radius, radius));
+        __m256d discriminant = _mm256_sub_pd(_mm256_mul_pd(h, h), _mm256_mul_pd(a, c));
+        __m256d valid = _mm256_cmp_pd(discriminant, zero, _CMP_GE_OQ);
+        if (_mm256_movemask_pd(valid) == 0) continue; // the common case: the ray misses all four
+        __m256d sqrtd = _mm256_sqrt_pd(discriminant);
+        __m256d t_near = _mm256_div_pd(_mm256_sub_pd(h, sqrtd), a);
+        __m256d t_far = _mm256_div_pd(_mm256_add_pd(h, sqrtd), a);
+        __m256d near_ok = _mm256_and_pd(_mm256_cmp_pd(t_near, t_min_v, _CMP_GT_OQ), _mm256_cmp_pd(t_near, best_t, _CMP_LT_OQ));
+        __m256d far_ok = _mm256_and_pd(_mm256_cmp_pd(t_far, t_min_v, _CMP_GE_OQ), _mm256_cmp_pd(t_far, best_t, _CMP_LE_OQ));
+        __m256d t = _mm256_blendv_pd(t_far, t_near, near_ok);
+        __m256d hit = _mm256_and_pd(valid, _mm256_or_pd(near_ok, far_ok));
+        __m256d index = _mm256_add_pd(_mm256_set1_pd(double(i)), lane_offsets);
+        best_t = _mm256_blendv_pd(best_t, t, hit);
+        best_index = _mm256_blendv_pd(best_index, index, hit);
+    }
+    double lane_t[4], lane_index[4];
+    _mm256_storeu_pd(lane_t, best_t);
+    _mm256_storeu_pd(lane_index, best_index);
+    bool found = reduce_lanes(lane_t, lane_index, 4, t_max, hit_index);
+    if (i < end && intersect_spheres_scalar(s, i, end - i, r, t_min, t_max, hit_index)) found = true;
+    return found;
+}
+
+__attribute__((target("avx512f")))
+inline bool intersect_spheres_avx512(const sphere_arrays& s, uint32_t first, uint32_t count, const sphere_kernel_ray& r,
+                                     double t_min, double& t_max, uint32_t& hit_index) {
+    const __m512d ox = _mm512_set1_pd(r.ox), oy = _mm512_set1_pd(r.oy), oz = _mm512_set1_pd(r.oz);
+    const __m512d dx = _mm512_set1_pd(r.dx), dy = _mm512_set1_pd(r.dy), dz = _mm512_set1_pd(r.dz);
+    const __m512d a = _mm512_set1_pd(r.a);
+    const __m512d zero = _mm512_setzero_pd();
+    const __m512d t_min_v = _mm512_set1_pd(t_min);
+    const __m512d lane_offsets = _mm512_set_pd(7, 6, 5, 4, 3, 2, 1, 0);
+    __m512d best_t = _mm512_set1_pd(t_max);
+    __m512d best_index = _mm512_set1_pd(-1);
+
+    // the last partial block is loaded with a mask instead of falling back to scalar code
+    for (uint32_t i = first, end = first + count; i < end; i += 8) {
+        __mmask8 lanes = end - i >= 8 ? __mmask8(0xff) : __mmask8((1u << (end - i)) - 1);
+        __m512d ocx = _mm512_sub_pd(_mm512_maskz_loadu_pd(lanes, s.center_x + i), ox);
+        __m512d ocy = _mm512_sub_pd(_mm512_maskz_loadu_pd(lanes, s.center_y + i), oy);
+        __m512d ocz = _mm512_sub_pd(_mm512_maskz_loadu_pd(lanes, s.center_z + i), oz);
+        __m512d radius = _mm512_maskz_loadu_pd(lanes, s.radius + i);
+        __m512d h = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(dx, ocx), _mm512_mul_pd(dy, ocy)), _mm512_mul_pd(dz, ocz));
+        __m512d c = _mm512_sub_pd(_mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(ocx, ocx), _mm512_mul_pd(ocy, ocy)), _mm512_mul_pd(ocz, ocz)),
+                                  _mm512_mul_pd(radius, radius));
+        __m512d discriminant = _mm512_sub_pd(_mm512_mul_pd(h, h), _mm512_mul_pd(a, c));
+        __mmask8 valid = _mm512_mask_cmp_pd_mask(lanes, discriminant, zero, _CMP_GE_OQ);
+        if (valid == 0) continue;
+        __m512d sqrtd = _mm512_sqrt_pd(discriminant);
+        __m512d t_near = _mm512_div_pd(_mm512_sub_pd(h, sqrtd), a);
+        __m512d t_far = _mm512_div_pd(_mm512_add_pd(h, sqrtd), a);
+        __mmask8 near_ok = _mm512_cmp_pd_mask(t_near, t_min_v, _CMP_GT_OQ) & _mm512_cmp_pd_mask(t_near, best_t, _CMP_LT_OQ);
+        __mmask8 far_ok = _mm512_cmp_pd_mask(t_far, t_min_v, _CMP_GE_OQ) & _mm512_cmp_pd_mask(t_far, best_t, _CMP_LE_OQ);
+        __m512d t = _mm512_mask_blend_pd(near_ok, t_far, t_near);
+        __mmask8 hit = valid & (near_ok | far_ok);
+        __m512d index = _mm512_add_pd(_mm512_set1_pd(double(i)), lane_offsets);
+        best_t = _mm512_mask_blend_pd(hit, best_t, t);
+        best_index = _mm512_mask_blend_pd(hit, best_index, index);
+    }
+    double lane_t[8], lane_index[8];
+    _mm512_storeu_pd(lane_t, best_t);
+    _mm512_storeu_pd(lane_index, best_index);
+    return reduce_lanes(lane_t, lane_index, 8, t_max, hit_index);
+}
+
+#endif // RT_SIMD_X86 && !RT_SINGLE_PRECISION
+
+#if defined(RT_SIMD_X86) && defined(RT_SINGLE_PRECISION)
+
+/** The float kernels. Same structure as the double ones, with twice the lanes. Lane indices are kept as 32-bit integers */
+inline bool reduce_lanes(const float* lane_t, const int32_t* lane_index, int lanes, float& t_max, uint32_t& hit_index) {
+    bool found = false;
+    for (int lane = 0; lane < lanes; lane++) {
+        if (lane_index[lane] >= 0 && lane_t[lane] <= t_max) {
+            if (found && lane_t[lane] == t_max && uint32_t(lane_index[lane]) > hit_index) continue; // ties go to the first sphere
+            t_max = lane_t[lane];
+            hit_index = uint32_t(lane_index[lane]);
+            found = true;
+        }
+    }
+    return found;
+}
+
+__attribute__((target("sse2")))
+inline bool intersect_spheres_sse2(const sphere_arrays& s, uint32_t first, uint32_t count, const sphere_kernel_ray& r,
+                                   float t_min, float& t_max, uint32_t& hit_index) {
+    const __m128 ox = _mm_set1_ps(r.ox), oy = _mm_set1_ps(r.oy), oz = _mm_set1_ps(r.oz);
+    const __m128 dx = _mm_set1_ps(r.dx), dy = _mm_set1_ps(r.dy), dz = _mm_set1_ps(r.dz);
+    const __m128 a = _mm_set1_ps(r.a);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 t_min_v = _mm_set1_ps(t_min);
+    const __m128i lane_offsets = _mm_set_epi32(3, 2, 1, 0);
+    __m128 best_t = _mm_set1_ps(t_max);
+    __m128 best_index = _mm_castsi128_ps(_mm_set1_epi32(-1));
+
+    uint32_t i = first, end = first + count;
+    for (; i + 4 <= end; i += 4) {
+        __m128 ocx = _mm_sub_ps(_mm_loadu_ps(s.center_x + i), ox);
+        __m128 ocy = _mm_sub_ps(_mm_loadu_ps(s.center_y + i), oy);
+        __m128 ocz = _mm_sub_ps(_mm_loadu_ps(s.center_z + i), oz);
+        __m128 radius = _mm_loadu_ps(s.radius + i);
+        __m128 h = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, ocx), _mm_mul_ps(dy, ocy)), _mm_mul_ps(dz, ocz));
+        __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)),
+                              _mm_mul_ps(radius, radius));
+        __m128 discriminant = _mm_sub_ps(_mm_mul_ps(h, h), _mm_mul_ps(a, c));
+        __m128 valid = _mm_cmpge_ps(discriminant, zero);
+        if (_mm_movemask_ps(valid) == 0) continue;
+        __m128 sqrtd = _mm_sqrt_ps(discriminant);
+        __m128 t_near = _mm_div_ps(_mm_sub_ps(h, sqrtd), a);
+        __m128 t_far = _mm_div_ps(_mm_add_ps(h, sqrtd), a);
+        __m128 near_ok = _mm_and_ps(_mm_cmpgt_ps(t_near, t_min_v), _mm_cmplt_ps(t_near, best_t));
+        __m128 far_ok = _mm_and_ps(_mm_cmpge_ps(t_far, t_min_v), _mm_cmple_ps(t_far, best_t));
+        __m128 t = _mm_or_ps(_mm_and_ps(near_ok, t_near), _mm_andnot_ps(near_ok, t_far));
+        __m128 hit = _mm_and_ps(valid, _mm_or_ps(near_ok, far_ok));
+        __m128 index = _mm_castsi128_ps(_mm_add_epi32(_mm_set1_epi32(int32_t(i)), lane_offsets));
+        best_t = _mm_or_ps(_mm_and_ps(hit, t), _mm_andnot_ps(hit, best_t));
+        best_index = _mm_or_ps(_mm_and_ps(hit, index), _mm_andnot_ps(hit, best_index));
+    }
+    float lane_t[4];
+    int32_t lane_index[4];
+    _mm_storeu_ps(lane_t, best_t);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lane_index), _mm_castps_si128(best_index));
+    bool found = reduce_lanes(lane_t, lane_index, 4, t_max, hit_index);
+    if (i < end && intersect_spheres_scalar(s, i, end - i, r, t_min, t_max, hit_index)) found = true;
+    return found;
+}
+
+__attribute__((target("avx2")))
+inline bool intersect_spheres_avx2(const sphere_arrays& s, uint32_t first, uint32_t count, const sphere_kernel_ray& r,
+                                   float t_min, float& t_max, uint32_t& hit_index) {
+    const __m256 ox = _mm256_set1_ps(r.ox), oy = _mm256_set1_ps(r.oy), oz = _mm256_set1_ps(r.oz);
+    const __m256 dx = _mm256_set1_ps(r.dx), dy = _mm256_set1_ps(r.dy), dz = _mm256_set1_ps(r.dz);
+    const __m256 a = _mm256_set1_ps(r.a);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 t_min_v = _mm256_set1_ps(t_min);
+    const __m256i lane_offsets = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+    __m256 best_t = _mm256_set1_ps(t_max);
+    __m256 best_index = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+
+    uint32_t i = first, end = first + count;
+    for (; i + 8 <= end; i += 8) {
+        __m256 ocx = _mm256_sub_ps(_mm256_loadu_ps(s.center_x + i), ox);
+        __m256 ocy = _mm256_sub_ps(_mm256_loadu_ps(s.center_y + i), oy);
+        __m256 ocz = _mm256_sub_ps(_mm256_loadu_ps(s.center_z + i), oz);
+        __m256 radius = _mm256_loadu_ps(s.radius + i);
+        __m256 h = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, ocx), _mm256_mul_ps(dy, ocy)), _mm256_mul_ps(dz, ocz));
+        __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz)),
+                                 _mm256_mul_ps(radius, radius));
+        __m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(h, h), _mm256_mul_ps(a, c));
+        __m256 valid = _mm256_cmp_ps(discriminant, zero, _CMP_GE_OQ);
+        if (_mm256_movemask_ps(valid) == 0) continue;
+        __m256 sqrtd = _mm256_sqrt_ps(discriminant);
+        __m256 t_near = _mm256_div_ps(_mm256_sub_ps(h, sqrtd), a);
+        __m256 t_far = _mm256_div_ps(_mm256_add_ps(h, sqrtd), a);
+        __m256 near_ok = _mm256_and_ps(_mm256_cmp_ps(t_near, t_min_v, _CMP_GT_OQ), _mm256_cmp_ps(t_near, best_t, _CMP_LT_OQ));
+        __m256 far_ok = _mm256_and_ps(_mm256_cmp_ps(t_far, t_min_v, _CMP_GE_OQ), _mm256_cmp_ps(t_far, best_t, _CMP_LE_OQ));
+        __m256 t = _mm256_blendv_ps(t_far, t_near, near_ok);
+        __m256 hit = _mm256_and_ps(valid, _mm256_or_ps(near_ok, far_ok));
+        __m256 index = _mm256_castsi256_ps(_mm256_add_epi32(_mm256_set1_epi32(int32_t(i)), lane_offsets));
+        best_t = _mm256_blendv_ps(best_t, t, hit);
+        best_index = _mm256_blendv_ps(best_index, index, hit);
+    }
+    float lane_t[8];
+    int32_t lane_index[8];
+    _mm256_storeu_ps(lane_t, best_t);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lane_index), _mm256_castps_si256(best_index));
+    bool found = reduce_lanes(lane_t, lane_index, 8, t_max, hit_index);
+    if (i < end && intersect_spheres_scalar(s, i, end - i, r, t_min, t_max, hit_index)) found = true;
+    return found;
+}
+
+__attribute__((target("avx512f")))
+inline bool intersect_spheres_avx512(const sphere_arrays& s, uint32_t first, uint32_t count, const sphere_kernel_ray& r,
+                                     float t_min, float& t_max, uint32_t& hit_index) {
+    const __m512 ox = _mm512_set1_ps(r.ox), oy = _mm512_set1_ps(r.oy), oz = _mm512_set1_ps(r.oz);
+    const __m512 dx = _mm512_set1_ps(r.dx), dy = _mm512_set1_ps(r.dy), dz = _mm512_set1_ps(r.dz);
+    const __m512 a = _mm512_set1_ps(r.a);
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512 t_min_v = _mm512_set1_ps(t_min);
+    const __m512i lane_offsets = _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    __m512 best_t = _mm512_set1_ps(t_max);
+    __m512i best_index = _mm512_set1_epi32(-1);
+
+    // a whole 16 sphere leaf is one iteration. Partial blocks are loaded with a mask
+    for (uint32_t i = first, end = first + count; i < end; i += 16) {
+        __mmask16 lanes = end - i >= 16 ? __mmask16(0xffff) : __mmask16((1u << (end - i)) - 1);
+        __m512 ocx = _mm512_sub_ps(_mm512_maskz_loadu_ps(lanes, s.center_x + i), ox);
+        __m512 ocy = _mm512_sub_ps(_mm512_maskz_loadu_ps(lanes, s.center_y + i), oy);
+        __m512 ocz = _mm512_sub_ps(_mm512_maskz_loadu_ps(lanes, s.center_z + i), oz);
+        __m512 radius = _mm512_maskz_loadu_ps(lanes, s.radius + i);
+        __m512 h = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, ocx), _mm512_mul_ps(dy, ocy)), _mm512_mul_ps(dz, ocz));
+        __m512 c = _mm512_sub_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(ocx, ocx), _mm512_mul_ps(ocy, ocy)), _mm512_mul_ps(ocz, ocz)),
+                                 _mm512_mul_ps(radius, radius));
+        __m512 discriminant = _mm512_sub_ps(_mm512_mul_ps(h, h), _mm512_mul_ps(a, c));
+        __mmask16 valid = _mm512_mask_cmp_ps_mask(lanes, discriminant, zero, _CMP_GE_OQ);
+        if (valid == 0) continue;
+        __m512 sqrtd = _mm512_sqrt_ps(discriminant);
+        __m512 t_near = _mm512_div_ps(_mm512_sub_ps(h, sqrtd), a);
+        __m512 t_far = _mm512_div_ps(_mm512_add_ps(h, sqrtd), a);
+        __mmask16 near_ok = _mm512_cmp_ps_mask(t_near, t_min_v, _CMP_GT_OQ) & _mm512_cmp_ps_mask(t_near, best_t, _CMP_LT_OQ);
+        __mmask16 far_ok = _mm512_cmp_ps_mask(t_far, t_min_v, _CMP_GE_OQ) & _mm512_cmp_ps_mask(t_far, best_t, _CMP_LE_OQ);
+        __m512 t = _mm512_mask_blend_ps(near_ok, t_far, t_near);
+        __mmask16 hit = valid & (near_ok | far_ok);
+        __m512i index = _mm512_add_epi32(_mm512_set1_epi32(int32_t(i)), lane_offsets);
+        best_t = _mm512_mask_blend_ps(hit, best_t, t);
+        best_index = _mm512_mask_blend_epi32(hit, best_index, index);
+    }
+    float lane_t[16];
+    int32_t lane_index[16];
+    _mm512_storeu_ps(lane_t, best_t);
+    _mm512_storeu_si512(lane_index, best_index);
+    return reduce_lanes(lane_t, lane_index, 16, t_max, hit_index);
+}
+
+#endif // RT_SIMD_X86 && RT_SINGLE_PRECISION
+
+/** the widest instruction set this CPU can run */
+inline simd_level best_simd_level() {
+#ifdef RT_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return simd_level::avx512;
+    if (__builtin_cpu_supports("avx2")) return simd_level::avx2;
+    if (__builtin_cpu_supports("sse2")) return simd_level::sse2;
+#endif
+    return simd_level::scalar;
+}
+
+/** the kernel for a level. Levels that were not compiled in fall back to the scalar loop */
+inline sphere_kernel get_sphere_kernel(simd_level level) {
+#ifdef RT_SIMD_X86
+    switch (level) {
+        case simd_level::avx512: return intersect_spheres_avx512;
+        case simd_level::avx2: return intersect_spheres_avx2;
+        case simd_level::sse2: return intersect_spheres_sse2;
+        default: break;
+    }
+#endif
+    return intersect_spheres_scalar;
+}
+
+#endif
@@ -0,0 +1,142 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A small work-stealing thread pool.
+ * Every worker owns a deque of tasks. It pops new work from the back of its own deque and,
+ * when that runs dry, steals from the front of the other workers' deques.
+ * That way big batches of uneven tasks (like image tiles) keep every core busy until the very end.
+ */
+class thread_pool {
+    public:
+        /** thread_count <= 0 means: use every hardware thread */
+        explicit thread_pool(int thread_count = 0) {
+            if (thread_count <= 0) thread_count = int(std::thread::hardware_concurrency());
+            if (thread_count <= 0) thread_count = 1;
+            for (int i = 0; i < thread_count; i++)
+                queues.push_back(std::unique_ptr<task_queue>(new task_queue()));
+            for (int i = 0; i < thread_count; i++)
+                workers.push_back(std::thread(&thread_pool::worker_loop, this, i));
+        }
+
+        ~thread_pool() {
+            {
+                std::lock_guard<std::mutex> lock(sleep_mutex);
+                stopping = true;
+            }
+            wake_workers.notify_all();
+            for (auto& worker : workers) worker.join();
+        }
+
+        thread_pool(const thread_pool&) = delete;
+        thread_pool& operator=(const thread_pool&) = delete;
+
+        int size() const { return int(workers.size()); }
+
+        /** Queue a task. Tasks submitted from a worker go to that worker's own deque, others are spread round-robin */
+        void submit(std::function<void()> task) {
+            int index = current_worker_index();
+            if (index < 0 || current_pool() != this)
+                index = int(next_queue.fetch_add(1) % queues.size());
+
+            pending_tasks.fetch_add(1);
+            {
+                std::lock_guard<std::mutex> lock(queues[index]->mutex);
+                queues[index]->tasks.push_back(std::move(task));
+            }
+            {
+                std::lock_guard<std::mutex> lock(sleep_mutex);
+                queued_tasks++;
+            }
+            wake_workers.notify_one();
+        }
+
+        /** Block until every task submitted so far has finished */
+        void wait() {
+            std::unique_lock<std::mutex> lock(done_mutex);
+            all_done.wait(lock, [this] { return pending_tasks.load() == 0; });
+        }
+
+    private:
+        struct task_queue {
+            std::mutex mutex;
+            std::deque<std::function<void()>> tasks;
+        };
+
+        std::vector<std::unique_ptr<task_queue>> queues;
+        std::vector<std::thread> workers;
+        std::atomic<unsigned> next_queue{0};
+        std::atomic<int> pending_tasks{0}; // submitted but not yet finished
+
+        std::mutex sleep_mutex;
+        std::condition_variable wake_workers;
+        int queued_tasks = 0; // submitted but not yet taken by a worker. Guarded by sleep_mutex
+        bool stopping = false;
+
+        std::mutex done_mutex;
+        std::condition_variable all_done;
+
+        static int& current_worker_index() {
+            static thread_local int index = -1;
+            return index;
+        }
+        static thread_pool*& current_pool() {
+            static thread_local thread_pool* pool = nullptr;
+            return pool;
+        }
+
+        void worker_loop(int index) {
+            current_worker_index() = index;
+            current_pool() = this;
+            while (true) {
+                {
+                    std::unique_lock<std::mutex> lock(sleep_mutex);
+                    wake_workers.wait(lock, [this] { return stopping || queued_tasks > 0; });
+                    if (queued_tasks == 0 && stopping) return;
+                    queued_tasks--;
+                }
+                // a task is reserved for us, so one of the deques is guaranteed to hand it out
+                std::function<void()> task;
+                while (!take_task(index, task)) std::this_thread::yield();
+                task();
+                if (pending_tasks.fetch_sub(1) == 1) {
+                    std::lock_guard<std::mutex> lock(done_mutex);
+                    all_done.notify_all();
+                }
+            }
+        }
+
+        /** pop from our own deque first, otherwise steal from the other workers */
+        bool take_task(int index, std::function<void()>& task) {
+            {
+                task_queue& own = *queues[index];
+                std::lock_guard<std::mutex> lock(own.mutex);
+                if (!own.tasks.empty()) {
+                    task = std::move(own.tasks.back());
+                    own.tasks.pop_back();
+                    return true;
+                }
+            }
+            for (size_t offset = 1; offset < queues.size(); offset++) {
+                task_queue& victim = *queues[(index + offset) % queues.size()];
+                std::lock_guard<std::mutex> lock(victim.mutex);
+                if (!victim.tasks.empty()) {
+                    task = std::move(victim.tasks.front());
+                    victim.tasks.pop_front();
+                    return true;
+                }
+            }
+            return false;
+        }
+};
+
+#endif
@@ -0,0 +1,252 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include "hittable.h"
+#include "project_utils.h"
+#include "bvh.h"
+#include "material.h"
+#include "render_stats.h"
+#include <utility>
+#include <vector>
+
+/**
+ * Per-ray setup of the watertight ray-triangle test (Woop, Benthin, Wald: "Watertight Ray/Triangle Intersection", JCGT 2013).
+ * The ray is turned into the +z axis by a permutation and a shear, which turns the 3D test into a 2D one:
+ * does the origin lie inside the triangle's projection? That is decided by the signs of three edge functions.
+ * Two triangles that share an edge compute the same edge function for it (with opposite sign),
+ * so a ray through the edge always hits one of them: no cracks between triangles, no matter how the mesh is tessellated.
+ */
+struct triangle_ray {
+    real origin[3];
+    int kx, ky, kz; // the axes of the sheared space. kz is the largest component of the direction
+    real shear_x, shear_y, shear_z;
+
+    triangle_ray(const ray& r) {
+        const vec3& d = r.direction();
+        for (int axis = 0; axis < 3; axis++) origin[axis] = r.origin()[axis];
+        kz = fabs(d.x()) > fabs(d.y()) ? (fabs(d.x()) > fabs(d.z()) ? 0 : 2) : (fabs(d.y()) > fabs(d.z()) ? 1 : 2);
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        if (d[kz] < 0) std::swap(kx, ky); // keeps the winding, so the sign of the determinant still tells the side
+        shear_x = d[kx] / d[kz];
+        shear_y = d[ky] / d[kz];
+        shear_z = 1 / d[kz];
+    }
+
+    /**
+     * Intersect the triangle with corners a, b, c. On a hit inside ray_range, sets t and the barycentric weights of a and b
+     * (the weight of c is 1 - wa - wb).
+     */
+    bool intersect(const float* a, const float* b, const float* c, const range& ray_range, real& t, real& wa, real& wb) const {
+        // corners relative to the ray origin, then sheared so the ray runs along +z
+        real az = a[kz] - origin[kz], bz = b[kz] - origin[kz], cz = c[kz] - origin[kz];
+        real ax = a[kx] - origin[kx] - shear_x * az;
+        real ay = a[ky] - origin[ky] - shear_y * az;
+        real bx = b[kx] - origin[kx] - shear_x * bz;
+        real by = b[ky] - origin[ky] - shear_y * bz;
+        real cx = c[kx] - origin[kx] - shear_x * cz;
+        real cy = c[ky] - origin[ky] - shear_y * cz;
+
+        // edge functions: u is the (scaled) weight of a, v of b, w of c
+        real u = cx * by - cy * bx;
+        real v = ax * cy - ay * cx;
+        real w = bx * ay - by * ax;
+#ifdef RT_SINGLE_PRECISION
+        // exactly on an edge, float rounding decides which side wins. Double gets it right
+        if (u == 0 || v == 0 || w == 0) {
+            u = real(double(cx) * double(by) - double(cy) * double(bx));
+            v = real(double(ax) * double(cy) - double(ay) * double(cx));
+            w = real(double(bx) * double(ay) - double(by) * double(ax));
+        }
+#endif
+        if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0)) return false; // origin outside the projected triangle
+        real determinant = u + v + w;
+        if (determinant == 0) return false; // the ray runs along the plane of the triangle
+
+        real scaled_t = u * (shear_z * az) + v * (shear_z * bz) + w * (shear_z * cz);
+        real inverse = 1 / determinant;
+        t = scaled_t * inverse;
+        if (!ray_range.surrounds(t)) return false;
+        wa = u * inverse;
+        wb = v * inverse;
+        return true;
+    }
+};
+
+/**
+ * A triangle mesh as one hittable: shared vertex positions (and optionally normals) plus three vertex indices per triangle.
+ * Vertices are stored as floats in both builds, 12 bytes per position and normal, and a triangle is 12 bytes of indices,
+ * so a mesh costs about a third of what separate triangle objects with their own corners would.
+ * build() sorts the triangles into a BVH of their own. No triangle is an object, a leaf is just a run of the index array.
+ * All triangles share the material of the mesh.
+ */
+class triangle_mesh : public hittable {
+    public:
+        triangle_mesh(shared_ptr<material> mat) : triangle_mesh(scene_materials().add(*mat)) {}
+
+        /** a mesh whose material is already in scene_materials() */
+        explicit triangle_mesh(uint32_t mat) : mat(mat) {}
+
+        void reserve(size_t vertices, size_t triangles) {
+            positions.reserve(3 * vertices);
+            indices.reserve(3 * triangles);
+        }
+
+        /** returns the index of the new vertex */
+        uint32_t add_vertex(const point3& p) {
+            for (int axis = 0; axis < 3; axis++) positions.push_back(float(p[axis]));
+            return uint32_t(vertex_count() - 1);
+        }
+
+        /** a vertex with a shading normal. Either all vertices of a mesh get normals or none does */
+        uint32_t add_vertex(const point3& p, const vec3& normal) {
+            for (int axis = 0; axis < 3; axis++) normals.push_back(float(normal[axis]));
+            return add_vertex(p);
+        }
+
+        void add_triangle(uint32_t a, uint32_t b, uint32_t c) {
+            indices.push_back(a);
+            indices.push_back(b);
+            indices.push_back(c);
+            nodes.clear(); // the BVH is out of date until the next build()
+        }
+
+        /**
+         * Take over whole buffers, e.g. from a mesh loader, without copying them.
+         * vertex_normals is either empty or has one normal per position. Call build() afterwards.
+         */
+        void assign(std::vector<float>&& vertex_positions, std::vector<float>&& vertex_normals, std::vector<uint32_t>&& triangle_indices) {
+            positions.swap(vertex_positions);
+            normals.swap(vertex_normals);
+            indices.swap(triangle_indices);
+            if (normals.size() != positions.size()) normals.clear();
+            nodes.clear();
+        }
+
+        /** Build the BVH. Call it after the last triangle is added, hits() needs it */
+        void build() {
+            positions.shrink_to_fit();
+            normals.shrink_to_fit();
+            indices.shrink_to_fit();
+            std::vector<aabb> boxes(triangle_count());
+            for (size_t i = 0; i < triangle_count(); i++) {
+                const float* a = vertex(indices[3*i]);
+                const float* b = vertex(indices[3*i+1]);
+                const float* c = vertex(indices[3*i+2]);
+                boxes[i] = aabb(aabb(point3(a[0], a[1], a[2]), point3(b[0], b[1], b[2])), aabb(point3(c[0], c[1], c[2]), point3(c[0], c[1], c[2])));
+            }
+            std::vector<uint32_t> order;
+            bvh_builder().build(boxes, nodes, order);
+            bbox = nodes[0].box;
+
+            // store the triangles in leaf order, so a leaf is a contiguous run of the index array
+            std::vector<uint32_t> sorted;
+            sorted.reserve(indices.size());
+            for (uint32_t triangle : order) {
+                for (int corner = 0; corner < 3; corner++) sorted.push_back(indices[3*triangle + corner]);
+            }
+            indices.swap(sorted);
+        }
+
+        size_t vertex_count() const { return positions.size() / 3; }
+        size_t triangle_count() const { return indices.size() / 3; }
+        bool has_normals() const { return !normals.empty(); }
+
+        /** bytes of the vertex, index and BVH buffers */
+        size_t memory_bytes() const {
+            return (positions.capacity() + normals.capacity()) * sizeof(float) + indices.capacity() * sizeof(uint32_t)
+                   + nodes.capacity() * sizeof(bvh_node);
+        }
+
+        /** read access to the buffers, e.g. for saving the mesh */
+        const std::vector<float>& vertex_positions() const { return positions; }
+        const std::vector<float>& vertex_normals() const { return normals; }
+        const std::vector<uint32_t>& triangle_indices() const { return indices; }
+
+        bool closest_hit(const ray& r, range ray_range, hit_id& id) const override {
+            if (nodes.empty() || triangle_count() == 0) return false;
+            triangle_ray tri_ray(r);
+            uint32_t hit_triangle = 0;
+            real hit_wa = 0, hit_wb = 0;
+            bool hit_anything = false;
+            render_stats& stats = thread_stats();
+
+            traverse_bvh(nodes, r, ray_range, [&](uint32_t first, uint32_t count, range& current_range) {
+                stats.intersection_tests += count;
+                for (uint32_t i = first; i < first + count; i++) {
+                    real t, wa, wb;
+                    if (tri_ray.intersect(vertex(indices[3*i]), vertex(indices[3*i+1]), vertex(indices[3*i+2]), current_range, t, wa, wb)) {
+                        hit_anything = true;
+                        current_range.max = t; // only closer triangles are interesting from now on
+                        hit_triangle = i;
+                        hit_wa = wa;
+                        hit_wb = wb;
+                    }
+                }
+            });
+            if (!hit_anything) return false;
+            id.set(ray_range.max, this, hit_triangle, hit_wa, hit_wb);
+            return true;
+        }
+
+        /** any triangle will do: the first one stops the traversal */
+        bool occluded(const ray& r, range ray_range) const override {
+            if (nodes.empty() || triangle_count() == 0) return false;
+            triangle_ray tri_ray(r);
+            bool blocked = false;
+            render_stats& stats = thread_stats();
+            traverse_bvh(nodes, r, ray_range, [&](uint32_t first, uint32_t count, range& current_range) {
+                for (uint32_t i = first; i < first + count; i++) {
+                    stats.intersection_tests++;
+                    real t, wa, wb;
+                    if (tri_ray.intersect(vertex(indices[3*i]), vertex(indices[3*i+1]), vertex(indices[3*i+2]), current_range, t, wa, wb)) {
+                        blocked = true;
+                        current_range.max = -infinity; // ends the traversal
+                        return;
+                    }
+                }
+            });
+            return blocked;
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+    protected:
+        /** only the closest triangle gets a full hit record */
+        void describe_hit(const ray& r, const hit_id& id, hit_details& rec) const override {
+            const uint32_t* corners = &indices[3*id.prim];
+            vec3 a = vertex_vector(positions, corners[0]), b = vertex_vector(positions, corners[1]), c = vertex_vector(positions, corners[2]);
+            rec.t = id.t;
+            rec.p = r.at(rec.t);
+            rec.mat = mat;
+            vec3 geometric_normal = unit_vector(cross(b - a, c - a));
+            rec.set_face_normal(r, geometric_normal);
+            if (has_normals()) {
+                // interpolated vertex normal, turned to the side of the surface the ray is on
+                real wc = 1 - id.u - id.v;
+                vec3 shading_normal = id.u * vertex_vector(normals, corners[0]) + id.v * vertex_vector(normals, corners[1])
+                                      + wc * vertex_vector(normals, corners[2]);
+                if (shading_normal.length_squared() > 0) {
+                    shading_normal = unit_vector(shading_normal);
+                    rec.normal = dot(shading_normal, rec.normal) < 0 ? -shading_normal : shading_normal;
+                }
+            }
+        }
+
+    private:
+        std::vector<float> positions; // x, y, z of every vertex
+        std::vector<float> normals; // x, y, z of every vertex, or empty for flat shading
+        std::vector<uint32_t> indices; // three vertices per triangle, in BVH leaf order after build()
+        std::vector<bvh_node> nodes;
+        uint32_t mat; // index into scene_materials()
+        aabb bbox;
+
+        const float* vertex(uint32_t index) const { return &positions[3*size_t(index)]; }
+
+        static vec3 vertex_vector(const std::vector<float>& values, uint32_t index) {
+            const float* v = &values[3*size_t(index)];
+            return vec3(v[0], v[1], v[2]);
+        }
+};
+
+#endif
@@ -6,18 +6,18 @@ using std::sqrt;
 
 class vec3 {
   public:
-    double e[3];
+    real e[3];
 
     vec3() : e{0,0,0} {}
-    vec3(double e0, double e1, double e2) : e{e0, e1, e2} {}
+    vec3(real e0, real e1, real e2) : e{e0, e1, e2} {}
 
-    double x() const { return e[0]; }
-    double y() const { return e[1]; }
-    double z() const { return e[2]; }
+    real x() const { return e[0]; }
+    real y() const { return e[1]; }
+    real z() const { return e[2]; }
 
     vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
-    double operator[](int i) const { return e[i]; }
-    double& operator[](int i) { return e[i]; }
+    real operator[](int i) const { return e[i]; }
+    real& operator[](int i) { return e[i]; }
 
     vec3& operator+=(const vec3& v) {
         e[0] += v.e[0];
@@ -26,30 +26,40 @@ class vec3 {
         return *this;
     }
 
-    vec3& operator*=(double t) {
+    vec3& operator*=(real t) {
         e[0] *= t;
         e[1] *= t;
         e[2] *= t;
         return *this;
     }
 
-    vec3& operator/=(double t) {
+    vec3& operator/=(real t) {
         return *this *= 1/t;
     }
 
-    double length() const {
+    real length() const {
         return sqrt(length_squared());
     }
 
-    double length_squared() const {
+    real length_squared() const {
         return e[0]*e[0] + e[1]*e[1] + e[2]*e[2];
     }
-    static vec3 random() {
-        return vec3(random_double(), random_double(), random_double());
+    static vec3 random(rng& gen) {
+        // separate statements, so the order of the random draws is fixed
+        auto x = random_double(gen);
+        auto y = random_double(gen);
+        auto z = random_double(gen);
+        return vec3(x, y, z);
     }
-    static vec3 random(double min, double max) {
-        return vec3(random_double(min, max), random_double(min, max), random_double(min, max));
+    static vec3 random(rng& gen, double min, double max) {
+        auto x = random_double(gen, min, max);
+        auto y = random_double(gen, min, max);
+        auto z = random_double(gen, min, max);
+        return vec3(x, y, z);
     }
+    /** scene building helpers, drawing from scene_rng() */
+    static vec3 random() { return random(scene_rng()); }
+    static vec3 random(double min, double max) { return random(scene_rng(), min, max); }
     bool near_zero() const {
         auto s = 1e-8;
         return (fabs(e[0]) < s) && (fabs(e[1]) < s) && (fabs(e[2]) < s);
@@ -78,19 +88,19 @@ inline vec3 operator*(const vec3& u, const vec3& v) {
     return vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
 }
 
-inline vec3 operator*(double t, const vec3& v) {
+inline vec3 operator*(real t, const vec3& v) {
     return vec3(t*v.e[0], t*v.e[1], t*v.e[2]);
 }
 
-inline vec3 operator*(const vec3& v, double t) {
+inline vec3 operator*(const vec3& v, real t) {
     return t * v;
 }
 
-inline vec3 operator/(const vec3& v, double t) {
+inline vec3 operator/(const vec3& v, real t) {
     return (1/t) * v;
 }
 
-inline double dot(const vec3& u, const vec3& v) {
+inline real dot(const vec3& u, const vec3& v) {
     return u.e[0] * v.e[0]
          + u.e[1] * v.e[1]
          + u.e[2] * v.e[2];
@@ -106,47 +116,102 @@ inline vec3 unit_vector(const vec3& v) {
     return v / v.length();
 }
 
-/** 
- * The reason to discard vectors that are too long is that 
- * if we don't, we won't get an even distribution of vectors. 
- * We would be more likely to get a vector pointing towards the corners of our [-1,1] cube
- * */
-inline vec3 random_in_unit_disk() {
-    while (true) {
-        auto p = vec3(random_double(-1,1), random_double(-1,1), 0);
-        if (p.length_squared() < 1)
-            return p;
-    }
-}
-
-inline vec3 random_in_unit_sphere() {
-    while (true) {
-        auto p = vec3::random(-1,1);
-        if (p.length_squared() < 1)
-            return p;
-    }
-}
-
-
-inline vec3 random_unit_vector() {
-    return unit_vector(random_in_unit_sphere());
-}
-
-inline vec3 random_on_hemisphere(const vec3& normal) {
-    vec3 on_unit_sphere = random_unit_vector();
-    if (dot(on_unit_sphere, normal) < 0.0) // In the same hemisphere as the normal
-        on_unit_sphere *= -1;
-    return on_unit_sphere;
-}
+/**
+ * Sampling warps: closed form maps from two uniform numbers in [0,1) to points and directions.
+ * Each takes exactly two random numbers and has no loop or data dependent branch (the selects compile to blends),
+ * unlike rejection sampling, which loops a random number of times. Every warp comes with its pdf,
+ * for estimators that weight a sample by f / pdf.
+ */
+
+/**
+ * sine and cosine of an angle in [-pi/4, pi/4], by their Taylor series: off by less than 1e-11 there,
+ * and a handful of multiplications instead of two calls into the math library
+ */
+inline void small_angle_sin_cos(double x, double& sine, double& cosine) {
+    double x2 = x * x;
+    sine = x * (1 + x2 * (-1.0 / 6 + x2 * (1.0 / 120 + x2 * (-1.0 / 5040 + x2 * (1.0 / 362880 + x2 * (-1.0 / 39916800))))));
+    cosine = 1 + x2 * (-1.0 / 2 + x2 * (1.0 / 24 + x2 * (-1.0 / 720 + x2 * (1.0 / 40320 + x2 * (-1.0 / 3628800 + x2 * (1.0 / 479001600))))));
+}
+
+/**
+ * MATH: the concentric map of Shirley and Chiu ("A Low Distortion Map Between Disk and Square", 1997):
+ * squares around the center go to circles, so strata and neighbourhoods survive. Uniform over the unit disk, pdf 1 / pi.
+ * The left and right wedges have angles (pi / 4) * b / a, the top and bottom ones pi / 2 - (pi / 4) * a / b,
+ * whose cosine and sine are the sine and cosine of (pi / 4) * a / b. So only angles within pi / 4 of zero come up
+ */
+inline vec3 concentric_disk(double u1, double u2) {
+    double a = 2 * u1 - 1, b = 2 * u2 - 1;
+    bool horizontal = a * a > b * b; // which pair of wedges: |a| > |b| maps to the left and right ones
+    double radius = horizontal ? a : b;
+    double ratio = horizontal ? b / a : (b != 0 ? a / b : 0);
+    double sine, cosine;
+    small_angle_sin_cos((pi / 4) * ratio, sine, cosine);
+    return horizontal ? vec3(real(radius * cosine), real(radius * sine), 0) : vec3(real(radius * sine), real(radius * cosine), 0);
+}
+
+/**
+ * MATH: Malley's method: points uniform on the disk, lifted straight up onto the hemisphere, are cosine distributed.
+ * Around +z, pdf cos(theta) / pi = z / pi
+ */
+inline vec3 cosine_hemisphere(double u1, double u2) {
+    vec3 d = concentric_disk(u1, u2);
+    return vec3(d.x(), d.y(), real(sqrt(fmax(0.0, 1 - double(d.x()) * d.x() - double(d.y()) * d.y()))));
+}
+
+inline double cosine_hemisphere_pdf(double cos_theta) { return cos_theta > 0 ? cos_theta / pi : 0; }
+
+/**
+ * MATH: Lambert's equal-area map takes the unit disk to the whole sphere, the point at radius r to height z = 1 - 2 r^2.
+ * It keeps areas (up to the factor 4), so a uniform point on the disk gives a uniform direction. pdf 1 / (4 pi)
+ */
+inline vec3 uniform_sphere(double u1, double u2) {
+    vec3 d = concentric_disk(u1, u2);
+    double r2 = double(d.x()) * d.x() + double(d.y()) * d.y();
+    double scale = 2 * sqrt(fmax(0.0, 1 - r2));
+    return vec3(real(d.x() * scale), real(d.y() * scale), real(1 - 2 * r2));
+}
+
+inline double uniform_sphere_pdf() { return 1 / (4 * pi); }
+
+/** a random point in the unit disk (z = 0), for the lens */
+inline vec3 random_in_unit_disk(rng& gen) {
+    double u1 = random_double(gen);
+    return concentric_disk(u1, random_double(gen));
+}
+
+inline vec3 random_unit_vector(rng& gen) {
+    double u1 = random_double(gen);
+    return uniform_sphere(u1, random_double(gen));
+}
+
+/**
+ * An orthonormal basis around a unit vector w, to turn directions sampled around +z into directions around a normal.
+ * MATH: the branchless construction of Duff et al. ("Building an Orthonormal Basis, Revisited", JCGT 2017)
+ */
+class onb {
+    public:
+        vec3 u, v, w;
+
+        explicit onb(const vec3& n) : w(n) {
+            real sign = std::copysign(real(1), n.z());
+            real a = -1 / (sign + n.z());
+            real b = n.x() * n.y() * a;
+            u = vec3(1 + sign * n.x() * n.x() * a, sign * b, -sign * n.x());
+            v = vec3(b, sign + n.y() * n.y() * a, -n.y());
+        }
+
+        /** the direction with coordinates (x, y, z) in this basis */
+        vec3 local(const vec3& a) const { return a.x() * u + a.y() * v + a.z() * w; }
+};
 
 inline vec3 reflect(const vec3& v, const vec3& n) {
     return v - 2*dot(v,n)*n;
 }
 
-inline vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat) {
-    auto cos_theta = fmin(dot(-uv, n), 1.0);
+inline vec3 refract(const vec3& uv, const vec3& n, real etai_over_etat) {
+    auto cos_theta = fmin(dot(-uv, n), real(1));
     vec3 r_out_perp = etai_over_etat * (uv + cos_theta*n);
-    vec3 r_out_parallel = -sqrt(fabs(1.0 - r_out_perp.length_squared())) * n;
+    vec3 r_out_parallel = -sqrt(fabs(1 - r_out_perp.length_squared())) * n;
     return r_out_perp + r_out_parallel;
 }
 
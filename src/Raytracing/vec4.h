@@ -0,0 +1,97 @@
+#ifndef VEC4_H
+#define VEC4_H
+
+#include "project_utils.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define RT_VEC4_SSE 1
+#include <immintrin.h>
+#endif
+
+/**
+ * Four floats in one 16-byte aligned SSE register: x, y, z and a padding lane w.
+ * A vec3 of floats is 12 bytes, which SIMD code can't load in one go. Padded to 16 it can,
+ * and one instruction then does the work of all three components.
+ * Without SSE it is a plain array and every operation is a loop.
+ */
+struct alignas(16) vec4f {
+#ifdef RT_VEC4_SSE
+    __m128 v;
+
+    vec4f() : v(_mm_setzero_ps()) {}
+    explicit vec4f(__m128 v) : v(v) {}
+    vec4f(float x, float y, float z, float w = 0) : v(_mm_set_ps(w, z, y, x)) {}
+    explicit vec4f(const vec3& u) : v(_mm_set_ps(0, float(u.z()), float(u.y()), float(u.x()))) {}
+
+    /** 4 floats from unaligned memory */
+    static vec4f load(const float* p) { return vec4f(_mm_loadu_ps(p)); }
+
+    float operator[](int i) const {
+        alignas(16) float e[4];
+        _mm_store_ps(e, v);
+        return e[i];
+    }
+
+    /** the lanes selected by mask (from compare) come from b, the others from a */
+    static vec4f select(const vec4f& a, const vec4f& b, const vec4f& mask) {
+        return vec4f(_mm_or_ps(_mm_and_ps(mask.v, b.v), _mm_andnot_ps(mask.v, a.v)));
+    }
+#else
+    float e[4];
+
+    vec4f() : e{0, 0, 0, 0} {}
+    vec4f(float x, float y, float z, float w = 0) : e{x, y, z, w} {}
+    explicit vec4f(const vec3& u) : e{float(u.x()), float(u.y()), float(u.z()), 0} {}
+
+    static vec4f load(const float* p) { return vec4f(p[0], p[1], p[2], p[3]); }
+
+    float operator[](int i) const { return e[i]; }
+
+    static vec4f select(const vec4f& a, const vec4f& b, const vec4f& mask) {
+        vec4f r;
+        for (int i = 0; i < 4; i++) r.e[i] = mask.e[i] != 0 ? b.e[i] : a.e[i];
+        return r;
+    }
+#endif
+};
+
+#ifdef RT_VEC4_SSE
+inline vec4f operator+(const vec4f& a, const vec4f& b) { return vec4f(_mm_add_ps(a.v, b.v)); }
+inline vec4f operator-(const vec4f& a, const vec4f& b) { return vec4f(_mm_sub_ps(a.v, b.v)); }
+inline vec4f operator*(const vec4f& a, const vec4f& b) { return vec4f(_mm_mul_ps(a.v, b.v)); }
+inline vec4f min(const vec4f& a, const vec4f& b) { return vec4f(_mm_min_ps(a.v, b.v)); }
+inline vec4f max(const vec4f& a, const vec4f& b) { return vec4f(_mm_max_ps(a.v, b.v)); }
+/** all bits set in the lanes where a < b, as a mask for select */
+inline vec4f less_than(const vec4f& a, const vec4f& b) { return vec4f(_mm_cmplt_ps(a.v, b.v)); }
+
+/** the largest / smallest of the x, y and z lanes. w is ignored */
+inline float max3(const vec4f& a) {
+    __m128 m = _mm_max_ss(a.v, _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(1, 1, 1, 1)));
+    return _mm_cvtss_f32(_mm_max_ss(m, _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(2, 2, 2, 2))));
+}
+inline float min3(const vec4f& a) {
+    __m128 m = _mm_min_ss(a.v, _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(1, 1, 1, 1)));
+    return _mm_cvtss_f32(_mm_min_ss(m, _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(2, 2, 2, 2))));
+}
+#else
+#define RT_VEC4_LANES(expression) vec4f r; for (int i = 0; i < 4; i++) r.e[i] = expression; return r;
+inline vec4f operator+(const vec4f& a, const vec4f& b) { RT_VEC4_LANES(a.e[i] + b.e[i]) }
+inline vec4f operator-(const vec4f& a, const vec4f& b) { RT_VEC4_LANES(a.e[i] - b.e[i]) }
+inline vec4f operator*(const vec4f& a, const vec4f& b) { RT_VEC4_LANES(a.e[i] * b.e[i]) }
+// same NaN behaviour as minps/maxps: if either is NaN, the result is b
+inline vec4f min(const vec4f& a, const vec4f& b) { RT_VEC4_LANES(a.e[i] < b.e[i] ? a.e[i] : b.e[i]) }
+inline vec4f max(const vec4f& a, const vec4f& b) { RT_VEC4_LANES(a.e[i] > b.e[i] ? a.e[i] : b.e[i]) }
+inline vec4f less_than(const vec4f& a, const vec4f& b) { RT_VEC4_LANES(a.e[i] < b.e[i] ? 1.0f : 0.0f) }
+#undef RT_VEC4_LANES
+
+inline float max3(const vec4f& a) {
+    float m = a.e[0] > a.e[1] ? a.e[0] : a.e[1];
+    return m > a.e[2] ? m : a.e[2];
+}
+inline float min3(const vec4f& a) {
+    float m = a.e[0] < a.e[1] ? a.e[0] : a.e[1];
+    return m < a.e[2] ? m : a.e[2];
+}
+#endif
+
+#endif
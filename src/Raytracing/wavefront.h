@@ -0,0 +1,197 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "project_utils.h"
+#include "hittable.h"
+#include "material.h"
+#include "render_stats.h"
+#include "path_limits.h"
+#include "lights.h"
+#include <vector>
+
+/** one camera sample on its way through the scene */
+struct path_state {
+    ray r;
+    color throughput = color(1,1,1); // product of all attenuations so far
+    uint64_t sample_key = 0; // seeds the generator of every bounce, exactly like the recursive integrator
+    sample_sequence samples; // the numbers of the sample's dimensions, see sampler.h
+    uint32_t sample_slot = 0; // where the result goes: pixel * samples_per_pixel + sample
+    int bounce = 0;
+    double scatter_pdf = 0; // of the direction of the last bounce if it sampled the lights, for emission_weight
+    uint16_t bounce_counts[int(bounce_kind::count)] = {0, 0, 0}; // bounces per kind, for the per-kind depth limits
+};
+
+/**
+ * Breadth-first (wavefront) path tracing.
+ * Instead of following one path to the end before starting the next, every stage runs over all paths of a tile at once:
+ *   1. generate the camera rays of every pixel sample of the tile
+ *   2. intersect all of them with the scene
+ *   3. bin the hits by material type. Paths that hit a light pick up its light and end
+ *   4. scatter every bin with the kernel of its material class (a direct, non-virtual call).
+ *      Lambertian hits also sample a light and queue a shadow ray to it (see lights.h)
+ *   5. trace the queued shadow rays
+ *   6. compact the surviving paths and go back to 2
+ * Paths use the same per-bounce generators and the same path_limits as camera::ray_color, so both integrators trace the same paths
+ * and add up the light of every sample in the same order.
+ */
+class wavefront_integrator {
+    public:
+        /**
+         * Trace all samples of a tile. sample_radiance receives the color of every sample, laid out [pixel][sample].
+         * generate(pixel, sample, path) sets path.r, path.sample_key and path.samples. background(ray) is the color of rays that escape.
+         * Diffuse bounces sample lights, none if it is empty.
+         */
+        template <typename ray_generator, typename background_function>
+        void render(const hittable& world, const light_list& lights, int pixel_count, int samples_per_pixel, const path_limits& limits,
+                    ray_generator generate, background_function background, std::vector<color>& sample_radiance) {
+            materials = &scene_materials();
+            // stage 1: camera rays
+            paths.clear();
+            paths.reserve(size_t(pixel_count) * samples_per_pixel);
+            thread_stats().primary_rays += uint64_t(pixel_count) * samples_per_pixel;
+            for (int pixel = 0; pixel < pixel_count; pixel++) {
+                for (int sample = 0; sample < samples_per_pixel; sample++) {
+                    path_state path;
+                    path.sample_slot = uint32_t(pixel * samples_per_pixel + sample);
+                    generate(pixel, sample, path);
+                    paths.push_back(path);
+                }
+            }
+            sample_radiance.assign(paths.size(), color(0,0,0));
+
+            while (!paths.empty()) {
+                intersect(world, limits.max_depth, background, sample_radiance);
+                bin_by_material();
+                emit_bin(material_type::emissive, lights, sample_radiance);
+                shadow_rays.clear();
+                scatter_bin<&material::scatter_lambertian>(material_type::lambertian, limits, lights.empty() ? nullptr : &lights);
+                scatter_bin<&material::scatter_metal>(material_type::metal, limits, nullptr);
+                scatter_bin<&material::scatter_dielectric>(material_type::dielectric, limits, nullptr);
+                absorb_bin(material_type::none);
+                trace_shadow_rays(world, sample_radiance);
+                compact();
+            }
+        }
+
+    private:
+        /** a shadow ray and the light it adds to its sample if nothing blocks it */
+        struct shadow_query {
+            ray r;
+            range t;
+            color light;
+            uint32_t sample_slot;
+        };
+
+        std::vector<path_state> paths;
+        std::vector<hit_details> hits;
+        std::vector<shadow_query> shadow_rays;
+        std::vector<char> alive;
+        std::vector<uint32_t> bins[int(material_type::count)];
+        const material_table* materials = nullptr; // looked up by every render(): a new scene replaces the table
+
+        /** stage 2: find the closest hit of every path. Escaping paths pick up the background and are done */
+        template <typename background_function>
+        void intersect(const hittable& world, int max_depth, background_function background, std::vector<color>& sample_radiance) {
+            hits.resize(paths.size());
+            alive.assign(paths.size(), 0);
+            render_stats& stats = thread_stats();
+            for (size_t i = 0; i < paths.size(); i++) {
+                path_state& path = paths[i];
+                if (path.bounce >= max_depth) continue; // out of bounces: contributes black, like ray_color at depth 0
+                stats.rays++;
+                if (world.hits(path.r, range(0.001, infinity), hits[i])) {
+                    alive[i] = 1;
+                } else {
+                    sample_radiance[path.sample_slot] += path.throughput * background(path.r);
+                }
+            }
+        }
+
+        /** stage 3: group the surviving paths by material type, keeping their order */
+        void bin_by_material() {
+            for (auto& bin : bins) bin.clear();
+            for (size_t i = 0; i < paths.size(); i++) {
+                if (alive[i]) bins[int((*materials)[hits[i].mat].type())].push_back(uint32_t(i));
+            }
+        }
+
+        typedef bool (material::*scatter_kernel)(const ray&, const hit_details&, color&, ray&, const sample_2d&, rng&) const;
+
+        /** the lights that paths hit, weighted against the light samples of the bounce before (emission_weight). Those paths end */
+        void emit_bin(material_type type, const light_list& lights, std::vector<color>& sample_radiance) {
+            for (uint32_t i : bins[int(type)]) {
+                const path_state& path = paths[i];
+                const material& mat = (*materials)[hits[i].mat];
+                sample_radiance[path.sample_slot] += path.throughput * (mat.emitted(hits[i]) * real(emission_weight(lights, path.r, hits[i], path.scatter_pdf)));
+                alive[i] = 0;
+            }
+        }
+
+        /**
+         * stage 4: scatter one bin. The kernel is a template argument, so the call is resolved at compile time
+         * and the loop has neither a virtual call nor a switch on the material type.
+         * With lights (lambertian only), every hit also queues a shadow ray to a light sample
+         */
+        template <scatter_kernel kernel>
+        void scatter_bin(material_type type, const path_limits& limits, const light_list* lights) {
+            bounce_kind kind = bounce_kind_of(type);
+            for (uint32_t i : bins[int(type)]) {
+                path_state& path = paths[i];
+                if (!limits.allows_bounce(kind, path.bounce_counts)) {
+                    alive[i] = 0; // out of bounces of this kind
+                    continue;
+                }
+                rng gen(hash_key(path.sample_key, uint64_t(path.bounce) + 1));
+                sample_2d u = path.samples.get_2d(sample_sequence::bounce_dimension(path.bounce), gen);
+                const material& mat = (*materials)[hits[i].mat];
+                bool sample_lights = lights && path.bounce + 1 < limits.max_depth;
+                if (sample_lights) {
+                    sample_2d light_u = path.samples.get_2d(sample_sequence::light_dimension(path.bounce), gen);
+                    shadow_query query;
+                    if (sample_direct_light(*lights, mat, hits[i], light_u, query.r, query.t, query.light)) {
+                        query.light = path.throughput * query.light;
+                        query.sample_slot = path.sample_slot;
+                        shadow_rays.push_back(query);
+                    }
+                }
+                color attenuation;
+                ray scattered;
+                if (!(mat.*kernel)(path.r, hits[i], attenuation, scattered, u, gen)) {
+                    alive[i] = 0; // absorbed: the sample stays black
+                    continue;
+                }
+                path.scatter_pdf = sample_lights ? mat.lambertian_pdf(hits[i], scattered.direction()) : 0;
+                path.throughput = path.throughput * attenuation;
+                if (!limits.survives_roulette(path.bounce, path.throughput, gen)) {
+                    alive[i] = 0;
+                    continue;
+                }
+                path.r = scattered;
+                path.bounce++;
+            }
+        }
+
+        /** stage 5: add the light of every shadow ray that gets through */
+        void trace_shadow_rays(const hittable& world, std::vector<color>& sample_radiance) {
+            thread_stats().shadow_rays += shadow_rays.size();
+            for (const shadow_query& query : shadow_rays) {
+                if (!world.occluded(query.r, query.t)) sample_radiance[query.sample_slot] += query.light;
+            }
+        }
+
+        /** materials without a type scatter nothing: their paths end black */
+        void absorb_bin(material_type type) {
+            for (uint32_t i : bins[int(type)]) alive[i] = 0;
+        }
+
+        /** stage 6: move the surviving paths to the front, in their original order */
+        void compact() {
+            size_t survivors = 0;
+            for (size_t i = 0; i < paths.size(); i++) {
+                if (alive[i]) paths[survivors++] = paths[i];
+            }
+            paths.resize(survivors);
+        }
+};
+
+#endif